@@ -27,6 +27,7 @@
 import sys
 import argparse
 import os
+import struct
 
 # List of valid notes
 NOTE_STRING_LIST = ["c0", "d0", "e0", "f0", "g0", "a0", "b0", "c1", "d1", "e1", "f1", "g1", "a1", "b1", "c2"]
@@ -67,6 +68,24 @@ COLOUR_BACKGROUND = "lightgray"
 # The stroke-width of all of the lines
 LINE_STROKE_WIDTH = 0.1
 
+# The tempo of the strip, in crotchet beats per minute, when the
+# plinky-plonky is driven at the velocity the Pi asks for and the
+# velocity profile is at 100%
+CROTCHETS_PER_MINUTE_DEFAULT = 120
+
+# The most segments a velocity profile may have and the fastest a
+# segment may be, in percent of the velocity the Pi asks for, as
+# PROTOCOL_PROFILE_SEGMENTS_MAX and PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX
+# in software/protocol/protocol.h
+PROFILE_SEGMENTS_MAX = 128
+PROFILE_TEMPO_PERCENT_MAX = 400
+
+# The longest a segment of a velocity profile may be, in milliseconds
+PROFILE_SEGMENT_MAX_MS = 0xFFFF
+
+# The file extension of a velocity profile
+PROFILE_EXTENSION = ".profile"
+
 def lead_in_pixels(mm_per_pixel):
     '''Return the lead-in size in pixels'''
     return LEAD_IN_MM * mm_per_pixel
@@ -262,14 +281,33 @@ def write_svg(output_file_handle, note_list, quaver_count, mm_per_pixel, speed_s
     output_file_handle.write(svg_notes(note_list, note_diameter_mm, speed_scale, mm_per_pixel) + "\n")
     output_file_handle.write(svg_close())
 
-def parse(input_data, speed_scale):
+def tempo_marker(tempo_text, quaver_beat_count, input_count, tempo_list):
+    '''Add the tempo marker tempo_text, which followed an @ that was on
+       quaver beat quaver_beat_count, to tempo_list'''
+    percent_text = tempo_text.lstrip('~')
+    if percent_text and 0 < int(percent_text) <= PROFILE_TEMPO_PERCENT_MAX:
+        tempo_list.append([quaver_beat_count, int(percent_text), tempo_text.startswith('~')])
+    else:
+        print(f"Warning: found invalid tempo '@{tempo_text}' (must be from 1 to"
+              f" {PROFILE_TEMPO_PERCENT_MAX} percent) ending at offset {input_count - 1}"
+              " (counting from 0) in input file.")
+
+def parse(input_data, speed_scale, tempo_list=None):
     '''Parse an input data sring and return a list of notes and gaps, where
        a note is an index into NOTE_STRING_LIST and the move to a new
        quaver beat is indicated by an out of range positive value, a quarter
-       beat offset (semiquaver) is indicated by an out of range negative value'''
+       beat offset (semiquaver) is indicated by an out of range negative value;
+       if tempo_list is given, any tempo markers are appended to it, each a
+       list of the quaver beat it is on, the tempo in percent and whether
+       the tempo ramps to it from the marker before'''
     # input_data is a string that can contain a note from NOTE_STRING_LIST,
-    # a new-line "\n" or whitespace
+    # a new-line "\n", a tempo marker or whitespace
     note_letter = None
+    # The text of a tempo marker being read, e.g. "~80" after an "@"
+    tempo_text = None
+    quaver_beat_count = 0
+    if tempo_list is None:
+        tempo_list = []
     note_count = 0
     semiquaver_beat_count = 0
     # output data a list of integers, being an index into the NOTE_STRING_LIST
@@ -282,6 +320,12 @@ def parse(input_data, speed_scale):
     note_history_list = []
     for input_count, character in enumerate(input_data):
         got_match = False
+        if tempo_text is not None:
+            if character.isdigit() or (character == '~' and not tempo_text):
+                tempo_text += character
+                continue
+            tempo_marker(tempo_text, quaver_beat_count, input_count, tempo_list)
+            tempo_text = None
         if note_letter:
             # Have a note first character, this should be the second character
             # of the note
@@ -305,6 +349,11 @@ def parse(input_data, speed_scale):
                 # It is a new-line: append a positive out of range value
                 output_list.append(len(NOTE_STRING_LIST))
                 semiquaver_beat_count += 2
+                quaver_beat_count += 1
+                got_match = True
+            elif character == '@':
+                # A tempo marker, for the velocity profile
+                tempo_text = ''
                 got_match = True
             else:
                 if character == '^':
@@ -326,6 +375,8 @@ def parse(input_data, speed_scale):
             print(f"Warning: found unexpected character '{character}'" \
                   f" at offset {input_count - 1} (counting from 0) in" \
                   f" input file.")
+    if tempo_text is not None:
+        tempo_marker(tempo_text, quaver_beat_count, len(input_data), tempo_list)
     # Go through the note history list and warn if a note
     # has been repeated within a crotchet beat
     warned = False
@@ -359,8 +410,66 @@ def parse(input_data, speed_scale):
               " notes) with the -s option, see command-line help (-h) for details.")
     return output_list
 
-def process(input_file, output_file, mm_per_pixel, speed_scale, note_diameter_mm):
-    '''Process the input file, write the output, return 0 on success'''
+def tempo_of_quaver_beats(tempo_list, quaver_count):
+    '''Return the tempo, in percent, of each of quaver_count quaver beats,
+       given the tempo markers from parse(): the tempo is 100% until the
+       first marker; a ramp is sampled at the middle of each quaver beat'''
+    tempo = [100.0] * quaver_count
+    previous_beat = 0
+    previous_percent = 100
+    for beat, percent, ramp in sorted(tempo_list, key=lambda marker: marker[0]):
+        beat = min(beat, quaver_count)
+        if ramp and beat > previous_beat:
+            for x in range(previous_beat, beat):
+                tempo[x] = previous_percent + ((percent - previous_percent) *
+                                               (x - previous_beat + 0.5) / (beat - previous_beat))
+        for x in range(beat, quaver_count):
+            tempo[x] = percent
+        previous_beat = beat
+        previous_percent = percent
+    return tempo
+
+def velocity_profile(tempo_list, quaver_count, speed_scale, crotchets_per_minute):
+    '''Return the velocity profile of the strip, a list of (duration in
+       milliseconds, velocity per mille) segments: the profile starts as
+       the lead-in begins, i.e. with the plinky-plonky at its reference
+       position, the lead-in being at the tempo of the first quaver beat'''
+    quaver_ms = 30000 / crotchets_per_minute
+    # The lead-in, in quaver beats: speed_scale squashes the notes, not the lead-in
+    lead_in_quavers = LEAD_IN_MM * speed_scale / QUAVER_DISTANCE_MM
+    tempo = tempo_of_quaver_beats(tempo_list, quaver_count)
+    # Pieces of (length in quaver beats, velocity per mille), neighbours
+    # at the same velocity combined
+    pieces = []
+    for length, percent in [(lead_in_quavers, tempo[0] if tempo else 100)] + [(1, x) for x in tempo]:
+        per_mille = round(percent * 10)
+        if pieces and pieces[-1][1] == per_mille:
+            pieces[-1][0] += length
+        else:
+            pieces.append([length, per_mille])
+    # Work in time since the start, so that rounding doesn't accumulate
+    segments = []
+    start_ms = 0
+    time_ms = 0
+    for length, per_mille in pieces:
+        time_ms += length * quaver_ms * 1000 / per_mille
+        end_ms = round(time_ms)
+        while end_ms - start_ms > 0:
+            duration_ms = min(end_ms - start_ms, PROFILE_SEGMENT_MAX_MS)
+            segments.append((duration_ms, per_mille))
+            start_ms += duration_ms
+    return segments
+
+def write_profile(output_file_handle, segments):
+    '''Write a velocity profile as the little-endian profile_segment_t's of
+       software/protocol/protocol.h, one after the other'''
+    for duration_ms, per_mille in segments:
+        output_file_handle.write(struct.pack('<HH', duration_ms, per_mille))
+
+def process(input_file, output_file, mm_per_pixel, speed_scale, note_diameter_mm,
+            profile_file=None, crotchets_per_minute=CROTCHETS_PER_MINUTE_DEFAULT):
+    '''Process the input file, write the output and, if profile_file is
+       given, the velocity profile, return 0 on success'''
     # Assume failure
     result_code = 1
     print(f"Processing file {input_file}, writing output to {output_file}.")
@@ -370,7 +479,8 @@ def process(input_file, output_file, mm_per_pixel, speed_scale, note_diameter_mm
                 with open(input_file, "r") as input_handle:
                     # Have both files, let's process!
                     input_string = input_handle.read()
-                    note_list = parse(input_string, speed_scale)
+                    tempo_list = []
+                    note_list = parse(input_string, speed_scale, tempo_list)
                     note_count = 0
                     quaver_count = 0
                     semiquaver_count = 0
@@ -395,6 +505,23 @@ def process(input_file, output_file, mm_per_pixel, speed_scale, note_diameter_mm
                     write_svg(output_handle, note_list, quaver_count + 1, mm_per_pixel, speed_scale, note_diameter_mm)
                     print(f"{output_file} successfully written.")
                     result_code = 0
+                    if profile_file:
+                        segments = velocity_profile(tempo_list, quaver_count, speed_scale,
+                                                    crotchets_per_minute)
+                        print(f"Found {len(tempo_list)} tempo marker(s), making a velocity profile of"
+                              f" {len(segments)} segment(s) lasting {sum(x[0] for x in segments) / 1000:g} s.")
+                        if len(segments) > PROFILE_SEGMENTS_MAX:
+                            print(f"Unable to write {profile_file}: more than {PROFILE_SEGMENTS_MAX}"
+                                  " segments, try fewer or shorter tempo ramps.")
+                            result_code = 1
+                        else:
+                            try:
+                                with open(profile_file, "wb") as profile_handle:
+                                    write_profile(profile_handle, segments)
+                                print(f"{profile_file} successfully written.")
+                            except IOError as e:
+                                print(f"Unable to open profile file {profile_file}: \"{e}\".")
+                                result_code = 1
             except IOError as e:
                 print(f"Unable to open input file {input_file}: \"{e}\".")
     except IOError as e:
@@ -460,7 +587,17 @@ if __name__ == '__main__':
                                                   " ^ (hat) character at the START of that line and"
                                                   " the notes will be snuck in between the quaver beats"
                                                   " of the adjacent lines.\n\n"
-                                                  "Notes may be separated by whitespace for readability."),
+                                                  "Notes may be separated by whitespace for readability.\n\n"
+                                                  "With the -v option a velocity profile is also written, for"
+                                                  " the motorised plinky-plonky to play: put @ followed by a"
+                                                  " tempo in percent (e.g. @80) on a line to play at that"
+                                                  " tempo from that quaver beat onwards, or @~ followed by a"
+                                                  " tempo (e.g. @~60) to slow down or speed up steadily from"
+                                                  " the previous tempo marker to that tempo at that quaver"
+                                                  " beat, e.g. @100 and then, some lines later, @~60 for a"
+                                                  " ritardando.  The tempo is 100% until the first marker."
+                                                  " The profile is uploaded, once, to the plinky-plonky,"
+                                                  " which scales the velocity the Pi asks for by it."),
                                      formatter_class=argparse.RawTextHelpFormatter)
     parser.add_argument('input_file', help=("a file containing notes and gaps"))
     parser.add_argument('output_file', nargs='?', help=("output SVG file name: if not provided the"
@@ -479,6 +616,17 @@ if __name__ == '__main__':
                                                                                      " if not specified"))
     parser.add_argument('-d', type=float, default=NOTE_DIAMETER_MM_DEFAULT, help=("the diameter of a note in millimetres, " +
                                                                                    str(NOTE_DIAMETER_MM_DEFAULT) + " if not specified"))
+    parser.add_argument('-v', nargs='?', const='', help=("also write a velocity profile to this file: if no file"
+                                                        " name is given the input file name will be used with a " +
+                                                        PROFILE_EXTENSION + " extension. ANY EXISTING FILE WILL"
+                                                        " BE OVERWRITTEN"))
+    parser.add_argument('-t', type=float, default=CROTCHETS_PER_MINUTE_DEFAULT, help=("for the velocity profile, the"
+                                                                                    " crotchet beats per minute that"
+                                                                                    " the strip plays at when the"
+                                                                                    " plinky-plonky is driven at the"
+                                                                                    " velocity the Pi asks for, " +
+                                                                                    str(CROTCHETS_PER_MINUTE_DEFAULT) +
+                                                                                    " if not specified"))
 
     args = parser.parse_args()
 
@@ -491,6 +639,10 @@ if __name__ == '__main__':
         output_file = args.output_file
         if not output_file:
             output_file = os.path.basename(args.input_file).split('.')[0] + ".svg"
-        result_code = process(args.input_file, output_file, args.m, args.s, args.d)
+        profile_file = args.v
+        if profile_file == '':
+            profile_file = os.path.basename(args.input_file).split('.')[0] + PROFILE_EXTENSION
+        result_code = process(args.input_file, output_file, args.m, args.s, args.d,
+                              profile_file, args.t)
 
     sys.exit(result_code)
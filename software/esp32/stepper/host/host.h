@@ -0,0 +1,38 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+/** @file
+ * @brief The settings of the host build of the stepper application,
+ * from the command line, see host_main.c.
+ */
+
+// What is printed at the start of each line of log output.
+extern const char *g_host_name;
+
+// The address to bind to before connecting to the server, NULL
+// to let the system choose.
+extern const char *g_host_bind_ip;
+
+// How much faster (greater than one) or slower (less than one) than
+// real time the simulated TMC2209 UART is; zero for instantaneous.
+extern double g_host_uart_speed;
+
+#endif // _HOST_H_
+
+// End of file
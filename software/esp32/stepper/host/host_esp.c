@@ -0,0 +1,688 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Host stand-in for the parts of ESP-IDF used by the stepper
+ * application: logging, esp_timer, GPIO, NVS and a few odds and ends.
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "nvs.h"
+#include "host.h"
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The number of NVS namespaces and of entries, across all of
+// them, that can be kept.
+#define HOST_NVS_MAX_NAMESPACES 8
+#define HOST_NVS_MAX_ENTRIES 32
+
+// The largest value, in bytes, that can be kept in NVS.
+#define HOST_NVS_MAX_LENGTH 512
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// A timer.
+struct host_timer_t {
+    esp_timer_create_args_t args;
+    bool armed;
+    int64_t expiry_us;
+    uint64_t period_us;  // Zero for a one-shot timer
+    struct host_timer_t *next;
+};
+
+// An NVS entry; the handle of a namespace is its index plus one.
+typedef struct {
+    nvs_handle_t handle;  // Zero if the entry is free
+    char key[16];
+    uint8_t value[HOST_NVS_MAX_LENGTH];
+    size_t length;
+} host_nvs_entry_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The level that log messages must be at or below to be printed.
+static esp_log_level_t g_log_level = ESP_LOG_INFO;
+
+// Keeps the lines of log output - and the prefix - together.
+static pthread_mutex_t g_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The timers, protected by g_timer_mutex.
+static struct host_timer_t *g_timer_list = NULL;
+static pthread_mutex_t g_timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_timer_cond;
+static pthread_once_t g_timer_once = PTHREAD_ONCE_INIT;
+
+// The time that esp_timer_get_time() counts from.
+static struct timespec g_boot_time = {0};
+static pthread_once_t g_boot_time_once = PTHREAD_ONCE_INIT;
+
+// The level of each GPIO: inputs read high, i.e. no sensor is triggered.
+static int g_gpio_level[GPIO_NUM_MAX];
+static bool g_gpio_isr_service_installed = false;
+
+// The interrupt of each GPIO, protected by g_gpio_mutex: as with the
+// real thing there is one handler per pin, adding another replacing it.
+static gpio_int_type_t g_gpio_intr_type[GPIO_NUM_MAX];
+static bool g_gpio_intr_enabled[GPIO_NUM_MAX];
+static gpio_isr_t g_gpio_isr_handler[GPIO_NUM_MAX];
+static void *g_gpio_isr_arg[GPIO_NUM_MAX];
+static pthread_mutex_t g_gpio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The NVS namespaces and entries, protected by g_nvs_mutex.
+static char g_nvs_namespace[HOST_NVS_MAX_NAMESPACES][16];
+static host_nvs_entry_t g_nvs_entry[HOST_NVS_MAX_ENTRIES];
+static pthread_mutex_t g_nvs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The least that esp_get_free_heap_size() has returned.
+static uint32_t g_heap_min_free = UINT32_MAX;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Find an NVS entry, or a free one if create is true; g_nvs_mutex
+// must be held.
+static host_nvs_entry_t *nvs_entry(nvs_handle_t handle, const char *key, bool create)
+{
+    host_nvs_entry_t *free_entry = NULL;
+
+    for (size_t x = 0; x < HOST_NVS_MAX_ENTRIES; x++) {
+        host_nvs_entry_t *entry = &g_nvs_entry[x];
+        if ((entry->handle == handle) && (strcmp(entry->key, key) == 0)) {
+            return entry;
+        }
+        if ((entry->handle == 0) && (free_entry == NULL)) {
+            free_entry = entry;
+        }
+    }
+    if (create && (free_entry != NULL)) {
+        free_entry->handle = handle;
+        snprintf(free_entry->key, sizeof(free_entry->key), "%s", key);
+        free_entry->length = 0;
+        return free_entry;
+    }
+
+    return NULL;
+}
+
+// Seed the random number generator behind esp_random().
+static void seed_random(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    srandom((unsigned int) (now.tv_nsec ^ (getpid() << 16)));
+}
+
+// Record the time that esp_timer_get_time() counts from and
+// make all of the GPIOs high.
+static void boot_time_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &g_boot_time);
+    for (size_t x = 0; x < GPIO_NUM_MAX; x++) {
+        g_gpio_level[x] = 1;
+    }
+}
+
+// The equivalent of the esp_timer task: calls the callbacks of
+// timers as they expire, one at a time.
+static void *timer_task(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&g_timer_mutex);
+    while (1) {
+        struct host_timer_t *next = NULL;
+        for (struct host_timer_t *timer = g_timer_list; timer != NULL; timer = timer->next) {
+            if (timer->armed && ((next == NULL) || (timer->expiry_us < next->expiry_us))) {
+                next = timer;
+            }
+        }
+        int64_t now = esp_timer_get_time();
+        if (next == NULL) {
+            pthread_cond_wait(&g_timer_cond, &g_timer_mutex);
+        } else if (next->expiry_us > now) {
+            struct timespec when;
+            int64_t wait_ns = (next->expiry_us - now) * 1000;
+            clock_gettime(CLOCK_MONOTONIC, &when);
+            wait_ns += when.tv_nsec;
+            when.tv_sec += wait_ns / 1000000000;
+            when.tv_nsec = wait_ns % 1000000000;
+            pthread_cond_timedwait(&g_timer_cond, &g_timer_mutex, &when);
+        } else {
+            if (next->period_us > 0) {
+                next->expiry_us += next->period_us;
+            } else {
+                next->armed = false;
+            }
+            // Call the callback without the lock, it may well
+            // want to start or stop a timer
+            esp_timer_cb_t callback = next->args.callback;
+            void *callback_arg = next->args.arg;
+            pthread_mutex_unlock(&g_timer_mutex);
+            callback(callback_arg);
+            pthread_mutex_lock(&g_timer_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+// Start timer_task().
+static void timer_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread, NULL, timer_task, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Arm a timer.
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us,
+                             uint64_t period_us)
+{
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    pthread_mutex_lock(&g_timer_mutex);
+    if (!timer->armed) {
+        timer->expiry_us = esp_timer_get_time() + (int64_t) timeout_us;
+        timer->period_us = period_us;
+        timer->armed = true;
+        pthread_cond_signal(&g_timer_cond);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&g_timer_mutex);
+
+    return err;
+}
+
+// Return true if a pin is valid.
+static bool gpio_is_valid(gpio_num_t pin)
+{
+    return (pin >= 0) && (pin < GPIO_NUM_MAX);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: LOGGING AND MISCELLANEOUS
+ * -------------------------------------------------------------- */
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:
+            return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED:
+            return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:
+            return "ESP_ERR_TIMEOUT";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
+
+void host_log_level_set(esp_log_level_t level)
+{
+    g_log_level = level;
+}
+
+void host_log(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static const char level_letter[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+    va_list args;
+
+    if ((level != ESP_LOG_NONE) && (level <= g_log_level)) {
+        pthread_mutex_lock(&g_log_mutex);
+        printf("%s %c (%lld) %s: ", g_host_name, level_letter[level],
+               (long long) (esp_timer_get_time() / 1000), tag);
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        printf("\n");
+        fflush(stdout);
+        pthread_mutex_unlock(&g_log_mutex);
+    }
+}
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    return ESP_OK;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    uint32_t free_size = (info.fordblks < UINT32_MAX) ? (uint32_t) info.fordblks : UINT32_MAX;
+    uint32_t min_free_size = __atomic_load_n(&g_heap_min_free, __ATOMIC_RELAXED);
+
+    while ((free_size < min_free_size) &&
+           !__atomic_compare_exchange_n(&g_heap_min_free, &min_free_size, free_size,
+                                        false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    return free_size;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return __atomic_load_n(&g_heap_min_free, __ATOMIC_RELAXED);
+}
+
+void esp_restart(void)
+{
+    host_log(ESP_LOG_WARN, "host", "Restart requested, exiting.");
+    exit(0);
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    // A locally administered address, made up from the
+    // address that we connect from
+    struct in_addr address = {0};
+
+    (void) type;
+    if (g_host_bind_ip != NULL) {
+        inet_pton(AF_INET, g_host_bind_ip, &address);
+    }
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    memcpy(mac + 2, &address, 4);
+
+    return ESP_OK;
+}
+
+uint32_t esp_random(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint32_t value;
+
+    // Seeded differently for each process so that several
+    // devices don't all come up with the same numbers
+    pthread_once(&once, seed_random);
+    pthread_mutex_lock(&mutex);
+    value = ((uint32_t) random() << 16) ^ (uint32_t) random();
+    pthread_mutex_unlock(&mutex);
+
+    return value;
+}
+
+int host_connect(int sock, const struct sockaddr *address, socklen_t address_len)
+{
+    if (g_host_bind_ip != NULL) {
+        struct sockaddr_in local = {0};
+        local.sin_family = AF_INET;
+        if ((inet_pton(AF_INET, g_host_bind_ip, &local.sin_addr) != 1) ||
+            (bind(sock, (struct sockaddr *) &local, sizeof(local)) != 0)) {
+            return -1;
+        }
+    }
+    return connect(sock, address, address_len);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: ESP_TIMER
+ * -------------------------------------------------------------- */
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    pthread_once(&g_boot_time_once, boot_time_init);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t) (now.tv_sec - g_boot_time.tv_sec) * 1000000) +
+           ((now.tv_nsec - g_boot_time.tv_nsec) / 1000);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    struct host_timer_t *timer = calloc(1, sizeof(*timer));
+
+    pthread_once(&g_timer_once, timer_init);
+    if (timer != NULL) {
+        timer->args = *create_args;
+        pthread_mutex_lock(&g_timer_mutex);
+        timer->next = g_timer_list;
+        g_timer_list = timer;
+        pthread_mutex_unlock(&g_timer_mutex);
+        *out_handle = timer;
+        err = ESP_OK;
+    }
+
+    return err;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    pthread_mutex_lock(&g_timer_mutex);
+    if (timer->armed) {
+        timer->armed = false;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&g_timer_mutex);
+
+    return err;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    pthread_mutex_lock(&g_timer_mutex);
+    if (!timer->armed) {
+        for (struct host_timer_t **p = &g_timer_list; *p != NULL; p = &((*p)->next)) {
+            if (*p == timer) {
+                *p = timer->next;
+                break;
+            }
+        }
+        free(timer);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&g_timer_mutex);
+
+    return err;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: GPIO
+ * -------------------------------------------------------------- */
+
+// Setting the level of a pin is how a sensor is triggered on the
+// host: if that makes an edge which the pin has an interrupt for,
+// the handler is called, from the calling thread since there is
+// no interrupt context here.
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    gpio_isr_t handler = NULL;
+    void *arg = NULL;
+
+    pthread_once(&g_boot_time_once, boot_time_init);
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    int previous = g_gpio_level[pin];
+    g_gpio_level[pin] = (level != 0);
+    if ((g_gpio_level[pin] != previous) && g_gpio_intr_enabled[pin]) {
+        gpio_int_type_t type = g_gpio_intr_type[pin];
+        if ((type == GPIO_INTR_ANYEDGE) ||
+            ((type == GPIO_INTR_POSEDGE) && g_gpio_level[pin]) ||
+            ((type == GPIO_INTR_NEGEDGE) && !g_gpio_level[pin])) {
+            handler = g_gpio_isr_handler[pin];
+            arg = g_gpio_isr_arg[pin];
+        }
+    }
+    pthread_mutex_unlock(&g_gpio_mutex);
+    if (handler != NULL) {
+        handler(arg);
+    }
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t pin)
+{
+    pthread_once(&g_boot_time_once, boot_time_init);
+    return gpio_is_valid(pin) ? g_gpio_level[pin] : 0;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode)
+{
+    (void) mode;
+    return gpio_is_valid(pin) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t type)
+{
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    g_gpio_intr_type[pin] = type;
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t pin)
+{
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    g_gpio_intr_enabled[pin] = true;
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t pin)
+{
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    g_gpio_intr_enabled[pin] = false;
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int flags)
+{
+    (void) flags;
+    if (g_gpio_isr_service_installed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    g_gpio_isr_service_installed = true;
+    return ESP_OK;
+}
+
+// As with the real thing, this replaces any handler the pin
+// already has and enables the interrupt of the pin.
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg)
+{
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!g_gpio_isr_service_installed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    g_gpio_isr_handler[pin] = handler;
+    g_gpio_isr_arg[pin] = arg;
+    g_gpio_intr_enabled[pin] = true;
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+    if (!gpio_is_valid(pin)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&g_gpio_mutex);
+    g_gpio_isr_handler[pin] = NULL;
+    g_gpio_isr_arg[pin] = NULL;
+    g_gpio_intr_enabled[pin] = false;
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ESP_OK;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: NVS
+ * -------------------------------------------------------------- */
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&g_nvs_mutex);
+    for (size_t x = 0; (x < HOST_NVS_MAX_NAMESPACES) && (err != ESP_OK); x++) {
+        if (strcmp(g_nvs_namespace[x], name) == 0) {
+            *out_handle = x + 1;
+            err = ESP_OK;
+        } else if ((g_nvs_namespace[x][0] == 0) && (open_mode == NVS_READWRITE)) {
+            // As with the real thing, a namespace only comes into
+            // being when opened for writing
+            snprintf(g_nvs_namespace[x], sizeof(g_nvs_namespace[x]), "%s", name);
+            *out_handle = x + 1;
+            err = ESP_OK;
+        }
+    }
+    pthread_mutex_unlock(&g_nvs_mutex);
+
+    return err;
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *out_value)
+{
+    size_t length = sizeof(*out_value);
+    esp_err_t err = nvs_get_blob(handle, key, out_value, &length);
+
+    if ((err == ESP_OK) && (length != sizeof(*out_value))) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    return err;
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&g_nvs_mutex);
+    host_nvs_entry_t *entry = nvs_entry(handle, key, false);
+    if (entry != NULL) {
+        err = ESP_OK;
+        if (out_value != NULL) {
+            if (*length < entry->length) {
+                err = ESP_ERR_INVALID_SIZE;
+            } else {
+                memcpy(out_value, entry->value, entry->length);
+            }
+        }
+        *length = entry->length;
+    }
+    pthread_mutex_unlock(&g_nvs_mutex);
+
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    esp_err_t err = ESP_ERR_INVALID_SIZE;
+
+    if (length <= HOST_NVS_MAX_LENGTH) {
+        err = ESP_ERR_NO_MEM;
+        pthread_mutex_lock(&g_nvs_mutex);
+        host_nvs_entry_t *entry = nvs_entry(handle, key, true);
+        if (entry != NULL) {
+            memcpy(entry->value, value, length);
+            entry->length = length;
+            err = ESP_OK;
+        }
+        pthread_mutex_unlock(&g_nvs_mutex);
+    }
+
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&g_nvs_mutex);
+    host_nvs_entry_t *entry = nvs_entry(handle, key, false);
+    if (entry != NULL) {
+        entry->handle = 0;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&g_nvs_mutex);
+
+    return err;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+// End of file
@@ -0,0 +1,372 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Host stand-in for the parts of FreeRTOS used by the stepper
+ * application, built on POSIX threads.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// A task: its thread and its notification value.
+struct host_task_t {
+    pthread_t thread;
+    TaskFunction_t function;
+    void *arg;
+    const char *name;
+    uint32_t stack_depth;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t notify_count;
+};
+
+// A mutex or binary semaphore.
+struct host_semaphore_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool given;
+};
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The task that is the calling thread, NULL for a thread that was
+// not created with xTaskCreate(), e.g. the one that calls main().
+static __thread struct host_task_t *g_current_task = NULL;
+
+// Stands in for any thread not created with xTaskCreate().
+static struct host_task_t g_main_task = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                                         .name = "main"};
+static pthread_once_t g_main_task_once = PTHREAD_ONCE_INIT;
+
+// The time that ticks are counted from.
+static struct timespec g_start_time = {0};
+static pthread_once_t g_start_time_once = PTHREAD_ONCE_INIT;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Record the time that ticks are counted from.
+static void start_time_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &g_start_time);
+}
+
+// Initialise a condition variable to use the monotonic clock.
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Set up the condition variable of g_main_task.
+static void main_task_init(void)
+{
+    cond_init(&g_main_task.cond);
+}
+
+// Work out the absolute time, on the monotonic clock, that is
+// ticks in the future.
+static void deadline(TickType_t ticks, struct timespec *when)
+{
+    uint64_t ns = (uint64_t) ticks * (1000000000ULL / configTICK_RATE_HZ);
+
+    clock_gettime(CLOCK_MONOTONIC, when);
+    ns += when->tv_nsec;
+    when->tv_sec += ns / 1000000000ULL;
+    when->tv_nsec = ns % 1000000000ULL;
+}
+
+// Wait on a condition variable for up to the given number of ticks,
+// returning false on timeout; the mutex must be locked.
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                      const struct timespec *when)
+{
+    if (when == NULL) {
+        return pthread_cond_wait(cond, mutex) == 0;
+    }
+    return pthread_cond_timedwait(cond, mutex, when) != ETIMEDOUT;
+}
+
+// The start of every task.
+static void *task_entry(void *arg)
+{
+    struct host_task_t *task = (struct host_task_t *) arg;
+
+    g_current_task = task;
+    task->function(task->arg);
+    // A FreeRTOS task must not return, but just in case
+    return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: TASKS
+ * -------------------------------------------------------------- */
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    BaseType_t result = pdFAIL;
+    struct host_task_t *task = calloc(1, sizeof(*task));
+
+    if (task != NULL) {
+        task->function = function;
+        task->arg = arg;
+        task->name = name;
+        task->stack_depth = stack_depth;
+        pthread_mutex_init(&task->mutex, NULL);
+        cond_init(&task->cond);
+        // The handle must be valid before the task runs as the
+        // task may well look at it
+        if (created_task != NULL) {
+            *created_task = task;
+        }
+        if (pthread_create(&task->thread, NULL, task_entry, task) == 0) {
+            pthread_detach(task->thread);
+            result = pdPASS;
+        } else {
+            if (created_task != NULL) {
+                *created_task = NULL;
+            }
+            pthread_cond_destroy(&task->cond);
+            pthread_mutex_destroy(&task->mutex);
+            free(task);
+        }
+    }
+
+    return result;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if ((task == NULL) || (task == g_current_task)) {
+        // The task structure is never freed, someone may still
+        // have the handle
+        pthread_exit(NULL);
+    } else if (task != &g_main_task) {
+        pthread_cancel(task->thread);
+    }
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0) {
+        sched_yield();
+    } else {
+        struct timespec when;
+        deadline(ticks, &when);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR) {
+        }
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (g_current_task != NULL) {
+        return g_current_task;
+    }
+    pthread_once(&g_main_task_once, main_task_init);
+    return &g_main_task;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+
+    pthread_once(&g_start_time_once, start_time_init);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ms = ((int64_t) (now.tv_sec - g_start_time.tv_sec) * 1000) +
+                 ((now.tv_nsec - g_start_time.tv_nsec) / 1000000);
+
+    return (TickType_t) (ms / portTICK_PERIOD_MS);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->mutex);
+    task->notify_count++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+{
+    xTaskNotifyGive(task);
+    if (higher_priority_task_woken != NULL) {
+        *higher_priority_task_woken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task_t *task = xTaskGetCurrentTaskHandle();
+    struct timespec when;
+    bool waiting = (ticks_to_wait > 0);
+    uint32_t value;
+
+    if (ticks_to_wait != portMAX_DELAY) {
+        deadline(ticks_to_wait, &when);
+    }
+    pthread_mutex_lock(&task->mutex);
+    while ((task->notify_count == 0) && waiting) {
+        waiting = cond_wait(&task->cond, &task->mutex,
+                            (ticks_to_wait != portMAX_DELAY) ? &when : NULL);
+    }
+    value = task->notify_count;
+    if (value > 0) {
+        task->notify_count = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->mutex);
+
+    return value;
+}
+
+TaskHandle_t xTaskGetHandle(const char *name)
+{
+    // Only the tasks of the application are known, and nothing
+    // keeps a list of those
+    return NULL;
+}
+
+TaskHandle_t xTaskGetIdleTaskHandle(void)
+{
+    // There is no idle task, the host gets on with something else
+    return NULL;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return task->stack_depth;
+}
+
+uint32_t ulTaskGetRunTimeCounter(TaskHandle_t task)
+{
+    uint32_t counter = 0;
+    clockid_t clock_id;
+    struct timespec now;
+
+    // g_main_task stands in for more than one thread, so it
+    // has no CPU time of its own
+    if ((task != &g_main_task) &&
+        (pthread_getcpuclockid(task->thread, &clock_id) == 0) &&
+        (clock_gettime(clock_id, &now) == 0)) {
+        counter = (uint32_t) (((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+    }
+
+    return counter;
+}
+
+uint32_t host_run_time_counter_value(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint32_t) (((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000));
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS: SEMAPHORES
+ * -------------------------------------------------------------- */
+
+SemaphoreHandle_t host_semaphore_create(bool given)
+{
+    struct host_semaphore_t *semaphore = calloc(1, sizeof(*semaphore));
+
+    if (semaphore != NULL) {
+        pthread_mutex_init(&semaphore->mutex, NULL);
+        cond_init(&semaphore->cond);
+        semaphore->given = given;
+    }
+
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    struct timespec when;
+    bool waiting = (ticks_to_wait > 0);
+    BaseType_t result = pdFALSE;
+
+    if (ticks_to_wait != portMAX_DELAY) {
+        deadline(ticks_to_wait, &when);
+    }
+    pthread_mutex_lock(&semaphore->mutex);
+    while (!semaphore->given && waiting) {
+        waiting = cond_wait(&semaphore->cond, &semaphore->mutex,
+                            (ticks_to_wait != portMAX_DELAY) ? &when : NULL);
+    }
+    if (semaphore->given) {
+        semaphore->given = false;
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+
+    return result;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    BaseType_t result = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    if (!semaphore->given) {
+        semaphore->given = true;
+        pthread_cond_signal(&semaphore->cond);
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+
+    return result;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore,
+                                 BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken != NULL) {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    return xSemaphoreGive(semaphore);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    pthread_cond_destroy(&semaphore->cond);
+    pthread_mutex_destroy(&semaphore->mutex);
+    free(semaphore);
+}
+
+// End of file
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief The entry point of the host build of the stepper application:
+ * sorts out the command line and then calls app_main() in stepper.c,
+ * which connects to the server as a device would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host.h"
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+const char *g_host_server_ip = "127.0.0.1";
+int g_host_server_port = 5000;
+int g_host_server_udp_port = 5002;
+const char *g_host_name = "stepper";
+const char *g_host_bind_ip = NULL;
+double g_host_uart_speed = 1.0;
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// In stepper.c.
+void app_main(void);
+
+// Print the usage.
+static void print_usage(const char *name)
+{
+    printf("Usage: %s [-s server_ip] [-p port] [-d udp_port] [-b bind_ip] [-u uart_speed] [-l level]\n"
+           "  -s  the address of the server, default %s.\n"
+           "  -p  the port on the server, default %d.\n"
+           "  -d  the port on the server that datagrams are sent to, default %d.\n"
+           "  -b  the address to connect from, which is how the server knows which\n"
+           "      device this is, e.g. 127.0.3.20 for the lift if the server has\n"
+           "      mapped 10.10.3.x to 127.0.3.x; default any.\n"
+           "  -u  the speed of the simulated TMC2209 UART relative to real time,\n"
+           "      0 for instantaneous, default %.1f.\n"
+           "  -l  the log level, one of e, w, i or d, default i.\n",
+           name, g_host_server_ip, g_host_server_port, g_host_server_udp_port,
+           g_host_uart_speed);
+}
+
+int main(int argc, char *argv[])
+{
+    int option;
+
+    while ((option = getopt(argc, argv, "s:p:d:b:u:l:h")) != -1) {
+        switch (option) {
+            case 's':
+                g_host_server_ip = optarg;
+                break;
+            case 'p':
+                g_host_server_port = atoi(optarg);
+                break;
+            case 'd':
+                g_host_server_udp_port = atoi(optarg);
+                break;
+            case 'b':
+                g_host_bind_ip = optarg;
+                g_host_name = optarg;
+                break;
+            case 'u':
+                g_host_uart_speed = atof(optarg);
+                break;
+            case 'l':
+                switch (optarg[0]) {
+                    case 'e':
+                        host_log_level_set(ESP_LOG_ERROR);
+                        break;
+                    case 'w':
+                        host_log_level_set(ESP_LOG_WARN);
+                        break;
+                    case 'd':
+                        host_log_level_set(ESP_LOG_DEBUG);
+                        break;
+                    default:
+                        host_log_level_set(ESP_LOG_INFO);
+                        break;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return (option == 'h') ? 0 : 1;
+        }
+    }
+
+    // Only returns if something went wrong
+    app_main();
+
+    return 1;
+}
+
+// End of file
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Stand-ins for the modules of the stepper application that
+ * have nothing to do on the host: OTA, Wi-Fi and logging to the
+ * server, deferred log messages being formatted and printed here.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_wifi_types.h"
+#include "log.h"
+#include "ota.h"
+#include "network.h"
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The deferred log format strings and their tags, see log_strings.h.
+static const char *const g_log_string_format[] = {
+#define LOG_STRING(id, tag, format) format,
+    LOG_STRINGS
+#undef LOG_STRING
+};
+static const char *const g_log_string_tag[] = {
+#define LOG_STRING(id, tag, format) tag,
+    LOG_STRINGS
+#undef LOG_STRING
+};
+
+// The deferred log messages at or above this level are printed.
+static log_level_t g_log_min_level = LOG_INFO;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+esp_err_t ota_init()
+{
+    return ESP_OK;
+}
+
+esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
+{
+    return ESP_OK;
+}
+
+esp_err_t network_init(const char *ssid, const char *password,
+                       wifi_auth_mode_t auth_mode)
+{
+    return ESP_OK;
+}
+
+void network_deinit()
+{
+}
+
+esp_err_t log_init(const char *server_ip, uint16_t port, log_level_t min_level)
+{
+    g_log_min_level = min_level;
+    return ESP_OK;
+}
+
+void log_deinit()
+{
+}
+
+esp_err_t log_set_min_level(log_level_t level)
+{
+    g_log_min_level = level;
+    return ESP_OK;
+}
+
+uint32_t log_get_dropped_count(void)
+{
+    return 0;
+}
+
+void log_get_task_handles(TaskHandle_t *reconnect_task_handle,
+                          TaskHandle_t *flush_task_handle)
+{
+    // Nothing is forwarded, everything is printed
+    *reconnect_task_handle = NULL;
+    *flush_task_handle = NULL;
+}
+
+void log_deferred(log_level_t level, log_string_id_t id,
+                  const int32_t *args, size_t num_args)
+{
+    static const esp_log_level_t esp_log_level[] = {ESP_LOG_DEBUG, ESP_LOG_INFO,
+                                                    ESP_LOG_WARN, ESP_LOG_ERROR};
+    int32_t a[LOG_DEFERRED_MAX_ARGS] = {0};
+    char buffer[LOG_MESSAGE_MAX_LEN];
+
+    if ((level >= g_log_min_level) && (level <= LOG_ERROR) && (id < LOG_STRING_NUM)) {
+        for (size_t x = 0; (x < num_args) && (x < LOG_DEFERRED_MAX_ARGS); x++) {
+            a[x] = args[x];
+        }
+        // The format strings only have integer conversions, see
+        // log_strings.h, so passing all of the arguments is fine
+        snprintf(buffer, sizeof(buffer), g_log_string_format[id],
+                 a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+        host_log(esp_log_level[level], g_log_string_tag[id], "%s", buffer);
+    }
+}
+
+// End of file
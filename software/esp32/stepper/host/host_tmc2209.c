@@ -0,0 +1,455 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Simulated TMC2209s for the host build of the stepper
+ * application, one at each UART address: each remembers what it is
+ * told and takes about as long as the real UART would to be told it,
+ * that being a large part of the time taken to start a target.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "tmc2209.h"
+#include "host.h"
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The bits in a write datagram, 8 bytes each of 10 bits on the wire.
+#define TMC2209_WRITE_BITS (8 * 10)
+
+// The bits in a read: a 4 byte request and an 8 byte reply.
+#define TMC2209_READ_BITS ((4 + 8) * 10)
+
+// The gap the TMC2209 leaves before replying, or the gap that
+// is left after an unbatched write to check its echo, in bit times.
+#define TMC2209_TURNAROUND_BITS 8
+
+// The clock of the TMC2209, for TSTEP.
+#define TMC2209_FCLK_HZ 12000000
+
+// The number of TMC2209s that can share the UART, as for the real
+// driver.
+#define TMC2209_NUM 4
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// The state of a simulated TMC2209.
+typedef struct {
+    int32_t velocity_millihertz;
+    uint32_t run_current_ma;
+    uint32_t hold_current_percent;
+    bool enabled;
+    int32_t microstep_resolution;
+} tmc2209_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The baud rate of the UART.
+static int32_t g_baud = 115200;
+
+// The number of writes held back by tmc2209_batch_begin(), -1 if
+// not batching.
+static int32_t g_batch_writes = -1;
+
+// As for the real driver, one task at a time on the UART, a batch
+// keeping hold of it from tmc2209_batch_begin() to
+// tmc2209_batch_end().
+static pthread_mutex_t g_mutex;
+static pthread_once_t g_mutex_once = PTHREAD_ONCE_INIT;
+
+// The state of the simulated TMC2209s, indexed by address.
+static tmc2209_t g_tmc2209[TMC2209_NUM] = {
+    [0 ... TMC2209_NUM - 1] = {.microstep_resolution = 256}
+};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Take the time that the given number of bits takes on the UART.
+static void uart_time(int32_t bits)
+{
+    struct timespec duration;
+    int64_t duration_ns;
+
+    if (g_host_uart_speed > 0) {
+        // The real driver blocks waiting for the UART, letting
+        // other tasks run, so sleep rather than spin
+        duration_ns = (int64_t) ((bits * 1000000000.0) / (g_baud * g_host_uart_speed));
+        duration.tv_sec = duration_ns / 1000000000;
+        duration.tv_nsec = duration_ns % 1000000000;
+        nanosleep(&duration, NULL);
+    }
+}
+
+// Make g_mutex recursive.
+static void mutex_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&g_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Take g_mutex.
+static void lock(void)
+{
+    pthread_once(&g_mutex_once, mutex_init);
+    pthread_mutex_lock(&g_mutex);
+}
+
+// Give back g_mutex.
+static void unlock(void)
+{
+    pthread_mutex_unlock(&g_mutex);
+}
+
+// Return the simulated TMC2209 at an address, NULL if there is
+// no such address.
+static tmc2209_t *get(int32_t address)
+{
+    return ((address >= 0) && (address < TMC2209_NUM)) ? &g_tmc2209[address] : NULL;
+}
+
+// A register write: held back if batching, otherwise sent and
+// its echo checked.
+static esp_err_t write(void)
+{
+    esp_err_t err = ESP_OK;
+
+    lock();
+    if (g_batch_writes >= 0) {
+        if (g_batch_writes >= TMC2209_BATCH_MAX_WRITES) {
+            err = ESP_ERR_NO_MEM;
+        } else {
+            g_batch_writes++;
+        }
+    } else {
+        uart_time(TMC2209_WRITE_BITS + TMC2209_TURNAROUND_BITS);
+    }
+    unlock();
+
+    return err;
+}
+
+// A register read.
+static void read(void)
+{
+    lock();
+    uart_time(TMC2209_READ_BITS + TMC2209_TURNAROUND_BITS);
+    unlock();
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+esp_err_t tmc2209_init(int32_t uart, int32_t pin_txd, int32_t pin_rxd,
+                       int32_t baud)
+{
+    g_baud = baud;
+    return ESP_OK;
+}
+
+esp_err_t tmc2209_start(int32_t address, int32_t pin_motor_enable)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // GCONF, then disabled
+    read();
+    write();
+    tmc2209->enabled = false;
+    return ESP_OK;
+}
+
+void tmc2209_deinit()
+{
+    for (size_t x = 0; x < TMC2209_NUM; x++) {
+        g_tmc2209[x].enabled = false;
+    }
+}
+
+esp_err_t tmc2209_motor_enable(int32_t address)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    tmc2209->enabled = true;
+    return write();
+}
+
+esp_err_t tmc2209_motor_disable(int32_t address)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    tmc2209->enabled = false;
+    return write();
+}
+
+esp_err_t tmc2209_batch_begin()
+{
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    lock();
+    if (g_batch_writes < 0) {
+        g_batch_writes = 0;
+        err = ESP_OK;
+    } else {
+        unlock();
+    }
+
+    return err;
+}
+
+esp_err_t tmc2209_batch_end(bool send)
+{
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    lock();
+    if (g_batch_writes >= 0) {
+        if (send && (g_batch_writes > 0)) {
+            // Back-to-back, then one check at the end
+            uart_time((g_batch_writes * TMC2209_WRITE_BITS) + TMC2209_READ_BITS);
+        }
+        g_batch_writes = -1;
+        err = ESP_OK;
+        unlock();
+    }
+    unlock();
+
+    return err;
+}
+
+esp_err_t tmc2209_get_position(int32_t address)
+{
+    if (get(address) == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    read();
+    return 0;
+}
+
+esp_err_t tmc2209_set_microstep_resolution(int32_t address, int32_t resolution)
+{
+    tmc2209_t *tmc2209 = get(address);
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+
+    if (tmc2209 != NULL) {
+        err = write();
+    }
+    if (err == ESP_OK) {
+        tmc2209->microstep_resolution = resolution;
+        err = resolution;
+    }
+
+    return err;
+}
+
+esp_err_t tmc2209_get_microstep_resolution(int32_t address)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    read();
+    return tmc2209->microstep_resolution;
+}
+
+esp_err_t tmc2209_set_current(int32_t address,
+                              uint32_t r_sense_mohm,
+                              uint32_t run_current_ma,
+                              uint32_t hold_current_percent)
+{
+    tmc2209_t *tmc2209 = get(address);
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+
+    // CHOPCONF for VSENSE, then IHOLD_IRUN
+    if (tmc2209 != NULL) {
+        err = write();
+    }
+    if (err == ESP_OK) {
+        err = write();
+    }
+    if (err == ESP_OK) {
+        tmc2209->run_current_ma = run_current_ma;
+        tmc2209->hold_current_percent = hold_current_percent;
+        err = (esp_err_t) run_current_ma;
+    }
+
+    return err;
+}
+
+esp_err_t tmc2209_set_velocity(int32_t address,
+                               int32_t milliHertz)
+{
+    tmc2209_t *tmc2209 = get(address);
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+
+    if (tmc2209 != NULL) {
+        err = write();
+    }
+    if (err == ESP_OK) {
+        tmc2209->velocity_millihertz = milliHertz;
+    }
+
+    return err;
+}
+
+esp_err_t tmc2209_get_velocity(int32_t address,
+                               int32_t *milliHertz)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Served from the shadow of VACTUAL, no UART traffic
+    *milliHertz = tmc2209->enabled ? tmc2209->velocity_millihertz : 0;
+    return ESP_OK;
+}
+
+esp_err_t tmc2209_set_stealth_chop_threshold(int32_t address,
+                                             int32_t threshold)
+{
+    if (get(address) == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return write();
+}
+
+esp_err_t tmc2209_stop_that_bloody_racket(int32_t address,
+                                          uint8_t tbl,
+                                          uint8_t toff,
+                                          uint8_t hstrt,
+                                          int8_t hend)
+{
+    if (get(address) == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return write();
+}
+
+esp_err_t tmc2209_get_tstep(int32_t address)
+{
+    tmc2209_t *tmc2209 = get(address);
+    int32_t millihertz;
+    int64_t tstep = 0xfffff;
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    millihertz = tmc2209->enabled ? abs(tmc2209->velocity_millihertz) : 0;
+    read();
+    if (millihertz > 0) {
+        // TSTEP is the time between 1/256 microsteps
+        tstep = ((int64_t) TMC2209_FCLK_HZ * 1000 * tmc2209->microstep_resolution) /
+                ((int64_t) millihertz * 256);
+        if (tstep > 0xfffff) {
+            tstep = 0xfffff;
+        }
+    }
+
+    return (esp_err_t) tstep;
+}
+
+esp_err_t tmc2209_get_sg_result(int32_t address)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    read();
+    // Lightly loaded, with a little noise
+    return tmc2209->enabled ? 200 + (rand() % 50) : 0;
+}
+
+esp_err_t tmc2209_get_current(int32_t address, uint32_t r_sense_mohm)
+{
+    tmc2209_t *tmc2209 = get(address);
+
+    if (tmc2209 == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // DRV_STATUS and CHOPCONF
+    read();
+    read();
+    if (!tmc2209->enabled) {
+        return 0;
+    }
+    if (tmc2209->velocity_millihertz == 0) {
+        return (esp_err_t) ((tmc2209->run_current_ma * tmc2209->hold_current_percent) / 100);
+    }
+    return (esp_err_t) tmc2209->run_current_ma;
+}
+
+esp_err_t tmc2209_init_stallguard(int32_t address,
+                                  int32_t tcoolthrs,
+                                  uint8_t sgthrs,
+                                  int32_t pin,
+                                  gpio_isr_t handler,
+                                  void *handler_arg)
+{
+    esp_err_t err = write();
+
+    if (err == ESP_OK) {
+        err = write();
+    }
+
+    return err;
+}
+
+esp_err_t tmc2209_set_stallguard(int32_t address,
+                                 int32_t tcoolthrs,
+                                 uint8_t sgthrs)
+{
+    esp_err_t err = write();
+
+    if (err == ESP_OK) {
+        err = write();
+    }
+
+    return err;
+}
+
+void tmc2209_deinit_stallguard(int32_t pin)
+{
+}
+
+// End of file
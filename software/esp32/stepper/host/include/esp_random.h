@@ -0,0 +1,30 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ESP_RANDOM_H_
+#define _ESP_RANDOM_H_
+
+/** @file
+ * @brief Host stand-in for the random number generator.
+ */
+
+#include <stdint.h>
+
+uint32_t esp_random(void);
+
+#endif // _ESP_RANDOM_H_
+
+// End of file
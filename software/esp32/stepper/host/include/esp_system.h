@@ -0,0 +1,35 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ESP_SYSTEM_H_
+#define _ESP_SYSTEM_H_
+
+/** @file
+ * @brief Host stand-in for the heap figures of ESP-IDF.
+ */
+
+#include <stdint.h>
+
+// What malloc() has free in its heap, which on the host grows as
+// it needs to.
+uint32_t esp_get_free_heap_size(void);
+
+// The least that esp_get_free_heap_size() has returned.
+uint32_t esp_get_minimum_free_heap_size(void);
+
+#endif // _ESP_SYSTEM_H_
+
+// End of file
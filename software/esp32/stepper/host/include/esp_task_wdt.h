@@ -0,0 +1,47 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ESP_TASK_WDT_H_
+#define _ESP_TASK_WDT_H_
+
+/** @file
+ * @brief Host stand-in for the task watchdog, which does nothing.
+ */
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static inline esp_err_t esp_task_wdt_add(TaskHandle_t task_handle)
+{
+    (void) task_handle;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_task_wdt_reset(void)
+{
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_task_wdt_delete(TaskHandle_t task_handle)
+{
+    (void) task_handle;
+    return ESP_OK;
+}
+
+#endif // _ESP_TASK_WDT_H_
+
+// End of file
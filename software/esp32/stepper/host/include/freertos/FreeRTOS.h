@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FREERTOS_H_
+#define _FREERTOS_H_
+
+/** @file
+ * @brief Host stand-in for FreeRTOS, built on POSIX threads, keeping
+ * the tick rate of the target so that delays behave the same.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "sdkconfig.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  0
+#define pdPASS  1
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+
+// There are no interrupts on the host, nothing to yield to.
+#define portYIELD_FROM_ISR(woken) (void) (woken)
+
+// The spinlock of a critical section, a mutex on the host, where
+// there are no interrupts to disable.
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZE(mux) pthread_mutex_init(mux, NULL)
+
+// The clock of the run-time statistics, counting in microseconds as
+// it does on the target with CONFIG_FREERTOS_RUN_TIME_STATS_USING_ESP_TIMER.
+uint32_t host_run_time_counter_value(void);
+#define portGET_RUN_TIME_COUNTER_VALUE() host_run_time_counter_value()
+
+#endif // _FREERTOS_H_
+
+// End of file
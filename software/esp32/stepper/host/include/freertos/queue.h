@@ -0,0 +1,29 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FREERTOS_QUEUE_H_
+#define _FREERTOS_QUEUE_H_
+
+/** @file
+ * @brief Host stand-in for FreeRTOS queues: only the semaphores,
+ * which in FreeRTOS are built on queues, are needed.
+ */
+
+#include "freertos/semphr.h"
+
+#endif // _FREERTOS_QUEUE_H_
+
+// End of file
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FREERTOS_SEMPHR_H_
+#define _FREERTOS_SEMPHR_H_
+
+/** @file
+ * @brief Host stand-in for FreeRTOS mutexes and binary semaphores,
+ * both of which are a count of zero or one here.
+ */
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_semaphore_t *SemaphoreHandle_t;
+
+SemaphoreHandle_t host_semaphore_create(bool given);
+
+#define xSemaphoreCreateMutex() host_semaphore_create(true)
+#define vSemaphoreCreateBinary(semaphore) (semaphore) = host_semaphore_create(true)
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore,
+                                 BaseType_t *higher_priority_task_woken);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#endif // _FREERTOS_SEMPHR_H_
+
+// End of file
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FREERTOS_TASK_H_
+#define _FREERTOS_TASK_H_
+
+/** @file
+ * @brief Host stand-in for FreeRTOS tasks and task notifications:
+ * each task is a thread; priorities and stack sizes are ignored.
+ */
+
+#include <sched.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_task_t *TaskHandle_t;
+
+typedef void (*TaskFunction_t)(void *arg);
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
+TaskHandle_t xTaskGetHandle(const char *name);
+TaskHandle_t xTaskGetIdleTaskHandle(void);
+// The host can't tell how much of its stack a task has used, so
+// this returns the whole of the stack depth that the task was
+// created with, zero for a thread not created with xTaskCreate().
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+// The CPU time of the thread of a task, in the units of
+// portGET_RUN_TIME_COUNTER_VALUE().
+uint32_t ulTaskGetRunTimeCounter(TaskHandle_t task);
+
+// See portMUX_TYPE.
+#define taskENTER_CRITICAL(mux) pthread_mutex_lock(mux)
+#define taskEXIT_CRITICAL(mux) pthread_mutex_unlock(mux)
+
+#define taskYIELD() sched_yield()
+
+#endif // _FREERTOS_TASK_H_
+
+// End of file
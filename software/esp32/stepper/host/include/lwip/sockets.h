@@ -0,0 +1,43 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LWIP_SOCKETS_H_
+#define _LWIP_SOCKETS_H_
+
+/** @file
+ * @brief Host stand-in for the lwIP sockets API, which is BSD sockets
+ * as on the host, except that connect() first binds the socket to
+ * the address given on the command line so that the server, which
+ * tells devices apart by IP address, can see several simulated
+ * devices on one host.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int host_connect(int sock, const struct sockaddr *address, socklen_t address_len);
+
+#define connect(sock, address, address_len) host_connect(sock, address, address_len)
+
+#endif // _LWIP_SOCKETS_H_
+
+// End of file
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SDKCONFIG_H_
+#define _SDKCONFIG_H_
+
+/** @file
+ * @brief The configuration of the host build of the stepper
+ * application, standing in for the sdkconfig.h that ESP-IDF
+ * generates from Kconfig.projbuild: production mode, with sensor
+ * pins so that the debounce code is exercised, but no STEP/DIR pins.
+ * The server address and ports are set on the command line, see
+ * host_main.c; the role of the image, CONFIG_STEPPER_ROLE, is "any"
+ * unless STEPPER_HOST_ROLE is set when configuring with CMake, and
+ * the number of motors, CONFIG_STEPPER_MOTOR_COUNT, is
+ * STEPPER_HOST_MOTOR_COUNT, also set by CMake.  If
+ * STEPPER_HOST_SHARED_SENSOR_PIN is defined, as it is for
+ * test_debounce.c, the lift limit, plinky-plonky reference and door
+ * open sensors are all on that pin, as in the shipped sdkconfig.
+ */
+
+extern const char *g_host_server_ip;
+extern int g_host_server_port;
+extern int g_host_server_udp_port;
+
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS 1
+
+#define CONFIG_STEPPER_WIFI_SSID ""
+#define CONFIG_STEPPER_WIFI_PASSWORD ""
+#define CONFIG_STEPPER_PRODUCTION_MODE 1
+#define CONFIG_STEPPER_PRODUCTION_SERVER g_host_server_ip
+#define CONFIG_STEPPER_PRODUCTION_PORT g_host_server_port
+#define CONFIG_STEPPER_PRODUCTION_LOG_PORT 5001
+#define CONFIG_STEPPER_LOG_DEFERRED 1
+#define CONFIG_STEPPER_LATENCY 1
+#define CONFIG_STEPPER_UDP 1
+#define CONFIG_STEPPER_PRODUCTION_UDP_PORT g_host_server_udp_port
+#if defined(STEPPER_HOST_ROLE_STAND)
+#  define CONFIG_STEPPER_ROLE_STAND 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_STAND 1
+#elif defined(STEPPER_HOST_ROLE_LIFT)
+#  define CONFIG_STEPPER_ROLE_LIFT 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_LIFT 1
+#elif defined(STEPPER_HOST_ROLE_PLINKY_PLONKY)
+#  define CONFIG_STEPPER_ROLE_PLINKY_PLONKY 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_PLINKY_PLONKY 1
+#elif defined(STEPPER_HOST_ROLE_DOOR)
+#  define CONFIG_STEPPER_ROLE_DOOR 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_DOOR 1
+#else
+#  define CONFIG_STEPPER_ROLE_ANY 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_STAND 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_LIFT 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_PLINKY_PLONKY 1
+#  define CONFIG_STEPPER_ROLE_MAY_BE_DOOR 1
+#endif
+#define CONFIG_STEPPER_FIRMWARE_UPG_URL ""
+#define CONFIG_STEPPER_OTA_RECV_TIMEOUT_MS 5000
+#define CONFIG_STEPPER_UART_NUM 1
+#define CONFIG_STEPPER_DEBUG_LED_PIN -1
+#define CONFIG_STEPPER_UART_TXD_PIN 21
+#define CONFIG_STEPPER_UART_RXD_PIN 20
+#define CONFIG_STEPPER_UART_BAUD_RATE 115200
+#define CONFIG_STEPPER_ENABLE_PIN -1
+#define CONFIG_STEPPER_DIAG_PIN -1
+#define CONFIG_STEPPER_STEP_PIN -1
+#define CONFIG_STEPPER_DIR_PIN -1
+#define CONFIG_STEPPER_ACCELERATION_HZ 2000
+// As in Kconfig.projbuild, a sensor pin only exists for a role
+// that the image may be
+#if defined(STEPPER_HOST_SHARED_SENSOR_PIN)
+#  define HOST_PIN_LIFT_LIMIT STEPPER_HOST_SHARED_SENSOR_PIN
+#  define HOST_PIN_PLINKY_PLONKY_REFERENCE STEPPER_HOST_SHARED_SENSOR_PIN
+#  define HOST_PIN_DOOR_OPEN STEPPER_HOST_SHARED_SENSOR_PIN
+#else
+#  define HOST_PIN_LIFT_LIMIT 4
+#  define HOST_PIN_PLINKY_PLONKY_REFERENCE 6
+#  define HOST_PIN_DOOR_OPEN 7
+#endif
+#if defined(CONFIG_STEPPER_ROLE_MAY_BE_LIFT)
+#  define CONFIG_STEPPER_LIFT_LIMIT_PIN HOST_PIN_LIFT_LIMIT
+#  define CONFIG_STEPPER_LIFT_DOWN_PIN 5
+#endif
+#if defined(CONFIG_STEPPER_ROLE_MAY_BE_PLINKY_PLONKY)
+#  define CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN HOST_PIN_PLINKY_PLONKY_REFERENCE
+#endif
+#if defined(CONFIG_STEPPER_ROLE_MAY_BE_DOOR)
+#  define CONFIG_STEPPER_DOOR_OPEN_PIN HOST_PIN_DOOR_OPEN
+#endif
+#define CONFIG_STEPPER_MOTOR_COUNT STEPPER_HOST_MOTOR_COUNT
+// The other motors have no enable pin but, for a door, do have a
+// door open pin each
+#if CONFIG_STEPPER_MOTOR_COUNT >= 2
+#  define CONFIG_STEPPER_MOTOR_1_ENABLE_PIN -1
+#  if defined(CONFIG_STEPPER_ROLE_MAY_BE_DOOR)
+#    define CONFIG_STEPPER_MOTOR_1_DOOR_OPEN_PIN 8
+#  endif
+#endif
+#if CONFIG_STEPPER_MOTOR_COUNT >= 3
+#  define CONFIG_STEPPER_MOTOR_2_ENABLE_PIN -1
+#  if defined(CONFIG_STEPPER_ROLE_MAY_BE_DOOR)
+#    define CONFIG_STEPPER_MOTOR_2_DOOR_OPEN_PIN 9
+#  endif
+#endif
+#if CONFIG_STEPPER_MOTOR_COUNT >= 4
+#  define CONFIG_STEPPER_MOTOR_3_ENABLE_PIN -1
+#  if defined(CONFIG_STEPPER_ROLE_MAY_BE_DOOR)
+#    define CONFIG_STEPPER_MOTOR_3_DOOR_OPEN_PIN 10
+#  endif
+#endif
+
+#endif // _SDKCONFIG_H_
+
+// End of file
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief A test of the debouncing of the sensor pins in production
+ * mode, built with the lift limit, plinky-plonky reference and door
+ * open sensors all on STEPPER_HOST_SHARED_SENSOR_PIN, as they are in
+ * the shipped sdkconfig: stepper.c is included here so that its
+ * static functions can be called.  The pin is bounced and then left
+ * low, and later high, and each time every sensor on it must follow.
+ */
+
+#include "../main/stepper.c"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// How long to wait for the sensors to settle, in milliseconds:
+// plenty of DEBOUNCE_THRESHOLD periods.
+#define TEST_DEBOUNCE_WAIT_MS 1000
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// Those that host_main.c would otherwise provide.
+const char *g_host_server_ip = "127.0.0.1";
+int g_host_server_port = 5000;
+int g_host_server_udp_port = 5002;
+const char *g_host_name = "test_debounce";
+const char *g_host_bind_ip = NULL;
+double g_host_uart_speed = 0;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Wait for all of the sensors on the shared pin of motor 0 to be
+// triggered, or not; returns true if they got there.
+static bool wait_sensors(bool triggered)
+{
+    for (size_t x = 0; x < TEST_DEBOUNCE_WAIT_MS; x++) {
+        if ((is_at_limit(0) == triggered) &&
+            (is_at_reference(0) == triggered) &&
+            (is_open(0) == triggered)) {
+            return true;
+        }
+        usleep(1000);
+    }
+    printf("Expected all sensors %s but at limit %s, at reference %s, open %s.\n",
+           triggered ? "triggered" : "not triggered",
+           is_at_limit(0) ? "true" : "false",
+           is_at_reference(0) ? "true" : "false",
+           is_open(0) ? "true" : "false");
+
+    return false;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+int main(void)
+{
+    TaskHandle_t task_handle_notify = NULL;
+    bool success = true;
+    esp_err_t err = ESP_OK;
+
+    for (size_t motor = 0; (motor < STEPPER_MOTOR_COUNT) && (err == ESP_OK); motor++) {
+        err = debounce_init(&g_context_production.context_debounce[motor], motor,
+                            &task_handle_notify);
+    }
+    if (err != ESP_OK) {
+        printf("debounce_init() returned %d.\n", err);
+        success = false;
+    }
+
+    if (success) {
+        // The pin starts high, i.e. nothing triggered; give the
+        // timers started by debounce_init() time to establish that
+        usleep(DEBOUNCE_CHECK_PERIOD_US * DEBOUNCE_THRESHOLD * 2);
+        success = wait_sensors(false);
+    }
+    if (success) {
+        // Bounce it a few times, more quickly than it can be
+        // debounced, and then leave it low
+        for (size_t x = 0; x < 5; x++) {
+            gpio_set_level(STEPPER_HOST_SHARED_SENSOR_PIN, 0);
+            usleep(DEBOUNCE_CHECK_PERIOD_US * 2);
+            gpio_set_level(STEPPER_HOST_SHARED_SENSOR_PIN, 1);
+            usleep(DEBOUNCE_CHECK_PERIOD_US * 2);
+        }
+        gpio_set_level(STEPPER_HOST_SHARED_SENSOR_PIN, 0);
+        success = wait_sensors(true);
+    }
+    if (success) {
+        gpio_set_level(STEPPER_HOST_SHARED_SENSOR_PIN, 1);
+        success = wait_sensors(false);
+    }
+
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        debounce_deinit(&g_context_production.context_debounce[motor]);
+    }
+
+    printf("%s\n", success ? "PASS" : "FAIL");
+
+    return success ? 0 : 1;
+}
+
+// End of file
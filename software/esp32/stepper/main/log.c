@@ -20,6 +20,7 @@
  */
 
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -39,6 +40,22 @@
  // Logging prefix
  #define TAG "log"
 
+// The size of the ring buffer in which log messages wait to be
+// sent, must be a power of two.
+#define LOG_RING_SIZE 4096
+
+// The maximum number of bytes of log messages sent in one go.
+#define LOG_FLUSH_MAX_LEN 1024
+
+// How often the flush task sends whatever log messages are in
+// the ring buffer; it is also woken early if the ring buffer is
+// getting full.
+#define LOG_FLUSH_PERIOD_MS 100
+
+// The number of times to retry a send() which would block, at 10 ms
+// intervals, before giving up.
+#define LOG_SEND_RETRIES 10
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -48,11 +65,25 @@ typedef struct {
     bool connected;
     bool running;
     TaskHandle_t task_handle;
+    TaskHandle_t flush_task_handle;
     struct sockaddr_in log_server;
     SemaphoreHandle_t lock;
     log_level_t min_level;  // Minimum level to forward
+    // Ring buffer of log_msg_t frames: the indexes are free-running,
+    // masked with LOG_RING_SIZE - 1 on access, and a frame may wrap
+    uint8_t ring[LOG_RING_SIZE];
+    uint32_t ring_write;
+    uint32_t ring_read;
+    portMUX_TYPE ring_mux;
+    uint32_t dropped_count;  // Frames that didn't fit in the ring
 } log_cfg_t;
 
+// An entry in the table of deferred log strings.
+typedef struct {
+    const char *tag;
+    const char *format;
+} log_string_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
@@ -61,7 +92,16 @@ static log_cfg_t g_log_cfg = {
     .socket = -1,
     .connected = false,
     .min_level = LOG_INFO,  // Default: forward INFO and above
-    .lock = NULL
+    .lock = NULL,
+    .ring_mux = portMUX_INITIALIZER_UNLOCKED
+};
+
+// The deferred log strings, indexed by log_string_id_t, for when
+// they have to be formatted here.
+static const log_string_t g_log_string[] = {
+#define LOG_STRING(id, tag, format) {tag, format},
+    LOG_STRINGS
+#undef LOG_STRING
 };
 
 /* ----------------------------------------------------------------
@@ -192,11 +232,179 @@ static void log_reconnect_task(void *arg)
     vTaskDelete(NULL);
 }
 
-// Custom vprintf handler with level filtering
+// Put a log frame, a log_msg_t header followed by its text, into
+// the ring buffer; if there is no room the frame is dropped and
+// counted.  Returns the number of bytes now waiting in the ring,
+// or -1 if the frame was dropped.
+static int32_t ring_put(const uint8_t *frame, uint32_t len)
+{
+    int32_t used = -1;
+    uint32_t waiting;
+
+    taskENTER_CRITICAL(&g_log_cfg.ring_mux);
+    waiting = g_log_cfg.ring_write - g_log_cfg.ring_read;
+    if (len <= LOG_RING_SIZE - waiting) {
+        uint32_t offset = g_log_cfg.ring_write & (LOG_RING_SIZE - 1);
+        uint32_t first = LOG_RING_SIZE - offset;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(g_log_cfg.ring + offset, frame, first);
+        memcpy(g_log_cfg.ring, frame + first, len - first);
+        g_log_cfg.ring_write += len;
+        used = waiting + len;
+    } else {
+        g_log_cfg.dropped_count++;
+    }
+    taskEXIT_CRITICAL(&g_log_cfg.ring_mux);
+
+    return used;
+}
+
+// Put a log frame into the ring buffer, waking the flush task early
+// if the ring is filling up.
+static void log_frame(const uint8_t *frame, uint32_t len)
+{
+    int32_t used = ring_put(frame, len);
+    if (((used < 0) || (used > LOG_RING_SIZE / 2)) &&
+        g_log_cfg.flush_task_handle) {
+        xTaskNotifyGive(g_log_cfg.flush_task_handle);
+    }
+}
+
+// Take as many whole log frames out of the ring buffer as will fit
+// into buffer, returning the number of bytes taken.  Only the flush
+// task calls this so the copy can be done outside the critical
+// section: writers never touch the bytes between read and write.
+static uint32_t ring_get(uint8_t *buffer, uint32_t size)
+{
+    uint32_t read = g_log_cfg.ring_read;
+    uint32_t write;
+    uint32_t len = 0;
+
+    taskENTER_CRITICAL(&g_log_cfg.ring_mux);
+    write = g_log_cfg.ring_write;
+    taskEXIT_CRITICAL(&g_log_cfg.ring_mux);
+
+    // Frames are always written whole so there can't be a partial one
+    while (read + len != write) {
+        // Both frame types have their length, in units of the
+        // thing that follows the header, at the same offset
+        uint8_t magic = g_log_cfg.ring[(read + len) & (LOG_RING_SIZE - 1)];
+        uint32_t count = g_log_cfg.ring[(read + len + offsetof(log_msg_t, length)) & (LOG_RING_SIZE - 1)];
+        uint32_t frame_len = sizeof(log_msg_t) + count;
+        if (magic == PROTOCOL_MAGIC_LOG_DEFERRED) {
+            frame_len = sizeof(log_deferred_msg_t) + (count * sizeof(int32_t));
+        }
+        if (len + frame_len > size) {
+            break;
+        }
+        len += frame_len;
+    }
+
+    if (len > 0) {
+        uint32_t offset = read & (LOG_RING_SIZE - 1);
+        uint32_t first = LOG_RING_SIZE - offset;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(buffer, g_log_cfg.ring + offset, first);
+        memcpy(buffer + first, g_log_cfg.ring, len - first);
+
+        taskENTER_CRITICAL(&g_log_cfg.ring_mux);
+        g_log_cfg.ring_read += len;
+        taskEXIT_CRITICAL(&g_log_cfg.ring_mux);
+    }
+
+    return len;
+}
+
+// Send a batch of log frames to the log server.  If the socket
+// stays full for too long, or a send fails, the connection is
+// marked as lost so that the reconnect task starts a fresh stream,
+// since a partially sent frame would leave the server out of step.
+static void send_frames(const uint8_t *buffer, uint32_t len)
+{
+    uint32_t sent = 0;
+    int32_t retries = 0;
+
+    if (xSemaphoreTake(g_log_cfg.lock, pdMS_TO_TICKS(100)) == pdTRUE) {
+        while ((sent < len) && g_log_cfg.connected) {
+            int32_t rc = send(g_log_cfg.socket, buffer + sent, len - sent, MSG_DONTWAIT);
+            if (rc > 0) {
+                sent += rc;
+                retries = 0;
+            } else if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) &&
+                       (retries < LOG_SEND_RETRIES)) {
+                retries++;
+                vTaskDelay(pdMS_TO_TICKS(10));
+                esp_task_wdt_reset();
+            } else {
+                ESP_LOGI(TAG, "send() failed after %" PRIu32 " of %" PRIu32 " byte(s) %d (%s)!",
+                         sent, len, errno, strerror(errno));
+                g_log_cfg.connected = false;
+            }
+        }
+        xSemaphoreGive(g_log_cfg.lock);
+    }
+}
+
+// Task to send log messages from the ring buffer to the log server
+// in batches, so that whoever is logging never waits on the socket.
+static void log_flush_task(void *arg)
+{
+    (void) arg;
+    // Static to keep it off this task's stack
+    static uint8_t buffer[LOG_FLUSH_MAX_LEN];
+    uint32_t dropped_count_reported = 0;
+
+    esp_task_wdt_add(NULL);
+
+    while (g_log_cfg.running) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_FLUSH_PERIOD_MS));
+        esp_task_wdt_reset();
+
+        if (g_log_cfg.connected) {
+            uint32_t len = ring_get(buffer, sizeof(buffer));
+            while ((len > 0) && g_log_cfg.connected) {
+                send_frames(buffer, len);
+                len = ring_get(buffer, sizeof(buffer));
+            }
+
+            // Let the server know if anything was lost, now that
+            // there is room; this is written straight to the ring
+            // rather than through ESP_LOGx() so that it is not
+            // filtered out by the minimum log level
+            uint32_t dropped_count = g_log_cfg.dropped_count;
+            if (dropped_count != dropped_count_reported) {
+                uint8_t frame[sizeof(log_msg_t) + 64];
+                log_msg_t *log_msg = (log_msg_t *) frame;
+                int32_t text_len = snprintf((char *) (frame + sizeof(log_msg_t)),
+                                            sizeof(frame) - sizeof(log_msg_t),
+                                            "W %s: %" PRIu32 " log message(s) dropped",
+                                            TAG, dropped_count - dropped_count_reported);
+                log_msg->magic = PROTOCOL_MAGIC_LOG;
+                log_msg->level = LOG_WARN;
+                log_msg->length = text_len;
+                if (ring_put(frame, sizeof(log_msg_t) + text_len) >= 0) {
+                    dropped_count_reported = dropped_count;
+                }
+            }
+        }
+    }
+
+    ESP_LOGI(TAG, "Log flush task exiting.");
+    esp_task_wdt_delete(NULL);
+    vTaskDelete(NULL);
+}
+
+// Custom vprintf handler with level filtering: messages are put
+// into the ring buffer for log_flush_task() to send.
 static int tcp_log_vprintf(const char *fmt, va_list args)
 {
-    char buffer[LOG_MESSAGE_MAX_LEN];
-    log_msg_t log_msg;
+    uint8_t frame[sizeof(log_msg_t) + LOG_MESSAGE_MAX_LEN];
+    log_msg_t *log_msg = (log_msg_t *) frame;
+    va_list args_copy;
 
     // Parse the log level from format string
     // ESP-IDF logs start with level character: "I (123) TAG: message"
@@ -218,30 +426,22 @@ static int tcp_log_vprintf(const char *fmt, va_list args)
         default: proto_level = LOG_INFO;
     }
 
-    // Format the message
-    int32_t len = vsnprintf(buffer, sizeof(buffer), fmt, args);
-
-    // Forward if level meets minimum and socket connected
-    if (len > 0 && g_log_cfg.connected && proto_level >= g_log_cfg.min_level) {
-
-        if (xSemaphoreTake(g_log_cfg.lock, pdMS_TO_TICKS(100)) == pdTRUE) {
-
-            log_msg.magic = PROTOCOL_MAGIC_LOG;
-            log_msg.level = proto_level;
-            strncpy(log_msg.message, buffer, LOG_MESSAGE_MAX_LEN - 1);
-            log_msg.message[LOG_MESSAGE_MAX_LEN - 1] = '\0';
-
-            if (send(g_log_cfg.socket, &log_msg, sizeof(log_msg), MSG_DONTWAIT) < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    // Buffer full, try again later? Or just drop
-                    ESP_LOGD(TAG, "Log send would block, dropping message");
-                } else {
-                    ESP_LOGI(TAG, "send() failed %d (%s)!", errno, strerror(errno));
-                    g_log_cfg.connected = false;
-                }
+    if (proto_level >= g_log_cfg.min_level) {
+        // Format the message straight after the header, using a copy
+        // of args since they are needed again for vprintf() below
+        va_copy(args_copy, args);
+        int32_t len = vsnprintf((char *) (frame + sizeof(log_msg_t)),
+                                LOG_MESSAGE_MAX_LEN, fmt, args_copy);
+        va_end(args_copy);
+
+        if (len > 0) {
+            if (len > LOG_MESSAGE_MAX_LEN - 1) {
+                len = LOG_MESSAGE_MAX_LEN - 1;
             }
-
-            xSemaphoreGive(g_log_cfg.lock);
+            log_msg->magic = PROTOCOL_MAGIC_LOG;
+            log_msg->level = proto_level;
+            log_msg->length = len;
+            log_frame(frame, sizeof(log_msg_t) + len);
         }
     }
 
@@ -249,6 +449,22 @@ static int tcp_log_vprintf(const char *fmt, va_list args)
     return vprintf(fmt, args);
 }
 
+// Convert a protocol log level into an ESP-IDF one.
+static esp_log_level_t to_esp_log_level(log_level_t level)
+{
+    esp_log_level_t esp_level = ESP_LOG_INFO;
+
+    switch(level) {
+        case LOG_ERROR: esp_level = ESP_LOG_ERROR; break;
+        case LOG_WARN:  esp_level = ESP_LOG_WARN; break;
+        case LOG_INFO:  esp_level = ESP_LOG_INFO; break;
+        case LOG_DEBUG: esp_level = ESP_LOG_DEBUG; break;
+        default: break;
+    }
+
+    return esp_level;
+}
+
 // Wot it says.
 static void clean_up()
 {
@@ -261,9 +477,14 @@ static void clean_up()
 
         xSemaphoreTake(g_log_cfg.lock, portMAX_DELAY);
 
-        // Let the reconnect task exit
+        // Let the reconnect and flush tasks exit
         g_log_cfg.running = false;
+        if (g_log_cfg.flush_task_handle) {
+            xTaskNotifyGive(g_log_cfg.flush_task_handle);
+        }
         vTaskDelay(1000);
+        g_log_cfg.task_handle = NULL;
+        g_log_cfg.flush_task_handle = NULL;
 
         // Close the socket
         if (g_log_cfg.socket >= 0) {
@@ -324,6 +545,12 @@ esp_err_t log_init(const char *server_ip, uint16_t port, log_level_t min_level)
                             err = ESP_ERR_NO_MEM;
                             ESP_LOGE(TAG, "Failed to create reconnect task %d (%s)!", errno, strerror(errno));
                         }
+                        // And a task to send what is logged
+                        if ((err == ESP_OK) &&
+                            (xTaskCreate(&log_flush_task, "log_flush_task", 1024 * 4, NULL, 5, &g_log_cfg.flush_task_handle) != pdPASS)) {
+                            err = ESP_ERR_NO_MEM;
+                            ESP_LOGE(TAG, "Failed to create log flush task %d (%s)!", errno, strerror(errno));
+                        }
                     } else {
                         ESP_LOGE(TAG, "Failed to connect to log server %d (%s)!", errno, strerror(errno));
                         close(g_log_cfg.socket);
@@ -378,5 +605,59 @@ esp_err_t log_set_min_level(log_level_t level)
     return err;
 }
 
+// Get the number of log messages dropped.
+uint32_t log_get_dropped_count(void)
+{
+    uint32_t dropped_count;
+
+    taskENTER_CRITICAL(&g_log_cfg.ring_mux);
+    dropped_count = g_log_cfg.dropped_count;
+    taskEXIT_CRITICAL(&g_log_cfg.ring_mux);
+
+    return dropped_count;
+}
+
+// Get the handles of the log tasks.
+void log_get_task_handles(TaskHandle_t *reconnect_task_handle,
+                          TaskHandle_t *flush_task_handle)
+{
+    *reconnect_task_handle = g_log_cfg.task_handle;
+    *flush_task_handle = g_log_cfg.flush_task_handle;
+}
+
+// Log a deferred message.
+void log_deferred(log_level_t level, log_string_id_t id,
+                  const int32_t *args, size_t num_args)
+{
+    if ((id < LOG_STRING_NUM) && (num_args <= LOG_DEFERRED_MAX_ARGS)) {
+#if defined(CONFIG_STEPPER_LOG_DEFERRED) && CONFIG_STEPPER_LOG_DEFERRED
+        if (g_log_cfg.running) {
+            if (level >= g_log_cfg.min_level) {
+                uint8_t frame[sizeof(log_deferred_msg_t) + (LOG_DEFERRED_MAX_ARGS * sizeof(int32_t))];
+                log_deferred_msg_t *log_msg = (log_deferred_msg_t *) frame;
+                log_msg->magic = PROTOCOL_MAGIC_LOG_DEFERRED;
+                log_msg->level = level;
+                log_msg->num_args = num_args;
+                log_msg->id = id;
+                log_msg->timestamp_ms = esp_log_timestamp();
+                memcpy(frame + sizeof(log_deferred_msg_t), args, num_args * sizeof(int32_t));
+                log_frame(frame, sizeof(log_deferred_msg_t) + (num_args * sizeof(int32_t)));
+            }
+        } else
+#endif
+        {
+            // No log server to defer to: format it here, passing all
+            // of the arguments since printf() ignores any extras
+            int32_t a[LOG_DEFERRED_MAX_ARGS] = {0};
+            char buffer[LOG_MESSAGE_MAX_LEN];
+            memcpy(a, args, num_args * sizeof(int32_t));
+            snprintf(buffer, sizeof(buffer), g_log_string[id].format,
+                     (int) a[0], (int) a[1], (int) a[2], (int) a[3],
+                     (int) a[4], (int) a[5], (int) a[6], (int) a[7]);
+            ESP_LOG_LEVEL(to_esp_log_level(level), g_log_string[id].tag, "%s", buffer);
+        }
+    }
+}
+
 // End of file
 
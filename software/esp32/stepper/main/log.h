@@ -28,9 +28,32 @@ extern "C" {
 // Required for log_level_t.
 #include "../../../protocol/protocol.h"
 
+// Required for log_string_id_t.
+#include "../../../protocol/log_strings.h"
+
+// Required for TaskHandle_t.
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
  /* ----------------------------------------------------------------
   * COMPILE-TIME MACROS
   * -------------------------------------------------------------- */
+
+/** Log one of the messages of log_strings.h, e.g.:
+ *
+ * LOG_DEFERRED(LOG_INFO, LOG_STRING_RX_QRY, qry, reference);
+ *
+ * The arguments must be integers, at most LOG_DEFERRED_MAX_ARGS of
+ * them; see log_deferred().
+ */
+#define LOG_DEFERRED(level, id, ...)                                       \
+    do {                                                                   \
+        const int32_t _log_args[] = {0, ##__VA_ARGS__};                    \
+        _Static_assert(sizeof(_log_args) / sizeof(_log_args[0]) - 1 <=     \
+                       LOG_DEFERRED_MAX_ARGS, "too many log arguments");   \
+        log_deferred(level, id, _log_args + 1,                             \
+                     (sizeof(_log_args) / sizeof(_log_args[0])) - 1);      \
+    } while (0)
  
  /* ----------------------------------------------------------------
   * TYPES
@@ -67,6 +90,42 @@ void log_deinit();
  */
 esp_err_t log_set_min_level(log_level_t level);
 
+/** Get the number of log messages that have been dropped, because
+ * they arrived faster than they could be sent to the log server,
+ * since boot; see QRY_SYSTEM_STATS.
+ *
+ * @return the number of log messages dropped.
+ */
+uint32_t log_get_dropped_count(void);
+
+/** Get the handles of the tasks that forward logging, e.g. to check
+ * on their stacks; a handle is NULL if that task is not running.
+ *
+ * @param reconnect_task_handle a place to put the handle of the task
+ *                              that reconnects to the log server.
+ * @param flush_task_handle     a place to put the handle of the task
+ *                              that sends what is logged.
+ */
+void log_get_task_handles(TaskHandle_t *reconnect_task_handle,
+                          TaskHandle_t *flush_task_handle);
+
+/** Log one of the messages of log_strings.h; call this through the
+ * LOG_DEFERRED() macro rather than directly.  If forwarding to the
+ * log server is running, and CONFIG_STEPPER_LOG_DEFERRED is set, the
+ * message is NOT formatted but just the ID of its format string, a
+ * timestamp and the arguments are sent, for the log server to
+ * format; in that case nothing is printed locally.  Otherwise the
+ * message is formatted and logged as normal.
+ *
+ * @param level    the level of the message.
+ * @param id       the ID of the format string in log_strings.h.
+ * @param args     the arguments.
+ * @param num_args the number of arguments, at most
+ *                 LOG_DEFERRED_MAX_ARGS.
+ */
+void log_deferred(log_level_t level, log_string_id_t id,
+                  const int32_t *args, size_t num_args);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,650 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file
+ * @brief Implementation of the motion API for the ESP32-based stepper
+ * motor driver.  Each step is one RMT symbol, a short high pulse
+ * followed by a low period that sets the step rate.  A move is given
+ * to the RMT channel as a series of short chunks, each its own
+ * transaction, by motion_task(), which keeps one chunk queued behind
+ * the one being sent so that the steps are back to back; a move of
+ * any length costs no more memory than a short one.  The count of
+ * steps is of those in chunks that the RMT channel has finished
+ * sending, so it is exact: motion_stop() lets the chunks already
+ * queued finish rather than abandoning them part way through.
+ *
+ * Note: the ESP32C3 has no MCPWM peripheral, hence RMT.
+ */
+
+#include <math.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "driver/gpio.h"
+#include "driver/rmt_tx.h"
+#include "driver/rmt_encoder.h"
+
+#include "motion.h"
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// Logging prefix
+#define TAG "motion"
+
+// The resolution of the RMT channel: one tick is a microsecond
+#define RMT_RESOLUTION_HZ 1000000
+
+// The number of RMT symbols in a memory block on an ESP32C3
+#define RMT_MEM_BLOCK_SYMBOLS 48
+
+// The duration of the high part of a STEP pulse in RMT ticks;
+// the TMC2209 needs at least 100 ns
+#define STEP_PULSE_TICKS 2
+
+// The most steps in a chunk: a chunk fits in the RMT memory block
+// so that the encoder writes it in one go.
+#define CHUNK_STEPS_MAX RMT_MEM_BLOCK_SYMBOLS
+
+// The duration of a chunk in microseconds, unless a single step takes
+// longer: this is the most that a move carries on for once
+// motion_stop() has been called with immediate set, per chunk queued.
+#define CHUNK_DURATION_US 1000
+
+// The number of chunks queued to the RMT channel at any one time: the
+// one being sent and the one that follows it.
+#define CHUNK_QUEUE_LENGTH 2
+
+// How long motion_stop() waits for the chunks that are queued to
+// finish, in milliseconds: enough for CHUNK_QUEUE_LENGTH chunks of a
+// step at MOTION_VELOCITY_MIN_HZ, with margin.
+#define STOP_WAIT_MS ((CHUNK_QUEUE_LENGTH * 1000 / MOTION_VELOCITY_MIN_HZ) + 50)
+
+// The stack size and priority of motion_task(): it must queue the
+// next chunk within CHUNK_DURATION_US of being told to, so it is
+// above the tasks of stepper.c.
+#define MOTION_TASK_STACK_SIZE (1024 * 3)
+#define MOTION_TASK_PRIORITY 10
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// The parameters of a move.
+typedef struct {
+    uint32_t id;            // Different for each move
+    int32_t start_position;
+    int32_t direction;
+    int32_t steps;          // May be cut short by motion_stop()
+    int32_t steps_queued;   // In chunks given to the RMT channel
+    int32_t steps_sent;     // In chunks the RMT channel has finished sending
+    int32_t ramp_steps;
+    float velocity_max_hz;
+    float acceleration_hz;
+    float velocity_hz;
+    motion_profile_t profile;
+    bool stop_requested;
+    bool stop_immediate;
+} motion_move_t;
+
+// A chunk of a move, which is the payload that is passed to the
+// RMT encoder: the period of each step, worked out by motion_task()
+// so that the encoder, which may be called in interrupt context,
+// only has to copy them.
+typedef struct {
+    int32_t steps;
+    uint16_t period_ticks[CHUNK_STEPS_MAX];
+} motion_chunk_t;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The RMT channel driving the STEP pin, NULL if motion_init()
+// has not been called.
+static rmt_channel_handle_t g_channel = NULL;
+
+// The RMT encoder that generates the steps.
+static rmt_encoder_handle_t g_encoder = NULL;
+
+// The GPIO wired to the DIR pin of the TMC2209.
+static gpio_num_t g_pin_dir = -1;
+
+// The move in progress, or the last move.
+static motion_move_t g_move = {0};
+
+// The chunks of the move in progress, a ring: g_chunk_write is the
+// next for motion_task() to fill, g_chunk_read is the next that the
+// RMT channel will finish sending and g_chunk_count is the number
+// queued to the RMT channel.
+static motion_chunk_t g_chunk[CHUNK_QUEUE_LENGTH];
+static size_t g_chunk_write = 0;
+static size_t g_chunk_read = 0;
+static size_t g_chunk_count = 0;
+
+// The handle of motion_task().
+static TaskHandle_t g_task_handle = NULL;
+
+// True while a move is in progress.
+static bool g_moving = false;
+
+// The position when no move is in progress.
+static int32_t g_position = 0;
+
+// The user callback for the end of a move and its argument.
+static motion_done_callback_t g_callback = NULL;
+static void *g_callback_arg = NULL;
+
+// Lock for the above, shared with interrupt context.
+static portMUX_TYPE g_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Clean-up on error or completion
+static void cleanup()
+{
+    if (g_task_handle != NULL) {
+        vTaskDelete(g_task_handle);
+        g_task_handle = NULL;
+    }
+    if (g_channel != NULL) {
+        rmt_disable(g_channel);
+        rmt_del_channel(g_channel);
+        g_channel = NULL;
+    }
+    if (g_encoder != NULL) {
+        rmt_del_encoder(g_encoder);
+        g_encoder = NULL;
+    }
+    g_pin_dir = -1;
+    g_moving = false;
+}
+
+// Return the number of steps it takes to ramp up to the
+// maximum velocity of a move.
+static int32_t ramp_steps(float velocity_max_hz, float acceleration_hz,
+                          motion_profile_t profile)
+{
+    // For constant acceleration v^2 = 2as; the S-curve is given
+    // twice the distance so that its peak acceleration is similar
+    float steps = (velocity_max_hz * velocity_max_hz) / acceleration_hz;
+    if (profile != MOTION_PROFILE_S_CURVE) {
+        steps /= 2;
+    }
+    if (steps < 1) {
+        steps = 1;
+    }
+
+    return (int32_t) steps;
+}
+
+// Return the velocity, in Hertz, of the given step of a move.
+static float velocity_at(const motion_move_t *move, int32_t step)
+{
+    float velocity_hz = move->velocity_max_hz;
+
+    // The distance to the nearer end of the move
+    int32_t distance = step + 1;
+    if (move->steps - step < distance) {
+        distance = move->steps - step;
+    }
+
+    if (distance < move->ramp_steps) {
+        if (move->profile == MOTION_PROFILE_S_CURVE) {
+            float x = ((float) distance) / move->ramp_steps;
+            velocity_hz = MOTION_VELOCITY_MIN_HZ +
+                          ((move->velocity_max_hz - MOTION_VELOCITY_MIN_HZ) * x * x * (3 - (2 * x)));
+        } else {
+            velocity_hz = sqrtf(2 * move->acceleration_hz * distance);
+        }
+    }
+    if (velocity_hz < MOTION_VELOCITY_MIN_HZ) {
+        velocity_hz = MOTION_VELOCITY_MIN_HZ;
+    }
+
+    return velocity_hz;
+}
+
+// End the move in progress, where the steps sent have got it to.
+// IMPORTANT: g_lock should be held when this is called.
+static int32_t move_end()
+{
+    g_position = g_move.start_position + (g_move.direction * g_move.steps_sent);
+    g_moving = false;
+
+    return g_position;
+}
+
+// RMT simple encoder callback: write as many of the step symbols
+// of a chunk as there is room for.  May be called in interrupt
+// context.
+static size_t encode_steps(const void *data, size_t data_size,
+                           size_t symbols_written, size_t symbols_free,
+                           rmt_symbol_word_t *symbols, bool *done, void *arg)
+{
+    const motion_chunk_t *chunk = (const motion_chunk_t *) data;
+    size_t count = 0;
+
+    (void) data_size;
+    (void) arg;
+
+    while ((count < symbols_free) && (symbols_written + count < (size_t) chunk->steps)) {
+        symbols[count].level0 = 1;
+        symbols[count].duration0 = STEP_PULSE_TICKS;
+        symbols[count].level1 = 0;
+        symbols[count].duration1 = chunk->period_ticks[symbols_written + count] - STEP_PULSE_TICKS;
+        count++;
+    }
+    *done = (symbols_written + count >= (size_t) chunk->steps);
+
+    return count;
+}
+
+// RMT transmit done callback, called in interrupt context at the end
+// of each chunk: counts the steps of the chunk as sent and either
+// ends the move or asks motion_task() for another chunk.
+static bool trans_done_callback(rmt_channel_handle_t channel,
+                                const rmt_tx_done_event_data_t *event_data,
+                                void *user_ctx)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    bool task_woken = false;
+    bool ended = false;
+    int32_t position = 0;
+
+    (void) channel;
+    (void) event_data;
+    (void) user_ctx;
+
+    portENTER_CRITICAL_ISR(&g_lock);
+    if (g_chunk_count > 0) {
+        g_move.steps_sent += g_chunk[g_chunk_read].steps;
+        g_chunk_read = (g_chunk_read + 1) % CHUNK_QUEUE_LENGTH;
+        g_chunk_count--;
+        if (g_moving && (g_chunk_count == 0) &&
+            ((g_move.steps_sent >= g_move.steps) || g_move.stop_immediate)) {
+            position = move_end();
+            ended = true;
+        }
+    }
+    portEXIT_CRITICAL_ISR(&g_lock);
+
+    if (ended) {
+        if (g_callback) {
+            task_woken = g_callback(position, g_callback_arg);
+        }
+    } else if (g_task_handle != NULL) {
+        vTaskNotifyGiveFromISR(g_task_handle, &higher_priority_task_woken);
+        task_woken = (higher_priority_task_woken == pdTRUE);
+    }
+
+    return task_woken;
+}
+
+// Give the RMT channel chunks of the move in progress until
+// CHUNK_QUEUE_LENGTH of them are queued or the move is all queued.
+// Only called by motion_task().
+static void queue_chunks()
+{
+    bool more = true;
+
+    while (more) {
+        motion_chunk_t *chunk = &(g_chunk[g_chunk_write]);
+        uint32_t id = 0;
+        int32_t steps_queued = 0;
+        int32_t steps = 0;
+
+        more = false;
+        portENTER_CRITICAL(&g_lock);
+        if (g_move.stop_requested) {
+            // Ramp down over the same number of steps it would
+            // take to ramp up to where we are now
+            int32_t ramp = g_move.steps_queued + 1;
+            if (ramp > g_move.ramp_steps) {
+                ramp = g_move.ramp_steps;
+            }
+            if (g_move.steps_queued + ramp < g_move.steps) {
+                g_move.steps = g_move.steps_queued + ramp;
+            }
+            g_move.stop_requested = false;
+        }
+        if (g_moving && !g_move.stop_immediate &&
+            (g_chunk_count < CHUNK_QUEUE_LENGTH)) {
+            id = g_move.id;
+            steps_queued = g_move.steps_queued;
+            steps = g_move.steps;
+            more = (steps_queued < steps);
+        }
+        portEXIT_CRITICAL(&g_lock);
+
+        if (more) {
+            // Work out the steps of the chunk, not locked as the
+            // floating point is not quick on an ESP32C3; velocity_hz
+            // is a single word so the readers of it will see either
+            // the old or the new value
+            uint32_t duration_ticks = 0;
+            chunk->steps = 0;
+            while ((chunk->steps < CHUNK_STEPS_MAX) &&
+                   (steps_queued + chunk->steps < steps) &&
+                   (duration_ticks < CHUNK_DURATION_US * (RMT_RESOLUTION_HZ / 1000000))) {
+                g_move.velocity_hz = velocity_at(&g_move, steps_queued + chunk->steps);
+                uint32_t period_ticks = (uint32_t) (RMT_RESOLUTION_HZ / g_move.velocity_hz);
+                chunk->period_ticks[chunk->steps] = (uint16_t) period_ticks;
+                duration_ticks += period_ticks;
+                chunk->steps++;
+            }
+            // Only queue it if the move hasn't been stopped, or
+            // replaced, in the meantime
+            portENTER_CRITICAL(&g_lock);
+            more = g_moving && !g_move.stop_immediate && (g_move.id == id);
+            if (more) {
+                g_move.steps_queued += chunk->steps;
+                g_chunk_count++;
+            }
+            portEXIT_CRITICAL(&g_lock);
+            if (more) {
+                rmt_transmit_config_t transmit_config = {
+                    .loop_count = 0
+                };
+                esp_err_t err = rmt_transmit(g_channel, g_encoder, chunk,
+                                             sizeof(*chunk), &transmit_config);
+                if (err == ESP_OK) {
+                    g_chunk_write = (g_chunk_write + 1) % CHUNK_QUEUE_LENGTH;
+                } else {
+                    // Take the chunk back and end the move when
+                    // what is already queued has been sent
+                    portENTER_CRITICAL(&g_lock);
+                    g_move.steps_queued -= chunk->steps;
+                    g_chunk_count--;
+                    g_move.steps = g_move.steps_queued;
+                    if (g_chunk_count == 0) {
+                        move_end();
+                    }
+                    portEXIT_CRITICAL(&g_lock);
+                    ESP_LOGE(TAG, "Unable to queue steps, move ended (%s).",
+                             esp_err_to_name(err));
+                    more = false;
+                }
+            }
+        }
+    }
+}
+
+// Task to feed the RMT channel with the chunks of a move: told to
+// by motion_move_to() at the start of a move and by
+// trans_done_callback() at the end of each chunk.
+static void motion_task(void *arg)
+{
+    (void) arg;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        queue_chunks();
+    }
+}
+
+// Return the expected duration of a move in milliseconds.
+static int32_t duration_ms(const motion_move_t *move)
+{
+    float seconds;
+
+    if (move->steps >= move->ramp_steps * 2) {
+        // The time to cover the ramps, at an average of half the
+        // maximum velocity, plus the time at maximum velocity
+        seconds = ((move->ramp_steps * 4) + (move->steps - (move->ramp_steps * 2))) /
+                  move->velocity_max_hz;
+    } else {
+        // Never gets to maximum velocity: for constant acceleration
+        // s = at^2 / 2 for each half; be pessimistic for S-curve
+        seconds = 2 * sqrtf(move->steps / move->acceleration_hz);
+        if (move->profile == MOTION_PROFILE_S_CURVE) {
+            seconds *= 2;
+        }
+    }
+
+    return (int32_t) (seconds * 1000);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Initialise the motion API.
+esp_err_t motion_init(int32_t pin_step, int32_t pin_dir,
+                      motion_done_callback_t callback,
+                      void *callback_arg)
+{
+    esp_err_t err = -ESP_ERR_INVALID_ARG;
+
+    if ((pin_step >= 0) && (pin_dir >= 0)) {
+        err = ESP_OK;
+        if (g_channel == NULL) {
+            ESP_LOGI(TAG, "Initialising motion with STEP pin %d, DIR pin %d.",
+                     pin_step, pin_dir);
+            err = gpio_set_level(pin_dir, 0);
+            if (err == ESP_OK) {
+                err = gpio_set_direction(pin_dir, GPIO_MODE_OUTPUT);
+            }
+            if (err == ESP_OK) {
+                g_pin_dir = pin_dir;
+                rmt_tx_channel_config_t channel_config = {
+                    .gpio_num = pin_step,
+                    .clk_src = RMT_CLK_SRC_DEFAULT,
+                    .resolution_hz = RMT_RESOLUTION_HZ,
+                    .mem_block_symbols = RMT_MEM_BLOCK_SYMBOLS,
+                    .trans_queue_depth = CHUNK_QUEUE_LENGTH,
+                };
+                err = rmt_new_tx_channel(&channel_config, &g_channel);
+            }
+            if (err == ESP_OK) {
+                rmt_simple_encoder_config_t encoder_config = {
+                    .callback = encode_steps,
+                    .arg = NULL,
+                    .min_chunk_size = 1
+                };
+                err = rmt_new_simple_encoder(&encoder_config, &g_encoder);
+            }
+            if (err == ESP_OK) {
+                rmt_tx_event_callbacks_t callbacks = {
+                    .on_trans_done = trans_done_callback
+                };
+                err = rmt_tx_register_event_callbacks(g_channel, &callbacks, NULL);
+            }
+            if (err == ESP_OK) {
+                err = rmt_enable(g_channel);
+            }
+            if ((err == ESP_OK) &&
+                (xTaskCreate(&motion_task, "motion_task", MOTION_TASK_STACK_SIZE, NULL,
+                             MOTION_TASK_PRIORITY, &g_task_handle) != pdPASS)) {
+                err = ESP_ERR_NO_MEM;
+            }
+            if (err == ESP_OK) {
+                g_callback = callback;
+                g_callback_arg = callback_arg;
+                g_position = 0;
+            } else {
+                ESP_LOGE(TAG, "Unable to initialise motion (%s).", esp_err_to_name(err));
+                cleanup();
+                err = -err;
+            }
+        }
+    }
+
+    return err;
+}
+
+// Deinitialise the motion API.
+void motion_deinit()
+{
+    cleanup();
+}
+
+// Start a move to the given position.
+esp_err_t motion_move_to(int32_t position, int32_t velocity_hz,
+                         int32_t acceleration_hz,
+                         motion_profile_t profile)
+{
+    esp_err_t err = -ESP_ERR_INVALID_STATE;
+
+    if ((g_channel != NULL) && !g_moving) {
+        err = -ESP_ERR_INVALID_ARG;
+        if (acceleration_hz > 0) {
+            if (velocity_hz < 0) {
+                velocity_hz = -velocity_hz;
+            }
+            if (velocity_hz < MOTION_VELOCITY_MIN_HZ) {
+                velocity_hz = MOTION_VELOCITY_MIN_HZ;
+            }
+            if (velocity_hz > MOTION_VELOCITY_MAX_HZ) {
+                velocity_hz = MOTION_VELOCITY_MAX_HZ;
+            }
+            g_move.id++;
+            g_move.start_position = g_position;
+            g_move.direction = 1;
+            g_move.steps = position - g_position;
+            if (g_move.steps < 0) {
+                g_move.direction = -1;
+                g_move.steps = -g_move.steps;
+            }
+            g_move.steps_queued = 0;
+            g_move.steps_sent = 0;
+            g_move.velocity_max_hz = velocity_hz;
+            g_move.acceleration_hz = acceleration_hz;
+            g_move.velocity_hz = 0;
+            g_move.profile = profile;
+            g_move.ramp_steps = ramp_steps(g_move.velocity_max_hz,
+                                           g_move.acceleration_hz, profile);
+            g_move.stop_requested = false;
+            g_move.stop_immediate = false;
+            err = ESP_OK;
+            if (g_move.steps > 0) {
+                ESP_LOGI(TAG, "Moving %d step(s) from %d to %d, up to %d Hz.",
+                         g_move.steps * g_move.direction, g_position,
+                         position, velocity_hz);
+                err = gpio_set_level(g_pin_dir, g_move.direction > 0);
+                if (err == ESP_OK) {
+                    // motion_task() does the rest
+                    g_moving = true;
+                    xTaskNotifyGive(g_task_handle);
+                }
+                if (err == ESP_OK) {
+                    err = duration_ms(&g_move);
+                } else {
+                    ESP_LOGE(TAG, "Unable to start move (%s).", esp_err_to_name(err));
+                    err = -err;
+                }
+            }
+        }
+    }
+
+    return err;
+}
+
+// Stop any move in progress.
+void motion_stop(bool immediate)
+{
+    if ((g_channel != NULL) && g_moving) {
+        if (immediate) {
+            // Queue no more chunks and let those already queued
+            // finish, trans_done_callback() ending the move with
+            // the last of them, so that the step count is exact
+            portENTER_CRITICAL(&g_lock);
+            g_move.stop_immediate = true;
+            if (g_chunk_count == 0) {
+                move_end();
+            }
+            portEXIT_CRITICAL(&g_lock);
+            for (int32_t waited_ms = 0; g_moving && (waited_ms < STOP_WAIT_MS); waited_ms++) {
+                if (rmt_tx_wait_all_done(g_channel, 1) == ESP_OK) {
+                    // Nothing left with the RMT channel but a chunk
+                    // may be on its way from motion_task()
+                    vTaskDelay(1);
+                }
+            }
+            if (g_moving) {
+                // Should never happen: disabling the channel abandons
+                // the chunks, so the count may be out by those
+                rmt_disable(g_channel);
+                portENTER_CRITICAL(&g_lock);
+                g_chunk_read = (g_chunk_read + g_chunk_count) % CHUNK_QUEUE_LENGTH;
+                g_chunk_count = 0;
+                move_end();
+                portEXIT_CRITICAL(&g_lock);
+                rmt_enable(g_channel);
+                ESP_LOGW(TAG, "Chunks of the move abandoned, step count may be out.");
+            }
+            ESP_LOGI(TAG, "Stopped at %d.", g_position);
+        } else {
+            portENTER_CRITICAL(&g_lock);
+            g_move.stop_requested = true;
+            portEXIT_CRITICAL(&g_lock);
+        }
+    }
+}
+
+// Determine whether a move is in progress.
+bool motion_is_moving()
+{
+    return g_moving;
+}
+
+// Get the current position.
+int32_t motion_get_position()
+{
+    int32_t position;
+
+    portENTER_CRITICAL(&g_lock);
+    position = g_position;
+    if (g_moving) {
+        position = g_move.start_position + (g_move.direction * g_move.steps_sent);
+    }
+    portEXIT_CRITICAL(&g_lock);
+
+    return position;
+}
+
+// Set the current position.
+esp_err_t motion_set_position(int32_t position)
+{
+    esp_err_t err = -ESP_ERR_INVALID_STATE;
+
+    if (!g_moving) {
+        g_position = position;
+        err = ESP_OK;
+    }
+
+    return err;
+}
+
+// Get the current velocity.
+int32_t motion_get_velocity()
+{
+    int32_t millihertz = 0;
+
+    portENTER_CRITICAL(&g_lock);
+    if (g_moving) {
+        millihertz = (int32_t) (g_move.velocity_hz * 1000) * g_move.direction;
+    }
+    portEXIT_CRITICAL(&g_lock);
+
+    return millihertz;
+}
+
+// End of file
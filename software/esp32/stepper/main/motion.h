@@ -0,0 +1,173 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MOTION_H_
+#define _MOTION_H_
+
+/** @file
+ * @brief The motion API for the stepper motor application: drives
+ * the STEP and DIR pins of a TMC2209 from the RMT peripheral with
+ * an acceleration profile, keeping count of the steps taken.
+ *
+ * Note: the TMC2209 only takes notice of its STEP pin when
+ * VACTUAL is zero, so make sure that tmc2209_set_velocity()
+ * has been called with zero before calling motion_move_to().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+/** The lowest step rate that motion_move_to() will use, in Hertz;
+ * limited by the width of the duration field of an RMT symbol.
+ */
+#define MOTION_VELOCITY_MIN_HZ 50
+
+/** The highest step rate that motion_move_to() will use, in Hertz.
+ */
+#define MOTION_VELOCITY_MAX_HZ 50000
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The acceleration profiles that motion_move_to() supports.
+ */
+typedef enum {
+    MOTION_PROFILE_TRAPEZOIDAL = 0, /**< constant acceleration up to,
+                                         and down from, the velocity. */
+    MOTION_PROFILE_S_CURVE = 1      /**< velocity follows a smoothstep
+                                         curve, over twice the distance
+                                         of the trapezoidal ramp, so that
+                                         the changes in acceleration are
+                                         gentle at both ends of a ramp. */
+} motion_profile_t;
+
+/** Callback for the end of a move, see motion_init().
+ *
+ * @param position the position, in steps, that the move ended at.
+ * @param arg      the user argument that was passed to motion_init().
+ * @return         true if a higher priority task has been woken
+ *                 by what the callback did, else false.
+ */
+typedef bool (*motion_done_callback_t)(int32_t position, void *arg);
+
+/* ----------------------------------------------------------------
+ * FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/** Initialise the motion API.  The position is set to zero.
+ *
+ * @param pin_step     the GPIO pin connected to the STEP pin of the
+ *                     TMC2209.
+ * @param pin_dir      the GPIO pin connected to the DIR pin of the
+ *                     TMC2209.
+ * @param callback     a function to be called when a move has
+ *                     ended; THIS WILL BE CALLED IN INTERRUPT
+ *                     CONTEXT so do very little in it, e.g.
+ *                     notify a task.  May be NULL.
+ * @param callback_arg user-defined argument that will be passed to
+ *                     callback; may be NULL.
+ * @return             zero on success else negative error code
+ *                     from esp_err_t.
+ */
+esp_err_t motion_init(int32_t pin_step, int32_t pin_dir,
+                      motion_done_callback_t callback,
+                      void *callback_arg);
+
+/** Deinitialise the motion API, stopping any move immediately.
+ */
+void motion_deinit();
+
+/** Start a move to the given position; this function returns
+ * immediately, use motion_is_moving() or the callback passed to
+ * motion_init() to find out when the move has ended.
+ *
+ * @param position         the position to move to, in steps.
+ * @param velocity_hz      the velocity to ramp up to, in steps per
+ *                         second; the sign is ignored, the direction
+ *                         comes from position.  Will be limited to
+ *                         the range MOTION_VELOCITY_MIN_HZ to
+ *                         MOTION_VELOCITY_MAX_HZ.
+ * @param acceleration_hz  the acceleration, in steps per second
+ *                         per second; must be greater than zero.
+ * @param profile          the acceleration profile to use.
+ * @return                 the expected duration of the move
+ *                         in milliseconds, else negative error
+ *                         code from esp_err_t; a move is not
+ *                         permitted if one is already in progress.
+ */
+esp_err_t motion_move_to(int32_t position, int32_t velocity_hz,
+                         int32_t acceleration_hz,
+                         motion_profile_t profile);
+
+/** Stop any move in progress.
+ *
+ * @param immediate if true, stop stepping now: the chunks of steps
+ *                  already with the RMT channel, a millisecond or so
+ *                  of them, are allowed to finish, which this waits
+ *                  for, so that the position stays exact; if false,
+ *                  ramp down as the profile would do and only then
+ *                  stop, this returning at once.  Note that the
+ *                  callback passed to motion_init() may not be
+ *                  called for a move that is stopped immediately.
+ */
+void motion_stop(bool immediate);
+
+/** Determine whether a move is in progress.
+ *
+ * @return true if a move is in progress, else false.
+ */
+bool motion_is_moving();
+
+/** Get the current position.  This is exact when there is no
+ * move in progress, otherwise it counts the steps that have been
+ * sent, to the end of the last chunk of them, so may be behind by
+ * up to a millisecond or so of steps.
+ *
+ * @return the position in steps.
+ */
+int32_t motion_get_position();
+
+/** Set the current position, e.g. to zero when a reference sensor
+ * has been reached; not permitted while a move is in progress.
+ *
+ * @param position the position in steps.
+ * @return         zero on success else negative error code
+ *                 from esp_err_t.
+ */
+esp_err_t motion_set_position(int32_t position);
+
+/** Get the current velocity.
+ *
+ * @return the velocity in milliHertz, negative for moves towards
+ *         lower positions, zero if there is no move in progress.
+ */
+int32_t motion_get_velocity();
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @}*/
+
+#endif // _MOTION_H_
+
+// End of file
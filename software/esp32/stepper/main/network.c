@@ -28,6 +28,7 @@
 #include "esp_wifi_types.h"
 #include "esp_phy_init.h"
 #include "lwip/netdb.h"
+#include "nvs.h"
 
 #include "network.h"
 
@@ -38,20 +39,135 @@
  // Logging prefix
  #define TAG "network"
 
+// The NVS namespace and key under which what is needed to connect
+// quickly (see CONFIG_STEPPER_FAST_RECONNECT) is kept
+#define NETWORK_NVS_NAMESPACE "network"
+#define NETWORK_NVS_KEY_CACHE "cache"
+
+// How long to wait for a connection using what was kept from last
+// time before giving up on it and doing things the long way
+#define NETWORK_FAST_CONNECT_TIMEOUT_MS 5000
+
+// How many times in a row a connection using what was kept from
+// last time may fail before it is given up on
+#define NETWORK_FAST_CONNECT_MAX_FAILURES 3
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+// What is kept in NVS to connect quickly next time.
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+} network_cache_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
 
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+// What was kept in NVS from last time
+static network_cache_t g_cache = {0};
+
+// True if g_cache is being used to connect.
+static bool g_cache_in_use = false;
+
+// The number of times in a row a connection using g_cache has failed.
+static int32_t g_cache_failure_count = 0;
+#endif
+
 // Semaphore for WiFi synchronization
 static SemaphoreHandle_t g_wifi_semaphore = NULL;
 
 // Wifi network interface
 static esp_netif_t *g_sta_netif = NULL;
 
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: FAST RECONNECT
+ * -------------------------------------------------------------- */
+
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+
+// Read what was kept from last time, returning true if there was anything.
+static bool cache_load(network_cache_t *cache)
+{
+    nvs_handle_t handle;
+    size_t length = sizeof(*cache);
+    bool loaded = false;
+
+    if (nvs_open(NETWORK_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        loaded = (nvs_get_blob(handle, NETWORK_NVS_KEY_CACHE, cache, &length) == ESP_OK) &&
+                 (length == sizeof(*cache));
+        nvs_close(handle);
+    }
+
+    return loaded;
+}
+
+// Keep what we are connected with now for next time, if it has changed.
+static void cache_update()
+{
+    network_cache_t cache;
+    wifi_ap_record_t ap_info;
+    nvs_handle_t handle;
+    esp_err_t err;
+
+    // Zero the padding too, since the whole thing is compared
+    memset(&cache, 0, sizeof(cache));
+    if ((esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) &&
+        (esp_netif_get_ip_info(g_sta_netif, &cache.ip_info) == ESP_OK)) {
+        memcpy(cache.bssid, ap_info.bssid, sizeof(cache.bssid));
+        cache.channel = ap_info.primary;
+        if (memcmp(&cache, &g_cache, sizeof(cache)) != 0) {
+            err = nvs_open(NETWORK_NVS_NAMESPACE, NVS_READWRITE, &handle);
+            if (err == ESP_OK) {
+                err = nvs_set_blob(handle, NETWORK_NVS_KEY_CACHE, &cache, sizeof(cache));
+                if (err == ESP_OK) {
+                    err = nvs_commit(handle);
+                }
+                nvs_close(handle);
+            }
+            if (err == ESP_OK) {
+                g_cache = cache;
+                ESP_LOGI(TAG, "Will reconnect to channel %d, IP " IPSTR " next time.",
+                         cache.channel, IP2STR(&cache.ip_info.ip));
+            } else {
+                ESP_LOGW(TAG, "Unable to keep connection details: %s.", esp_err_to_name(err));
+            }
+        }
+    }
+}
+
+// Stop using what was kept from last time, and forget it: from
+// here on in the AP is scanned for on all channels and DHCP is used.
+static void cache_forget()
+{
+    wifi_config_t wifi_config;
+    nvs_handle_t handle;
+
+    if (g_cache_in_use) {
+        ESP_LOGW(TAG, "Unable to connect quickly, forgetting BSSID/channel/IP address.");
+        g_cache_in_use = false;
+        memset(&g_cache, 0, sizeof(g_cache));
+        if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) == ESP_OK) {
+            wifi_config.sta.bssid_set = false;
+            wifi_config.sta.channel = 0;
+            wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+            esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+        }
+        esp_netif_dhcpc_start(g_sta_netif);
+        if (nvs_open(NETWORK_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            nvs_erase_key(handle, NETWORK_NVS_KEY_CACHE);
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+    }
+}
+
+#endif // #if defined(CONFIG_STEPPER_FAST_RECONNECT)
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS: EVENT HANDLERS
  * -------------------------------------------------------------- */
@@ -64,6 +180,9 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
         ESP_LOGI(TAG, "WiFi connected to AP.");
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+        g_cache_failure_count = 0;
+#endif
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t*) event_data;
         ESP_LOGI(TAG, "WiFi disconnected, reason: %d.", event->reason);
@@ -75,6 +194,16 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                 event->bssid[3], event->bssid[4], event->bssid[5]);
         ESP_LOGI(TAG, "Reason: %d.", event->reason);
 
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+        // The AP may have moved channel or been replaced
+        if (g_cache_in_use) {
+            g_cache_failure_count++;
+            if (g_cache_failure_count >= NETWORK_FAST_CONNECT_MAX_FAILURES) {
+                cache_forget();
+            }
+        }
+#endif
+
         ESP_LOGI(TAG, "Attempting to reconnect...");
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_AUTHMODE_CHANGE) {
@@ -184,6 +313,28 @@ esp_err_t network_init(const char *ssid, const char *password,
             wifi_config.sta.pmf_cfg.capable = true;
             wifi_config.sta.pmf_cfg.required = false;
 
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+            // If we know where the AP was last time, go straight there,
+            // and with the same IP address, rather than scanning all
+            // channels and then waiting for DHCP
+            if (cache_load(&g_cache)) {
+                memcpy(wifi_config.sta.bssid, g_cache.bssid, sizeof(wifi_config.sta.bssid));
+                wifi_config.sta.bssid_set = true;
+                wifi_config.sta.channel = g_cache.channel;
+                wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+                if ((esp_netif_dhcpc_stop(g_sta_netif) == ESP_OK) &&
+                    (esp_netif_set_ip_info(g_sta_netif, &g_cache.ip_info) == ESP_OK)) {
+                    ESP_LOGI(TAG, "Connecting quickly on channel %d, IP " IPSTR ".",
+                             g_cache.channel, IP2STR(&g_cache.ip_info.ip));
+                } else {
+                    esp_netif_dhcpc_start(g_sta_netif);
+                    ESP_LOGI(TAG, "Connecting quickly on channel %d.", g_cache.channel);
+                }
+                g_cache_in_use = true;
+                g_cache_failure_count = 0;
+            }
+#endif
+
             err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
             if (err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to set WiFi configuration: %s.", esp_err_to_name(err));
@@ -219,10 +370,27 @@ esp_err_t network_init(const char *ssid, const char *password,
             }
         }
 
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+        // Give the quick way a short while, then do it the long way
+        if ((err == ESP_OK) && g_cache_in_use) {
+            if (xSemaphoreTake(g_wifi_semaphore, pdMS_TO_TICKS(NETWORK_FAST_CONNECT_TIMEOUT_MS)) == pdTRUE) {
+                // Put it back for the wait below
+                xSemaphoreGive(g_wifi_semaphore);
+            } else {
+                cache_forget();
+                // The disconnect event will connect again
+                esp_wifi_disconnect();
+            }
+        }
+#endif
+
         // Wait for IP address (with timeout)
         if (err == ESP_OK) {
             if (xSemaphoreTake(g_wifi_semaphore, pdMS_TO_TICKS(60000)) == pdTRUE) {
                 ESP_LOGI(TAG, "WiFi connected, IP obtained.");
+#if defined(CONFIG_STEPPER_FAST_RECONNECT)
+                cache_update();
+#endif
             } else {
                 ESP_LOGE(TAG, "Failed to obtain IP address within timeout.");
                 err = ESP_ERR_TIMEOUT;
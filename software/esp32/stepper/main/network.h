@@ -43,7 +43,8 @@ extern "C" {
  
 /** Initialise networking; requires the default event loop to
  * have been created.  Note that this function will create a semaphore
- * that is never destroyed.
+ * that is never destroyed.  If CONFIG_STEPPER_FAST_RECONNECT is
+ * defined, NVS must also have been initialised.
  *
  * @param ssid      the SSID of the Wi-Fi access point to connect to,
  *                  e.g. MusicalBox.
@@ -18,10 +18,14 @@
  * @brief OTA functions for the stepper motor driver.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
@@ -32,6 +36,9 @@
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "errno.h"
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+# include "miniz.h"
+#endif
 
 #include "ota.h"
 
@@ -42,8 +49,80 @@
  // Logging prefix
  #define TAG "ota"
 
- // OTA buffer
-#define OTA_BUFFER_SIZE 1024
+ // The size of each OTA download block
+#if defined(CONFIG_STEPPER_OTA_BLOCK_SIZE) && (CONFIG_STEPPER_OTA_BLOCK_SIZE > 0)
+# define OTA_BLOCK_SIZE CONFIG_STEPPER_OTA_BLOCK_SIZE
+#else
+# define OTA_BLOCK_SIZE 4096
+#endif
+
+// The number of OTA download blocks: one is written to flash while
+// the other is downloaded into
+#define OTA_BLOCK_COUNT 2
+
+// How many times to resume a broken OTA download
+#if defined(CONFIG_STEPPER_OTA_RESUME_ATTEMPTS) && (CONFIG_STEPPER_OTA_RESUME_ATTEMPTS >= 0)
+# define OTA_RESUME_ATTEMPTS CONFIG_STEPPER_OTA_RESUME_ATTEMPTS
+#else
+# define OTA_RESUME_ATTEMPTS 5
+#endif
+
+// How long to wait before resuming a broken OTA download
+#define OTA_RESUME_DELAY_MS 500
+
+// The HTTP status code of a response to a Range request
+#define OTA_HTTP_STATUS_PARTIAL_CONTENT 206
+
+// The HTTP status code of a response with the whole file
+#define OTA_HTTP_STATUS_OK 200
+
+// The room for the ETag of the file being downloaded, including
+// the quotes and a terminator: one that is longer is cut short,
+// which means that it won't match, so the download starts again
+// from the beginning rather than being resumed
+#define OTA_ETAG_MAX_LENGTH 48
+
+// The buffer that each read from the HTTP connection goes into
+#define OTA_RX_BUFFER_SIZE 2048
+
+// A packed image, as produced by ota_pack.py on the Raspberry Pi,
+// begins with a header of OTA_PACK_HEADER_SIZE bytes, all values
+// little-endian:
+//
+// - the four characters OTA_PACK_MAGIC,
+// - a version byte, OTA_PACK_VERSION,
+// - a flags byte, OTA_PACK_FLAG_DELTA set if the pack is relative
+//   to a base image,
+// - two reserved bytes,
+// - the uint32_t length of the unpacked image,
+// - the SHA-256 appended to the unpacked image,
+// - the SHA-256 appended to the base image, zero if not a delta.
+//
+// ...followed by a zlib stream of operations, each an
+// OTA_PACK_OP_x byte plus arguments:
+//
+// - OTA_PACK_OP_COPY, uint32_t offset, uint32_t length: copy length
+//   bytes from offset in the running (base) image,
+// - OTA_PACK_OP_LITERAL, uint32_t length, then length bytes:
+//   the bytes themselves,
+// - OTA_PACK_OP_END: the end of the image.
+//
+// The first byte of a plain image is always 0xE9, so the two can't
+// be confused.
+#define OTA_PACK_MAGIC "MBPK"
+#define OTA_PACK_VERSION 1
+#define OTA_PACK_FLAG_DELTA 0x01
+#define OTA_PACK_HEADER_SIZE (4 + 1 + 1 + 2 + 4 + HASH_LEN + HASH_LEN)
+#define OTA_PACK_OFFSET_VERSION 4
+#define OTA_PACK_OFFSET_FLAGS 5
+#define OTA_PACK_OFFSET_IMAGE_LENGTH 8
+#define OTA_PACK_OFFSET_BASE_SHA256 (12 + HASH_LEN)
+#define OTA_PACK_OP_END 0x00
+#define OTA_PACK_OP_COPY 0x01
+#define OTA_PACK_OP_LITERAL 0x02
+
+// The buffer that data copied from the running image is read into
+#define OTA_PACK_COPY_BUFFER_SIZE 1024
 
 // Downloaded file header buffer
 #define OTA_FILE_HEADER_BUFFER_SIZE 8192
@@ -58,15 +137,93 @@
  * TYPES
  * -------------------------------------------------------------- */
 
+// An OTA download block.
+typedef struct {
+    char *data;
+    size_t length; // Zero in the full queue tells the writer task to stop
+} ota_block_t;
+
+// The state of the task that writes OTA download blocks to flash.
+typedef struct {
+    esp_ota_handle_t update_handle;
+    QueueHandle_t full;   // Blocks to be written to flash
+    QueueHandle_t empty;  // Blocks that may be downloaded into
+    SemaphoreHandle_t stopped;
+    volatile esp_err_t err; // The first error from esp_ota_write()
+    bool started;
+} ota_writer_t;
+
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+
+// Where stream_write() has got to, see OTA_PACK_MAGIC.
+typedef enum {
+    OTA_UNPACK_STATE_DETECT,  // Not yet known if the image is packed
+    OTA_UNPACK_STATE_PLAIN,   // Not packed, passed straight through
+    OTA_UNPACK_STATE_OP,      // Waiting for an operation
+    OTA_UNPACK_STATE_ARGS,    // Collecting the arguments of an operation
+    OTA_UNPACK_STATE_LITERAL, // Passing through the bytes of a literal
+    OTA_UNPACK_STATE_END      // Seen OTA_PACK_OP_END
+} ota_unpack_state_t;
+
+// The state of unpacking a packed image.
+typedef struct {
+    ota_unpack_state_t state;
+    uint8_t header[OTA_PACK_HEADER_SIZE];
+    size_t header_length;
+    uint32_t image_length;
+    tinfl_decompressor *inflator;
+    uint8_t *dictionary; // TINFL_LZ_DICT_SIZE, which output is inflated into
+    size_t dictionary_offset;
+    bool inflate_done;
+    uint8_t op;
+    uint8_t args[8];
+    size_t args_length;
+    size_t args_needed;
+    uint32_t literal_remaining;
+} ota_unpack_t;
+
+#endif // #if defined(CONFIG_STEPPER_OTA_PACKED)
+
+// The state of writing the image that is being downloaded: the
+// header is accumulated and checked, then the rest goes to the
+// writer task in blocks.
+typedef struct {
+    const esp_partition_t *running;
+    const esp_partition_t *update_partition;
+    esp_ota_handle_t update_handle;
+    ota_writer_t writer;
+    ota_block_t block; // The block being filled, once the header has been checked
+    size_t header_accumulated;
+    bool image_header_was_checked;
+    bool same_version_detected;
+    int32_t binary_file_length;
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+    ota_unpack_t unpack;
+#endif
+} ota_image_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
 
-// An OTA data write buffer ready to write to the flash
-static char g_ota_write_data[OTA_BUFFER_SIZE + 1] = { 0 };
+// The buffer for reads from the HTTP connection
+static char g_ota_rx_buffer[OTA_RX_BUFFER_SIZE] = { 0 };
+
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+// The buffer for data copied from the running image
+static uint8_t g_ota_copy_buffer[OTA_PACK_COPY_BUFFER_SIZE] = { 0 };
+#endif
+
+// The OTA download blocks
+static char g_ota_block[OTA_BLOCK_COUNT][OTA_BLOCK_SIZE] = { 0 };
 
 // Buffer for accumulating header data
 static char g_header_buffer[OTA_FILE_HEADER_BUFFER_SIZE] = { 0 };
+
+// The ETag of the file being downloaded, from the most recent
+// response, empty if it had none
+static char g_etag[OTA_ETAG_MAX_LENGTH] = { 0 };
+
 extern const uint8_t g_server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 extern const uint8_t g_server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
@@ -186,6 +343,523 @@ static int32_t parse_firmware_header(const char *buffer, size_t buffer_len,
     return 1;  // Update in progress
 }
 
+// Task that writes full OTA download blocks to flash, handing
+// them back to be downloaded into again, so that the download
+// doesn't wait on the flash.
+static void ota_writer_task(void *arg)
+{
+    ota_writer_t *writer = (ota_writer_t *) arg;
+    ota_block_t block;
+    bool stop = false;
+
+    while (!stop) {
+        if (xQueueReceive(writer->full, &block, portMAX_DELAY) == pdTRUE) {
+            if (block.length > 0) {
+                if (writer->err == ESP_OK) {
+                    esp_err_t err = esp_ota_write(writer->update_handle,
+                                                  (const void *) block.data,
+                                                  block.length);
+                    if (err != ESP_OK) {
+                        ESP_LOGE(TAG, "esp_ota_write failed (%s).", esp_err_to_name(err));
+                        writer->err = err;
+                    }
+                }
+                xQueueSend(writer->empty, &block, portMAX_DELAY);
+            } else {
+                stop = true;
+            }
+        }
+    }
+
+    xSemaphoreGive(writer->stopped);
+    vTaskDelete(NULL);
+}
+
+// Stop the OTA writer task, once it has written everything that was
+// queued, returning the first error it had.
+static esp_err_t ota_writer_stop(ota_writer_t *writer)
+{
+    esp_err_t err = ESP_OK;
+    ota_block_t block = {0};
+
+    if (writer->started) {
+        xQueueSend(writer->full, &block, portMAX_DELAY);
+        xSemaphoreTake(writer->stopped, portMAX_DELAY);
+        writer->started = false;
+        err = writer->err;
+    }
+    if (writer->full) {
+        vQueueDelete(writer->full);
+        writer->full = NULL;
+    }
+    if (writer->empty) {
+        vQueueDelete(writer->empty);
+        writer->empty = NULL;
+    }
+    if (writer->stopped) {
+        vSemaphoreDelete(writer->stopped);
+        writer->stopped = NULL;
+    }
+
+    return err;
+}
+
+// Start the OTA writer task.
+static esp_err_t ota_writer_start(ota_writer_t *writer,
+                                  esp_ota_handle_t update_handle)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    ota_block_t block;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->update_handle = update_handle;
+    writer->full = xQueueCreate(OTA_BLOCK_COUNT + 1, sizeof(ota_block_t));
+    writer->empty = xQueueCreate(OTA_BLOCK_COUNT, sizeof(ota_block_t));
+    writer->stopped = xSemaphoreCreateBinary();
+    if (writer->full && writer->empty && writer->stopped) {
+        for (size_t x = 0; x < OTA_BLOCK_COUNT; x++) {
+            block.data = g_ota_block[x];
+            block.length = 0;
+            xQueueSend(writer->empty, &block, 0);
+        }
+        if (xTaskCreate(&ota_writer_task, "ota_writer_task", 1024 * 4,
+                        writer, 5, NULL) == pdPASS) {
+            writer->started = true;
+            err = ESP_OK;
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start OTA writer task.");
+        ota_writer_stop(writer);
+    }
+
+    return err;
+}
+
+// Hand a full (or the last) OTA download block to the writer task.
+static void ota_writer_queue(ota_writer_t *writer, ota_block_t *block)
+{
+    if (block->data != NULL) {
+        if (block->length > 0) {
+            xQueueSend(writer->full, block, portMAX_DELAY);
+        } else {
+            // Nothing in it, just give it back
+            xQueueSend(writer->empty, block, portMAX_DELAY);
+        }
+        block->data = NULL;
+        block->length = 0;
+    }
+}
+
+// Keep the ETag of the file being downloaded, for http_open().
+static esp_err_t http_event_handler(esp_http_client_event_t *event)
+{
+    if ((event->event_id == HTTP_EVENT_ON_HEADER) &&
+        (strcasecmp(event->header_key, "ETag") == 0)) {
+        snprintf(g_etag, sizeof(g_etag), "%s", event->header_value);
+    }
+
+    return ESP_OK;
+}
+
+// Open the HTTP connection, asking for the file from *offset
+// onwards if that is not zero, i.e. when resuming.  So that the
+// rest can only come from the same file, the resume is conditional
+// on the ETag of the previous response, with If-Range: if the file
+// has changed, or there was no ETag, the whole file is sent, in
+// which case *offset is set to zero and what has been received so
+// far must be thrown away.
+static esp_err_t http_open(esp_http_client_handle_t client, size_t *offset)
+{
+    char range[32];
+    char if_range[sizeof(g_etag)];
+
+    esp_http_client_delete_header(client, "Range");
+    esp_http_client_delete_header(client, "If-Range");
+    if ((*offset > 0) && (g_etag[0] != 0)) {
+        snprintf(range, sizeof(range), "bytes=%zu-", *offset);
+        esp_http_client_set_header(client, "Range", range);
+        snprintf(if_range, sizeof(if_range), "%s", g_etag);
+        esp_http_client_set_header(client, "If-Range", if_range);
+    }
+    g_etag[0] = 0;
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err == ESP_OK) {
+        int64_t content_length = esp_http_client_fetch_headers(client);
+        int status_code = esp_http_client_get_status_code(client);
+        ESP_LOGI(TAG, "HTTP status %d, Content-Length: %"PRId64", ETag %s.",
+                 status_code, content_length, g_etag[0] != 0 ? g_etag : "none");
+        if ((*offset > 0) && (status_code != OTA_HTTP_STATUS_PARTIAL_CONTENT)) {
+            if (status_code == OTA_HTTP_STATUS_OK) {
+                // The file has changed, or can't be resumed: have it all again
+                ESP_LOGW(TAG, "Server cannot resume from offset %zu, starting again"
+                         " from the beginning.", *offset);
+                *offset = 0;
+            } else {
+                ESP_LOGE(TAG, "Server cannot resume from offset %zu (HTTP status %d).",
+                         *offset, status_code);
+                err = ESP_ERR_NOT_SUPPORTED;
+            }
+        }
+    } else {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s.", esp_err_to_name(err));
+    }
+
+    return err;
+}
+
+// Write data of the downloaded image: accumulate and check the
+// header, then hand the rest to the writer task in blocks.
+static esp_err_t image_write(ota_image_t *image, const void *data, size_t length)
+{
+    esp_err_t err = ESP_OK;
+    const char *source = (const char *) data;
+    size_t size;
+
+    while ((err == ESP_OK) && (length > 0) && !image->same_version_detected) {
+        if (image->image_header_was_checked == false) {
+            // Accumulate data until we have enough to parse the header
+            size = OTA_FILE_HEADER_BUFFER_SIZE - image->header_accumulated;
+            if (size > length) {
+                size = length;
+            }
+            if (size == 0) {
+                ESP_LOGE(TAG, "Header buffer overflow!");
+                err = ESP_ERR_NO_MEM;
+            } else {
+                memcpy(g_header_buffer + image->header_accumulated, source, size);
+                image->header_accumulated += size;
+                source += size;
+                length -= size;
+                ESP_LOGI(TAG, "Accumulated %zu/%d bytes for header.", image->header_accumulated, OTA_FILE_HEADER_BUFFER_SIZE);
+                /* Check if we have accumulated enough data to parse the header */
+                if (has_complete_header(image->header_accumulated)) {
+                    ESP_LOGI(TAG, "Complete header accumulated (%zu byte(s)).", image->header_accumulated);
+                    int32_t parse_result = parse_firmware_header(g_header_buffer, image->header_accumulated,
+                                                                 image->running, &image->update_handle,
+                                                                 image->update_partition);
+                    if (parse_result == 1) {
+                        // Update in progress
+                        image->image_header_was_checked = true;
+                        image->binary_file_length = image->header_accumulated;
+                        err = ota_writer_start(&image->writer, image->update_handle);
+                        ESP_LOGI(TAG, "New version detected, continuing with OTA in %d byte blocks...",
+                                 OTA_BLOCK_SIZE);
+                    } else if (parse_result == 0) {
+                        // Same version - no update needed
+                        ESP_LOGI(TAG, "Already running latest version, no update needed.");
+                        image->same_version_detected = true;
+                    } else { /* parse_result == -1 */
+                        // Fatal error (like invalid version that previously failed)
+                        ESP_LOGE(TAG, "Firmware header validation failed.");
+                        err = ESP_ERR_INVALID_RESPONSE;
+                    }
+                } else {
+                    ESP_LOGI(TAG, "Still accumulating header data (need more than %zu byte(s), currently at %zu).",
+                             has_complete_header_min_size(), image->header_accumulated);
+                }
+            }
+        } else {
+            // Header already processed: fill a block, which the
+            // writer task writes to flash once it is full
+            if (image->block.data == NULL) {
+                xQueueReceive(image->writer.empty, &image->block, portMAX_DELAY);
+                image->block.length = 0;
+            }
+            size = OTA_BLOCK_SIZE - image->block.length;
+            if (size > length) {
+                size = length;
+            }
+            memcpy(image->block.data + image->block.length, source, size);
+            image->block.length += size;
+            image->binary_file_length += size;
+            source += size;
+            length -= size;
+            if (image->block.length >= OTA_BLOCK_SIZE) {
+                ota_writer_queue(&image->writer, &image->block);
+            }
+            if (image->writer.err != ESP_OK) {
+                err = image->writer.err;
+            }
+        }
+    }
+
+    return err;
+}
+
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+
+// Get a little-endian uint32_t.
+static uint32_t unpack_uint32(const uint8_t *buffer)
+{
+    return ((uint32_t) buffer[0]) | (((uint32_t) buffer[1]) << 8) |
+           (((uint32_t) buffer[2]) << 16) | (((uint32_t) buffer[3]) << 24);
+}
+
+// Check the header of a packed image and get ready to inflate it.
+static esp_err_t unpack_start(ota_unpack_t *unpack, ota_image_t *image)
+{
+    esp_err_t err = ESP_OK;
+    uint8_t sha_256[HASH_LEN] = { 0 };
+    uint8_t flags = unpack->header[OTA_PACK_OFFSET_FLAGS];
+
+    unpack->image_length = unpack_uint32(unpack->header + OTA_PACK_OFFSET_IMAGE_LENGTH);
+    ESP_LOGI(TAG, "Packed image, version %d, flags 0x%02x, unpacks to %"PRIu32" bytes.",
+             unpack->header[OTA_PACK_OFFSET_VERSION], flags, unpack->image_length);
+    if (unpack->header[OTA_PACK_OFFSET_VERSION] != OTA_PACK_VERSION) {
+        ESP_LOGE(TAG, "Unsupported packed image version.");
+        err = ESP_ERR_NOT_SUPPORTED;
+    } else if (flags & OTA_PACK_FLAG_DELTA) {
+        // Must be relative to what we're running
+        esp_partition_get_sha256(image->running, sha_256);
+        if (memcmp(sha_256, unpack->header + OTA_PACK_OFFSET_BASE_SHA256, sizeof(sha_256)) != 0) {
+            print_sha256(unpack->header + OTA_PACK_OFFSET_BASE_SHA256, "Delta is relative to");
+            ESP_LOGE(TAG, "Delta is not relative to the running firmware.");
+            err = ESP_ERR_INVALID_VERSION;
+        }
+    }
+
+    if (err == ESP_OK) {
+        // Big, hence only allocated while we have a need
+        unpack->inflator = (tinfl_decompressor *) malloc(sizeof(tinfl_decompressor));
+        unpack->dictionary = (uint8_t *) malloc(TINFL_LZ_DICT_SIZE);
+        if ((unpack->inflator != NULL) && (unpack->dictionary != NULL)) {
+            tinfl_init(unpack->inflator);
+            unpack->dictionary_offset = 0;
+            unpack->state = OTA_UNPACK_STATE_OP;
+        } else {
+            ESP_LOGE(TAG, "Unable to allocate %d byte(s) to inflate packed image.",
+                     sizeof(tinfl_decompressor) + TINFL_LZ_DICT_SIZE);
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+
+    return err;
+}
+
+// Free what unpack_start() allocated.
+static void unpack_deinit(ota_unpack_t *unpack)
+{
+    free(unpack->inflator);
+    unpack->inflator = NULL;
+    free(unpack->dictionary);
+    unpack->dictionary = NULL;
+}
+
+// Copy from the running image to the image being written.
+static esp_err_t unpack_copy(ota_image_t *image, uint32_t offset, uint32_t length)
+{
+    esp_err_t err = ESP_OK;
+    uint32_t size;
+
+    if ((offset > image->running->size) || (length > image->running->size - offset)) {
+        ESP_LOGE(TAG, "Copy of %"PRIu32" byte(s) from offset %"PRIu32" is outside the running image.",
+                 length, offset);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    while ((err == ESP_OK) && (length > 0)) {
+        size = length;
+        if (size > sizeof(g_ota_copy_buffer)) {
+            size = sizeof(g_ota_copy_buffer);
+        }
+        err = esp_partition_read(image->running, offset, g_ota_copy_buffer, size);
+        if (err == ESP_OK) {
+            err = image_write(image, g_ota_copy_buffer, size);
+            offset += size;
+            length -= size;
+        } else {
+            ESP_LOGE(TAG, "Unable to read running image at offset %"PRIu32" (%s).",
+                     offset, esp_err_to_name(err));
+        }
+    }
+
+    return err;
+}
+
+// Carry out the operations of an inflated packed image.
+static esp_err_t unpack_ops(ota_unpack_t *unpack, ota_image_t *image,
+                            const uint8_t *data, size_t length)
+{
+    esp_err_t err = ESP_OK;
+    size_t size;
+
+    while ((err == ESP_OK) && (length > 0)) {
+        switch (unpack->state) {
+            case OTA_UNPACK_STATE_OP:
+                unpack->op = *data;
+                data++;
+                length--;
+                unpack->args_length = 0;
+                unpack->state = OTA_UNPACK_STATE_ARGS;
+                if (unpack->op == OTA_PACK_OP_COPY) {
+                    unpack->args_needed = 8;
+                } else if (unpack->op == OTA_PACK_OP_LITERAL) {
+                    unpack->args_needed = 4;
+                } else if (unpack->op == OTA_PACK_OP_END) {
+                    unpack->state = OTA_UNPACK_STATE_END;
+                } else {
+                    ESP_LOGE(TAG, "Unknown operation 0x%02x in packed image.", unpack->op);
+                    err = ESP_ERR_INVALID_RESPONSE;
+                }
+                break;
+            case OTA_UNPACK_STATE_ARGS:
+                size = unpack->args_needed - unpack->args_length;
+                if (size > length) {
+                    size = length;
+                }
+                memcpy(unpack->args + unpack->args_length, data, size);
+                unpack->args_length += size;
+                data += size;
+                length -= size;
+                if (unpack->args_length >= unpack->args_needed) {
+                    unpack->state = OTA_UNPACK_STATE_OP;
+                    if (unpack->op == OTA_PACK_OP_COPY) {
+                        err = unpack_copy(image, unpack_uint32(unpack->args),
+                                          unpack_uint32(unpack->args + 4));
+                    } else {
+                        unpack->literal_remaining = unpack_uint32(unpack->args);
+                        if (unpack->literal_remaining > 0) {
+                            unpack->state = OTA_UNPACK_STATE_LITERAL;
+                        }
+                    }
+                }
+                break;
+            case OTA_UNPACK_STATE_LITERAL:
+                size = unpack->literal_remaining;
+                if (size > length) {
+                    size = length;
+                }
+                err = image_write(image, data, size);
+                unpack->literal_remaining -= size;
+                data += size;
+                length -= size;
+                if (unpack->literal_remaining == 0) {
+                    unpack->state = OTA_UNPACK_STATE_OP;
+                }
+                break;
+            default:
+                ESP_LOGE(TAG, "%zu byte(s) beyond the end of the packed image.", length);
+                err = ESP_ERR_INVALID_SIZE;
+                break;
+        }
+    }
+
+    return err;
+}
+
+// Inflate data of a packed image, carrying out the operations.
+static esp_err_t unpack_inflate(ota_unpack_t *unpack, ota_image_t *image,
+                                const uint8_t *data, size_t length)
+{
+    esp_err_t err = ESP_OK;
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    size_t in_size;
+    size_t out_size;
+
+    while ((err == ESP_OK) && !unpack->inflate_done &&
+           ((length > 0) || (status == TINFL_STATUS_HAS_MORE_OUTPUT))) {
+        in_size = length;
+        // The dictionary is circular, output always stopping at its end
+        out_size = TINFL_LZ_DICT_SIZE - unpack->dictionary_offset;
+        status = tinfl_decompress(unpack->inflator, data, &in_size, unpack->dictionary,
+                                  unpack->dictionary + unpack->dictionary_offset, &out_size,
+                                  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_size;
+        length -= in_size;
+        if (out_size > 0) {
+            err = unpack_ops(unpack, image, unpack->dictionary + unpack->dictionary_offset, out_size);
+            unpack->dictionary_offset = (unpack->dictionary_offset + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Unable to inflate packed image (%d).", status);
+            err = ESP_ERR_INVALID_RESPONSE;
+        } else if (status == TINFL_STATUS_DONE) {
+            unpack->inflate_done = true;
+        }
+    }
+    if ((err == ESP_OK) && (length > 0)) {
+        ESP_LOGE(TAG, "%zu byte(s) beyond the end of the packed image.", length);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    return err;
+}
+
+// Return true if a packed image was completely unpacked.
+static bool unpack_is_complete(ota_unpack_t *unpack, ota_image_t *image)
+{
+    bool complete = false;
+
+    if (unpack->inflate_done && (unpack->state == OTA_UNPACK_STATE_END) &&
+        (image->binary_file_length == unpack->image_length)) {
+        complete = true;
+    } else {
+        ESP_LOGE(TAG, "Packed image incomplete, unpacked %d of %"PRIu32" byte(s).",
+                 image->binary_file_length, unpack->image_length);
+    }
+
+    return complete;
+}
+
+#endif // #if defined(CONFIG_STEPPER_OTA_PACKED)
+
+// Write data as it arrives from the HTTP connection, unpacking it
+// first if it is a packed image (see OTA_PACK_MAGIC) and we can.
+static esp_err_t stream_write(ota_image_t *image, const char *data, size_t length)
+{
+    esp_err_t err = ESP_OK;
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+    ota_unpack_t *unpack = &image->unpack;
+
+    // Collect the header, giving up as soon as it is not a pack
+    while ((err == ESP_OK) && (length > 0) && (unpack->state == OTA_UNPACK_STATE_DETECT)) {
+        unpack->header[unpack->header_length] = *data;
+        unpack->header_length++;
+        data++;
+        length--;
+        if ((unpack->header_length <= strlen(OTA_PACK_MAGIC)) &&
+            (unpack->header[unpack->header_length - 1] != OTA_PACK_MAGIC[unpack->header_length - 1])) {
+            unpack->state = OTA_UNPACK_STATE_PLAIN;
+            err = image_write(image, unpack->header, unpack->header_length);
+        } else if (unpack->header_length >= sizeof(unpack->header)) {
+            err = unpack_start(unpack, image);
+        }
+    }
+    if ((err == ESP_OK) && (length > 0)) {
+        if (unpack->state == OTA_UNPACK_STATE_PLAIN) {
+            err = image_write(image, data, length);
+        } else {
+            err = unpack_inflate(unpack, image, (const uint8_t *) data, length);
+        }
+    }
+#else
+    err = image_write(image, data, length);
+#endif
+
+    return err;
+}
+
+// Throw away all that has been written of the downloaded image,
+// so that it can be written again from the beginning.
+static void image_restart(ota_image_t *image)
+{
+    // Any error the writer had belongs to what is being thrown away
+    ota_writer_stop(&image->writer);
+    memset(&image->block, 0, sizeof(image->block));
+    if (image->update_handle) {
+        esp_ota_abort(image->update_handle);
+        image->update_handle = 0;
+    }
+    image->header_accumulated = 0;
+    image->image_header_was_checked = false;
+    image->same_version_detected = false;
+    image->binary_file_length = 0;
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+    unpack_deinit(&image->unpack);
+    memset(&image->unpack, 0, sizeof(image->unpack));
+#endif
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -247,18 +921,18 @@ esp_err_t ota_init()
     return -err;
 }
 
+
 // Perform an OTA update, requires networking to have been established.
 esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
 {
     esp_err_t err = ESP_OK;
-    // update handle: set by esp_ota_begin(), must be freed via esp_ota_end()
-    esp_ota_handle_t update_handle = 0 ;
-    const esp_partition_t *update_partition = NULL;
+    ota_image_t image = {0};
 
     ESP_LOGI(TAG, "Starting OTA");
 
     const esp_partition_t *configured = esp_ota_get_boot_partition();
     const esp_partition_t *running = esp_ota_get_running_partition();
+    image.running = running;
 
     if (configured != running) {
         ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08"PRIx32", but running from offset 0x%08"PRIx32".",
@@ -273,7 +947,8 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
         .cert_pem = (char *)g_server_cert_pem_start,
         .timeout_ms = timeout_ms,
         .keep_alive_enable = true,
-        .buffer_size = 2048
+        .buffer_size = 2048,
+        .event_handler = http_event_handler
     };
 
 #ifdef CONFIG_STEPPER_SKIP_COMMON_NAME_CHECK
@@ -283,106 +958,71 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
     // Begin the HTTP download
     esp_http_client_handle_t client = esp_http_client_init(&config);
     if (client != NULL) {
-        err = esp_http_client_open(client, 0);
-        if (err == ESP_OK) {
-            int content_length = esp_http_client_fetch_headers(client);
-            ESP_LOGI(TAG, "Content-Length: %d.", content_length);
-        } else {
-            ESP_LOGE(TAG, "Failed to open HTTP connection: %s.", esp_err_to_name(err));
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+        // Tell the server what we are running, so that it can send
+        // us a packed image relative to it if it has one
+        uint8_t sha_256[HASH_LEN] = { 0 };
+        char sha_256_hex[HASH_LEN * 2 + 1];
+        esp_partition_get_sha256(running, sha_256);
+        for (int32_t i = 0; i < HASH_LEN; ++i) {
+            sprintf(&sha_256_hex[i * 2], "%02x", sha_256[i]);
         }
+        esp_http_client_set_header(client, "X-Running-SHA256", sha_256_hex);
+#endif
+        size_t offset = 0;
+        err = http_open(client, &offset);
     } else {
         ESP_LOGE(TAG, "Failed to initialise HTTP connection.");
         err = ESP_ERR_NO_MEM;
     }
 
     // Write the file
-    int32_t binary_file_length = 0;
     if (err == ESP_OK) {
-        update_partition = esp_ota_get_next_update_partition(NULL);
-        assert(update_partition != NULL);
+        image.update_partition = esp_ota_get_next_update_partition(NULL);
+        assert(image.update_partition != NULL);
         ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%"PRIx32".",
-                update_partition->subtype, update_partition->address);
+                image.update_partition->subtype, image.update_partition->address);
 
-        bool image_header_was_checked = false;
-        size_t header_accumulated = 0;
         int32_t zero_read_count = 0;
         int32_t max_zero_reads = 10;  // Maximum consecutive zero reads before considering connection dead
-        
+        int32_t resume_count = 0;
+        // How much of the file has been received, which is where a
+        // resumed download carries on from
+        size_t offset = 0;
+
         // State variables to control the loop
         bool transfer_complete = false;
-        bool same_version_detected = false;
-        
+
         // Deal with all receive packets
-        while (err == ESP_OK && !transfer_complete && !same_version_detected) {
-            int32_t data_read = esp_http_client_read(client, g_ota_write_data, OTA_BUFFER_SIZE);
+        while (err == ESP_OK && !transfer_complete && !image.same_version_detected) {
+            bool connection_lost = false;
+            int32_t data_read = esp_http_client_read(client, g_ota_rx_buffer, OTA_RX_BUFFER_SIZE);
             if (data_read < 0) {
                 ESP_LOGE(TAG, "Error: SSL data read error.");
-                err = ESP_ERR_INVALID_RESPONSE;
+                connection_lost = true;
             } else if (data_read > 0) {
                 // Reset zero read counter on successful read
                 zero_read_count = 0;
-                if (image_header_was_checked == false) {
-                    // Accumulate data until we have enough to parse the header
-                    if (header_accumulated + data_read <= OTA_FILE_HEADER_BUFFER_SIZE) {
-                        memcpy(g_header_buffer + header_accumulated, g_ota_write_data, data_read);
-                        header_accumulated += data_read;
-                        ESP_LOGI(TAG, "Accumulated %d/%d bytes for header.", header_accumulated, OTA_FILE_HEADER_BUFFER_SIZE);
-                    } else {
-                        ESP_LOGE(TAG, "Header buffer overflow!");
-                        err = ESP_ERR_NO_MEM;
-                    }
-                    /* Check if we have accumulated enough data to parse the header */
-                    if (has_complete_header(header_accumulated)) {
-                        ESP_LOGI(TAG, "Complete header accumulated (%d byte(s)).", header_accumulated);
-                        int32_t parse_result = parse_firmware_header(g_header_buffer, header_accumulated, 
-                                                                     running, &update_handle, update_partition);
-                        if (parse_result == 1) {
-                            // Update in progress
-                            image_header_was_checked = true;
-                            binary_file_length = header_accumulated;
-                            ESP_LOGI(TAG, "New version detected, continuing with OTA...");
-                            // Will continue to next iteration naturally
-                        } else if (parse_result == 0) {
-                            // Same version - no update needed
-                            ESP_LOGI(TAG, "Already running latest version, no update needed.");
-                            // Set flag to exit loop and go to infinite loop
-                            same_version_detected = true;
-                        } else { /* parse_result == -1 */
-                            // Fatal error (like invalid version that previously failed)
-                            ESP_LOGE(TAG, "Firmware header validation failed.");
-                            err = ESP_ERR_INVALID_RESPONSE;
-                        }
-                    } else {
-                        ESP_LOGI(TAG, "Still accumulating header data (need more than %zu byte(s), currently at %zu).", 
-                                 has_complete_header_min_size(), header_accumulated);
-                        // Need to keep accumulating - will continue naturally
-                    }
-                } else {
-                    // Header already processed, write data directly
-                    err = esp_ota_write(update_handle, (const void *)g_ota_write_data, data_read);
-                    if (err != ESP_OK) {
-                        ESP_LOGE(TAG, "esp_ota_write failed.");
-                    }
-                    binary_file_length += data_read;
-                }
+                offset += data_read;
+                err = stream_write(&image, g_ota_rx_buffer, data_read);
             } else if (data_read == 0) {
                 // Handle zero read - this could be temporary or permanent
                 zero_read_count++;
-                ESP_LOGI(TAG, "Zero read #%d, header_accumulated=%d, header_checked=%d.", 
-                         zero_read_count, header_accumulated, image_header_was_checked);
+                ESP_LOGI(TAG, "Zero read #%d, header_accumulated=%zu, header_checked=%d.",
+                         zero_read_count, image.header_accumulated, image.image_header_was_checked);
                 // If we haven't checked the header yet, we need to be careful
-                if (!image_header_was_checked) {
+                if (!image.image_header_was_checked) {
                     // We haven't accumulated enough header data yet - this zero read might be temporary
                     if (esp_http_client_is_complete_data_received(client) == true) {
                         // Server says transfer is complete, but we don't have enough header data
                         ESP_LOGE(TAG, "Connection closed before accumulating enough header data!");
-                        ESP_LOGE(TAG, "Accumulated only %zu bytes, need at least %zu.", 
-                                 header_accumulated, has_complete_header_min_size());
+                        ESP_LOGE(TAG, "Accumulated only %zu bytes, need at least %zu.",
+                                 image.header_accumulated, has_complete_header_min_size());
                         err = ESP_ERR_NOT_FINISHED;
                     } else if (zero_read_count >= max_zero_reads) {
                         // Too many consecutive zero reads - connection might be dead
                         ESP_LOGE(TAG, "Too many zero reads (%d) while accumulating header.", zero_read_count);
-                        err = ESP_ERR_INVALID_RESPONSE;
+                        connection_lost = true;
                     } else {
                         // Temporary zero read - wait a bit and continue
                         ESP_LOGI(TAG, "Temporary zero read during header accumulation, waiting...");
@@ -393,7 +1033,7 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
                     // We've already processed the header, now handle zero reads normally
                     if (errno == ECONNRESET || errno == ENOTCONN) {
                         ESP_LOGE(TAG, "Connection closed, errno = %d.", errno);
-                        err = ESP_ERR_NOT_FINISHED;
+                        connection_lost = true;
                     }
                     else if (esp_http_client_is_complete_data_received(client) == true) {
                         ESP_LOGI(TAG, "Connection closed - transfer complete.");
@@ -401,7 +1041,7 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
                     }
                     else if (zero_read_count >= max_zero_reads) {
                         ESP_LOGE(TAG, "Too many zero reads (%d) after header, connection may be dead.", zero_read_count);
-                        err = ESP_ERR_INVALID_RESPONSE;
+                        connection_lost = true;
                     }
                     else {
                         // Small delay to avoid busy-looping when no data available
@@ -411,17 +1051,57 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
                     }
                 }
             }
+
+            if (connection_lost) {
+                // Rather than starting all over again, carry on from
+                // where we got to
+                if (resume_count < OTA_RESUME_ATTEMPTS) {
+                    resume_count++;
+                    ESP_LOGW(TAG, "Connection lost at offset %zu, resuming (attempt %d of %d)...",
+                             offset, resume_count, OTA_RESUME_ATTEMPTS);
+                    esp_http_client_close(client);
+                    vTaskDelay(pdMS_TO_TICKS(OTA_RESUME_DELAY_MS));
+                    zero_read_count = 0;
+                    size_t resume_offset = offset;
+                    err = http_open(client, &resume_offset);
+                    if ((err == ESP_OK) && (resume_offset != offset)) {
+                        image_restart(&image);
+                        offset = resume_offset;
+                    }
+                } else {
+                    ESP_LOGE(TAG, "Connection lost at offset %zu, giving up after %d resume(s).",
+                             offset, resume_count);
+                    err = ESP_ERR_NOT_FINISHED;
+                }
+            }
+        }
+
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+        if ((err == ESP_OK) && transfer_complete &&
+            (image.unpack.state != OTA_UNPACK_STATE_PLAIN) &&
+            !unpack_is_complete(&image.unpack, &image)) {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+#endif
+
+        // Write whatever is left and wait for the flash to catch up
+        if (err == ESP_OK) {
+            ota_writer_queue(&image.writer, &image.block);
+        }
+        esp_err_t writer_err = ota_writer_stop(&image.writer);
+        if (err == ESP_OK) {
+            err = writer_err;
         }
     }
 
     // Either have a new binary file or don't need one, finish the OTA
     if (err == ESP_OK) {
-        ESP_LOGI(TAG, "Total write binary data length: %d.", binary_file_length);
+        ESP_LOGI(TAG, "Total write binary data length: %d.", image.binary_file_length);
         if (esp_http_client_is_complete_data_received(client)) {
-            err = esp_ota_end(update_handle);
-            update_handle = 0;
+            err = esp_ota_end(image.update_handle);
+            image.update_handle = 0;
             if (err == ESP_OK) {
-                err = esp_ota_set_boot_partition(update_partition);
+                err = esp_ota_set_boot_partition(image.update_partition);
                 if (err == ESP_OK) {
                     ESP_LOGI(TAG, "Prepare to restart system!");
                     esp_restart();
@@ -440,13 +1120,15 @@ esp_err_t ota_update(const char *update_file_url, int32_t timeout_ms)
     if (client) {
         http_cleanup(client);
     }
-    if (update_handle) {
-        esp_ota_abort(update_handle);
+    if (image.update_handle) {
+        esp_ota_abort(image.update_handle);
     }
+#if defined(CONFIG_STEPPER_OTA_PACKED)
+    unpack_deinit(&image.unpack);
+#endif
 
     // Returns ESP_OK or negative error code from esp_err_t
     return -err;
 }
 
 // End of file
-
@@ -51,9 +51,13 @@ esp_err_t ota_init();
 /** Perform an OTA update.  Attempts to get the given file and,
  * if the version number (see version.txt) is different to the
  * current running code, will write the binary file to NV storage
- * and RESTART THE SYSTEM.  Requires networking to have been
- * established.  ota_init() must have been called before this
- * function
+ * and RESTART THE SYSTEM.  The file is downloaded in blocks of
+ * CONFIG_STEPPER_OTA_BLOCK_SIZE, each written to flash by a separate
+ * task while the next is downloaded, and if the connection is lost
+ * the download carries on from where it got to with an HTTP Range
+ * request, up to CONFIG_STEPPER_OTA_RESUME_ATTEMPTS times.  Requires
+ * networking to have been established.  ota_init() must have been
+ * called before this function
  *
  * @param update_file_url   the URL of the binary file, e.g.
  *                          https://10.10.3.1:8070/stepper.bin.
@@ -31,14 +31,19 @@
 #include "esp_timer.h"
 #include "esp_task_wdt.h"
 #include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "nvs.h"
 #include "lwip/sockets.h"
 #include "lwip/netdb.h"
 
 #include "../../../protocol/protocol.h"
+#include "../../../protocol/state_rules.h"
 #include "log.h"
 #include "ota.h"
 #include "network.h"
 #include "tmc2209.h"
+#include "motion.h"
 #include "ping.h"
 
 /* ----------------------------------------------------------------
@@ -81,13 +86,83 @@
 // 20 milliseconds to be open
 #define DEBOUNCE_THRESHOLD 20
 
-// The maximum motor current to set, in milliAmps, used only
-// in production mode
-#define MOTOR_CURRENT_MAX_MA 1200
+// The pins of the sensors that are debounced in production,
+// GPIO_NUM_NC where a sensor is not present.
+#if defined(CONFIG_STEPPER_LIFT_DOWN_PIN) && (CONFIG_STEPPER_LIFT_DOWN_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_DOWN CONFIG_STEPPER_LIFT_DOWN_PIN
+#else
+#  define DEBOUNCE_PIN_IS_DOWN GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_LIFT_LIMIT_PIN) && (CONFIG_STEPPER_LIFT_LIMIT_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_AT_LIMIT CONFIG_STEPPER_LIFT_LIMIT_PIN
+#else
+#  define DEBOUNCE_PIN_IS_AT_LIMIT GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN) && (CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_AT_REFERENCE CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN
+#else
+#  define DEBOUNCE_PIN_IS_AT_REFERENCE GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_DOOR_OPEN_PIN) && (CONFIG_STEPPER_DOOR_OPEN_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_OPEN CONFIG_STEPPER_DOOR_OPEN_PIN
+#else
+#  define DEBOUNCE_PIN_IS_OPEN GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_1_DOOR_OPEN_PIN) && (CONFIG_STEPPER_MOTOR_1_DOOR_OPEN_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_OPEN_1 CONFIG_STEPPER_MOTOR_1_DOOR_OPEN_PIN
+#else
+#  define DEBOUNCE_PIN_IS_OPEN_1 GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_2_DOOR_OPEN_PIN) && (CONFIG_STEPPER_MOTOR_2_DOOR_OPEN_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_OPEN_2 CONFIG_STEPPER_MOTOR_2_DOOR_OPEN_PIN
+#else
+#  define DEBOUNCE_PIN_IS_OPEN_2 GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_3_DOOR_OPEN_PIN) && (CONFIG_STEPPER_MOTOR_3_DOOR_OPEN_PIN >= 0)
+#  define DEBOUNCE_PIN_IS_OPEN_3 CONFIG_STEPPER_MOTOR_3_DOOR_OPEN_PIN
+#else
+#  define DEBOUNCE_PIN_IS_OPEN_3 GPIO_NUM_NC
+#endif
+
+// The number of motors driven in production, each by the TMC2209
+// at the UART address of the same number, see
+// CONFIG_STEPPER_MOTOR_COUNT; only motor 0 has the STEP and DIR
+// pins and the lift and plinky-plonky sensors.
+#if defined(CONFIG_STEPPER_MOTOR_COUNT) && (CONFIG_STEPPER_MOTOR_COUNT > 1)
+#  define STEPPER_MOTOR_COUNT CONFIG_STEPPER_MOTOR_COUNT
+#else
+#  define STEPPER_MOTOR_COUNT 1
+#endif
+
+_Static_assert(STEPPER_MOTOR_COUNT <= PROTOCOL_MOTOR_MAX, "too many motors for the protocol");
+
+// The enable pin of the TMC2209 of each motor, GPIO_NUM_NC where
+// there is none.
+#if defined(CONFIG_STEPPER_ENABLE_PIN) && (CONFIG_STEPPER_ENABLE_PIN >= 0)
+#  define MOTOR_PIN_ENABLE CONFIG_STEPPER_ENABLE_PIN
+#else
+#  define MOTOR_PIN_ENABLE GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_1_ENABLE_PIN) && (CONFIG_STEPPER_MOTOR_1_ENABLE_PIN >= 0)
+#  define MOTOR_PIN_ENABLE_1 CONFIG_STEPPER_MOTOR_1_ENABLE_PIN
+#else
+#  define MOTOR_PIN_ENABLE_1 GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_2_ENABLE_PIN) && (CONFIG_STEPPER_MOTOR_2_ENABLE_PIN >= 0)
+#  define MOTOR_PIN_ENABLE_2 CONFIG_STEPPER_MOTOR_2_ENABLE_PIN
+#else
+#  define MOTOR_PIN_ENABLE_2 GPIO_NUM_NC
+#endif
+#if defined(CONFIG_STEPPER_MOTOR_3_ENABLE_PIN) && (CONFIG_STEPPER_MOTOR_3_ENABLE_PIN >= 0)
+#  define MOTOR_PIN_ENABLE_3 CONFIG_STEPPER_MOTOR_3_ENABLE_PIN
+#else
+#  define MOTOR_PIN_ENABLE_3 GPIO_NUM_NC
+#endif
 
-// The maximum motor current to set for a door, in milliAmps,
-// used only in production mode
-#define MOTOR_CURRENT_DOOR_MAX_MA 250
+// The longest monitor_task() will wait for a notification from
+// debounce_timer_callback() before checking on things anyway, e.g.
+// for a command timeout, in milliseconds
+#define MONITOR_PERIOD_MS 100
 
 // The desired stepper motor velocity and current, only used when not in production mode
 #if defined(CONFIG_STEPPER_STAND)
@@ -122,6 +197,20 @@
 // so that we are able to move away from it.
 #define HYSTERESIS_PLINKY_PLONKY_MS 500
 
+// Defined if the STEP and DIR pins of the TMC2209 are connected,
+// in which case CMD_STEPPER_TARGET_POSITION_START is supported.
+#if defined(CONFIG_STEPPER_STEP_PIN) && (CONFIG_STEPPER_STEP_PIN >= 0) && \
+    defined(CONFIG_STEPPER_DIR_PIN) && (CONFIG_STEPPER_DIR_PIN >= 0)
+#  define STEP_DIR_CONNECTED
+#endif
+
+// The acceleration profile for moves to a position.
+#if defined(CONFIG_STEPPER_S_CURVE)
+#  define MOTION_PROFILE MOTION_PROFILE_S_CURVE
+#else
+#  define MOTION_PROFILE MOTION_PROFILE_TRAPEZOIDAL
+#endif
+
 // Idle time before TCP keep-alive kicks in, in seconds.
 #define TCP_KEEP_ALIVE_IDLE_TIME_SECONDS   20
 
@@ -159,6 +248,114 @@
 // Socket timeout (use 0 for none).
 #define SOCKET_TIMEOUT_SECONDS 5
 
+// The shortest and longest wait between attempts to connect to
+// the server: the wait doubles with each failure, up to the
+// maximum, and is jittered so that several devices, which all
+// lost the server at the same moment, don't all come back at
+// the same moment.
+#define RECONNECT_BACKOFF_MIN_MS 50
+#define RECONNECT_BACKOFF_MAX_MS 5000
+
+// The NVS namespace and key under which what we are, i.e. the
+// last CMD_*_INIT received, is kept, so that we can carry on
+// being it straight away after a restart.
+#define NVS_NAMESPACE "stepper"
+#define NVS_KEY_INIT "init"
+
+// The NVS key under which the velocity profile of the plinky-plonky
+// is kept, see CMD_PLINKY_PLONKY_PROFILE_BEGIN.
+#define NVS_KEY_PROFILE "profile"
+
+// The number of targets that can be queued behind the one that
+// is running, see CMD_STEPPER_TARGET_APPEND.
+#define TARGET_QUEUE_LENGTH 8
+
+// The number of messages that can be waiting in the transmit
+// ring for comms_tx_task() to send them: must be a power of two.
+#define TX_RING_LENGTH 32
+
+// The maximum number of messages that comms_tx_task() will
+// coalesce into a single send().
+#define TX_COALESCE_MAX 16
+
+// The number of different state indications whose latest value is kept,
+// to be sent later, when they are dropped because the transmit ring
+// is full.
+#define TX_DROPPED_IND_MAX 8
+
+// The longest that comms_tx_task() will wait for something to send
+// before feeding the watchdog.
+#define TX_IDLE_PERIOD_MS 100
+
+// How long tx_msg() waits between looks for room in a full transmit
+// ring, for a message that may not be dropped.
+#define TX_FULL_WAIT_MS 5
+
+// How often IND_SYSTEM_STATE, and the current value of each sensor,
+// is sent for each motor on the UDP channel, see CONFIG_STEPPER_UDP.
+#define UDP_HEARTBEAT_PERIOD_MS 500
+
+// Wot it says.
+#define MAX_OF(a, b) ((a) > (b) ? (a) : (b))
+
+// The largest message that goes through the transmit ring.
+#define TX_MSG_MAX_LEN MAX_OF(MAX_OF(MAX_OF(MAX_OF(MAX_OF(sizeof(rsp_msg_t), sizeof(ind_msg_t)), \
+                                                  sizeof(tlm_msg_t)), sizeof(rsp_many_msg_t)), \
+                                     sizeof(lat_msg_t)), sizeof(stats_msg_t))
+
+// The furthest ahead that CMD_STEPPER_START_AT may be set, in
+// milliseconds; must be well within the 32-bit microsecond range of
+// the time it carries.
+#define START_AT_MAX_MS (60 * 1000)
+
+// The range of telemetry sample intervals, see CMD_STEPPER_TELEMETRY.
+#define TLM_PERIOD_MIN_MS 10
+#define TLM_PERIOD_MAX_MS UINT16_MAX
+
+// The size of the buffer that comms_rx_task() receives into:
+// enough for a burst of several messages from the server.
+#define RX_BUFFER_SIZE (PROTOCOL_ESP32_MAX_RX_LEN * 8)
+
+// The CMD_*_INIT of the role that a production image has been built
+// for, see CONFIG_STEPPER_ROLE; not defined if the role is whatever
+// the server says it is.
+#if defined(CONFIG_STEPPER_PRODUCTION_MODE)
+#  if defined(CONFIG_STEPPER_ROLE_STAND)
+#    define STEPPER_ROLE_INIT CMD_STAND_INIT
+#  elif defined(CONFIG_STEPPER_ROLE_LIFT)
+#    define STEPPER_ROLE_INIT CMD_LIFT_INIT
+#  elif defined(CONFIG_STEPPER_ROLE_PLINKY_PLONKY)
+#    define STEPPER_ROLE_INIT CMD_PLINKY_PLONKY_INIT
+#  elif defined(CONFIG_STEPPER_ROLE_DOOR)
+#    define STEPPER_ROLE_INIT CMD_DOOR_INIT
+#  endif
+#endif
+
+#if defined(CONFIG_STEPPER_LATENCY)
+// Capture the time at which a command reached a stage of its handling.
+#  define LATENCY_STAMP(lat, stage) latency_stamp(lat, stage)
+// Send a latency message, see lat_msg_t.
+#  define LATENCY_SEND(context, lat, cmd_or_ind) latency_send(context, lat, cmd_or_ind)
+// Note that the response to a command has been queued and send
+// the latency message for it.
+#  define LATENCY_RSP_QUEUED(context, lat) latency_rsp_queued(context, lat)
+#else
+#  define LATENCY_STAMP(lat, stage)
+#  define LATENCY_SEND(context, lat, cmd_or_ind)
+#  define LATENCY_RSP_QUEUED(context, lat)
+#endif
+
+#if defined(CONFIG_STEPPER_UDP)
+// Add a message to the datagram being put together for the UDP
+// channel, if it is one for the UDP channel, returning true if so.
+#  define UDP_ADD(context, buffer, len) udp_add(context, buffer, len)
+// Send the datagram being put together for the UDP channel.
+#  define UDP_SEND(context) udp_send(context)
+#else
+#  define UDP_ADD(context, buffer, len) false
+#  define UDP_SEND(context)
+#endif
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -166,39 +363,151 @@
 // Production mode message parser state.
 typedef enum {
     MSG_PARSER_STATE_NEED_MAGIC = 0,
-    MSG_PARSER_STATE_NEED_CMD_BODY,
-    MSG_PARSER_STATE_NEED_QRY_BODY
+    MSG_PARSER_STATE_NEED_BODY
 } msg_parser_state_t;
 
-// Structure to hold a received command or query.
+// A received command or query: points either straight into the
+// receive buffer or, if the message was split across receives,
+// into the buffer of the message parser.
 typedef struct {
-    bool cmd_not_qry;
+    uint8_t magic;  // PROTOCOL_MAGIC_CMD, PROTOCOL_MAGIC_QRY or PROTOCOL_MAGIC_QRY_MANY
     union {
-        cmd_msg_t cmd;
-        qry_msg_t qry;
-        uint8_t buffer[PROTOCOL_ESP32_MAX_RX_LEN];
+        cmd_msg_t *cmd;
+        qry_msg_t *qry;
+        qry_many_msg_t *qry_many;
     };
 } cmd_or_qry_t;
 
-// The context data for the message parser.
+// The context data for the message parser; while a message body
+// is needed the magic byte is at the start of buffer.
 typedef struct {
     msg_parser_state_t msg_parser_state;
-    cmd_or_qry_t cmd_or_qry;
+    union {
+        cmd_msg_t cmd;
+        qry_msg_t qry;
+        qry_many_msg_t qry_many;
+        uint8_t buffer[PROTOCOL_ESP32_MAX_RX_LEN];
+    };
     size_t buffer_index;
 } context_parser_t;
 
-// The context data for state.
+// A message waiting to be sent to the server.
+typedef struct {
+    size_t length;
+    union {
+        rsp_msg_t rsp;
+        rsp_many_msg_t rsp_many;
+        ind_msg_t ind;
+        tlm_msg_t tlm;
+        lat_msg_t lat;
+        stats_msg_t stats;
+        uint8_t buffer[TX_MSG_MAX_LEN];
+    };
+} tx_msg_t;
+
+// The context data for transmission: a multiple-producer,
+// single-consumer ring.  The producers, anyone calling tx_msg(),
+// take it in turns through mux, held only for as long as it takes
+// to copy one message in, so that no-one need hold the production
+// lock to send something; the consumer is comms_tx_task(), which
+// does not need mux to read the ring.  The indices are free-running.
+typedef struct {
+    tx_msg_t ring[TX_RING_LENGTH];
+    portMUX_TYPE mux;
+    uint32_t write_index;  // Only written by a producer holding mux.
+    uint32_t read_index;   // Only written by comms_tx_task().
+    uint32_t dropped_count; // Protected by mux.
+    uint32_t retry_count;   // Only written by comms_tx_task().
+    // The latest value of each state indication that has been dropped,
+    // protected by mux.
+    ind_msg_t dropped_ind[TX_DROPPED_IND_MAX];
+    size_t dropped_ind_count;
+} context_tx_t;
+
+#if defined(CONFIG_STEPPER_UDP)
+// The context data for the UDP channel, see CONFIG_STEPPER_UDP: the
+// datagram that comms_tx_task() is putting together, the messages
+// following room for its udp_msg_t header.  Only used by
+// comms_tx_task(), except that socket is only written with the
+// production lock held.
+typedef struct {
+    int socket;         // -1 if there is no UDP channel
+    uint32_t sequence;  // That of the next datagram
+    uint8_t buffer[PROTOCOL_UDP_MAX_LEN];
+    size_t len;         // Bytes of messages in buffer, after the header
+    size_t count;       // The number of messages in buffer
+} context_udp_t;
+#endif
+
+struct context_state_t;
+
+// The pins of a motor other than those of the UART, GPIO_NUM_NC
+// where a pin is not connected.
+typedef struct {
+    gpio_num_t enable;
+    gpio_num_t door_open;
+} motor_pins_t;
+
+// A target, as filtered by filter_and_conclude().
+typedef struct {
+    cmd_msg_t cmd_msg;
+    bool (*stop_callback)(struct context_state_t *);
+    lat_msg_t lat;  // Timestamps of the command, see CONFIG_STEPPER_LATENCY
+} target_t;
+
+// The context data for the state of a motor.
 typedef struct context_state_t {
+    size_t motor;  // The motor, which is also the UART address of its TMC2209
     state_t init;
     state_t current_state;
     state_t target_state;
     bool cmd_running;
+    bool position_not_velocity;
     int64_t start_time_microseconds;
     int32_t timeout_ms;
     bool (*stop_callback)(struct context_state_t *);
+    target_t queue[TARGET_QUEUE_LENGTH];
+    size_t queue_read;
+    size_t queue_count;
+    bool start_at_armed;  // If true, queued targets are held until start_at_microseconds
+    int64_t start_at_microseconds;
+    lat_msg_t lat;        // Timestamps of the running target, see CONFIG_STEPPER_LATENCY
+    esp_timer_handle_t timer_handle_start_at;
+    int32_t profile_millihertz;  // The velocity the profile is scaling, zero if none is being played
+    size_t profile_next;         // The next segment of the profile to play
+    int64_t profile_next_microseconds;  // When it is due
 } context_state_t;
 
-// The context data for sensor monitoring.
+// A target about to be started by start_targets().
+typedef struct {
+    target_t *target;
+    context_state_t *context_state;
+    bool chained;   // True if it follows on from a target that has just ended on the same motor
+    esp_err_t err;  // The outcome of starting it
+} target_start_t;
+
+// The context data for the telemetry of a motor, see
+// CMD_STEPPER_TELEMETRY; msg is guarded by lock_tlm of
+// context_production_t.
+typedef struct {
+    int32_t period_ms;  // Zero if telemetry is off
+    int64_t next_sample_time_microseconds;
+    tlm_msg_t msg;      // The samples gathered so far
+} context_tlm_t;
+
+// The context data for the velocity profile of the plinky-plonky,
+// see CMD_PLINKY_PLONKY_PROFILE_BEGIN: the profile that targets play,
+// as kept in NVS, and the one being uploaded, which replaces it once
+// all of its segments have arrived.
+typedef struct {
+    profile_segment_t segment[PROTOCOL_PROFILE_SEGMENTS_MAX];
+    size_t count;            // Zero if there is no profile
+    profile_segment_t upload[PROTOCOL_PROFILE_SEGMENTS_MAX];
+    size_t upload_count;     // The number of segments that have arrived
+    size_t upload_expected;  // Zero if there is no upload under way
+} context_profile_t;
+
+// The context data for monitoring the sensors of a motor.
 typedef struct {
     bool is_down;
     bool is_at_limit;
@@ -206,14 +515,62 @@ typedef struct {
     bool is_open;
 } context_sensor_t;
 
-// The context data for debouncing.
+// What queries are answered from, a copy of the state and the
+// sensors that snapshot_publish() makes while the production lock
+// is held, so that comms_rx_task() can answer a query without the
+// lock, with snapshot_read(): a sequence lock, sequence being odd
+// while the copy is being written.
+typedef struct {
+    state_t current_state;
+    context_sensor_t sensor;
+} context_snapshot_motor_t;
+
+typedef struct {
+    uint32_t sequence;
+    state_t init;
+    context_snapshot_motor_t motor[STEPPER_MOTOR_COUNT];
+} context_snapshot_t;
+
+// The context data for QRY_SYSTEM_STATS: the run-time counters
+// as they were at the previous query, which the CPU load is
+// worked out from.  Only used by comms_rx_task().
 typedef struct {
-    esp_timer_create_args_t timer_args;
-    esp_timer_handle_t timer_handle;
-    size_t triggered_count_is_down;
-    size_t triggered_count_is_at_limit;
-    size_t triggered_count_is_at_reference;
-    size_t triggered_count_is_open;
+    int64_t time_microseconds;
+    uint32_t run_time[STATS_TASK_NUM];  // Indexed by stats_task_t
+    uint32_t run_time_total;
+} context_stats_t;
+
+// The sensors that are debounced in production.
+typedef enum {
+    DEBOUNCE_SENSOR_IS_DOWN,
+    DEBOUNCE_SENSOR_IS_AT_LIMIT,
+    DEBOUNCE_SENSOR_IS_AT_REFERENCE,
+    DEBOUNCE_SENSOR_IS_OPEN,
+    DEBOUNCE_SENSOR_NUM
+} debounce_sensor_t;
+
+// The context data for debouncing a single sensor pin: an edge
+// on the pin disables its interrupt and starts the timer, which
+// then reads the pin every DEBOUNCE_CHECK_PERIOD_US until it has
+// read the same level DEBOUNCE_THRESHOLD times in a row, at which
+// point that level becomes the debounced state and the interrupt
+// is re-enabled, leaving the timer idle until the next edge.  A
+// GPIO can only have one interrupt handler, so where sensors share
+// a pin only the first of them debounces it and the rest take
+// their state from that one.
+typedef struct context_debounce_pin_t {
+    gpio_num_t pin;       // GPIO_NUM_NC if the sensor is not present
+    struct context_debounce_pin_t *debounced; // The sensor that debounces pin, may be this one
+    esp_timer_handle_t timer_handle;  // NULL unless debounced is this one
+    TaskHandle_t *task_handle_notify;
+    int level;            // The level most recently read from the pin
+    size_t stable_count;  // The number of times level has been read in a row
+    bool triggered;       // The debounced state, true if the pin is low
+} context_debounce_pin_t;
+
+// The context data for debouncing the sensors of a motor.
+typedef struct {
+    context_debounce_pin_t sensor[DEBOUNCE_SENSOR_NUM];
 } context_debounce_t;
 
 // The context data for production mode.
@@ -223,23 +580,51 @@ typedef struct {
     bool running;
     struct sockaddr_in server;
     SemaphoreHandle_t lock;
+    TaskHandle_t task_handle_production;  // Notified when the connection is lost
     TaskHandle_t task_handle_comms_rx;
+    TaskHandle_t task_handle_comms_tx;
     TaskHandle_t task_handle_monitor;
+    TaskHandle_t task_handle_telemetry;
+    SemaphoreHandle_t lock_tlm;  // Guards the msg of each context_tlm[]
     context_parser_t context_parser;
-    context_state_t context_state;
-    context_sensor_t context_sensor;
-    context_debounce_t context_debounce;
+    context_state_t context_state[STEPPER_MOTOR_COUNT];  // Indexed by motor
+    context_sensor_t context_sensor[STEPPER_MOTOR_COUNT];
+    context_snapshot_t context_snapshot;
+    context_debounce_t context_debounce[STEPPER_MOTOR_COUNT];
+    context_tx_t context_tx;
+#if defined(CONFIG_STEPPER_UDP)
+    context_udp_t context_udp;
+#endif
+    context_tlm_t context_tlm[STEPPER_MOTOR_COUNT];
+    context_stats_t context_stats;
+    context_profile_t context_profile;
 } context_production_t;
 
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
 
+#if defined CONFIG_STEPPER_DIAG_PIN && (CONFIG_STEPPER_DIAG_PIN >= 0)
 // A place to remember the handle of the stall task if created.
 static TaskHandle_t g_stall_task_handle = NULL;
 
 // A semaphore to let diag_interrupt_handler signal the stall task.
 static SemaphoreHandle_t g_diag_semaphore = NULL;
+#endif
+
+// The pins of each motor, indexed by motor.
+static const motor_pins_t g_motor_pins[STEPPER_MOTOR_COUNT] = {
+    {MOTOR_PIN_ENABLE, DEBOUNCE_PIN_IS_OPEN},
+#if STEPPER_MOTOR_COUNT > 1
+    {MOTOR_PIN_ENABLE_1, DEBOUNCE_PIN_IS_OPEN_1},
+#endif
+#if STEPPER_MOTOR_COUNT > 2
+    {MOTOR_PIN_ENABLE_2, DEBOUNCE_PIN_IS_OPEN_2},
+#endif
+#if STEPPER_MOTOR_COUNT > 3
+    {MOTOR_PIN_ENABLE_3, DEBOUNCE_PIN_IS_OPEN_3},
+#endif
+};
 
 #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
 // The production context
@@ -392,8 +777,6 @@ static void diag_interrupt_handler(void *handler_arg)
     }
 }
 
-#endif
-
 // Task to handle stall indications.
 static void stall_task(void *arg)
 {
@@ -403,6 +786,28 @@ static void stall_task(void *arg)
     }
 }
 
+#endif
+
+#if defined(STEP_DIR_CONNECTED) && defined(CONFIG_STEPPER_PRODUCTION_MODE)
+
+// Callback for the end of a move to a position, called in
+// interrupt context; notifies the task whose handle is at arg.
+static bool motion_done_callback(int32_t position, void *arg)
+{
+    TaskHandle_t *task_handle = (TaskHandle_t *) arg;
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+
+    (void) position;
+
+    if ((task_handle != NULL) && (*task_handle != NULL)) {
+        vTaskNotifyGiveFromISR(*task_handle, &higherPriorityTaskWoken);
+    }
+
+    return higherPriorityTaskWoken == pdTRUE;
+}
+
+#endif
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS: SENSOR RELATED (PRODUCTION AND NON-PRODUCTION)
  * -------------------------------------------------------------- */
@@ -473,36 +878,45 @@ static bool is_down(void)
 
 #else
 
-// Return true if the lift is at a limit.
-static bool is_at_limit(void)
+// Return the debounced state of a sensor of a motor, which may
+// be that of another sensor on the same pin.
+static bool is_triggered(size_t motor, debounce_sensor_t sensor)
 {
-    return g_context_production.context_debounce.triggered_count_is_at_limit >= DEBOUNCE_THRESHOLD;
+    const context_debounce_pin_t *context = &g_context_production.context_debounce[motor].sensor[sensor];
+
+    return (context->debounced != NULL) && context->debounced->triggered;
 }
 
-// Return true if the lift is at a limit but it is not down.
-static bool is_up(void)
+// Return true if the lift of a motor is at a limit.
+static bool is_at_limit(size_t motor)
 {
-    return (g_context_production.context_debounce.triggered_count_is_at_limit >= DEBOUNCE_THRESHOLD) &&
-           (g_context_production.context_debounce.triggered_count_is_down == 0);
+    return is_triggered(motor, DEBOUNCE_SENSOR_IS_AT_LIMIT);
 }
 
-// Return true if the lift is down.
-static bool is_down(void)
+// Return true if the lift of a motor is at a limit but it is not down.
+static bool is_up(size_t motor)
 {
-    return g_context_production.context_debounce.triggered_count_is_down >= DEBOUNCE_THRESHOLD;
+    return is_triggered(motor, DEBOUNCE_SENSOR_IS_AT_LIMIT) &&
+           !is_triggered(motor, DEBOUNCE_SENSOR_IS_DOWN);
 }
 
-// Return true if the plinky-plonky is at its reference position,
-// production version.
-static bool is_at_reference(void)
+// Return true if the lift of a motor is down.
+static bool is_down(size_t motor)
 {
-    return g_context_production.context_debounce.triggered_count_is_at_reference >= DEBOUNCE_THRESHOLD;
+    return is_triggered(motor, DEBOUNCE_SENSOR_IS_DOWN);
 }
 
-// Return true if a door is open, production version.
-static bool is_open(void)
+// Return true if the plinky-plonky of a motor is at its reference
+// position, production version.
+static bool is_at_reference(size_t motor)
+{
+    return is_triggered(motor, DEBOUNCE_SENSOR_IS_AT_REFERENCE);
+}
+
+// Return true if the door of a motor is open, production version.
+static bool is_open(size_t motor)
 {
-    return g_context_production.context_debounce.triggered_count_is_open >= DEBOUNCE_THRESHOLD;
+    return is_triggered(motor, DEBOUNCE_SENSOR_IS_OPEN);
 }
 
 #endif // #if (!defined(CONFIG_STEPPER_PRODUCTION_MODE)
@@ -515,12 +929,13 @@ static bool is_open(void)
 esp_err_t init(void)
 {
 
-#if defined(CONFIG_STEPPER_ENABLE_PIN) && (CONFIG_STEPPER_ENABLE_PIN >= 0)
-    // Stop the motor moving too much before it is configured,
-    if (gpio_set_level(CONFIG_STEPPER_ENABLE_PIN, 1) == ESP_OK) {
-        gpio_set_direction(CONFIG_STEPPER_ENABLE_PIN, GPIO_MODE_OUTPUT);
+    // Stop the motors moving too much before they are configured
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        if ((g_motor_pins[motor].enable != GPIO_NUM_NC) &&
+            (gpio_set_level(g_motor_pins[motor].enable, 1) == ESP_OK)) {
+            gpio_set_direction(g_motor_pins[motor].enable, GPIO_MODE_OUTPUT);
+        }
     }
-#endif
 
     // Print out our Wi-Fi MAC address, if possible
     uint8_t mac[6] = {0};
@@ -569,6 +984,13 @@ esp_err_t init(void)
     }
 #endif
 
+    // Configure the door open pins of any other motors
+    for (size_t motor = 1; (motor < STEPPER_MOTOR_COUNT) && (err == ESP_OK); motor++) {
+        if (g_motor_pins[motor].door_open != GPIO_NUM_NC) {
+            err = gpio_set_direction(g_motor_pins[motor].door_open, GPIO_MODE_INPUT);
+        }
+    }
+
 #if !defined(CONFIG_STEPPER_NO_WIFI)
     // Initialise OTA
     if (err == ESP_OK) {
@@ -602,7 +1024,23 @@ esp_err_t init(void)
                            CONFIG_STEPPER_UART_RXD_PIN, CONFIG_STEPPER_UART_BAUD_RATE);
     }
 
-    // Create the RTOS stuff needed for stall handling
+#if defined(STEP_DIR_CONNECTED)
+    // Initialise stepping through the STEP/DIR pins
+    if (err == ESP_OK) {
+#  if defined(CONFIG_STEPPER_PRODUCTION_MODE)
+        err = motion_init(CONFIG_STEPPER_STEP_PIN, CONFIG_STEPPER_DIR_PIN,
+                          motion_done_callback,
+                          &g_context_production.task_handle_monitor);
+#  else
+        err = motion_init(CONFIG_STEPPER_STEP_PIN, CONFIG_STEPPER_DIR_PIN,
+                          NULL, NULL);
+#  endif
+    }
+#endif
+
+#if defined CONFIG_STEPPER_DIAG_PIN && (CONFIG_STEPPER_DIAG_PIN >= 0)
+    // Create the RTOS stuff needed for stall handling, only worth
+    // having if there is a DIAG pin to tell us of a stall
     if (err == ESP_OK) {
         vSemaphoreCreateBinary(g_diag_semaphore);
         if (!g_diag_semaphore ||
@@ -610,15 +1048,14 @@ esp_err_t init(void)
             err = ESP_ERR_NO_MEM;
             ESP_LOGE(TAG, "Unable to create stall_task or semaphore.");
         }
-#if defined CONFIG_STEPPER_DIAG_PIN && (CONFIG_STEPPER_DIAG_PIN >= 0)
         // Initial setup of stall detection with threshold value that means
         // a stall should never be detected
         if (err == ESP_OK) {
             tmc2209_init_stallguard(TMC2209_ADDRESS, -1, 100, CONFIG_STEPPER_DIAG_PIN,
                                     diag_interrupt_handler, NULL);
         }
-#endif
     }
+#endif
 
 #if defined(CONFIG_STEPPER_NO_STEPPERS)
     // Make sure the operator knows we're not gonna do nuffin
@@ -918,125 +1355,201 @@ static void do_test_mode(void)
 
 #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
 
+// Get the velocity of a motor, whether it is being driven by
+// VACTUAL or, motor 0 only, through the STEP pin.
+static void get_velocity(size_t motor, int32_t *millihertz)
+{
+    tmc2209_get_velocity(motor, millihertz);
+#  if defined(STEP_DIR_CONNECTED)
+    if ((*millihertz == 0) && (motor == 0)) {
+        *millihertz = motion_get_velocity();
+    }
+#  endif
+}
+
 // Return true if the stand is rotating in a clockwise direction.
-static bool is_state_stand_rotating_clockwise(void)
+static bool is_state_stand_rotating_clockwise(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz < 0;
 }
 
 // Return true if the stand is rotating in an anticlockwise direction.
-static bool is_state_stand_rotating_anticlockwise(void)
+static bool is_state_stand_rotating_anticlockwise(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz > 0;
 }
 
 // Return true if the lift is stopped and down.
-static bool is_state_lift_stopped_down(void)
+static bool is_state_lift_stopped_down(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
-    return (millihertz == 0) && is_down();
+    get_velocity(motor, &millihertz);
+    return (millihertz == 0) && is_down(motor);
 }
 
 // Return true if the lift is stopped and up.
-static bool is_state_lift_stopped_up(void)
+static bool is_state_lift_stopped_up(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
-    return (millihertz == 0) && is_up();
+    get_velocity(motor, &millihertz);
+    return (millihertz == 0) && is_up(motor);
 }
 
 // Return true if the lift is rising.
-static bool is_state_lift_rising(void)
+static bool is_state_lift_rising(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz > 0;
 }
 
 // Return true if the lift is lowering.
-static bool is_state_lift_lowering(void)
+static bool is_state_lift_lowering(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz < 0;
 }
 
 // Return true if the plinky-plonky is stopped at the
 // reference position.
-static bool is_state_plinky_plonky_stopped_at_reference(void)
+static bool is_state_plinky_plonky_stopped_at_reference(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
-    return (millihertz == 0) && is_at_reference();
+    get_velocity(motor, &millihertz);
+    return (millihertz == 0) && is_at_reference(motor);
 }
 
 // Return true if the plinky-plonky is playing.
-static bool is_state_plinky_plonky_playing(void)
+static bool is_state_plinky_plonky_playing(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz != 0;
 }
 
 // Return true if a door is stopped and open
-static bool is_state_door_stopped_open(void)
+static bool is_state_door_stopped_open(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
-    return (millihertz == 0) && is_open();
+    get_velocity(motor, &millihertz);
+    return (millihertz == 0) && is_open(motor);
 }
 
 // Return true if a door is opening.
-static bool is_state_door_opening(void)
+static bool is_state_door_opening(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz < 0;
 }
 
 // Return true if a door is closing.
-static bool is_state_door_closing(void)
+static bool is_state_door_closing(size_t motor)
 {
     int32_t millihertz = 0;
-    tmc2209_get_velocity(TMC2209_ADDRESS, &millihertz);
+    get_velocity(motor, &millihertz);
     return millihertz > 0;
 }
 
 // Return true if we are being the stand, based on the
-// init command we should have received at start of day
+// init command we should have received at start of day or, for
+// an image built for one role, on that role, so that the code of
+// the other roles folds away
 static bool we_are_stand(state_t init)
 {
+#if defined(STEPPER_ROLE_INIT)
+    (void) init;
+    return STATE_RULE_ROLE(STEPPER_ROLE_INIT) == STATE_RULE_ROLE(STATE_STAND_BEGIN);
+#else
     return (init >= STATE_STAND_BEGIN) && (init < STATE_STAND_END);
+#endif
 }
 
 // Return true if we are being the lift, based on the
 // init command we should have received at start of day
 static bool we_are_lift(state_t init)
 {
+#if defined(STEPPER_ROLE_INIT)
+    (void) init;
+    return STATE_RULE_ROLE(STEPPER_ROLE_INIT) == STATE_RULE_ROLE(STATE_LIFT_BEGIN);
+#else
     return (init >= STATE_LIFT_BEGIN) && (init < STATE_LIFT_END);
+#endif
 }
 
 // Return true if we are being the plinky-plonky, based on the
 // init command we should have received at start of day
 static bool we_are_plinky_plonky(state_t init)
 {
+#if defined(STEPPER_ROLE_INIT)
+    (void) init;
+    return STATE_RULE_ROLE(STEPPER_ROLE_INIT) == STATE_RULE_ROLE(STATE_PLINKY_PLONKY_BEGIN);
+#else
     return (init >= STATE_PLINKY_PLONKY_BEGIN) && (init < STATE_PLINKY_PLONKY_END);
+#endif
 }
 
 // Return true if we are being a door, based on the
 // init command we should have received at start of day
 static bool we_are_door(state_t init)
 {
+#if defined(STEPPER_ROLE_INIT)
+    (void) init;
+    return STATE_RULE_ROLE(STEPPER_ROLE_INIT) == STATE_RULE_ROLE(STATE_DOOR_BEGIN);
+#else
     return (init >= STATE_DOOR_BEGIN) && (init < STATE_DOOR_END);
+#endif
+}
+
+#if defined(CONFIG_STEPPER_PRODUCTION_MODE) && !defined(STEPPER_ROLE_INIT)
+
+// Read what we were being before a restart from NVS, returning
+// STATE_NULL if we weren't being anything.
+static state_t init_load(void)
+{
+    state_t init = STATE_NULL;
+    nvs_handle_t handle;
+    uint16_t value;
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        if ((nvs_get_u16(handle, NVS_KEY_INIT, &value) == ESP_OK) &&
+            (we_are_stand(value) || we_are_lift(value) ||
+             we_are_plinky_plonky(value) || we_are_door(value))) {
+            init = (state_t) value;
+        }
+        nvs_close(handle);
+    }
+
+    return init;
+}
+
+// Keep what we are being in NVS.
+static void init_save(state_t init)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+
+    if (err == ESP_OK) {
+        err = nvs_set_u16(handle, NVS_KEY_INIT, (uint16_t) init);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to save 0x%04x to NVS: %s.", init, esp_err_to_name(err));
+    }
 }
 
-// Get the current state, which depends on what we are being,
-// hence the need for the last target state, also updates
+#endif // #if defined(CONFIG_STEPPER_PRODUCTION_MODE) && !defined(STEPPER_ROLE_INIT)
+
+// Get the current state of a motor, which depends on what we are
+// being, hence the need for the last target state, also updates
 // the current state.
 // Note: if we've never been given a target state, this will return
 // STATE_NULL, we just don't know who we are yet.
@@ -1045,9 +1558,9 @@ static state_t get_state(context_state_t *context)
     state_t state = STATE_NULL;
 
     if (we_are_stand(context->init)) {
-        if (is_state_stand_rotating_clockwise()) {
+        if (is_state_stand_rotating_clockwise(context->motor)) {
             state = STATE_STAND_ROTATING_CLOCKWISE;
-        } else if (is_state_stand_rotating_anticlockwise()) {
+        } else if (is_state_stand_rotating_anticlockwise(context->motor)) {
             state = STATE_STAND_ROTATING_ANTICLOCKWISE;
         } else {
             state = STATE_STAND_STOPPED;
@@ -1055,13 +1568,13 @@ static state_t get_state(context_state_t *context)
     } else if (we_are_lift(context->init)) {
         // Got to go through these in the right order,
         // narrowest conditions first
-        if (is_state_lift_stopped_up()) {
+        if (is_state_lift_stopped_up(context->motor)) {
             state = STATE_LIFT_STOPPED_UP;
-        } else if (is_state_lift_stopped_down()) {
+        } else if (is_state_lift_stopped_down(context->motor)) {
             state = STATE_LIFT_STOPPED_DOWN;
-        } else if (is_state_lift_rising()) {
+        } else if (is_state_lift_rising(context->motor)) {
             state = STATE_LIFT_RISING;
-        } else if (is_state_lift_lowering()) {
+        } else if (is_state_lift_lowering(context->motor)) {
             state = STATE_LIFT_LOWERING;
         } else {
             state = STATE_LIFT_STOPPED_UNKNOWN;
@@ -1069,9 +1582,9 @@ static state_t get_state(context_state_t *context)
     } else if (we_are_plinky_plonky(context->init)) {
         // Got to go through these in the right order,
         // narrowest conditions first
-        if (is_state_plinky_plonky_stopped_at_reference()) {
+        if (is_state_plinky_plonky_stopped_at_reference(context->motor)) {
             state = STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE;
-        } else if (is_state_plinky_plonky_playing()) {
+        } else if (is_state_plinky_plonky_playing(context->motor)) {
             state = STATE_PLINKY_PLONKY_PLAYING;
         } else {
             state = STATE_PLINKY_PLONKY_STOPPED_UNKNOWN;
@@ -1079,11 +1592,11 @@ static state_t get_state(context_state_t *context)
     } else if (we_are_door(context->init)) {
         // Got to go through these in the right order,
         // narrowest conditions first
-        if (is_state_door_stopped_open()) {
+        if (is_state_door_stopped_open(context->motor)) {
             state = STATE_DOOR_STOPPED_OPEN;
-        } else if (is_state_door_opening()) {
+        } else if (is_state_door_opening(context->motor)) {
             state = STATE_DOOR_OPENING;
-        } else if (is_state_door_closing()) {
+        } else if (is_state_door_closing(context->motor)) {
             state = STATE_DOOR_CLOSING;
         } else {
             // Note that we have no way of
@@ -1099,6 +1612,55 @@ static state_t get_state(context_state_t *context)
     return state;
 }
 
+// Bring the snapshot that queries are answered from up to date.
+// IMPORTANT: the production context should be locked before this is
+// called, that is what makes this the only writer.
+static void snapshot_publish(context_production_t *context)
+{
+    context_snapshot_t *snapshot = &context->context_snapshot;
+    uint32_t sequence = snapshot->sequence;
+    state_t current_state[STEPPER_MOTOR_COUNT];
+
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        current_state[motor] = get_state(&context->context_state[motor]);
+    }
+
+    // Odd while writing, so that snapshot_read() knows to try again
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    // All motors are always being the same thing
+    snapshot->init = context->context_state[0].init;
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        snapshot->motor[motor].current_state = current_state[motor];
+        snapshot->motor[motor].sensor = context->context_sensor[motor];
+    }
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Take a consistent copy of the snapshot that queries are answered
+// from; the production lock need not be held.
+static void snapshot_read(const context_snapshot_t *snapshot,
+                          context_snapshot_t *copy)
+{
+    uint32_t sequence;
+
+    while (1) {
+        sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) == 0) {
+            copy->init = snapshot->init;
+            memcpy(copy->motor, snapshot->motor, sizeof(copy->motor));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) == sequence) {
+                break;
+            }
+        } else {
+            // We've caught snapshot_publish() in the act, let it finish
+            taskYIELD();
+        }
+    }
+    copy->sequence = sequence;
+}
+
 #endif // #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
 
 /* ----------------------------------------------------------------
@@ -1107,8 +1669,10 @@ static state_t get_state(context_state_t *context)
 
 #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
 
-// Send data to the server.
-static esp_err_t send_tx_data(uint8_t *buffer, size_t len, int socket)
+// Send data to the server, adding the number of times a send had
+// to be retried to *retry_count_total.
+static esp_err_t send_tx_data(uint8_t *buffer, size_t len, int socket,
+                              uint32_t *retry_count_total)
 {
     esp_err_t err = ESP_OK;
     size_t total_written = 0;
@@ -1122,6 +1686,7 @@ static esp_err_t send_tx_data(uint8_t *buffer, size_t len, int socket)
         } else {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 retry_count++;
+                __atomic_store_n(retry_count_total, *retry_count_total + 1, __ATOMIC_RELAXED);
                 vTaskDelay(pdMS_TO_TICKS(10));  // Small delay before retry
             } else {
                 err = -errno;
@@ -1138,12 +1703,194 @@ static esp_err_t send_tx_data(uint8_t *buffer, size_t len, int socket)
     return err;
 }
 
+// Return true if a message is an indication of the state of a
+// sensor or of a motor, one for which only the latest value matters,
+// as opposed to IND_SYSTEM_STEPPER_TARGET_END, which says that
+// something has happened.
+static bool is_state_ind(const uint8_t *buffer, size_t len)
+{
+    return (*buffer == PROTOCOL_MAGIC_IND) && (len == sizeof(ind_msg_t)) &&
+           (((const ind_msg_t *) buffer)->ind != IND_SYSTEM_STEPPER_TARGET_END);
+}
+
+#  if defined(CONFIG_STEPPER_UDP)
+
+// Return true if a message is one for the UDP channel, one for which
+// only the latest value matters, see udp_msg_t.
+static bool is_udp_msg(const uint8_t *buffer, size_t len)
+{
+    return ((*buffer == PROTOCOL_MAGIC_TLM) && (len == sizeof(tlm_msg_t))) ||
+           is_state_ind(buffer, len);
+}
+
+// Send the datagram that udp_add() has been putting together, if
+// there is anything in it: there are no retries, a datagram that
+// cannot be sent is lost, just as one may be on the way, and the
+// gap in the sequence numbers tells the server so.  Only called by
+// comms_tx_task().
+static void udp_send(context_production_t *context)
+{
+    context_udp_t *udp = &context->context_udp;
+    context_tx_t *tx = &context->context_tx;
+
+    if (udp->count > 0) {
+        udp_msg_t *header = (udp_msg_t *) udp->buffer;
+        size_t len = sizeof(*header) + udp->len;
+        header->magic = PROTOCOL_MAGIC_UDP;
+        header->sequence = udp->sequence;
+        udp->sequence++;
+        int32_t len_written = -1;
+        if (context->connected && (udp->socket >= 0)) {
+            len_written = send(udp->socket, udp->buffer, len, 0);
+        }
+        if ((len_written < 0) || ((size_t) len_written != len)) {
+            taskENTER_CRITICAL(&tx->mux);
+            tx->dropped_count += udp->count;
+            taskEXIT_CRITICAL(&tx->mux);
+        }
+    }
+
+    udp->len = 0;
+    udp->count = 0;
+}
+
+// If there is a UDP channel and a message is one for it, add the
+// message to the datagram being put together, sending what is
+// already there first if there is no room, and return true, else
+// return false.  Only called by comms_tx_task().
+static bool udp_add(context_production_t *context, const uint8_t *buffer, size_t len)
+{
+    context_udp_t *udp = &context->context_udp;
+    bool added = false;
+
+    if ((udp->socket >= 0) && is_udp_msg(buffer, len)) {
+        if (sizeof(udp_msg_t) + udp->len + len > sizeof(udp->buffer)) {
+            udp_send(context);
+        }
+        memcpy(udp->buffer + sizeof(udp_msg_t) + udp->len, buffer, len);
+        udp->len += len;
+        udp->count++;
+        added = true;
+    }
+
+    return added;
+}
+
+#  endif // #if defined(CONFIG_STEPPER_UDP)
+
+// Queue a message for comms_tx_task() to send to the server.  If
+// the transmit ring is full the message is dropped, and counted,
+// except that the latest value of a dropped state indication is kept
+// aside and sent once there is room, so that the server ends up
+// knowing the latest state of the sensors.  The exception is
+// IND_SYSTEM_STEPPER_TARGET_END, which is never dropped or merged,
+// since the server waits on each one; this waits until there is room
+// for it in the ring instead.  The production lock need not be held.
+static void tx_msg(context_production_t *context, uint8_t *buffer, size_t len)
+{
+    context_tx_t *tx = &context->context_tx;
+    bool must_queue = (*buffer == PROTOCOL_MAGIC_IND) && (len == sizeof(ind_msg_t)) &&
+                      !is_state_ind(buffer, len);
+    bool queued = false;
+    bool dropped = false;
+
+    while (!queued && !dropped) {
+
+        taskENTER_CRITICAL(&tx->mux);
+
+        uint32_t write_index = tx->write_index;
+        uint32_t read_index = __atomic_load_n(&tx->read_index, __ATOMIC_ACQUIRE);
+
+        if ((write_index - read_index < TX_RING_LENGTH) &&
+            (len <= sizeof(tx->ring[0].buffer))) {
+            tx_msg_t *msg = &(tx->ring[write_index % TX_RING_LENGTH]);
+            msg->length = len;
+            memcpy(msg->buffer, buffer, len);
+            // Only now let comms_tx_task() see it
+            __atomic_store_n(&tx->write_index, write_index + 1, __ATOMIC_RELEASE);
+            queued = true;
+        } else if (!must_queue || !context->running ||
+                   (context->task_handle_comms_tx == NULL)) {
+            // Drop it: a message that may not be dropped still is if
+            // there is no comms_tx_task() to make room
+            tx->dropped_count++;
+            dropped = true;
+            if (is_state_ind(buffer, len)) {
+                ind_msg_t *ind = (ind_msg_t *) buffer;
+                size_t x;
+                for (x = 0; (x < tx->dropped_ind_count) &&
+                            ((tx->dropped_ind[x].ind != ind->ind) ||
+                             (tx->dropped_ind[x].motor != ind->motor)); x++) {
+                }
+                if (x < TX_DROPPED_IND_MAX) {
+                    tx->dropped_ind[x] = *ind;
+                    if (x >= tx->dropped_ind_count) {
+                        tx->dropped_ind_count = x + 1;
+                    }
+                }
+            }
+        }
+
+        taskEXIT_CRITICAL(&tx->mux);
+
+        if (context->task_handle_comms_tx != NULL) {
+            xTaskNotifyGive(context->task_handle_comms_tx);
+        }
+
+        if (!queued && !dropped) {
+            // Let comms_tx_task() make room
+            vTaskDelay(pdMS_TO_TICKS(TX_FULL_WAIT_MS));
+        }
+    }
+}
+
+#  if defined(CONFIG_STEPPER_LATENCY)
+
+// Capture the time at which a command reached a stage of its
+// handling, in the time base of QRY_SYSTEM_TIME; zero is kept
+// to mean "not reached".
+static void latency_stamp(lat_msg_t *lat, lat_stage_t stage)
+{
+    uint32_t now = (uint32_t) esp_timer_get_time();
+    lat->time_us[stage] = (now != 0) ? now : 1;
+}
+
+// Send a latency message.
+// IMPORTANT: the production context should be locked before this is called.
+static void latency_send(context_production_t *context, lat_msg_t *lat,
+                         uint16_t cmd_or_ind)
+{
+    lat->magic = PROTOCOL_MAGIC_LAT;
+    lat->cmd_or_ind = cmd_or_ind;
+    tx_msg(context, (uint8_t *) lat, sizeof(*lat));
+}
+
+// Note that the response to the command of lat has been queued and
+// send the latency message for it; if the command is the one that
+// started the running target, the time is also noted in the record
+// of that target, to go with its end indication.
+// IMPORTANT: the production context should be locked before this is called.
+static void latency_rsp_queued(context_production_t *context, lat_msg_t *lat)
+{
+    latency_stamp(lat, LAT_STAGE_RSP_QUEUED);
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        context_state_t *context_state = &context->context_state[motor];
+        if (context_state->cmd_running &&
+            (context_state->lat.reference == lat->reference) &&
+            (context_state->lat.time_us[LAT_STAGE_PARSED] == lat->time_us[LAT_STAGE_PARSED])) {
+            context_state->lat.time_us[LAT_STAGE_RSP_QUEUED] = lat->time_us[LAT_STAGE_RSP_QUEUED];
+        }
+    }
+    latency_send(context, lat, lat->cmd_or_ind);
+}
+
+#  endif // #if defined(CONFIG_STEPPER_LATENCY)
+
 // Stop callback for the lift, downwards bound.
 // IMPORTANT: the production context should be locked before this is called.
 static bool is_down_callback(context_state_t *context_state)
 {
-    (void) context_state;
-    return is_down();
+    return is_down(context_state->motor);
 }
 
 
@@ -1155,7 +1902,7 @@ static bool is_up_callback(context_state_t *context_state)
 
     // Need to wait for the lift to move away from the limit at the bottom
     if (esp_timer_get_time() - context_state->start_time_microseconds > (HYSTERESIS_LIFT_MS * 1000)) {
-        stop = is_up();
+        stop = is_up(context_state->motor);
     }
 
     return stop;
@@ -1169,7 +1916,7 @@ static bool is_at_reference_callback(context_state_t *context_state)
 
     // Need to allow some time for us to move past the sensor from "park"
     if (esp_timer_get_time() - context_state->start_time_microseconds > (HYSTERESIS_PLINKY_PLONKY_MS * 1000)) {
-        stop = is_at_reference();
+        stop = is_at_reference(context_state->motor);
     }
 
     return stop;
@@ -1179,77 +1926,100 @@ static bool is_at_reference_callback(context_state_t *context_state)
 // IMPORTANT: the production context should be locked before this is called.
 static bool is_open_callback(context_state_t *context_state)
 {
-    (void) context_state;
-    return is_open();
+    return is_open(context_state->motor);
+}
+
+// The rule for a target state, see state_rules.h.
+typedef struct {
+    bool valid;
+    state_rule_velocity_t velocity;
+    state_rule_stop_t stop;
+} state_rule_t;
+
+// The rules for the target states, indexed by STATE_RULE_INDEX(),
+// with valid false for a state that may not be a target.
+static const state_rule_t g_state_rules[STATE_RULE_ROLE_NUM * STATE_RULE_OFFSET_NUM] = {
+#define STATE_RULE(state, velocity, stop) [STATE_RULE_INDEX(state)] = {true, velocity, stop},
+    STATE_RULES
+#undef STATE_RULE
+};
+
+// Make sure that every state in STATE_RULES fits into g_state_rules.
+#define STATE_RULE(state, velocity, stop)                                     \
+    _Static_assert((STATE_RULE_ROLE(state) < STATE_RULE_ROLE_NUM) &&          \
+                   (STATE_RULE_OFFSET(state) < STATE_RULE_OFFSET_NUM),        \
+                   #state " does not fit into g_state_rules[]");
+STATE_RULES
+#undef STATE_RULE
+
+// The most current that may be asked for in each role, in
+// milliAmps, indexed by STATE_RULE_ROLE().
+static const int32_t g_role_current_max_ma[STATE_RULE_ROLE_NUM] = {
+#define ROLE_RULE(begin, current_max_ma) [STATE_RULE_ROLE(begin)] = current_max_ma,
+    ROLE_RULES
+#undef ROLE_RULE
+};
+
+// The stop callback for each state_rule_stop_t.
+static bool (*const g_stop_callbacks[STATE_RULE_STOP_NUM])(context_state_t *) = {
+    [STATE_RULE_STOP_NONE] = NULL,
+    [STATE_RULE_STOP_DOWN] = is_down_callback,
+    [STATE_RULE_STOP_UP] = is_up_callback,
+    [STATE_RULE_STOP_AT_REFERENCE] = is_at_reference_callback,
+    [STATE_RULE_STOP_OPEN] = is_open_callback
+};
+
+// Return the rule for a target state, NULL if it may not be a target.
+static const state_rule_t *get_state_rule(int32_t state)
+{
+    const state_rule_t *rule = NULL;
+
+    if ((STATE_RULE_ROLE(state) < STATE_RULE_ROLE_NUM) &&
+        (STATE_RULE_OFFSET(state) < STATE_RULE_OFFSET_NUM) &&
+        g_state_rules[STATE_RULE_INDEX(state)].valid) {
+        rule = &g_state_rules[STATE_RULE_INDEX(state)];
+    }
+
+    return rule;
 }
 
 // Given a command message that is to achieve a target state, filter
-// out requests that don't make sense and set up concluding conditions.
+// out requests that don't make sense and set up concluding conditions,
+// using the rules of state_rules.h.
 // IMPORTANT: the production context should be locked before this is called.
 static status_t filter_and_conclude(cmd_msg_t *cmd_msg,
                                     context_state_t *context_state,
                                     bool (**stop_callback)(context_state_t *))
 {
     status_t status = STATUS_ERROR_INVALID_PARAM;
+    uint32_t role = STATE_RULE_ROLE(context_state->init);
+    const state_rule_t *rule = get_state_rule(cmd_msg->param_1);
     *stop_callback = NULL;
 
-    if ((we_are_door(context_state->init) && (cmd_msg->param_3 <= MOTOR_CURRENT_DOOR_MAX_MA)) ||
-        (cmd_msg->param_3 <= MOTOR_CURRENT_MAX_MA))  {
+    if ((role < STATE_RULE_ROLE_NUM) && (cmd_msg->param_3 <= g_role_current_max_ma[role]))  {
         // Only accept commands that make sense for who we are
-        if ((we_are_stand(context_state->init) && (cmd_msg->param_1 >= STATE_STAND_BEGIN) &&
-             (cmd_msg->param_1 <= STATE_STAND_END)) ||
-            (we_are_lift(context_state->init) && (cmd_msg->param_1 >= STATE_LIFT_BEGIN) &&
-             (cmd_msg->param_1 <= STATE_LIFT_END)) ||
-            (we_are_plinky_plonky(context_state->init) && (cmd_msg->param_1 >= STATE_PLINKY_PLONKY_BEGIN) &&
-             (cmd_msg->param_1 <= STATE_PLINKY_PLONKY_END)) ||
-            (we_are_door(context_state->init) && (cmd_msg->param_1 >= STATE_DOOR_BEGIN) &&
-             (cmd_msg->param_1 <= STATE_DOOR_END))) {
+        if ((rule != NULL) && (STATE_RULE_ROLE(cmd_msg->param_1) == role)) {
             status = STATUS_OK;
             // If the command is a "stopped" one, mask
             // any velocity (cmd_msg->param_2) to zero
-            if ((cmd_msg->param_1 == STATE_STAND_STOPPED) ||
-                (cmd_msg->param_1 == STATE_LIFT_STOPPED_UNKNOWN) ||
-                (cmd_msg->param_1 == STATE_PLINKY_PLONKY_STOPPED_UNKNOWN) ||
-                (cmd_msg->param_1 == STATE_DOOR_STOPPED_UNKNOWN)) {
-                ESP_LOGW(TAG, "\"Stopped\" type target state (0x%04x) received with"
-                        " non-zero velocity (%d), zeroing the velocity.",
-                        cmd_msg->param_1, cmd_msg->param_2);
-                cmd_msg->param_2 = 0;
+            if (rule->velocity == STATE_RULE_VELOCITY_ZERO) {
+                if (cmd_msg->param_2 != 0) {
+                    ESP_LOGW(TAG, "\"Stopped\" type target state (0x%04x) received with"
+                            " non-zero velocity (%d), zeroing the velocity.",
+                            cmd_msg->param_1, cmd_msg->param_2);
+                    cmd_msg->param_2 = 0;
+                }
             // Correct any mistakes in velocity versus requested state
-            } else if (((cmd_msg->param_1 == STATE_STAND_ROTATING_CLOCKWISE) &&
-                        (cmd_msg->param_2 > 0)) ||
-                       ((cmd_msg->param_1 == STATE_STAND_ROTATING_ANTICLOCKWISE) &&
-                        (cmd_msg->param_2 < 0)) ||
-                       (((cmd_msg->param_1 == STATE_LIFT_STOPPED_UP) || (cmd_msg->param_1 == STATE_LIFT_RISING)) &&
-                        (cmd_msg->param_2 < 0)) ||
-                       (((cmd_msg->param_1 == STATE_LIFT_STOPPED_DOWN) || (cmd_msg->param_1 == STATE_LIFT_LOWERING)) &&
-                         (cmd_msg->param_2 > 0)) ||
-                       (((cmd_msg->param_1 == STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE) || (cmd_msg->param_1 == STATE_PLINKY_PLONKY_PLAYING)) &&
-                        (cmd_msg->param_2 < 0)) ||
-                       (((cmd_msg->param_1 == STATE_DOOR_STOPPED_OPEN) || (cmd_msg->param_1 == STATE_DOOR_OPENING)) &&
-                        (cmd_msg->param_2 > 0)) ||
-                       (((cmd_msg->param_1 == STATE_DOOR_STOPPED_CLOSED) || (cmd_msg->param_1 == STATE_DOOR_CLOSING)) &&
-                        (cmd_msg->param_2 < 0))) {
+            } else if (((rule->velocity == STATE_RULE_VELOCITY_POSITIVE) && (cmd_msg->param_2 < 0)) ||
+                       ((rule->velocity == STATE_RULE_VELOCITY_NEGATIVE) && (cmd_msg->param_2 > 0))) {
                 ESP_LOGW(TAG, "Sign of velocity (%d) doesn't match target state (0x%04x),"
                         " negating the velocity.",
                         cmd_msg->param_2, cmd_msg->param_1);
                 cmd_msg->param_2 = -cmd_msg->param_2;
-             }
+            }
             // Now, if necessary, set up an end condition associated
             // with a sensor check
-            if ((cmd_msg->param_1 == STATE_LIFT_STOPPED_DOWN) ||
-                (cmd_msg->param_1 == STATE_LIFT_LOWERING)) {
-                *stop_callback = is_down_callback;
-            } else if ((cmd_msg->param_1 == STATE_LIFT_STOPPED_UP) ||
-                       (cmd_msg->param_1 == STATE_LIFT_RISING)) {
-                *stop_callback = is_up_callback;
-            } else if ((cmd_msg->param_1 == STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE) ||
-                       (cmd_msg->param_1 == STATE_PLINKY_PLONKY_PLAYING)) {
-                *stop_callback = is_at_reference_callback;
-            } else if ((cmd_msg->param_1 == STATE_DOOR_STOPPED_OPEN) ||
-                       (cmd_msg->param_1 == STATE_DOOR_OPENING)) {
-                *stop_callback = is_open_callback;
-            }
+            *stop_callback = g_stop_callbacks[rule->stop];
         } else {
             ESP_LOGE(TAG, "Target state (0x%04x) not applicable, ignoring command.",
                      cmd_msg->param_1);
@@ -1259,27 +2029,478 @@ static status_t filter_and_conclude(cmd_msg_t *cmd_msg,
     return status;
 }
 
-// Set a command in motion.
+// Send an IND_SYSTEM_STEPPER_TARGET_END for a motor.
 // IMPORTANT: the production context should be locked before this is called.
-static status_t do_cmd(cmd_msg_t *cmd_msg,
-                       context_production_t *context,
-                       bool *and_reboot)
+static void send_ind_target_end(status_t status, size_t motor,
+                                context_production_t *context)
 {
-    status_t status = STATUS_ERROR_INVALID_COMMAND;
-    context_state_t *context_state = &context->context_state;
-    bool (*stop_callback)(context_state_t *) = NULL;
+    ind_msg_t ind = {0};
+    ind.magic = PROTOCOL_MAGIC_IND;
+    ind.ind = IND_SYSTEM_STEPPER_TARGET_END;
+    ind.value = status;
+    ind.motor = (uint8_t) motor;
+    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+}
 
-    if (and_reboot) {
-        *and_reboot = false;
+// Return true if a target is a move to a position, rather than at
+// a velocity.
+static bool is_position_target(target_t *target)
+{
+    return (target->cmd_msg.command == CMD_STEPPER_TARGET_POSITION_START) ||
+           (target->cmd_msg.command == CMD_STEPPER_TARGET_POSITION_APPEND);
+}
+
+// Read the velocity profile of the plinky-plonky from NVS, leaving
+// there being no profile if there isn't one there.
+static void profile_load(context_profile_t *profile)
+{
+    nvs_handle_t handle;
+    size_t length = sizeof(profile->segment);
+
+    profile->count = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        if ((nvs_get_blob(handle, NVS_KEY_PROFILE, profile->segment, &length) == ESP_OK) &&
+            (length % sizeof(profile->segment[0]) == 0)) {
+            profile->count = length / sizeof(profile->segment[0]);
+            ESP_LOGI(TAG, "Velocity profile of %zu segment(s) loaded.", profile->count);
+        }
+        nvs_close(handle);
     }
+}
 
-    switch(cmd_msg->command) {
-        case CMD_REBOOT:
-            status = STATUS_ERROR_UNHANDLED_COMMAND;
-            if (and_reboot) {
-                *and_reboot = true;
-                ESP_LOGI(TAG, "Received CMD_REBOOT (0x%04x).", cmd_msg->command);
-                status = STATUS_OK;
+// Keep the segments of a velocity profile in NVS, deleting the
+// profile there if count is zero.
+static esp_err_t profile_save(const profile_segment_t *segment, size_t count)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+
+    if (err == ESP_OK) {
+        if (count > 0) {
+            err = nvs_set_blob(handle, NVS_KEY_PROFILE, segment, count * sizeof(*segment));
+        } else {
+            err = nvs_erase_key(handle, NVS_KEY_PROFILE);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to save velocity profile to NVS: %s.", esp_err_to_name(err));
+    }
+
+    return err;
+}
+
+// Return true if a target plays the velocity profile, which is any
+// target of the plinky-plonky that moves at a velocity.
+static bool profile_is_played_by(target_t *target, context_state_t *context_state,
+                                 context_profile_t *profile)
+{
+    return (profile->count > 0) && we_are_plinky_plonky(context_state->init) &&
+           (target->cmd_msg.param_2 != 0) && !is_position_target(target);
+}
+
+// Return a velocity scaled by a segment of the velocity profile,
+// never letting it fall to zero, which would stop us.
+static int32_t profile_scale(int32_t millihertz, const profile_segment_t *segment)
+{
+    int32_t scaled = (int32_t) (((int64_t) millihertz * segment->velocity_per_mille) / 1000);
+
+    if (scaled == 0) {
+        scaled = (millihertz < 0) ? -1 : 1;
+    }
+
+    return scaled;
+}
+
+// Handle CMD_PLINKY_PLONKY_PROFILE_BEGIN.
+// IMPORTANT: the production context should be locked before this is called.
+static status_t profile_upload_begin(cmd_msg_t *cmd_msg, context_production_t *context)
+{
+    context_profile_t *profile = &context->context_profile;
+    status_t status = STATUS_ERROR_INVALID_PARAM;
+
+    profile->upload_count = 0;
+    profile->upload_expected = 0;
+    if ((cmd_msg->param_1 > 0) && (cmd_msg->param_1 <= PROTOCOL_PROFILE_SEGMENTS_MAX)) {
+        ESP_LOGI(TAG, "Received CMD_PLINKY_PLONKY_PROFILE_BEGIN (0x%04x): %d segment(s).",
+                 cmd_msg->command, cmd_msg->param_1);
+        profile->upload_expected = cmd_msg->param_1;
+        status = STATUS_OK;
+    } else if (cmd_msg->param_1 == 0) {
+        ESP_LOGI(TAG, "Received CMD_PLINKY_PLONKY_PROFILE_BEGIN (0x%04x): deleting velocity profile.",
+                 cmd_msg->command);
+        status = STATUS_ERROR_GENERIC;
+        if (profile_save(NULL, 0) == ESP_OK) {
+            profile->count = 0;
+            status = STATUS_OK;
+        }
+    }
+
+    return status;
+}
+
+// Handle CMD_PLINKY_PLONKY_PROFILE_SEGMENTS, keeping the profile once
+// the last of its segments has arrived; a target already playing the
+// previous profile carries on at the velocity it has got to.
+// IMPORTANT: the production context should be locked before this is called.
+static status_t profile_upload_segments(cmd_msg_t *cmd_msg, context_production_t *context)
+{
+    context_profile_t *profile = &context->context_profile;
+    int32_t param[] = {cmd_msg->param_2, cmd_msg->param_3, cmd_msg->param_4};
+    status_t status = STATUS_ERROR_INVALID_PARAM;
+
+    // Segments must arrive in order and be sensible
+    if ((profile->upload_expected > 0) && (cmd_msg->param_1 == profile->upload_count)) {
+        status = STATUS_OK;
+        for (size_t x = 0; (x < sizeof(param) / sizeof(param[0])) &&
+                           (profile->upload_count < profile->upload_expected) &&
+                           (status == STATUS_OK); x++) {
+            profile_segment_t segment = {.duration_ms = (uint16_t) (((uint32_t) param[x]) & 0xFFFF),
+                                         .velocity_per_mille = (uint16_t) (((uint32_t) param[x]) >> 16)};
+            if ((segment.duration_ms > 0) && (segment.velocity_per_mille > 0) &&
+                (segment.velocity_per_mille <= PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX)) {
+                profile->upload[profile->upload_count] = segment;
+                profile->upload_count++;
+            } else {
+                ESP_LOGE(TAG, "Velocity profile segment %zu (%d ms at %d per mille) is invalid.",
+                         profile->upload_count, segment.duration_ms, segment.velocity_per_mille);
+                status = STATUS_ERROR_INVALID_PARAM;
+            }
+        }
+        if ((status == STATUS_OK) && (profile->upload_count == profile->upload_expected)) {
+            status = STATUS_ERROR_GENERIC;
+            if (profile_save(profile->upload, profile->upload_count) == ESP_OK) {
+                memcpy(profile->segment, profile->upload, profile->upload_count * sizeof(profile->upload[0]));
+                profile->count = profile->upload_count;
+                for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+                    context->context_state[motor].profile_millihertz = 0;
+                }
+                ESP_LOGI(TAG, "Velocity profile of %zu segment(s) saved.", profile->count);
+                status = STATUS_OK;
+            }
+        }
+    }
+    if (status != STATUS_OK) {
+        // Start again from the top
+        profile->upload_expected = 0;
+    }
+
+    return status;
+}
+
+// Write the registers of the TMC2209 of the motor of a target,
+// within the batch of start_targets().
+// IMPORTANT: the production context should be locked before this is called.
+static esp_err_t start_target_write(target_t *target, context_state_t *context_state,
+                                    context_profile_t *profile)
+{
+    size_t motor = context_state->motor;
+    esp_err_t err = ESP_OK;
+    int32_t millihertz = target->cmd_msg.param_2;
+
+    if (profile_is_played_by(target, context_state, profile)) {
+        // Start at the velocity of the first segment of the profile
+        millihertz = profile_scale(millihertz, &profile->segment[0]);
+    }
+
+    if (target->cmd_msg.param_2 != 0) {
+        // We're gonna move, so set the current
+        err = tmc2209_set_current(motor, TMC2209_RSENSE_MOHM,
+                                  target->cmd_msg.param_3,
+                                  STEPPER_MOTOR_HOLD_CURRENT_PERCENT);
+    }
+    if (err >= 0) {
+        LOG_DEFERRED(LOG_INFO, LOG_STRING_TARGET_CURRENT, err);
+        // When moving to a position VACTUAL must be zero
+        // for the TMC2209 to take notice of its STEP pin
+        err = tmc2209_set_velocity(motor,
+                                   is_position_target(target) ? 0 : millihertz);
+    }
+    if ((err == ESP_OK) && (target->cmd_msg.param_2 != 0) &&
+        we_are_door(context_state->init)) {
+        // Doors need specific treatment
+        ESP_LOGI(TAG, "Switching off StallGuard and CoolStep.");
+        err = tmc2209_set_stealth_chop_threshold(motor, UINT32_MAX);
+        if (err == ESP_OK) {
+            err = tmc2209_stop_that_bloody_racket(motor, 3, 3, 6, 0);
+        }
+    }
+
+    return err;
+}
+
+// Start moving towards several targets at once, each for a different
+// motor and each one that has already been through
+// filter_and_conclude(); the register writes for all of them go to the
+// TMC2209s in a single batch, so that they start together.  The err
+// field of each entry of start is set to the outcome for that target;
+// the caller must have dealt with any target that was running on
+// those motors.  A chained target is one that follows on from the
+// target that has just ended on its motor: the motor is left enabled
+// and turning into it, only the registers that differ being written
+// (the rest are skipped by the shadow in tmc2209.c), so that there is
+// no pause between the two; if a chained target fails to start, the
+// caller must stop its motor.
+// IMPORTANT: the production context should be locked before this is called.
+static void start_targets(context_production_t *context,
+                          target_start_t *start, size_t count)
+{
+    context_profile_t *profile = &context->context_profile;
+    int32_t timeout_ms[STEPPER_MOTOR_COUNT];
+    size_t written_count = 0;
+
+    // Disable the motors to begin with, unless chaining
+    for (size_t x = 0; x < count; x++) {
+        size_t motor = start[x].context_state->motor;
+#  if defined(STEP_DIR_CONNECTED)
+        if ((motor == 0) && (!start[x].chained || motion_is_moving())) {
+            // Whatever happens, any previous move through the STEP
+            // pin is over; when chaining there is only one if the
+            // target before ended on a sensor part way through it
+            motion_stop(true);
+        }
+#  endif
+        timeout_ms[x] = start[x].target->cmd_msg.param_4;
+        start[x].err = ESP_OK;
+        if (!start[x].chained) {
+            start[x].err = tmc2209_motor_disable(motor);
+        }
+    }
+
+    // Batch up the register writes so that they go to the TMC2209s
+    // back-to-back in one go, rather than each waiting for its own echo
+    esp_err_t batch_err = tmc2209_batch_begin();
+    for (size_t x = 0; x < count; x++) {
+        if (start[x].err == ESP_OK) {
+            start[x].err = batch_err;
+            if (start[x].err == ESP_OK) {
+                start[x].err = start_target_write(start[x].target,
+                                                  start[x].context_state,
+                                                  profile);
+            }
+            if (start[x].err == ESP_OK) {
+                written_count++;
+            }
+        }
+    }
+    if (batch_err == ESP_OK) {
+        // Always end the batch, only sending it if there is something
+        // good in it; a target that went wrong part way through its
+        // writes leaves its motor disabled, so what it did write is
+        // harmless, or, if chained, is stopped by the caller
+        batch_err = tmc2209_batch_end(written_count > 0);
+    }
+
+    for (size_t x = 0; x < count; x++) {
+        target_t *target = start[x].target;
+        context_state_t *context_state = start[x].context_state;
+        bool position_not_velocity = is_position_target(target);
+        esp_err_t err = start[x].err;
+        if (err == ESP_OK) {
+            err = batch_err;
+        }
+        if (err == ESP_OK) {
+            LATENCY_STAMP(&target->lat, LAT_STAGE_UART_DONE);
+        }
+        if ((err == ESP_OK) && (target->cmd_msg.param_2 != 0)) {
+            // We're gonna move, so enable the motor
+            err = tmc2209_motor_enable(context_state->motor);
+#  if defined(STEP_DIR_CONNECTED)
+            // do_cmd() only lets motor 0 move to a position
+            if ((err == ESP_OK) && position_not_velocity) {
+                err = motion_move_to(target->cmd_msg.param_4, target->cmd_msg.param_2 / 1000,
+                                     CONFIG_STEPPER_ACCELERATION_HZ,
+                                     MOTION_PROFILE);
+                if (err >= 0) {
+                    // The move is self-terminating, the timeout is
+                    // just a safety net, allow plenty of margin
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_TARGET_MOVE_TIME, err);
+                    timeout_ms[x] = (err * 2) + 1000;
+                    err = ESP_OK;
+                }
+            }
+#  endif
+            if (err == ESP_OK) {
+                LATENCY_STAMP(&target->lat, LAT_STAGE_MOTOR_ENABLED);
+            }
+        } else if ((err == ESP_OK) && start[x].chained) {
+            // A "stopped" target leaves the motor disabled, as it
+            // would be had the target been started afresh
+            err = tmc2209_motor_disable(context_state->motor);
+        }
+        if (err == ESP_OK) {
+            context_state->lat = target->lat;
+            context_state->start_time_microseconds = esp_timer_get_time();
+            context_state->timeout_ms = timeout_ms[x];
+            context_state->target_state = target->cmd_msg.param_1;
+            context_state->stop_callback = target->stop_callback;
+            context_state->position_not_velocity = position_not_velocity;
+            context_state->profile_millihertz = 0;
+            if (profile_is_played_by(target, context_state, profile)) {
+                // monitor_task() plays the rest of the profile
+                context_state->profile_millihertz = target->cmd_msg.param_2;
+                context_state->profile_next = 1;
+                context_state->profile_next_microseconds = context_state->start_time_microseconds +
+                                                           (profile->segment[0].duration_ms * 1000);
+            }
+            context_state->cmd_running = true;
+            // Update the current state, now that we know what we are
+            // the rest is left to the monitoring task
+            get_state(context_state);
+        }
+        start[x].err = err;
+    }
+}
+
+// Start moving towards a target, one that has already been through
+// filter_and_conclude(); the caller must have dealt with any target
+// that was running on the motor.
+// IMPORTANT: the production context should be locked before this is called.
+static status_t start_target(context_production_t *context,
+                             target_t *target, context_state_t *context_state)
+{
+    target_start_t start = {.target = target, .context_state = context_state};
+
+    start_targets(context, &start, 1);
+
+    return (start.err == ESP_OK) ? STATUS_OK : STATUS_ERROR_HARDWARE;
+}
+
+// Throw away any queued targets of a motor, sending an abort
+// indication for each.
+// IMPORTANT: the production context should be locked before this is called.
+static void discard_targets(context_state_t *context_state,
+                            context_production_t *context)
+{
+    if (context_state->queue_count > 0) {
+        LOG_DEFERRED(LOG_WARN, LOG_STRING_TARGET_DISCARD, context_state->queue_count);
+    }
+    for (; context_state->queue_count > 0; context_state->queue_count--) {
+        send_ind_target_end(STATUS_ERROR_ABORT, context_state->motor, context);
+    }
+    context_state->queue_read = 0;
+}
+
+// Abort whatever target is running on the motor of the command
+// cmd_msg, and anything queued behind it or waiting for a
+// CMD_STEPPER_START_AT, to make way for cmd_msg.
+// IMPORTANT: the production context should be locked before this is called.
+static void abort_targets(cmd_msg_t *cmd_msg, context_production_t *context)
+{
+    context_state_t *context_state = &context->context_state[cmd_msg->motor];
+
+    // If there was already a command running, send
+    // an abort indication
+    if (context_state->cmd_running) {
+        send_ind_target_end(STATUS_ERROR_ABORT, context_state->motor, context);
+        context_state->cmd_running = false;
+        LOG_DEFERRED(LOG_WARN, LOG_STRING_TARGET_ABORT,
+                     context_state->target_state,
+                     (int32_t) ((esp_timer_get_time() - context_state->start_time_microseconds) / 1000),
+                     cmd_msg->param_1);
+    }
+    // ...and anything that was queued behind it
+    discard_targets(context_state, context);
+    if (context_state->start_at_armed) {
+        context_state->start_at_armed = false;
+        esp_timer_stop(context_state->timer_handle_start_at);
+    }
+}
+
+// Start the next queued target of each of the motors in the bit-map
+// motors, all together, returning a bit-map of the motors that a
+// target was started on; a queued target which fails to start is
+// ended with an indication and the one after it is tried.  If
+// chained is true the targets follow on from targets that have just
+// ended on those motors, see start_targets().  Since the role or the
+// state of a motor may have changed since a target was queued, each
+// goes through filter_and_conclude() again before it is started.
+// IMPORTANT: the production context should be locked before this is called.
+static uint32_t start_next_targets(context_production_t *context, uint32_t motors,
+                                   bool chained)
+{
+    target_start_t start[STEPPER_MOTOR_COUNT];
+    uint32_t started = 0;
+    size_t popped_count;
+    size_t count;
+
+    do {
+        popped_count = 0;
+        count = 0;
+        for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+            context_state_t *context_state = &context->context_state[motor];
+            if ((motors & ~started & (1UL << motor)) && (context_state->queue_count > 0)) {
+                target_t *target = &(context_state->queue[context_state->queue_read]);
+                context_state->queue_read = (context_state->queue_read + 1) % TARGET_QUEUE_LENGTH;
+                context_state->queue_count--;
+                popped_count++;
+                LOG_DEFERRED(LOG_INFO, LOG_STRING_TARGET_START_QUEUED,
+                             target->cmd_msg.param_1, context_state->queue_count);
+                status_t status = filter_and_conclude(&target->cmd_msg, context_state,
+                                                      &target->stop_callback);
+                if (status == STATUS_OK) {
+                    start[count].target = target;
+                    start[count].context_state = context_state;
+                    start[count].chained = chained;
+                    count++;
+                } else {
+                    LOG_DEFERRED(LOG_ERROR, LOG_STRING_TARGET_START_QUEUED_FAILED,
+                                 target->cmd_msg.param_1, status);
+                    send_ind_target_end(status, motor, context);
+                }
+            }
+        }
+        if (count > 0) {
+            start_targets(context, start, count);
+            for (size_t x = 0; x < count; x++) {
+                size_t motor = start[x].context_state->motor;
+                if (start[x].err == ESP_OK) {
+                    started |= 1UL << motor;
+                } else {
+                    LOG_DEFERRED(LOG_ERROR, LOG_STRING_TARGET_START_QUEUED_FAILED,
+                                 start[x].target->cmd_msg.param_1, STATUS_ERROR_HARDWARE);
+                    send_ind_target_end(STATUS_ERROR_HARDWARE, motor, context);
+                }
+            }
+        }
+    } while (popped_count > 0);
+
+    return started;
+}
+
+// Set a command in motion; lat is the latency record of the command,
+// which goes with any target it starts or queues and is updated with
+// the stages of starting one.
+// IMPORTANT: the production context should be locked before this is called.
+static status_t do_cmd(cmd_msg_t *cmd_msg,
+                       context_production_t *context,
+                       lat_msg_t *lat,
+                       bool *and_reboot)
+{
+    status_t status = STATUS_ERROR_INVALID_COMMAND;
+    // comms_rx_task() has checked that the motor is one we have
+    context_state_t *context_state = &context->context_state[cmd_msg->motor];
+    target_t target = {0};
+    bool position_not_velocity = false;
+    bool append = false;
+
+    if (and_reboot) {
+        *and_reboot = false;
+    }
+
+    switch(cmd_msg->command) {
+        case CMD_REBOOT:
+            status = STATUS_ERROR_UNHANDLED_COMMAND;
+            if (and_reboot) {
+                *and_reboot = true;
+                ESP_LOGI(TAG, "Received CMD_REBOOT (0x%04x).", cmd_msg->command);
+                status = STATUS_OK;
                 tmc2209_deinit();
                 log_deinit();
                 network_deinit();
@@ -1302,91 +2523,150 @@ static status_t do_cmd(cmd_msg_t *cmd_msg,
                      cmd_msg->command);
         break;
         case CMD_STEPPER_TARGET_START:
-            // For this command, the parameters have meaning:
+        case CMD_STEPPER_TARGET_POSITION_START:
+        case CMD_STEPPER_TARGET_APPEND:
+        case CMD_STEPPER_TARGET_POSITION_APPEND:
+            // For these commands, the parameters have meaning:
             //
             // param_1: the target state, taken from state_t,
-            // param_2: the velocity to travel at in TSTEPs
+            // param_2: the velocity to travel at in milliHertz
             // param_3: the current to supply to the stepper motor in milliamps
-            // param_4: the timeout for the operation in milliseconds
-
+            // param_4: the timeout for the operation in milliseconds or,
+            //          for the POSITION variants, the position to move
+            //          to in steps
+            position_not_velocity = (cmd_msg->command == CMD_STEPPER_TARGET_POSITION_START) ||
+                                    (cmd_msg->command == CMD_STEPPER_TARGET_POSITION_APPEND);
+            append = (cmd_msg->command == CMD_STEPPER_TARGET_APPEND) ||
+                     (cmd_msg->command == CMD_STEPPER_TARGET_POSITION_APPEND);
+            if (position_not_velocity) {
+                LOG_DEFERRED(LOG_INFO, append ? LOG_STRING_CMD_TARGET_POSITION_APPEND :
+                                                LOG_STRING_CMD_TARGET_POSITION_START,
+                             cmd_msg->command, cmd_msg->param_1, cmd_msg->param_2,
+                             cmd_msg->param_3, cmd_msg->param_4);
+            } else {
+                LOG_DEFERRED(LOG_INFO, append ? LOG_STRING_CMD_TARGET_APPEND :
+                                                LOG_STRING_CMD_TARGET_START,
+                             cmd_msg->command, cmd_msg->param_1, cmd_msg->param_2,
+                             cmd_msg->param_3, cmd_msg->param_4);
+            }
             // Some protection to avoid motor burn-out
-            ESP_LOGI(TAG, "Received CMD_STEPPER_TARGET_START (0x%04x):"
-                     " target state 0x%04x, velocity %d milliHertz, %d mA, timeout %d ms.",
-                     cmd_msg->command, cmd_msg->param_1, cmd_msg->param_2,
-                     cmd_msg->param_3, cmd_msg->param_4);
             // Some states don't make sense as target states, or have
             // terminating actions we need to set up; do that here
-            status = filter_and_conclude(cmd_msg, context_state, &stop_callback);
-            if (status == STATUS_OK)  {
-                // If there was already a command running, send
-                // an abort indication
-                if (context_state->cmd_running) {
-                    ind_msg_t ind = {0};
-                    ind.magic = PROTOCOL_MAGIC_IND;
-                    ind.ind = IND_SYSTEM_STEPPER_TARGET_END;
-                    ind.value = STATUS_ERROR_ABORT;
-                    send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                    context_state->cmd_running = false;
-                    ESP_LOGW(TAG, "Aborting previous target (0x%04x) after"
-                             " %lld ms to accommodate new one (0x%04x).",
-                             context_state->target_state,
-                             (esp_timer_get_time() - context_state->start_time_microseconds) / 1000,
-                             cmd_msg->param_1);
-                }
-                // Do the thing, disabling the motor to begin with
-                status = STATUS_ERROR_HARDWARE;
-                esp_err_t err = tmc2209_motor_disable(TMC2209_ADDRESS);
-                if (err == ESP_OK) {
-                    if (cmd_msg->param_2 != 0) {
-                        // We're gonna move, so set the current
-                        err = tmc2209_set_current(TMC2209_ADDRESS, TMC2209_RSENSE_MOHM,
-                                                  cmd_msg->param_3,
-                                                  STEPPER_MOTOR_HOLD_CURRENT_PERCENT);
-                    }
-                    if (err >= 0) {
-                        ESP_LOGI(TAG, "Current will be %d mA.", err);
-                        err = tmc2209_set_velocity(TMC2209_ADDRESS, cmd_msg->param_2);
-                    }
-                    if ((err == ESP_OK) && (cmd_msg->param_2 != 0)) {
-                        if (we_are_door(context_state->init)) {
-                            // Doors need specific treatment
-                            ESP_LOGI(TAG, "Switching off StallGuard and CoolStep.");
-                            err = tmc2209_set_stealth_chop_threshold(TMC2209_ADDRESS, UINT32_MAX);
-                            if (err == ESP_OK) {
-                                err = tmc2209_stop_that_bloody_racket(TMC2209_ADDRESS, 3, 3, 6, 0);
-                            }
-                        }
-                        if (err == ESP_OK) {
-                            // We're gonna move, so enable the motor
-                            err = tmc2209_motor_enable(TMC2209_ADDRESS);
-                        }
-                    }
+            target.cmd_msg = *cmd_msg;
+            target.lat = *lat;
+            status = filter_and_conclude(&target.cmd_msg, context_state,
+                                         &target.stop_callback);
+#  if !defined(STEP_DIR_CONNECTED)
+            if (position_not_velocity) {
+                ESP_LOGE(TAG, "STEP/DIR pins not connected, can't move to a position.");
+                status = STATUS_ERROR_UNHANDLED_COMMAND;
+            }
+#  endif
+            if (position_not_velocity && (cmd_msg->motor != 0)) {
+                ESP_LOGE(TAG, "Only motor 0 has STEP/DIR pins, motor %d can't move to a position.",
+                         cmd_msg->motor);
+                status = STATUS_ERROR_UNHANDLED_COMMAND;
+            }
+            if ((status == STATUS_OK) && append &&
+                (context_state->cmd_running || (context_state->queue_count > 0) ||
+                 context_state->start_at_armed)) {
+                // Queue it up behind whatever is going on
+                status = STATUS_ERROR_BUSY;
+                if (context_state->queue_count < TARGET_QUEUE_LENGTH) {
+                    context_state->queue[(context_state->queue_read + context_state->queue_count) %
+                                         TARGET_QUEUE_LENGTH] = target;
+                    context_state->queue_count++;
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_TARGET_QUEUED,
+                                 target.cmd_msg.param_1, context_state->queue_count);
+                    status = STATUS_OK;
+                } else {
+                    LOG_DEFERRED(LOG_ERROR, LOG_STRING_TARGET_QUEUE_FULL,
+                                 context_state->queue_count);
                 }
-                if (err == ESP_OK) {
-                    context_state->start_time_microseconds = esp_timer_get_time();
-                    context_state->timeout_ms = cmd_msg->param_4;
-                    context_state->target_state = cmd_msg->param_1;
-                    context_state->stop_callback = stop_callback;
-                    context_state->cmd_running = true;
-                    // Update the current state, now that we know what we are
-                    // the rest is left to the monitoring task
-                    get_state(context_state);
+            } else if (status == STATUS_OK)  {
+                abort_targets(cmd_msg, context);
+                status = start_target(context, &target, context_state);
+                *lat = target.lat;
+            }
+        break;
+        case CMD_STEPPER_START_AT:
+        {
+            // param_1: the time, as returned by QRY_SYSTEM_TIME, at
+            //          which to start the targets that are appended
+            //          after this command
+            int64_t now = esp_timer_get_time();
+            // Modulo arithmetic copes with the time having wrapped
+            int32_t delay_us = (int32_t) ((uint32_t) cmd_msg->param_1 - (uint32_t) now);
+            LOG_DEFERRED(LOG_INFO, LOG_STRING_CMD_START_AT, cmd_msg->command, delay_us);
+            status = STATUS_ERROR_INVALID_PARAM;
+            if ((delay_us > 0) && (delay_us <= START_AT_MAX_MS * 1000)) {
+                status = STATUS_ERROR_GENERIC;
+                abort_targets(cmd_msg, context);
+                if (esp_timer_start_once(context_state->timer_handle_start_at, delay_us) == ESP_OK) {
+                    context_state->start_at_microseconds = now + delay_us;
+                    context_state->start_at_armed = true;
                     status = STATUS_OK;
                 }
             }
+        }
+        break;
+        case CMD_STEPPER_TELEMETRY:
+            status = STATUS_ERROR_INVALID_PARAM;
+            if ((cmd_msg->param_1 == 0) ||
+                ((cmd_msg->param_1 >= TLM_PERIOD_MIN_MS) &&
+                 (cmd_msg->param_1 <= TLM_PERIOD_MAX_MS))) {
+                ESP_LOGI(TAG, "Received CMD_STEPPER_TELEMETRY (0x%04x): interval %d ms, motor %d.",
+                         cmd_msg->command, cmd_msg->param_1, cmd_msg->motor);
+                context->context_tlm[cmd_msg->motor].period_ms = cmd_msg->param_1;
+                if (context->task_handle_telemetry != NULL) {
+                    xTaskNotifyGive(context->task_handle_telemetry);
+                }
+                status = STATUS_OK;
+            }
+        break;
+        case CMD_PLINKY_PLONKY_PROFILE_BEGIN:
+        case CMD_PLINKY_PLONKY_PROFILE_SEGMENTS:
+            status = STATUS_ERROR_UNHANDLED_COMMAND;
+            if (we_are_plinky_plonky(context_state->init)) {
+                if (cmd_msg->command == CMD_PLINKY_PLONKY_PROFILE_BEGIN) {
+                    status = profile_upload_begin(cmd_msg, context);
+                } else {
+                    status = profile_upload_segments(cmd_msg, context);
+                }
+            } else {
+                ESP_LOGE(TAG, "Received a velocity profile (0x%04x) but we are not a plinky-plonky.",
+                         cmd_msg->command);
+            }
         break;
         case CMD_STAND_INIT:
         case CMD_LIFT_INIT:
         case CMD_PLINKY_PLONKY_INIT:
         case CMD_DOOR_INIT:
-            ESP_LOGI(TAG, "Received CMD_*_INIT (0x%04x).", cmd_msg->command);
+            LOG_DEFERRED(LOG_INFO, LOG_STRING_CMD_INIT, cmd_msg->command);
             // fall-through
-            // This tells us what we are
-            context_state->init = cmd_msg->command;
+#if defined(STEPPER_ROLE_INIT)
+            // We were built to be one thing and are that already,
+            // anything else the server can't have
+            if (cmd_msg->command == STEPPER_ROLE_INIT) {
+                status = STATUS_OK;
+            } else {
+                status = STATUS_ERROR_UNHANDLED_COMMAND;
+            }
+#else
+            // This tells us what we are, all of our motors being the
+            // same thing; remember it across a restart, only writing
+            // to flash when it changes
+            if (context_state->init != (state_t) cmd_msg->command) {
+                init_save((state_t) cmd_msg->command);
+            }
+            for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+                context->context_state[motor].init = cmd_msg->command;
+            }
             status = STATUS_OK;
+#endif
         break;
         default:
-            ESP_LOGE(TAG, "Unknown command received 0x%04x", cmd_msg->command);
+            LOG_DEFERRED(LOG_ERROR, LOG_STRING_CMD_UNKNOWN, cmd_msg->command);
         break;
     }
 
@@ -1394,29 +2674,238 @@ static status_t do_cmd(cmd_msg_t *cmd_msg,
 }
 
 // Wot it says
-static void stop_motor()
+static void stop_motor(size_t motor)
 {
-    esp_err_t err = tmc2209_set_velocity(TMC2209_ADDRESS, 0);
+#  if defined(STEP_DIR_CONNECTED)
+    if (motor == 0) {
+        motion_stop(true);
+    }
+#  endif
+    esp_err_t err = tmc2209_set_velocity(motor, 0);
     if (err != ESP_OK) {
         ESP_LOGW(TAG, "tmc2209_set_velocity() returned error"
                 " (%d) when stopping, continuing...", err);
     }
-    err = tmc2209_motor_disable(TMC2209_ADDRESS);
+    err = tmc2209_motor_disable(motor);
     if (err != ESP_OK) {
         ESP_LOGW(TAG, "tmc2209_motor_disable() returned error"
                 " (%d) when stopping, continuing...", err);
     }
 }
 
+// Send any telemetry samples that have been gathered for a motor.
+// IMPORTANT: lock_tlm should be held when this is called.
+static void telemetry_flush(context_production_t *context, size_t motor)
+{
+    context_tlm_t *tlm = &context->context_tlm[motor];
+
+    if (tlm->msg.num_samples > 0) {
+        tlm->msg.magic = PROTOCOL_MAGIC_TLM;
+        tlm->msg.motor = (uint8_t) motor;
+        tx_msg(context, (uint8_t *) &(tlm->msg), sizeof(tlm->msg));
+        memset(&(tlm->msg), 0, sizeof(tlm->msg));
+    }
+}
+
+// Send any telemetry samples that have been gathered for a motor;
+// the production lock need not be held.
+static void telemetry_send(context_production_t *context, size_t motor)
+{
+    xSemaphoreTake(context->lock_tlm, portMAX_DELAY);
+    telemetry_flush(context, motor);
+    xSemaphoreGive(context->lock_tlm);
+}
+
+// Take a telemetry sample for a motor, if telemetry is on, a target
+// is running and a sample is due, sending the samples once there are
+// TLM_MAX_SAMPLES of them.  Returns the number of milliseconds that
+// telemetry_task() should wait before calling this again.  The
+// production lock must NOT be held: taking a sample is three reads
+// over the TMC2209 UART.
+static int32_t telemetry_sample(context_production_t *context, size_t motor)
+{
+    context_tlm_t *tlm = &context->context_tlm[motor];
+    context_state_t *context_state = &context->context_state[motor];
+    int32_t wait_ms = MONITOR_PERIOD_MS;
+
+    if ((tlm->period_ms > 0) && context_state->cmd_running) {
+        int64_t now = esp_timer_get_time();
+        if (now >= tlm->next_sample_time_microseconds) {
+            esp_err_t sg_result = tmc2209_get_sg_result(motor);
+            esp_err_t tstep = tmc2209_get_tstep(motor);
+            esp_err_t current_ma = tmc2209_get_current(motor, TMC2209_RSENSE_MOHM);
+            xSemaphoreTake(context->lock_tlm, portMAX_DELAY);
+            // monitor_task() sets cmd_running false before it sends
+            // what is left at the end of a target, so if it is still
+            // true the sample can't end up after the end
+            if ((sg_result >= 0) && (tstep >= 0) && (current_ma >= 0) &&
+                context_state->cmd_running) {
+                size_t x = tlm->msg.num_samples;
+                if (x == 0) {
+                    tlm->msg.timestamp_ms = (uint32_t) (now / 1000);
+                    tlm->msg.period_ms = (uint16_t) tlm->period_ms;
+                }
+                tlm->msg.sg_result[x] = (uint16_t) sg_result;
+                tlm->msg.tstep[x] = (uint32_t) tstep;
+                tlm->msg.current_ma[x] = (uint16_t) current_ma;
+                tlm->msg.num_samples++;
+                if (tlm->msg.num_samples >= TLM_MAX_SAMPLES) {
+                    telemetry_flush(context, motor);
+                }
+            }
+            xSemaphoreGive(context->lock_tlm);
+            // Keep to the period unless we've fallen behind
+            tlm->next_sample_time_microseconds += tlm->period_ms * 1000;
+            if (tlm->next_sample_time_microseconds < now) {
+                tlm->next_sample_time_microseconds = now + (tlm->period_ms * 1000);
+            }
+        }
+        int32_t due_ms = (int32_t) ((tlm->next_sample_time_microseconds - now) / 1000);
+        if (due_ms < wait_ms) {
+            wait_ms = due_ms;
+        }
+    } else {
+        // Telemetry is off or no target is running: don't leave
+        // behind anything that is still waiting to be sent
+        telemetry_send(context, motor);
+    }
+
+    return wait_ms;
+}
+
+// Take the telemetry samples, over the TMC2209 UART, without holding
+// the production lock, so that neither monitor_task() nor the
+// commands of comms_rx_task() have to wait for them; this task runs
+// at a lower priority than those.
+static void telemetry_task(void *arg)
+{
+    context_production_t *context = (context_production_t *) arg;
+
+    // Allow us to feed the watchdog
+    esp_task_wdt_add(NULL);
+
+    while (context->running) {
+        int32_t wait_ms = MONITOR_PERIOD_MS;
+        for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+            int32_t tlm_wait_ms = telemetry_sample(context, motor);
+            if (tlm_wait_ms < wait_ms) {
+                wait_ms = tlm_wait_ms;
+            }
+        }
+
+        esp_task_wdt_reset();
+
+        // Wait for the next sample to be due, or for
+        // CMD_STEPPER_TELEMETRY to change things, always
+        // for at least a tick
+        TickType_t wait_ticks = pdMS_TO_TICKS(wait_ms);
+        if (wait_ticks == 0) {
+            wait_ticks = 1;
+        }
+        ulTaskNotifyTake(pdTRUE, wait_ticks);
+    }
+
+    esp_task_wdt_delete(NULL);
+    vTaskDelete(NULL);
+}
+
+// Play the velocity profile of the plinky-plonky for a motor, if its
+// target is playing it, changing the velocity as each segment falls
+// due.  Returns the number of milliseconds that monitor_task() should
+// wait before calling this again.
+// IMPORTANT: the production context should be locked before this is called.
+static int32_t profile_play(context_production_t *context, size_t motor)
+{
+    context_state_t *context_state = &context->context_state[motor];
+    context_profile_t *profile = &context->context_profile;
+    int32_t wait_ms = MONITOR_PERIOD_MS;
+
+    if (context_state->cmd_running && (context_state->profile_millihertz != 0)) {
+        int64_t now = esp_timer_get_time();
+        const profile_segment_t *segment = NULL;
+        // Skip over any segments that we have fallen behind with
+        while ((context_state->profile_next < profile->count) &&
+               (now >= context_state->profile_next_microseconds)) {
+            segment = &profile->segment[context_state->profile_next];
+            context_state->profile_next++;
+            context_state->profile_next_microseconds += segment->duration_ms * 1000;
+        }
+        if (segment != NULL) {
+            esp_err_t err = tmc2209_set_velocity(motor, profile_scale(context_state->profile_millihertz,
+                                                                      segment));
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "tmc2209_set_velocity() returned error (%d) when playing"
+                         " the velocity profile, continuing...", err);
+            }
+        }
+        if (context_state->profile_next < profile->count) {
+            int32_t due_ms = (int32_t) ((context_state->profile_next_microseconds - now) / 1000);
+            if (due_ms < wait_ms) {
+                wait_ms = due_ms;
+            }
+        } else {
+            // The end of the profile, just carry on as we are
+            context_state->profile_millihertz = 0;
+        }
+    }
+
+    return wait_ms;
+}
+
+#  if defined(CONFIG_STEPPER_UDP)
+
+// Send IND_SYSTEM_STATE for a motor on the UDP channel, followed by
+// the current value of each of the sensor indications of its role,
+// so that the server catches up with anything that was lost.
+// IMPORTANT: the production context should be locked before this is called.
+static void heartbeat_send(context_production_t *context, size_t motor)
+{
+    context_state_t *context_state = &context->context_state[motor];
+    context_sensor_t *context_sensor = &context->context_sensor[motor];
+    ind_msg_t ind = {0};
+
+    ind.magic = PROTOCOL_MAGIC_IND;
+    ind.motor = (uint8_t) motor;
+    ind.ind = IND_SYSTEM_STATE;
+    ind.value = context_state->current_state;
+    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+    if (we_are_lift(context_state->init)) {
+        ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN;
+        ind.value = context_sensor->is_down;
+        tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+        ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT;
+        ind.value = context_sensor->is_at_limit;
+        tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+    }
+    if (we_are_plinky_plonky(context_state->init)) {
+        ind.ind = IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE;
+        ind.value = context_sensor->is_at_reference;
+        tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+    }
+    if (we_are_door(context_state->init)) {
+        ind.ind = IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN;
+        ind.value = context_sensor->is_open;
+        tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+    }
+}
+
+#  endif // #if defined(CONFIG_STEPPER_UDP)
+
 // Monitor the operation of commands.
 static void monitor_task(void *arg)
 {
     context_production_t *context = (context_production_t *) arg;
-    context_sensor_t *context_sensor = &context->context_sensor;
-    context_state_t *context_state = &context->context_state;
     ind_msg_t ind = {0};
     ind.magic = PROTOCOL_MAGIC_IND;
-    state_t previous_state = STATE_NULL;
+    state_t previous_state[STEPPER_MOTOR_COUNT];
+    int32_t wait_ms = MONITOR_PERIOD_MS;
+#  if defined(CONFIG_STEPPER_UDP)
+    int64_t heartbeat_time_microseconds = 0;
+#  endif
+
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        previous_state[motor] = STATE_NULL;
+    }
 
     // Allow us to feed the watchdog
     esp_task_wdt_add(NULL);
@@ -1424,10 +2913,14 @@ static void monitor_task(void *arg)
     PRODUCTION_CONTEXT_LOCK(context->lock, "monitor_task() 1");
 
     // Set up the initial shadow sensor values
-    context_sensor->is_down = is_down();
-    context_sensor->is_at_limit = is_at_limit();
-    context_sensor->is_at_reference = is_at_reference();
-    context_sensor->is_open = is_open();
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        context_sensor_t *context_sensor = &context->context_sensor[motor];
+        context_sensor->is_down = is_down(motor);
+        context_sensor->is_at_limit = is_at_limit(motor);
+        context_sensor->is_at_reference = is_at_reference(motor);
+        context_sensor->is_open = is_open(motor);
+    }
+    snapshot_publish(context);
 
     PRODUCTION_CONTEXT_UNLOCK(context->lock, "monitor_task() 1");
 
@@ -1436,147 +2929,357 @@ static void monitor_task(void *arg)
 
         PRODUCTION_CONTEXT_LOCK(context->lock, "monitor_task() 2");
 
-        // Read all of the sensors and send indications
-        // as necessary
-        bool previous_sensor_state;
-        if (we_are_lift(context_state->init)){
-            previous_sensor_state = context_sensor->is_down;
-            context_sensor->is_down = is_down();
-            if (previous_sensor_state != context_sensor->is_down) {
-                ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN;
-                ind.value = !previous_sensor_state;
-                send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                ESP_LOGI(TAG, "Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN.");
-            }
-            previous_sensor_state = context_sensor->is_at_limit;
-            context_sensor->is_at_limit = is_at_limit();
-            if (previous_sensor_state != context_sensor->is_at_limit) {
-                ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT;
-                ind.value = !previous_sensor_state;
-                send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                ESP_LOGI(TAG, "Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT.");
-            }
-        }
-        if (we_are_plinky_plonky(context_state->init)){
-            previous_sensor_state = context_sensor->is_at_reference;
-            context_sensor->is_at_reference = is_at_reference();
-            if (previous_sensor_state != context_sensor->is_at_reference) {
-                ind.ind = IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE;
-                ind.value = !previous_sensor_state;
-                send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                ESP_LOGI(TAG, "Sent IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE.");
-            }
-        }
-        if (we_are_door(context_state->init)){
-            previous_sensor_state = context_sensor->is_open;
-            context_sensor->is_open = is_open();
-            if (previous_sensor_state != context_sensor->is_open) {
-                ind.ind = IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN;
-                ind.value = !previous_sensor_state;
-                send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                ESP_LOGI(TAG, "Sent IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN.");
-            }
-        }
-
-        // Update our state
-        get_state(context_state);
-        if (context_state->current_state != previous_state) {
-            ESP_LOGI(TAG, "State change 0x%04x -> 0x%04x.",
-                     previous_state, context_state->current_state);
-            previous_state = context_state->current_state;
-        }
-
-        if (context_state->cmd_running) {
-            // Check the stop callback, if there is one
-            if ((context_state->stop_callback != NULL) &&
-                (context_state->stop_callback(context_state))) {
-                // Seems we're there
-                stop_motor();
-                context_state->cmd_running = false;
-                ESP_LOGI(TAG, "Stop callback returned true.");
-            } else {
-                // No stop callback check for a timeout
-                if (esp_timer_get_time() - context_state->start_time_microseconds > (context_state->timeout_ms * 1000)) {
-                    //  Timeout
-                    context_state->cmd_running = false;
-                    stop_motor();
-                    ind.ind = IND_SYSTEM_STEPPER_TARGET_END;
-                    ind.value = STATUS_OK;
-                    send_tx_data((uint8_t *) &ind, sizeof(ind), context->socket);
-                    ESP_LOGW(TAG, "Sent IND_SYSTEM_STEPPER_TARGET_END, timeout.");
+        // Do this first, as it is the most time-critical thing:
+        // if a CMD_STEPPER_START_AT is due, start the targets that
+        // have been held waiting for it, those of all the motors
+        // that are due together
+        int64_t now = esp_timer_get_time();
+        uint32_t motors_due = 0;
+        for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+            context_state_t *context_state = &context->context_state[motor];
+            if (context_state->start_at_armed &&
+                (now >= context_state->start_at_microseconds)) {
+                context_state->start_at_armed = false;
+                if (!context_state->cmd_running) {
+                    motors_due |= 1UL << motor;
+                }
+            }
+        }
+        if (motors_due != 0) {
+            start_next_targets(context, motors_due, false);
+        }
+
+        wait_ms = MONITOR_PERIOD_MS;
+        for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+            context_sensor_t *context_sensor = &context->context_sensor[motor];
+            context_state_t *context_state = &context->context_state[motor];
+            ind.motor = (uint8_t) motor;
+
+            // Read all of the sensors and send indications
+            // as necessary
+            bool previous_sensor_state;
+            if (we_are_lift(context_state->init)){
+                previous_sensor_state = context_sensor->is_down;
+                context_sensor->is_down = is_down(motor);
+                if (previous_sensor_state != context_sensor->is_down) {
+                    ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN;
+                    ind.value = !previous_sensor_state;
+                    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_IND_LIFT_DOWN);
+                }
+                previous_sensor_state = context_sensor->is_at_limit;
+                context_sensor->is_at_limit = is_at_limit(motor);
+                if (previous_sensor_state != context_sensor->is_at_limit) {
+                    ind.ind = IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT;
+                    ind.value = !previous_sensor_state;
+                    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_IND_LIFT_LIMIT);
+                }
+            }
+            if (we_are_plinky_plonky(context_state->init)){
+                previous_sensor_state = context_sensor->is_at_reference;
+                context_sensor->is_at_reference = is_at_reference(motor);
+                if (previous_sensor_state != context_sensor->is_at_reference) {
+                    ind.ind = IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE;
+                    ind.value = !previous_sensor_state;
+                    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_IND_PLINKY_PLONKY_REFERENCE);
+                }
+            }
+            if (we_are_door(context_state->init)){
+                previous_sensor_state = context_sensor->is_open;
+                context_sensor->is_open = is_open(motor);
+                if (previous_sensor_state != context_sensor->is_open) {
+                    ind.ind = IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN;
+                    ind.value = !previous_sensor_state;
+                    tx_msg(context, (uint8_t *) &ind, sizeof(ind));
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_IND_DOOR_OPEN);
+                }
+            }
+
+            // Update our state
+            get_state(context_state);
+            if (context_state->current_state != previous_state[motor]) {
+                LOG_DEFERRED(LOG_INFO, LOG_STRING_STATE_CHANGE, motor,
+                             previous_state[motor], context_state->current_state);
+                previous_state[motor] = context_state->current_state;
+            }
+
+            int32_t profile_wait_ms = profile_play(context, motor);
+            if (profile_wait_ms < wait_ms) {
+                wait_ms = profile_wait_ms;
+            }
+
+            if (context_state->cmd_running) {
+                bool ended = false;
+                status_t status = STATUS_OK;
+                // Check the stop callback, if there is one
+                if ((context_state->stop_callback != NULL) &&
+                    (context_state->stop_callback(context_state))) {
+                    // Seems we're there
+                    ended = true;
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_STOP_CALLBACK);
+#  if defined(STEP_DIR_CONNECTED)
+                } else if (context_state->position_not_velocity && !motion_is_moving()) {
+                    // Got to the position
+                    ended = true;
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_AT_POSITION, motion_get_position());
+#  endif
+                } else {
+                    // No stop callback check for a timeout
+                    if (esp_timer_get_time() - context_state->start_time_microseconds > (context_state->timeout_ms * 1000)) {
+                        //  Timeout: for a move to a position this is an error,
+                        // otherwise it is how the target is normally reached
+                        ended = true;
+                        if (context_state->position_not_velocity) {
+                            status = STATUS_ERROR_TIMEOUT;
+                        }
+                        LOG_DEFERRED(LOG_WARN, LOG_STRING_TIMEOUT);
+                    }
+                }
+                if (ended) {
+                    LATENCY_STAMP(&context_state->lat, LAT_STAGE_STOP_DETECTED);
+                    context_state->cmd_running = false;
+                    // Telemetry first, so that it arrives before the end,
+                    // unless it is going on the UDP channel
+                    telemetry_send(context, motor);
+                    send_ind_target_end(status, motor, context);
+                    LATENCY_STAMP(&context_state->lat, LAT_STAGE_IND_QUEUED);
+                    LATENCY_SEND(context, &context_state->lat, IND_SYSTEM_STEPPER_TARGET_END);
+                    LOG_DEFERRED(LOG_INFO, LOG_STRING_IND_TARGET_END, motor, status);
+                    // Go straight on to the next target, if there is
+                    // one, otherwise stop
+                    if (start_next_targets(context, 1UL << motor, true) == 0) {
+                        stop_motor(motor);
+                    }
+                }
+            }
+        }
+
+#  if defined(CONFIG_STEPPER_UDP)
+        // Every so often, send the state and sensors of each motor on
+        // the UDP channel, if there is one
+        if ((context->context_udp.socket >= 0) && (now >= heartbeat_time_microseconds)) {
+            for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+                heartbeat_send(context, motor);
+            }
+            heartbeat_time_microseconds = now + (UDP_HEARTBEAT_PERIOD_MS * 1000);
+        }
+#  endif
+
+        // Let queries see what has changed
+        snapshot_publish(context);
+
+        PRODUCTION_CONTEXT_UNLOCK(context->lock, "monitor_task() 2");
+
+        esp_task_wdt_reset();
+
+        // Wait for debounce_timer_callback() to tell us that a sensor
+        // has changed state, or start_at_callback() to tell us that
+        // a CMD_STEPPER_START_AT is due, or for the period to expire,
+        // or for the next segment of a profile to be due; always wait
+        // for at least a tick so as not to starve anyone else
+        TickType_t wait_ticks = pdMS_TO_TICKS(wait_ms);
+        if (wait_ticks == 0) {
+            wait_ticks = 1;
+        }
+        ulTaskNotifyTake(pdTRUE, wait_ticks);
+    }
+
+    esp_task_wdt_delete(NULL);
+    vTaskDelete(NULL);
+}
+
+#endif // #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: PRODUCTION MODE
+ * -------------------------------------------------------------- */
+
+#if defined(CONFIG_STEPPER_PRODUCTION_MODE)
+
+// Answer a query about a motor from a copy of the snapshot that
+// monitor_task() publishes, without the production lock.
+static int32_t answer_qry(qry_t qry, size_t motor, int32_t *value,
+                          const context_snapshot_t *snapshot)
+{
+    status_t status = STATUS_ERROR_INVALID_QUERY;
+
+    if (motor < STEPPER_MOTOR_COUNT) {
+        switch (qry) {
+            case QRY_SYSTEM_STEPPER_STATE:
+                *value = snapshot->motor[motor].current_state;
+                status = STATUS_OK;
+            break;
+            case QRY_SYSTEM_STEPPER_POSITION:
+                status = STATUS_ERROR_UNHANDLED_QUERY;
+#  if defined(STEP_DIR_CONNECTED)
+                // Only motor 0 has STEP/DIR pins
+                if (motor == 0) {
+                    *value = motion_get_position();
+                    status = STATUS_OK;
+                }
+#  endif
+            break;
+            case QRY_SYSTEM_TIME:
+                // Deliberately truncated to 32 bits
+                *value = (int32_t) (uint32_t) esp_timer_get_time();
+                status = STATUS_OK;
+            break;
+            case QRY_SYSTEM_STATS:
+                // The rest follows in a stats_msg_t, see stats_send()
+                *value = (int32_t) esp_get_free_heap_size();
+                status = STATUS_OK;
+            break;
+            case QRY_LIFT_SENSOR_DOWN:
+                if (we_are_lift(snapshot->init)) {
+                    *value = snapshot->motor[motor].sensor.is_down;
+                    status = STATUS_OK;
+                }
+            break;
+            case QRY_LIFT_SENSOR_LIMIT:
+                if (we_are_lift(snapshot->init)) {
+                    *value = snapshot->motor[motor].sensor.is_at_limit;
+                    status = STATUS_OK;
+                }
+            break;
+            case QRY_PLINKY_PLONKY_SENSOR_REFERENCE:
+                if (we_are_plinky_plonky(snapshot->init)) {
+                    *value = snapshot->motor[motor].sensor.is_at_reference;
+                    status = STATUS_OK;
+                }
+            break;
+            case QRY_DOOR_SENSOR_OPEN:
+                if (we_are_door(snapshot->init)) {
+                    *value = snapshot->motor[motor].sensor.is_open;
+                    status = STATUS_OK;
+                }
+            break;
+            case QRY_SYSTEM_END:
+            case QRY_STAND_BEGIN:
+            case QRY_STAND_END:
+            case QRY_LIFT_END:
+            case QRY_PLINKY_PLONKY_END:
+            case QRY_DOOR_END:
+                // To keep the compiler happy
+                break;
+            default:
+                LOG_DEFERRED(LOG_ERROR, LOG_STRING_QRY_UNKNOWN, qry);
+            break;
+        }
+    } else {
+        status = STATUS_ERROR_INVALID_PARAM;
+    }
+
+    return status;
+}
+
+// Answer the queries of a qry_many_msg_t, populating rsp_many, all
+// from the same copy of the snapshot and all about the same motor.
+static void answer_qry_many(const qry_many_msg_t *qry_many,
+                            rsp_many_msg_t *rsp_many,
+                            const context_snapshot_t *snapshot)
+{
+    // The query at each bit position of a qry_many_msg_t
+    static const qry_t qry_at_bit[QRY_MANY_NUM] = {
+        [QRY_MANY_SYSTEM_STEPPER_STATE] = QRY_SYSTEM_STEPPER_STATE,
+        [QRY_MANY_SYSTEM_STEPPER_POSITION] = QRY_SYSTEM_STEPPER_POSITION,
+        [QRY_MANY_LIFT_SENSOR_DOWN] = QRY_LIFT_SENSOR_DOWN,
+        [QRY_MANY_LIFT_SENSOR_LIMIT] = QRY_LIFT_SENSOR_LIMIT,
+        [QRY_MANY_PLINKY_PLONKY_SENSOR_REFERENCE] = QRY_PLINKY_PLONKY_SENSOR_REFERENCE,
+        [QRY_MANY_DOOR_SENSOR_OPEN] = QRY_DOOR_SENSOR_OPEN
+    };
+
+    memset(rsp_many, 0, sizeof(*rsp_many));
+    rsp_many->magic = PROTOCOL_MAGIC_RSP_MANY;
+    rsp_many->reference = qry_many->reference;
+    rsp_many->queries = qry_many->queries;
+    rsp_many->status = STATUS_OK;
+
+    for (size_t x = 0; x < QRY_MANY_MAX; x++) {
+        if (qry_many->queries & (1U << x)) {
+            status_t status = STATUS_ERROR_INVALID_QUERY;
+            if (x < QRY_MANY_NUM) {
+                int32_t value = 0;
+                status = answer_qry(qry_at_bit[x], qry_many->motor, &value, snapshot);
+                if (status == STATUS_OK) {
+                    rsp_many->value[x] = value;
+                    rsp_many->answered |= (uint16_t) (1U << x);
                 }
             }
+            if ((status != STATUS_OK) && (rsp_many->status == STATUS_OK)) {
+                rsp_many->status = status;
+            }
         }
-
-        PRODUCTION_CONTEXT_UNLOCK(context->lock, "monitor_task() 2");
-
-        esp_task_wdt_reset();
-
-        vTaskDelay(pdMS_TO_TICKS(100));
     }
-
-    esp_task_wdt_delete(NULL);
-    vTaskDelete(NULL);
 }
 
-#endif // #if defined(CONFIG_STEPPER_PRODUCTION_MODE)
-
-/* ----------------------------------------------------------------
- * STATIC FUNCTIONS: PRODUCTION MODE
- * -------------------------------------------------------------- */
-
-#if defined(CONFIG_STEPPER_PRODUCTION_MODE)
-
-// Answer a query, updating the current state as we go.
-// IMPORTANT: the production context should be locked before this is called.
-static int32_t answer_qry(qry_t qry, int32_t *value,
-                          context_state_t *context)
+// Send the stats_msg_t that follows the response to a
+// QRY_SYSTEM_STATS.  The CPU load of each task is how far its
+// run-time counter has moved on since the previous query as a
+// share of how far the run-time clock has; on a single core the
+// shares, idle task included, add up to (about) 100%.  The
+// production lock need not be held but, since this keeps the
+// counters of the previous query, only comms_rx_task() may call it.
+static void stats_send(context_production_t *context, uint8_t reference)
 {
-    status_t status = STATUS_ERROR_INVALID_QUERY;
+    context_stats_t *stats = &context->context_stats;
+    context_tx_t *tx = &context->context_tx;
+    TaskHandle_t task_handle[STATS_TASK_NUM] = {
+        [STATS_TASK_PRODUCTION] = context->task_handle_production,
+        [STATS_TASK_MONITOR] = context->task_handle_monitor,
+        [STATS_TASK_COMMS_RX] = context->task_handle_comms_rx,
+        [STATS_TASK_COMMS_TX] = context->task_handle_comms_tx,
+        [STATS_TASK_TELEMETRY] = context->task_handle_telemetry,
+#  if defined CONFIG_STEPPER_DIAG_PIN && (CONFIG_STEPPER_DIAG_PIN >= 0)
+        [STATS_TASK_STALL] = g_stall_task_handle,
+#  endif
+        [STATS_TASK_ESP_TIMER] = xTaskGetHandle("esp_timer"),
+        [STATS_TASK_IDLE] = xTaskGetIdleTaskHandle()
+    };
+    stats_msg_t msg = {.magic = PROTOCOL_MAGIC_STATS,
+                       .reference = reference};
+    int64_t now = esp_timer_get_time();
+
+    log_get_task_handles(&task_handle[STATS_TASK_LOG_RECONNECT],
+                         &task_handle[STATS_TASK_LOG_FLUSH]);
+
+    msg.period_ms = (uint32_t) ((now - stats->time_microseconds) / 1000);
+    stats->time_microseconds = now;
+    msg.heap_free = esp_get_free_heap_size();
+    msg.heap_min_free = esp_get_minimum_free_heap_size();
+    msg.log_dropped_count = log_get_dropped_count();
+    taskENTER_CRITICAL(&tx->mux);
+    msg.tx_dropped_count = tx->dropped_count;
+    taskEXIT_CRITICAL(&tx->mux);
+    msg.tx_retry_count = __atomic_load_n(&tx->retry_count, __ATOMIC_RELAXED);
+
+#  if defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+    uint32_t run_time_total = (uint32_t) portGET_RUN_TIME_COUNTER_VALUE();
+    uint32_t run_time_elapsed = run_time_total - stats->run_time_total;
+    stats->run_time_total = run_time_total;
+#  endif
 
-    switch (qry) {
-        case QRY_SYSTEM_STEPPER_STATE:
-            *value = get_state(context);
-            status = STATUS_OK;
-        break;
-        case QRY_LIFT_SENSOR_DOWN:
-            if (we_are_lift(context->init)) {
-                *value = is_down();
-                status = STATUS_OK;
-            }
-        break;
-        case QRY_LIFT_SENSOR_LIMIT:
-            if (we_are_lift(context->init)) {
-                *value = is_at_limit();
-                status = STATUS_OK;
+    for (size_t x = 0; x < STATS_MAX_TASKS; x++) {
+        msg.cpu_percent[x] = STATS_UNKNOWN_CPU;
+        msg.stack_free[x] = STATS_UNKNOWN_STACK;
+        if ((x < STATS_TASK_NUM) && (task_handle[x] != NULL)) {
+            UBaseType_t stack_free = uxTaskGetStackHighWaterMark(task_handle[x]);
+            msg.stack_free[x] = (stack_free < STATS_UNKNOWN_STACK) ? stack_free : STATS_UNKNOWN_STACK - 1;
+#  if defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+            // A task that has only just appeared is counted
+            // from boot, hence the clamp
+            uint32_t run_time = (uint32_t) ulTaskGetRunTimeCounter(task_handle[x]);
+            if (run_time_elapsed > 0) {
+                uint64_t percent = ((uint64_t) (run_time - stats->run_time[x]) * 100) / run_time_elapsed;
+                msg.cpu_percent[x] = (uint8_t) ((percent < 100) ? percent : 100);
             }
-        break;
-        case QRY_PLINKY_PLONKY_SENSOR_REFERENCE:
-            if (we_are_plinky_plonky(context->init)) {
-                *value = is_at_reference();
-                status = STATUS_OK;
-            }
-        break;
-        case QRY_DOOR_SENSOR_OPEN:
-            if (we_are_door(context->init)) {
-                *value = is_open();
-                status = STATUS_OK;
-            }
-        break;
-        case QRY_SYSTEM_END:
-        case QRY_STAND_BEGIN:
-        case QRY_STAND_END:
-        case QRY_LIFT_END:
-        case QRY_PLINKY_PLONKY_END:
-        case QRY_DOOR_END:
-            // To keep the compiler happy
-            break;
-        default:
-            ESP_LOGE(TAG, "Unknown query received 0x%04x", qry);
-        break;
+            stats->run_time[x] = run_time;
+#  endif
+        }
     }
 
-    return status;
+    tx_msg(context, (uint8_t *) &msg, sizeof(msg));
 }
 
 // Set socket to non-blocking mode.
@@ -1691,90 +3394,175 @@ static esp_err_t enable_tcp_keepalive(int sock)
    return err;
 }
 
-// Process a buffer of received data, decrementing the contents of
-// *len on return and returning a pointer to a command or
-// query if one is found.  Returns either when a command or a query
-// is found in the buffer or there is no more data to process.
-// IMPORTANT: the production context should be locked before this is called.
-static cmd_or_qry_t *process_rx_data(uint8_t *buffer, int32_t *len,
-                                     context_parser_t *context)
+// Return the length of the received message that begins with
+// the given magic byte, zero if the magic byte is not one that
+// we receive.
+static size_t rx_msg_len(uint8_t magic)
+{
+    size_t msg_len = 0;
+
+    switch (magic) {
+        case PROTOCOL_MAGIC_CMD:
+            msg_len = sizeof(cmd_msg_t);
+        break;
+        case PROTOCOL_MAGIC_QRY:
+            msg_len = sizeof(qry_msg_t);
+        break;
+        case PROTOCOL_MAGIC_QRY_MANY:
+            msg_len = sizeof(qry_many_msg_t);
+        break;
+        default:
+            break;
+    }
+
+    return msg_len;
+}
+
+// Point cmd_or_qry at a complete received message.
+static void set_cmd_or_qry(uint8_t *msg, cmd_or_qry_t *cmd_or_qry)
+{
+    cmd_or_qry->magic = *msg;
+    switch (cmd_or_qry->magic) {
+        case PROTOCOL_MAGIC_CMD:
+            cmd_or_qry->cmd = (cmd_msg_t *) msg;
+        break;
+        case PROTOCOL_MAGIC_QRY:
+            cmd_or_qry->qry = (qry_msg_t *) msg;
+        break;
+        case PROTOCOL_MAGIC_QRY_MANY:
+            cmd_or_qry->qry_many = (qry_many_msg_t *) msg;
+        break;
+        default:
+            break;
+    }
+}
+
+// Process a buffer of received data, advancing *buffer and
+// decrementing *len by the amount processed; returns true, with
+// cmd_or_qry populated, if a command or query is found: call this
+// again until it returns false to get all of the messages in the
+// buffer.  A message that is wholly within the buffer is not
+// copied, cmd_or_qry points into the buffer, hence the buffer must
+// remain untouched until the message has been dealt with; only a
+// message that is split across receives is gathered, in context,
+// which only comms_rx_task() uses.
+static bool process_rx_data(uint8_t **buffer, int32_t *len,
+                            context_parser_t *context,
+                            cmd_or_qry_t *cmd_or_qry)
 {
-    int32_t bytes_processed = 0;
-    cmd_or_qry_t *cmd_or_qry = NULL;
+    bool found = false;
+    size_t msg_len;
+    size_t x;
 
-    while ((bytes_processed < *len) && (cmd_or_qry == NULL)) {
+    while ((*len > 0) && !found) {
         switch (context->msg_parser_state) {
             case MSG_PARSER_STATE_NEED_MAGIC:
             {
-                ESP_LOGD(TAG, "MSG_PARSER_STATE_NEED_MAGIC");
-                context->cmd_or_qry.buffer[context->buffer_index] = buffer[bytes_processed];
-                if (context->cmd_or_qry.buffer[context->buffer_index] == PROTOCOL_MAGIC_CMD) {
-                    context->msg_parser_state = MSG_PARSER_STATE_NEED_CMD_BODY;
-                    context->buffer_index++;
-                } else if (context->cmd_or_qry.buffer[context->buffer_index] == PROTOCOL_MAGIC_QRY) {
-                    context->msg_parser_state = MSG_PARSER_STATE_NEED_QRY_BODY;
-                    context->buffer_index++;
+                msg_len = rx_msg_len(**buffer);
+                if (msg_len == 0) {
+                    LOG_DEFERRED(LOG_WARN, LOG_STRING_RX_UNKNOWN_MAGIC, **buffer);
+                    (*buffer)++;
+                    (*len)--;
+                } else if (*len >= msg_len) {
+                    // The whole message is here, no need to copy it
+                    set_cmd_or_qry(*buffer, cmd_or_qry);
+                    *buffer += msg_len;
+                    *len -= msg_len;
+                    found = true;
                 } else {
-                    ESP_LOGW(TAG, "Received unknown magic byte from host (0x%02x)!",
-                             context->cmd_or_qry.buffer[context->buffer_index]);
+                    // Only the start of the message is here,
+                    // gather the rest of it in the context
+                    memcpy(context->buffer, *buffer, *len);
+                    context->buffer_index = *len;
+                    context->msg_parser_state = MSG_PARSER_STATE_NEED_BODY;
+                    *buffer += *len;
+                    *len = 0;
                 }
             }
             break;
-            case MSG_PARSER_STATE_NEED_CMD_BODY:
+            case MSG_PARSER_STATE_NEED_BODY:
             {
-                ESP_LOGD(TAG, "MSG_PARSER_STATE_NEED_CMD_BODY");
-                context->cmd_or_qry.buffer[context->buffer_index] = buffer[bytes_processed];
-                context->buffer_index++;
-                if (context->buffer_index >= sizeof(cmd_msg_t)) {
-                    context->cmd_or_qry.cmd_not_qry = true;
-                    cmd_or_qry = &(context->cmd_or_qry);
-                    ESP_LOGI(TAG, "Received command 0x%04x, reference %d,"
-                             " parameters 0x%x, 0x%x, 0x%x, 0x%x.",
-                             context->cmd_or_qry.cmd.command,
-                             context->cmd_or_qry.cmd.reference,
-                             context->cmd_or_qry.cmd.param_1,
-                             context->cmd_or_qry.cmd.param_2,
-                             context->cmd_or_qry.cmd.param_3,
-                             context->cmd_or_qry.cmd.param_4);
+                msg_len = rx_msg_len(context->buffer[0]);
+                x = msg_len - context->buffer_index;
+                if (x > *len) {
+                    x = *len;
                 }
-            }
-            break;
-            case MSG_PARSER_STATE_NEED_QRY_BODY:
-            {
-                ESP_LOGD(TAG, "MSG_PARSER_STATE_NEED_QRY_BODY");
-                context->cmd_or_qry.buffer[context->buffer_index] = buffer[bytes_processed];
-                context->buffer_index++;
-                if (context->buffer_index >= sizeof(qry_msg_t)) {
-                    context->cmd_or_qry.cmd_not_qry = false;
-                    cmd_or_qry = &(context->cmd_or_qry);
-                    ESP_LOGI(TAG, "Received query 0x%04x, reference %d.",
-                             context->cmd_or_qry.qry.query,
-                             context->cmd_or_qry.qry.reference);
+                memcpy(context->buffer + context->buffer_index, *buffer, x);
+                context->buffer_index += x;
+                *buffer += x;
+                *len -= x;
+                if (context->buffer_index >= msg_len) {
+                    set_cmd_or_qry(context->buffer, cmd_or_qry);
+                    // Reset the context for next time
+                    context->buffer_index = 0;
+                    context->msg_parser_state = MSG_PARSER_STATE_NEED_MAGIC;
+                    found = true;
                 }
             }
             break;
             default:
                 break;
         }
+    }
 
-        bytes_processed++;
+    if (found) {
+        switch (cmd_or_qry->magic) {
+            case PROTOCOL_MAGIC_CMD:
+                LOG_DEFERRED(LOG_INFO, LOG_STRING_RX_CMD,
+                             cmd_or_qry->cmd->command,
+                             cmd_or_qry->cmd->reference,
+                             cmd_or_qry->cmd->motor,
+                             cmd_or_qry->cmd->param_1,
+                             cmd_or_qry->cmd->param_2,
+                             cmd_or_qry->cmd->param_3,
+                             cmd_or_qry->cmd->param_4);
+            break;
+            case PROTOCOL_MAGIC_QRY:
+                LOG_DEFERRED(LOG_INFO, LOG_STRING_RX_QRY,
+                             cmd_or_qry->qry->query,
+                             cmd_or_qry->qry->reference,
+                             cmd_or_qry->qry->motor);
+            break;
+            case PROTOCOL_MAGIC_QRY_MANY:
+                LOG_DEFERRED(LOG_INFO, LOG_STRING_RX_QRY_MANY,
+                             cmd_or_qry->qry_many->queries,
+                             cmd_or_qry->qry_many->reference,
+                             cmd_or_qry->qry_many->motor);
+            break;
+            default:
+                break;
+        }
     }
 
-    // Decrement the length we were passed by the number of bytes
-    // processed
-    *len -= bytes_processed;
+    return found;
+}
 
-    if (cmd_or_qry) {
-        // Found something: reset context for next time
-        context->buffer_index = 0;
-        context->msg_parser_state = MSG_PARSER_STATE_NEED_MAGIC;
+// Mark the connection to the server as lost and wake up
+// do_production() to re-establish it; the lock must be held.
+static void set_disconnected(context_production_t *context)
+{
+    context->connected = false;
+    if (context->task_handle_production != NULL) {
+        xTaskNotifyGive(context->task_handle_production);
     }
+}
 
-
-    return cmd_or_qry;
+// Mark the connection to the server as lost because of a failure
+// of sock, taking the lock to do so, unless a reconnection has
+// already replaced sock, in which case the failure is of no interest.
+static void rx_set_disconnected(context_production_t *context, int sock)
+{
+    PRODUCTION_CONTEXT_LOCK(context->lock, "rx_set_disconnected()");
+    if (sock == context->socket) {
+        set_disconnected(context);
+    }
+    PRODUCTION_CONTEXT_UNLOCK(context->lock, "rx_set_disconnected()");
 }
 
-// Task to receive comms from the server.
+// Task to receive comms from the server: the production lock is only
+// taken to carry out a command, queries are answered from the
+// snapshot that monitor_task() publishes, hence a query never has to
+// wait for the motor or the sensors to be dealt with.
 static void comms_rx_task(void *arg)
 {
     context_production_t *context = (context_production_t *) arg;
@@ -1789,73 +3577,111 @@ static void comms_rx_task(void *arg)
     // Main command processing loop
     while (context->running) {
 
-        PRODUCTION_CONTEXT_LOCK(context->lock, "comms_rx_task()");
-
         // Use select() to check socket state before recv()
         // this reduces the chances of us getting stuck
         // if the far end doesn't close a socket nicely
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(context->socket, &readfds);
+        int sock = context->socket;
+        int select_ret = 0;
+        // The stages, common to all of the commands received
+        // in one go, that a command goes through before it
+        // is parsed
+        lat_msg_t lat_rx = {0};
+        if (sock >= 0) {
+            fd_set readfds;
+            FD_ZERO(&readfds);
+            FD_SET(sock, &readfds);
+
+            struct timeval tv;
+            tv.tv_sec = 0;
+            tv.tv_usec = 100000; // 100 ms select timeout
+            select_ret = select(sock + 1, &readfds, NULL, NULL, &tv);
+            LATENCY_STAMP(&lat_rx, LAT_STAGE_RX);
+        }
 
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000; // 100 ms select timeout
-        int select_ret = select(context->socket + 1, &readfds, NULL, NULL, &tv);
         if (select_ret < 0) {
             // select error - connection likely dead
             ESP_LOGE(TAG, "select() failed: %d (%s)!", errno, strerror(errno));
-            context->connected = false;
-        } else if (select_ret == 0) {
-            // No data available, still connected
-        } else {
-            // We will be receiving either a command or a query
-            uint8_t buffer[PROTOCOL_ESP32_MAX_RX_LEN];
+            rx_set_disconnected(context, sock);
+        } else if (select_ret > 0) {
+            // We will be receiving commands and/or queries; receive
+            // as many as we can in one go.  If a reconnection has
+            // replaced sock since select() then the receive fails
+            // and rx_set_disconnected() ignores the failure
+            uint8_t buffer[RX_BUFFER_SIZE];
             // Non-blocking receive
-            int32_t err = recv(context->socket, &buffer, sizeof(buffer), 0);
+            int32_t err = recv(sock, &buffer, sizeof(buffer), 0);
             if (err > 0) {
                 // Process received data
                 ESP_LOGD(TAG, "Received %d byte(s) from server:", err);
                 char debug_buffer[128];
                 hex_dump_to_buffer(buffer, err, debug_buffer, sizeof(debug_buffer));
                 ESP_LOGD(TAG, "%s", debug_buffer);
-                while (err > 0) {
-                    cmd_or_qry_t *cmd_or_qry = process_rx_data(buffer, &err, &context->context_parser);
-                    if (cmd_or_qry) {
-                        bool and_reboot = false;
-                        if (!cmd_or_qry->cmd_not_qry) {
-                            // Got a query, get the answer
-                            int32_t value = 0;
-                            rsp.reference = cmd_or_qry->qry.reference;
-                            rsp.cmd_or_qry = cmd_or_qry->qry.query;
-                            rsp.status = answer_qry(cmd_or_qry->qry.query, &value,
-                                                    &context->context_state);
-                            rsp.value = value;
-                            ESP_LOGI(TAG, "Sending query response 0x%04x, reference %d.",
-                                     rsp.value, rsp.reference);
-                        } else {
-                            // Got a command: set it in motion
-                            rsp.reference = cmd_or_qry->cmd.reference;
-                            rsp.cmd_or_qry = cmd_or_qry->cmd.command;
-                            rsp.status = do_cmd(&cmd_or_qry->cmd, context, &and_reboot);
+                uint8_t *p = buffer;
+                cmd_or_qry_t cmd_or_qry = {0};
+                context_snapshot_t snapshot;
+                lat_msg_t lat;
+                while (process_rx_data(&p, &err, &context->context_parser, &cmd_or_qry)) {
+                    bool and_reboot = false;
+                    if (cmd_or_qry.magic == PROTOCOL_MAGIC_QRY_MANY) {
+                        // Got several queries, answer them all at once
+                        rsp_many_msg_t rsp_many;
+                        snapshot_read(&context->context_snapshot, &snapshot);
+                        answer_qry_many(cmd_or_qry.qry_many, &rsp_many, &snapshot);
+                        tx_msg(context, (uint8_t *) &rsp_many, sizeof(rsp_many));
+                        continue;
+                    }
+                    if (cmd_or_qry.magic == PROTOCOL_MAGIC_QRY) {
+                        // Got a query, get the answer
+                        int32_t value = 0;
+                        snapshot_read(&context->context_snapshot, &snapshot);
+                        rsp.reference = cmd_or_qry.qry->reference;
+                        rsp.cmd_or_qry = cmd_or_qry.qry->query;
+                        rsp.status = answer_qry(cmd_or_qry.qry->query,
+                                                cmd_or_qry.qry->motor, &value,
+                                                &snapshot);
+                        rsp.value = value;
+                        ESP_LOGI(TAG, "Sending query response 0x%04x, reference %d.",
+                                 rsp.value, rsp.reference);
+                        tx_msg(context, (uint8_t *) &rsp, sizeof(rsp));
+                        if ((rsp.cmd_or_qry == QRY_SYSTEM_STATS) &&
+                            (rsp.status == STATUS_OK)) {
+                            stats_send(context, rsp.reference);
                         }
-                        // Send the response.
-                        send_tx_data((uint8_t *) &rsp, sizeof(rsp), context->socket);
-                        if (and_reboot) {
-                            // Goin' down...
-                            ESP_LOGW(TAG, "Rebooting in a few seconds...");
-                            vTaskDelay(pdMS_TO_TICKS(2000));
-                            tmc2209_deinit();
-                            log_deinit();
-                            network_deinit();
-                            esp_restart();
+                    } else {
+                        // Got a command: set it in motion
+                        lat = lat_rx;
+                        PRODUCTION_CONTEXT_LOCK(context->lock, "comms_rx_task()");
+                        LATENCY_STAMP(&lat, LAT_STAGE_LOCKED);
+                        lat.cmd_or_ind = cmd_or_qry.cmd->command;
+                        lat.reference = cmd_or_qry.cmd->reference;
+                        LATENCY_STAMP(&lat, LAT_STAGE_PARSED);
+                        rsp.reference = cmd_or_qry.cmd->reference;
+                        rsp.cmd_or_qry = cmd_or_qry.cmd->command;
+                        rsp.status = STATUS_ERROR_INVALID_PARAM;
+                        if (cmd_or_qry.cmd->motor < STEPPER_MOTOR_COUNT) {
+                            rsp.status = do_cmd(cmd_or_qry.cmd, context, &lat, &and_reboot);
                         }
+                        // Let queries see what the command has done
+                        snapshot_publish(context);
+                        // Send the response
+                        tx_msg(context, (uint8_t *) &rsp, sizeof(rsp));
+                        LATENCY_RSP_QUEUED(context, &lat);
+                        PRODUCTION_CONTEXT_UNLOCK(context->lock, "comms_rx_task()");
+                    }
+                    if (and_reboot) {
+                        // Goin' down...
+                        ESP_LOGW(TAG, "Rebooting in a few seconds...");
+                        vTaskDelay(pdMS_TO_TICKS(2000));
+                        tmc2209_deinit();
+                        log_deinit();
+                        network_deinit();
+                        esp_restart();
                     }
                 }
             } else if (err == 0) {
                 // Connection closed by peer
                 ESP_LOGI(TAG, "Connection closed by peer!");
-                context->connected = false;
+                rx_set_disconnected(context, sock);
             } else {
                 // Error or would block
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -1866,18 +3692,17 @@ static void comms_rx_task(void *arg)
                 } else {
                     // Real error occurred
                     ESP_LOGE(TAG, "recv() failed %d (%s)!", errno, strerror(errno));
-                    context->connected = false;
+                    rx_set_disconnected(context, sock);
                 }
             }
         }
 
-        PRODUCTION_CONTEXT_UNLOCK(context->lock, "comms_rx_task()");
-
         esp_task_wdt_reset();
 
         if (!context->connected) {
-            // Wait for a reconnection
-            vTaskDelay(pdMS_TO_TICKS(2000));
+            // Wait for a reconnection, which do_production() will
+            // be getting on with
+            vTaskDelay(pdMS_TO_TICKS(RECONNECT_BACKOFF_MIN_MS));
         } else {
             // Just a short delay
             vTaskDelay(pdMS_TO_TICKS(WATCHDOG_FEED_TIME_MS));
@@ -1892,40 +3717,271 @@ static void comms_rx_task(void *arg)
     vTaskDelete(NULL);
 }
 
-// Debounce a single pin.
-static void debounce_pin(gpio_num_t pin, size_t *triggered_count)
+// Task to send comms to the server: takes what has been put into
+// the transmit ring by tx_msg() and sends it, as few send()s as
+// possible, so that no-one else ever has to wait on the network.
+// Anything that is for the UDP channel, if there is one, is sent
+// as a datagram ahead of what goes on the TCP connection.
+static void comms_tx_task(void *arg)
 {
-    if (!gpio_get_level(pin)) {
-        // The sensor is pulled low
-        (*triggered_count)++;
-        if ((*triggered_count) > DEBOUNCE_THRESHOLD) {
-            // For the unlikely case of a wrap
-            (*triggered_count) = DEBOUNCE_THRESHOLD;
+    context_production_t *context = (context_production_t *) arg;
+    context_tx_t *tx = &context->context_tx;
+    // Static to keep it off this task's stack
+    static uint8_t buffer[(TX_COALESCE_MAX + TX_DROPPED_IND_MAX) * sizeof(tx->ring[0].buffer)];
+    uint32_t dropped_count_reported = 0;
+
+    // Allow us to feed the watchdog
+    esp_task_wdt_add(NULL);
+
+    while (context->running) {
+
+        // Wait for tx_msg() to tell us there is something to send
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TX_IDLE_PERIOD_MS));
+
+        size_t count;
+        do {
+            size_t len = 0;
+            size_t count_tcp = 0;
+            count = 0;
+            uint32_t read_index = tx->read_index;
+            uint32_t write_index = __atomic_load_n(&tx->write_index, __ATOMIC_ACQUIRE);
+            for (; (read_index != write_index) && (count < TX_COALESCE_MAX);
+                 read_index++, count++) {
+                tx_msg_t *msg = &(tx->ring[read_index % TX_RING_LENGTH]);
+                if (!UDP_ADD(context, msg->buffer, msg->length)) {
+                    memcpy(buffer + len, msg->buffer, msg->length);
+                    len += msg->length;
+                    count_tcp++;
+                }
+            }
+            // Give the space back to the producer
+            __atomic_store_n(&tx->read_index, read_index, __ATOMIC_RELEASE);
+            if (read_index == write_index) {
+                // The ring is empty, now send the latest of anything
+                // that was dropped, taking a copy so as not to send
+                // a datagram with mux held
+                ind_msg_t dropped_ind[TX_DROPPED_IND_MAX];
+                size_t dropped_ind_count;
+                taskENTER_CRITICAL(&tx->mux);
+                dropped_ind_count = tx->dropped_ind_count;
+                memcpy(dropped_ind, tx->dropped_ind, dropped_ind_count * sizeof(dropped_ind[0]));
+                tx->dropped_ind_count = 0;
+                taskEXIT_CRITICAL(&tx->mux);
+                for (size_t x = 0; x < dropped_ind_count; x++) {
+                    if (!UDP_ADD(context, (uint8_t *) &(dropped_ind[x]), sizeof(dropped_ind[x]))) {
+                        memcpy(buffer + len, &(dropped_ind[x]), sizeof(dropped_ind[x]));
+                        len += sizeof(dropped_ind[x]);
+                        count_tcp++;
+                    }
+                    count++;
+                }
+            }
+            UDP_SEND(context);
+            if (len > 0) {
+                // Anything queued for a connection that has
+                // since gone is of no use to anyone
+                if (!context->connected ||
+                    (send_tx_data(buffer, len, context->socket, &tx->retry_count) != ESP_OK)) {
+                    taskENTER_CRITICAL(&tx->mux);
+                    tx->dropped_count += count_tcp;
+                    taskEXIT_CRITICAL(&tx->mux);
+                }
+            }
+        } while (count > 0);
+
+        if (tx->dropped_count != dropped_count_reported) {
+            ESP_LOGW(TAG, "%d message(s) to the server dropped so far.",
+                     tx->dropped_count);
+            dropped_count_reported = tx->dropped_count;
         }
+
+        esp_task_wdt_reset();
+    }
+
+    esp_task_wdt_delete(NULL);
+    vTaskDelete(NULL);
+}
+
+// Timer callback for CMD_STEPPER_START_AT: wake up monitor_task(),
+// whose handle is at arg, to start the targets.
+static void start_at_callback(void *arg)
+{
+    TaskHandle_t *task_handle = (TaskHandle_t *) arg;
+
+    // This is called from the esp_timer task, not an ISR, so
+    // the plain task notification API is fine here
+    if (*task_handle != NULL) {
+        xTaskNotifyGive(*task_handle);
+    }
+}
+
+// Interrupt handler for an edge on a sensor pin: stop listening
+// to the pin, since it may well be bouncing, and start the timer
+// that debounces it.
+static void debounce_interrupt_handler(void *handler_arg)
+{
+    context_debounce_pin_t *context = (context_debounce_pin_t *) handler_arg;
+
+    gpio_intr_disable(context->pin);
+    context->stable_count = 0;
+    esp_timer_start_once(context->timer_handle, DEBOUNCE_CHECK_PERIOD_US);
+}
+
+// Debounce timer callback function for a single sensor pin in
+// production; if the debounced state of the sensor changes the
+// monitor task is notified so that it can send indications and
+// stop the motor without waiting.
+static void debounce_timer_callback(void *arg)
+{
+    context_debounce_pin_t *context = (context_debounce_pin_t *) arg;
+    int level = gpio_get_level(context->pin);
+
+    if (level == context->level) {
+        context->stable_count++;
     } else {
-        // Not open, reset the count
-        (*triggered_count) = 0;
+        context->level = level;
+        context->stable_count = 1;
+    }
+
+    if (context->stable_count >= DEBOUNCE_THRESHOLD) {
+        // The sensors are pulled low when triggered
+        bool triggered = (level == 0);
+        if (triggered != context->triggered) {
+            context->triggered = triggered;
+            // This is called from the esp_timer task, not an ISR, so
+            // the plain task notification API is fine here
+            if ((context->task_handle_notify != NULL) &&
+                (*context->task_handle_notify != NULL)) {
+                xTaskNotifyGive(*context->task_handle_notify);
+            }
+        }
+        // Go back to waiting for an edge; should the pin have
+        // moved before the interrupt was re-enabled there will
+        // be no edge to see, hence check it here (if the interrupt
+        // handler got there first the timer is already running
+        // and this will do nothing)
+        gpio_intr_enable(context->pin);
+        if (gpio_get_level(context->pin) != level) {
+            esp_timer_start_once(context->timer_handle, DEBOUNCE_CHECK_PERIOD_US);
+        }
+    } else {
+        esp_timer_start_once(context->timer_handle, DEBOUNCE_CHECK_PERIOD_US);
     }
 }
 
-// Debounce timer callback function for debouncing all of the
-// sensors in production.
-static void debounce_callback(void* arg)
+// Remove the sensor pin interrupts and timers set up by
+// debounce_init().
+static void debounce_deinit(context_debounce_t *context)
 {
-    context_debounce_t *context = (context_debounce_t *) arg;
+    for (size_t x = 0; x < DEBOUNCE_SENSOR_NUM; x++) {
+        context_debounce_pin_t *sensor = &(context->sensor[x]);
+        if (sensor->timer_handle != NULL) {
+            gpio_set_intr_type(sensor->pin, GPIO_INTR_DISABLE);
+            gpio_isr_handler_remove(sensor->pin);
+            esp_timer_stop(sensor->timer_handle);
+            esp_timer_delete(sensor->timer_handle);
+            sensor->timer_handle = NULL;
+        }
+        sensor->debounced = NULL;
+    }
+}
 
-#  if defined(CONFIG_STEPPER_LIFT_LIMIT_PIN) && (CONFIG_STEPPER_LIFT_LIMIT_PIN >= 0)
-    debounce_pin(CONFIG_STEPPER_LIFT_LIMIT_PIN, &context->triggered_count_is_at_limit);
-#  endif
-#  if defined(CONFIG_STEPPER_LIFT_DOWN_PIN) && (CONFIG_STEPPER_LIFT_DOWN_PIN >= 0)
-    debounce_pin(CONFIG_STEPPER_LIFT_DOWN_PIN, &context->triggered_count_is_down);
-#  endif
-#  if defined(CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN) && (CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN >= 0)
-    debounce_pin(CONFIG_STEPPER_PLINKY_PLONKY_REFERENCE_PIN, &context->triggered_count_is_at_reference);
-#  endif
-#  if defined(CONFIG_STEPPER_DOOR_OPEN_PIN) && (CONFIG_STEPPER_DOOR_OPEN_PIN >= 0)
-    debounce_pin(CONFIG_STEPPER_DOOR_OPEN_PIN, &context->triggered_count_is_open);
-#  endif
+// Return the sensor that already debounces a pin, looking at all
+// of the sensors of the motors before this one and the sensors of
+// this motor before this sensor, NULL if there is none.
+static context_debounce_pin_t *debounce_find(gpio_num_t pin, size_t motor,
+                                             size_t sensor)
+{
+    for (size_t m = 0; m <= motor; m++) {
+        context_debounce_t *context = &g_context_production.context_debounce[m];
+        for (size_t x = 0; (x < DEBOUNCE_SENSOR_NUM) && ((m < motor) || (x < sensor)); x++) {
+            context_debounce_pin_t *candidate = &(context->sensor[x]);
+            if ((candidate->pin == pin) && (candidate->debounced == candidate)) {
+                return candidate;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Set up debouncing of whichever sensor pins of a motor are
+// present: each gets an interrupt on either edge and a one-shot
+// timer, the timer being started here to establish the initial
+// state of the sensor.  Nothing is woken up while the sensors are
+// still.  Only motor 0 has the lift and plinky-plonky sensors.  A
+// sensor on the same pin as one that is already set up, of this
+// motor or of an earlier one, shares the debouncing of that one;
+// the motors must hence be set up in order, starting with motor 0.
+static esp_err_t debounce_init(context_debounce_t *context, size_t motor,
+                               TaskHandle_t *task_handle_notify)
+{
+    bool first = (motor == 0);
+    const gpio_num_t pin[DEBOUNCE_SENSOR_NUM] = {
+        [DEBOUNCE_SENSOR_IS_DOWN] = first ? DEBOUNCE_PIN_IS_DOWN : GPIO_NUM_NC,
+        [DEBOUNCE_SENSOR_IS_AT_LIMIT] = first ? DEBOUNCE_PIN_IS_AT_LIMIT : GPIO_NUM_NC,
+        [DEBOUNCE_SENSOR_IS_AT_REFERENCE] = first ? DEBOUNCE_PIN_IS_AT_REFERENCE : GPIO_NUM_NC,
+        [DEBOUNCE_SENSOR_IS_OPEN] = g_motor_pins[motor].door_open
+    };
+    esp_err_t err = ESP_OK;
+
+    for (size_t x = 0; (x < DEBOUNCE_SENSOR_NUM) && (err == ESP_OK); x++) {
+        context_debounce_pin_t *sensor = &(context->sensor[x]);
+        sensor->pin = pin[x];
+        sensor->debounced = sensor;
+        sensor->timer_handle = NULL;
+        sensor->task_handle_notify = task_handle_notify;
+        sensor->level = -1;
+        sensor->stable_count = 0;
+        sensor->triggered = false;
+        context_debounce_pin_t *debounced = NULL;
+        if (sensor->pin != GPIO_NUM_NC) {
+            debounced = debounce_find(sensor->pin, motor, x);
+        }
+        if (debounced != NULL) {
+            // Another sensor is on this pin, which can only have
+            // one interrupt handler: share the state of that one
+            sensor->debounced = debounced;
+            ESP_LOGI(TAG, "Motor %d sensor %d shares pin %d.", (int) motor, (int) x,
+                     sensor->pin);
+        } else if (sensor->pin != GPIO_NUM_NC) {
+            esp_timer_create_args_t timer_args = {
+                .callback = debounce_timer_callback,
+                .arg = (void *) sensor,
+                .dispatch_method = ESP_TIMER_TASK,
+                .name = "debounce",
+                .skip_unhandled_events = false
+            };
+            err = esp_timer_create(&timer_args, &sensor->timer_handle);
+            if (err == ESP_OK) {
+                err = gpio_install_isr_service(0);
+                // ESP_ERR_INVALID_STATE means the ISR service was already installed
+                if ((err == ESP_OK) || (err == ESP_ERR_INVALID_STATE)) {
+                    err = gpio_set_intr_type(sensor->pin, GPIO_INTR_ANYEDGE);
+                }
+            }
+            if (err == ESP_OK) {
+                err = gpio_isr_handler_add(sensor->pin, debounce_interrupt_handler,
+                                           (void *) sensor);
+            }
+            if (err == ESP_OK) {
+                // Adding the handler enables the interrupt: disable
+                // it again, the timer enables it once it has a stable
+                // reading
+                err = gpio_intr_disable(sensor->pin);
+            }
+            if (err == ESP_OK) {
+                err = esp_timer_start_once(sensor->timer_handle,
+                                           DEBOUNCE_CHECK_PERIOD_US);
+            }
+        }
+    }
+
+    if (err != ESP_OK) {
+        debounce_deinit(context);
+    }
+
+    return err;
 }
 
 // Create a socket and form a TCP connection to the given server/port.
@@ -1971,90 +4027,195 @@ static esp_err_t connect_to_server(const char *server_ip, uint16_t port,
     return err;
 }
 
+#  if defined(CONFIG_STEPPER_UDP)
+
+// Create a UDP socket and connect it to the given server/port, so
+// that it only need be given to send().
+static esp_err_t connect_udp_to_server(const char *server_ip, uint16_t port, int *sock)
+{
+    esp_err_t err = ESP_FAIL;
+    struct sockaddr_in server = {0};
+
+    *sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (*sock >= 0) {
+        server.sin_family = AF_INET;
+        server.sin_port = htons(port);
+        inet_pton(AF_INET, server_ip, &server.sin_addr);
+        if (connect(*sock, (struct sockaddr *) &server, sizeof(server)) == 0) {
+            // Never wait in a send(), a datagram that can't be
+            // sent straight away is simply lost
+            err = set_socket_non_blocking(*sock);
+        } else {
+            ESP_LOGE(TAG, "Failed to connect UDP socket %d (%s)!", errno, strerror(errno));
+        }
+        if (err != ESP_OK) {
+            close(*sock);
+            *sock = -1;
+        }
+    } else {
+        ESP_LOGE(TAG, "Unable to create UDP socket %d (%s)!", errno, strerror(errno));
+    }
+
+    return err;
+}
+
+#  endif // #if defined(CONFIG_STEPPER_UDP)
+
+// Return how long to wait before the next attempt to connect to
+// the server and double *backoff_ms for the time after: the wait
+// is somewhere between half and all of *backoff_ms.
+static int32_t reconnect_backoff(int32_t *backoff_ms)
+{
+    int32_t half_ms = *backoff_ms / 2;
+    int32_t wait_ms = half_ms + (int32_t) (esp_random() % (uint32_t) (half_ms + 1));
+
+    *backoff_ms *= 2;
+    if (*backoff_ms > RECONNECT_BACKOFF_MAX_MS) {
+        *backoff_ms = RECONNECT_BACKOFF_MAX_MS;
+    }
+
+    return wait_ms;
+}
+
+// Connect (or reconnect) to the server, closing any previous
+// socket, trying again with back-off until it works.
+static void connect_to_server_with_backoff(context_production_t *context,
+                                           const char *server_ip, uint16_t port)
+{
+    int32_t backoff_ms = RECONNECT_BACKOFF_MIN_MS;
+    int32_t wait_ms;
+
+    while (!context->connected) {
+
+        PRODUCTION_CONTEXT_LOCK(context->lock, "connect_to_server_with_backoff()");
+
+        // Close old socket if it exists
+        if (context->socket >= 0) {
+            close(context->socket);
+            context->socket = -1;
+        }
+#  if defined(CONFIG_STEPPER_UDP)
+        if (context->context_udp.socket >= 0) {
+            close(context->context_udp.socket);
+            context->context_udp.socket = -1;
+        }
+#  endif
+
+        // Create new connection
+        if (connect_to_server(server_ip, port, &context->socket,
+                              &context->server) == ESP_OK) {
+            context->connected = true;
+#  if defined(CONFIG_STEPPER_UDP)
+            // Without the UDP channel everything just goes over TCP
+            if (connect_udp_to_server(server_ip, CONFIG_STEPPER_PRODUCTION_UDP_PORT,
+                                      &context->context_udp.socket) != ESP_OK) {
+                ESP_LOGW(TAG, "No UDP channel, sending everything over TCP.");
+            }
+#  endif
+        }
+
+        PRODUCTION_CONTEXT_UNLOCK(context->lock, "connect_to_server_with_backoff()");
+
+        if (!context->connected) {
+            wait_ms = reconnect_backoff(&backoff_ms);
+            ESP_LOGE(TAG, "Unable to connect to server, trying again in %d ms.", wait_ms);
+            vTaskDelay(pdMS_TO_TICKS(wait_ms) + 1);
+        }
+        esp_task_wdt_reset();
+    }
+}
+
 // Production mode.
 static void do_production(const char *server_ip, uint16_t port)
 {
-    context_debounce_t *context_debounce = &g_context_production.context_debounce;
     esp_err_t err = ESP_FAIL;
+#if defined(STEPPER_ROLE_INIT)
+    // We can only be the one thing
+    state_t init = (state_t) STEPPER_ROLE_INIT;
+#else
+    // Carry on being whatever we were before a restart; the server
+    // will tell us again in any case
+    state_t init = init_load();
+#endif
+
+    ESP_LOGI(TAG, "PRODUCTION MODE, %d motor(s)", STEPPER_MOTOR_COUNT);
 
-    ESP_LOGI(TAG, "PRODUCTION MODE");
+    g_context_production.socket = -1;
+#  if defined(CONFIG_STEPPER_UDP)
+    g_context_production.context_udp.socket = -1;
+#  endif
+    g_context_production.task_handle_production = xTaskGetCurrentTaskHandle();
+    portMUX_INITIALIZE(&g_context_production.context_tx.mux);
+
+    for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+        g_context_production.context_state[motor].motor = motor;
+        g_context_production.context_state[motor].init = init;
+    }
+    if (init != STATE_NULL) {
+        ESP_LOGI(TAG, "Resuming as 0x%04x.", init);
+    }
+    profile_load(&g_context_production.context_profile);
 
     // Create mutex
     if (!g_context_production.lock) {
         g_context_production.lock = xSemaphoreCreateMutex();
     }
-    if (g_context_production.lock) {
+    if (!g_context_production.lock_tlm) {
+        g_context_production.lock_tlm = xSemaphoreCreateMutex();
+    }
+    if (g_context_production.lock && g_context_production.lock_tlm) {
 
         PRODUCTION_CONTEXT_LOCK(g_context_production.lock, "do_production() 1");
 
-        // Start a timer to read the sensor pins and debounce them
-        context_debounce->timer_args.callback = debounce_callback;
-        context_debounce->timer_args.arg = (void *) &g_context_production.context_debounce;
-        context_debounce->timer_args.dispatch_method = ESP_TIMER_TASK;
-        context_debounce->timer_args.name = "debounce";
-        context_debounce->timer_args.skip_unhandled_events = false;
-        context_debounce->timer_handle = NULL;
-        err = esp_timer_create(&context_debounce->timer_args,
-                               &context_debounce->timer_handle);
-        if (err == ESP_OK) {
-            err = esp_timer_start_periodic(context_debounce->timer_handle,
-                                           DEBOUNCE_CHECK_PERIOD_US);
-        }
-        if (err == ESP_OK) {
-            // Create a TCP socket for comms with the server
-            err = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        }
-        if (err >= 0) {
-            g_context_production.socket = err;
-
-            err = connect_to_server(server_ip, port,
-                                    &g_context_production.socket,
-                                    &g_context_production.server);
+        // Set up interrupts and timers to debounce the sensor pins
+        // of each motor
+        err = ESP_OK;
+        for (size_t motor = 0; (motor < STEPPER_MOTOR_COUNT) && (err == ESP_OK); motor++) {
+            err = debounce_init(&g_context_production.context_debounce[motor], motor,
+                                &g_context_production.task_handle_monitor);
             if (err == ESP_OK) {
-                g_context_production.connected = true;
-                g_context_production.running = true;
+                // ...and the timer for CMD_STEPPER_START_AT
+                esp_timer_create_args_t timer_args = {
+                    .callback = start_at_callback,
+                    .arg = (void *) &g_context_production.task_handle_monitor,
+                    .dispatch_method = ESP_TIMER_TASK,
+                    .name = "start at",
+                    .skip_unhandled_events = false
+                };
+                err = esp_timer_create(&timer_args,
+                                       &g_context_production.context_state[motor].timer_handle_start_at);
             }
         }
 
         PRODUCTION_CONTEXT_UNLOCK(g_context_production.lock, "do_production() 1");
 
+        if (err == ESP_OK) {
+            // The server may well not be there yet, e.g. if we have
+            // all just been switched on, so keep trying
+            connect_to_server_with_backoff(&g_context_production, server_ip, port);
+            g_context_production.running = true;
+        }
+
         // Start tasks to receive comms from the server and monitor the operation of commands
         if (g_context_production.connected &&
             (xTaskCreate(&monitor_task, "monitor_task", 1024 * 4, &g_context_production, 5, &g_context_production.task_handle_monitor) == pdPASS) &&
-            (xTaskCreate(&comms_rx_task, "comms_rx_task", 1024 * 4, &g_context_production, 5, &g_context_production.task_handle_comms_rx) == pdPASS)) {
+            (xTaskCreate(&comms_tx_task, "comms_tx_task", 1024 * 4, &g_context_production, 5, &g_context_production.task_handle_comms_tx) == pdPASS) &&
+            (xTaskCreate(&comms_rx_task, "comms_rx_task", 1024 * 4, &g_context_production, 5, &g_context_production.task_handle_comms_rx) == pdPASS) &&
+            (xTaskCreate(&telemetry_task, "telemetry_task", 1024 * 3, &g_context_production, 4, &g_context_production.task_handle_telemetry) == pdPASS)) {
 
             ESP_LOGI(TAG, "Waiting for commands from server.");
 
             while(1) {
 
                 flash_debug_led(DEBUG_LED_SHORT_MS);
-                vTaskDelay(pdMS_TO_TICKS(1000));
+                // Wait for a second, or to be told that the
+                // connection has been lost, whichever is sooner
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
 
                 if (!g_context_production.connected) {
                     ESP_LOGE(TAG, "Reconnecting to server after error!");
-
-                    PRODUCTION_CONTEXT_LOCK(g_context_production.lock, "do_production() 2");
-
-                    // Close old socket if it exists
-                    if (g_context_production.socket >= 0) {
-                        close(g_context_production.socket);
-                        g_context_production.socket = -1;
-                    }
-
-                    // Create new connection
-                    err = connect_to_server(server_ip, port,
-                                            &g_context_production.socket,
-                                            &g_context_production.server);
-                    if (err == ESP_OK) {
-                        g_context_production.connected = true;
-                        ESP_LOGI(TAG, "Reconnected.");
-                    } else {
-                        ESP_LOGE(TAG, "Unable to reconnect to server!");
-                    }
-
-                    PRODUCTION_CONTEXT_UNLOCK(g_context_production.lock, "do_production() 2");
-
-                    vTaskDelay(pdMS_TO_TICKS(2000));
+                    connect_to_server_with_backoff(&g_context_production, server_ip, port);
+                    ESP_LOGI(TAG, "Reconnected.");
                 }
                 esp_task_wdt_reset();
             }
@@ -2067,18 +4228,37 @@ static void do_production(const char *server_ip, uint16_t port)
 
         close(g_context_production.socket);
         g_context_production.socket = -1;
+#  if defined(CONFIG_STEPPER_UDP)
+        if (g_context_production.context_udp.socket >= 0) {
+            close(g_context_production.context_udp.socket);
+            g_context_production.context_udp.socket = -1;
+        }
+#  endif
 
         if (g_context_production.task_handle_comms_rx) {
             vTaskDelete(g_context_production.task_handle_comms_rx);
         }
 
+        if (g_context_production.task_handle_comms_tx) {
+            vTaskDelete(g_context_production.task_handle_comms_tx);
+        }
+
         if (g_context_production.task_handle_monitor) {
             vTaskDelete(g_context_production.task_handle_monitor);
         }
 
-        if (context_debounce->timer_handle != NULL) {
-            esp_timer_stop(context_debounce->timer_handle);
-            esp_timer_delete(context_debounce->timer_handle);
+        if (g_context_production.task_handle_telemetry) {
+            vTaskDelete(g_context_production.task_handle_telemetry);
+        }
+
+        for (size_t motor = 0; motor < STEPPER_MOTOR_COUNT; motor++) {
+            context_state_t *context_state = &g_context_production.context_state[motor];
+            debounce_deinit(&g_context_production.context_debounce[motor]);
+            if (context_state->timer_handle_start_at != NULL) {
+                esp_timer_stop(context_state->timer_handle_start_at);
+                esp_timer_delete(context_state->timer_handle_start_at);
+                context_state->timer_handle_start_at = NULL;
+            }
         }
 
         PRODUCTION_CONTEXT_UNLOCK(g_context_production.lock, "do_production() 3");
@@ -2103,14 +4283,17 @@ void app_main(void)
     if (err == ESP_OK) {
         ESP_LOGI(TAG, "Initialization complete.");
 
-        err = tmc2209_start(TMC2209_ADDRESS, CONFIG_STEPPER_ENABLE_PIN);
+        // Motor n is driven by the TMC2209 at UART address n
+        for (size_t motor = 0; (motor < STEPPER_MOTOR_COUNT) && (err == ESP_OK); motor++) {
+            err = tmc2209_start(motor, g_motor_pins[motor].enable);
 
-        if (err == ESP_OK) {
-            ESP_LOGI(TAG, "Setting TMC2209 %d to full step.", TMC2209_ADDRESS);
-            err = tmc2209_set_microstep_resolution(TMC2209_ADDRESS, 1);
-            if (err >= 0) {
-                ESP_LOGI(TAG, "Microstep resolution is now %d.", err);
-                err = ESP_OK;
+            if (err == ESP_OK) {
+                ESP_LOGI(TAG, "Setting TMC2209 %d to full step.", (int) motor);
+                err = tmc2209_set_microstep_resolution(motor, 1);
+                if (err >= 0) {
+                    ESP_LOGI(TAG, "Microstep resolution is now %d.", err);
+                    err = ESP_OK;
+                }
             }
         }
 
@@ -2183,7 +4366,6 @@ void app_main(void)
 
 #if defined CONFIG_STEPPER_DIAG_PIN && (CONFIG_STEPPER_DIAG_PIN >= 0)
     tmc2209_deinit_stallguard(CONFIG_STEPPER_DIAG_PIN);
-#endif
     if (g_stall_task_handle) {
         vTaskDelete(g_stall_task_handle);
         g_stall_task_handle = NULL;
@@ -2192,6 +4374,10 @@ void app_main(void)
         vSemaphoreDelete(g_diag_semaphore);
         g_diag_semaphore = NULL;
     }
+#endif
+#if defined(STEP_DIR_CONNECTED)
+    motion_deinit();
+#endif
     tmc2209_deinit();
     log_deinit();
     network_deinit();
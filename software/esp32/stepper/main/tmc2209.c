@@ -24,6 +24,8 @@
 
 #include <string.h>
 #include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "errno.h"
 #include "driver/uart.h"
@@ -56,10 +58,43 @@
 // The maximum value of IRUN or IHOLD, which are 5-bit values.
 #define IRUN_OR_IHOLD_MAX 31
 
+// The length of a write datagram.
+#define WRITE_DATAGRAM_LENGTH 8
+
+// How long to wait for the echo of what we sent to come back.
+#define ECHO_TIMEOUT_MS 100
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
 
+// A register write that is waiting in a batch.
+typedef struct {
+    int32_t address;
+    int32_t reg;
+    uint32_t data;
+} batch_entry_t;
+
+// A batch of register writes, see tmc2209_batch_begin().
+typedef struct {
+    bool active;
+    size_t count;
+    batch_entry_t entry[TMC2209_BATCH_MAX_WRITES];
+    uint8_t buffer[TMC2209_BATCH_MAX_WRITES * WRITE_DATAGRAM_LENGTH];
+} batch_t;
+
+// A register that is shadowed, see g_shadow_reg[].
+typedef struct {
+    int32_t reg;
+    bool write_only;
+} shadow_reg_t;
+
+// The shadow of the contents of a register.
+typedef struct {
+    bool valid;
+    uint32_t data;
+} shadow_t;
+
 /* ----------------------------------------------------------------
  * VARIABLES
  * -------------------------------------------------------------- */
@@ -76,9 +111,71 @@ static gpio_num_t g_pin_motor_enable[MAX_NUM_TMC2209];
 // register i.e. 256 is an MRES value of 0, 1 is an MRES value of 8.
 static const int32_t g_microstep_table[] = {256, 128, 64, 32, 16, 8, 4, 2, 1};
 
-// The VACTUAL register is write-only so keep a shadow of it
-// for the purposes of tmc2209_get_velocity().
-static int32_t g_vactual = 0;
+// The registers that we keep a shadow of; the values of the
+// write-only ones can only be known once we have written them.
+static const shadow_reg_t g_shadow_reg[] = {{0x00, false},  // GCONF
+                                            {0x10, true},   // IHOLD_IRUN
+                                            {0x13, true},   // TPWMTHRS
+                                            {0x14, true},   // TCOOLTHRS
+                                            {0x22, true},   // VACTUAL
+                                            {0x40, true},   // SGTHRS
+                                            {0x42, true},   // COOLCONF
+                                            {0x6c, false},  // CHOPCONF
+                                            {0x70, false}}; // PWMCONF
+
+// The shadow of the registers in g_shadow_reg[], for each
+// TMC2209, so that writes which change nothing can be skipped
+// and reads can be served from RAM.
+static shadow_t g_shadow[MAX_NUM_TMC2209][sizeof(g_shadow_reg) / sizeof(g_shadow_reg[0])] = {0};
+
+// Storage for a batch of register writes.
+static batch_t g_batch = {0};
+
+// Mutex so that only one task at a time talks on the UART (and to
+// the shadows or the batch); recursive since a batch holds it from
+// tmc2209_batch_begin() to tmc2209_batch_end().
+static SemaphoreHandle_t g_mutex = NULL;
+
+// Lookup table for the TMC2209 CRC8, polynomial 0x07.  The TMC2209
+// feeds each byte into the CRC LSB first, i.e. reflected, while
+// the CRC register itself is not reflected, so this is the table
+// for the fully reflected form of the polynomial (0xe0): run the
+// bytes through it and reflect the result at the end, see
+// calculate_crc().
+static const uint8_t g_crc_table[256] = {
+    0x00, 0x91, 0xe3, 0x72, 0x07, 0x96, 0xe4, 0x75,
+    0x0e, 0x9f, 0xed, 0x7c, 0x09, 0x98, 0xea, 0x7b,
+    0x1c, 0x8d, 0xff, 0x6e, 0x1b, 0x8a, 0xf8, 0x69,
+    0x12, 0x83, 0xf1, 0x60, 0x15, 0x84, 0xf6, 0x67,
+    0x38, 0xa9, 0xdb, 0x4a, 0x3f, 0xae, 0xdc, 0x4d,
+    0x36, 0xa7, 0xd5, 0x44, 0x31, 0xa0, 0xd2, 0x43,
+    0x24, 0xb5, 0xc7, 0x56, 0x23, 0xb2, 0xc0, 0x51,
+    0x2a, 0xbb, 0xc9, 0x58, 0x2d, 0xbc, 0xce, 0x5f,
+    0x70, 0xe1, 0x93, 0x02, 0x77, 0xe6, 0x94, 0x05,
+    0x7e, 0xef, 0x9d, 0x0c, 0x79, 0xe8, 0x9a, 0x0b,
+    0x6c, 0xfd, 0x8f, 0x1e, 0x6b, 0xfa, 0x88, 0x19,
+    0x62, 0xf3, 0x81, 0x10, 0x65, 0xf4, 0x86, 0x17,
+    0x48, 0xd9, 0xab, 0x3a, 0x4f, 0xde, 0xac, 0x3d,
+    0x46, 0xd7, 0xa5, 0x34, 0x41, 0xd0, 0xa2, 0x33,
+    0x54, 0xc5, 0xb7, 0x26, 0x53, 0xc2, 0xb0, 0x21,
+    0x5a, 0xcb, 0xb9, 0x28, 0x5d, 0xcc, 0xbe, 0x2f,
+    0xe0, 0x71, 0x03, 0x92, 0xe7, 0x76, 0x04, 0x95,
+    0xee, 0x7f, 0x0d, 0x9c, 0xe9, 0x78, 0x0a, 0x9b,
+    0xfc, 0x6d, 0x1f, 0x8e, 0xfb, 0x6a, 0x18, 0x89,
+    0xf2, 0x63, 0x11, 0x80, 0xf5, 0x64, 0x16, 0x87,
+    0xd8, 0x49, 0x3b, 0xaa, 0xdf, 0x4e, 0x3c, 0xad,
+    0xd6, 0x47, 0x35, 0xa4, 0xd1, 0x40, 0x32, 0xa3,
+    0xc4, 0x55, 0x27, 0xb6, 0xc3, 0x52, 0x20, 0xb1,
+    0xca, 0x5b, 0x29, 0xb8, 0xcd, 0x5c, 0x2e, 0xbf,
+    0x90, 0x01, 0x73, 0xe2, 0x97, 0x06, 0x74, 0xe5,
+    0x9e, 0x0f, 0x7d, 0xec, 0x99, 0x08, 0x7a, 0xeb,
+    0x8c, 0x1d, 0x6f, 0xfe, 0x8b, 0x1a, 0x68, 0xf9,
+    0x82, 0x13, 0x61, 0xf0, 0x85, 0x14, 0x66, 0xf7,
+    0xa8, 0x39, 0x4b, 0xda, 0xaf, 0x3e, 0x4c, 0xdd,
+    0xa6, 0x37, 0x45, 0xd4, 0xa1, 0x30, 0x42, 0xd3,
+    0xb4, 0x25, 0x57, 0xc6, 0xb3, 0x22, 0x50, 0xc1,
+    0xba, 0x2b, 0x59, 0xc8, 0xbd, 0x2c, 0x5e, 0xcf
+};
 
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
@@ -95,6 +192,57 @@ static void print_datagram(const char *prefix, uint8_t *p, int32_t length)
     ESP_LOGD(TAG, "%s0x%s (%d byte(s)).", prefix, buffer, length);
 }
 
+// Return the shadow of the given register, NULL if the
+// register is not shadowed.
+static shadow_t *shadow_find(int32_t address, int32_t reg,
+                             bool *write_only)
+{
+    shadow_t *shadow = NULL;
+
+    if ((address >= 0) && (address < MAX_NUM_TMC2209)) {
+        for (size_t x = 0; (x < sizeof(g_shadow_reg) / sizeof(g_shadow_reg[0])) &&
+                           (shadow == NULL); x++) {
+            if (g_shadow_reg[x].reg == reg) {
+                shadow = &(g_shadow[address][x]);
+                if (write_only) {
+                    *write_only = g_shadow_reg[x].write_only;
+                }
+            }
+        }
+    }
+
+    return shadow;
+}
+
+// Forget the shadowed registers of the given TMC2209, or
+// of all of them if address is negative.
+static void shadow_invalidate(int32_t address)
+{
+    for (int32_t a = 0; a < MAX_NUM_TMC2209; a++) {
+        if ((address < 0) || (a == address)) {
+            for (size_t x = 0; x < sizeof(g_shadow[a]) / sizeof(g_shadow[a][0]); x++) {
+                g_shadow[a][x].valid = false;
+            }
+        }
+    }
+}
+
+// Take the mutex, if there is one.
+static void lock()
+{
+    if (g_mutex != NULL) {
+        xSemaphoreTakeRecursive(g_mutex, portMAX_DELAY);
+    }
+}
+
+// Give back the mutex, if there is one.
+static void unlock()
+{
+    if (g_mutex != NULL) {
+        xSemaphoreGiveRecursive(g_mutex);
+    }
+}
+
  // Clean-up on error or completion
 static void cleanup()
 {
@@ -102,6 +250,9 @@ static void cleanup()
         uart_driver_delete((uart_port_t) g_uart);
         g_uart = -1;
     }
+    g_batch.active = false;
+    g_batch.count = 0;
+    shadow_invalidate(-1);
     for (size_t x = 0; x < sizeof(g_pin_motor_enable) / sizeof(g_pin_motor_enable[0]); x++) {
         if (g_pin_motor_enable[x] >= 0) {
             gpio_set_level(g_pin_motor_enable[x], 1);
@@ -138,8 +289,10 @@ static uint32_t endian_convert(uint32_t data)
     return output;
 }
 
-// Calculate the CRC on a datagram
-static uint8_t calculate_crc(uint8_t *p, size_t length)
+// Calculate the CRC on a datagram bit by bit: this is only used
+// as a reference by crc_self_test(), see calculate_crc() for the
+// quick version.
+static uint8_t calculate_crc_bitwise(uint8_t *p, size_t length)
 {
     uint8_t crc = 0;
     uint8_t byte;
@@ -160,72 +313,237 @@ static uint8_t calculate_crc(uint8_t *p, size_t length)
     return crc;
 }
 
-// Write to a TMC2209.  data may be NULL, in which case
-// a read request is sent.  See sections 4.1.1 and 4.1.2
-// of the tMC2209n data sheet:
+// Reverse the order of the bits in a byte.
+static uint8_t reflect(uint8_t byte)
+{
+    byte = ((byte & 0xf0) >> 4) | ((byte & 0x0f) << 4);
+    byte = ((byte & 0xcc) >> 2) | ((byte & 0x33) << 2);
+    byte = ((byte & 0xaa) >> 1) | ((byte & 0x55) << 1);
+
+    return byte;
+}
+
+// Calculate the CRC of a TMC2209 datagram using g_crc_table[].
+static uint8_t calculate_crc(uint8_t *p, size_t length)
+{
+    uint8_t crc = 0;
+
+    for (size_t x = 0; x < length; x++) {
+        crc = g_crc_table[crc ^ *p];
+        p++;
+    }
+
+    return reflect(crc);
+}
+
+// Check that calculate_crc() and calculate_crc_bitwise() agree,
+// for every single byte value and for a pseudo-random sequence of
+// datagram-sized lumps.
+static bool crc_self_test()
+{
+    bool success = true;
+    uint8_t buffer[WRITE_DATAGRAM_LENGTH - 1];
+    uint32_t seed = 0x12345678;
+
+    for (int32_t x = 0; (x < 256) && success; x++) {
+        buffer[0] = (uint8_t) x;
+        success = (calculate_crc(buffer, 1) == calculate_crc_bitwise(buffer, 1));
+    }
+    for (int32_t x = 0; (x < 64) && success; x++) {
+        for (size_t y = 0; y < sizeof(buffer); y++) {
+            // Linear congruential generator, values from Numerical Recipes
+            seed = (seed * 1664525) + 1013904223;
+            buffer[y] = (uint8_t) (seed >> 24);
+        }
+        success = (calculate_crc(buffer, sizeof(buffer)) ==
+                   calculate_crc_bitwise(buffer, sizeof(buffer)));
+    }
+
+    return success;
+}
+
+// Encode a datagram for a TMC2209 into p, which must be at least
+// WRITE_DATAGRAM_LENGTH bytes long, returning the number of bytes
+// encoded.  data may be NULL, in which case a read request is encoded.
+// See sections 4.1.1 and 4.1.2 of the TMC2209 data sheet:
 // https://www.analog.com/media/en/technical-documentation/data-sheets/TMC2209_datasheet_rev1.09.pdf
+static size_t encode_datagram(int32_t address, int32_t reg, uint32_t *data,
+                              uint8_t *p)
+{
+    size_t index = 0;
+
+    *(p + index) = DATAGRAM_SYNC_AND_RESERVED;
+    index++;
+    *(p + index) = address;
+    index++;
+    *(p + index) = reg;
+    if (data != NULL) {
+        *(p + index) = reg | 0x80; // Set top bit if there is data to write
+    }
+    index++;
+    if (data != NULL) {
+        uint32_t buffer = endian_convert(*data);
+        memcpy ((p + index), &buffer, sizeof(buffer));
+        index += sizeof(buffer);
+    }
+    *(p + index) = calculate_crc(p, index);
+    index++;
+
+    return index;
+}
+
+// Send one or more datagrams to the TMC2209s and check that
+// they come back: since the Tx and Rx pins are tied together
+// we will get back what we sent.  Returns the number of bytes
+// sent or negative error code from esp_err_t.
+static esp_err_t send_datagrams(uint8_t *p, size_t length)
+{
+    uint8_t echo[sizeof(g_batch.buffer)];
+
+    print_datagram("Send datagram will be ", p, length);
+    // This function return the number of bytes sent or -1
+    esp_err_t err = uart_write_bytes((uart_port_t) g_uart, p, length);
+    if (err == length) {
+        // Read the echo out now to get it out of the way
+        int32_t read_count = uart_read_bytes((uart_port_t) g_uart, echo,
+                                             length,
+                                             pdMS_TO_TICKS(ECHO_TIMEOUT_MS));
+        if (read_count > 0) {
+            if ((read_count != length) || (memcmp(echo, p, length) != 0)) {
+                print_datagram("Expected to read back what we sent but"
+                               " instead read ", echo, read_count);
+                // Can't be sure what the TMC2209s got
+                shadow_invalidate(-1);
+            }
+        } else {
+            ESP_LOGW(TAG, "Expected to read back what we sent but"
+                     " read returned %d.", read_count);
+        }
+    } else {
+        if (err >= 0) {
+            ESP_LOGE(TAG, "%d byte(s) (of %d) sent.", err, length);
+            err = -ESP_ERR_INVALID_SIZE;
+        } else {
+            ESP_LOGE(TAG, "UART write returned %d.", err);
+            err = -ESP_FAIL;
+        }
+    }
+
+    return err;
+}
+
+// Forget the shadows of the registers in the batch: they are
+// updated as the writes are added to the batch so, if the batch
+// is not sent, they are wrong.
+static void batch_invalidate_shadow()
+{
+    for (size_t x = 0; x < g_batch.count; x++) {
+        shadow_t *shadow = shadow_find(g_batch.entry[x].address,
+                                       g_batch.entry[x].reg, NULL);
+        if (shadow) {
+            shadow->valid = false;
+        }
+    }
+}
+
+// Send any batched register writes.
+static esp_err_t flush_batch()
+{
+    esp_err_t err = ESP_OK;
+
+    if (g_batch.count > 0) {
+        ESP_LOGD(TAG, "Sending batch of %d register write(s).", g_batch.count);
+        err = send_datagrams(g_batch.buffer, g_batch.count * WRITE_DATAGRAM_LENGTH);
+        if (err >= 0) {
+            err = ESP_OK;
+        } else {
+            batch_invalidate_shadow();
+        }
+        g_batch.count = 0;
+    }
+
+    return err;
+}
+
+// Add a register write to the batch, replacing any earlier
+// write to the same register in the same batch, sending the
+// batch if it is full.  Returns the number of data bytes
+// queued or negative error code from esp_err_t.
+static esp_err_t add_to_batch(int32_t address, int32_t reg, uint32_t data)
+{
+    esp_err_t err = ESP_OK;
+    size_t index;
+
+    for (index = 0; (index < g_batch.count) &&
+                    ((g_batch.entry[index].address != address) ||
+                     (g_batch.entry[index].reg != reg)); index++) {
+    }
+    if (index >= TMC2209_BATCH_MAX_WRITES) {
+        err = flush_batch();
+        index = 0;
+    }
+    if (err == ESP_OK) {
+        g_batch.entry[index].address = address;
+        g_batch.entry[index].reg = reg;
+        g_batch.entry[index].data = data;
+        encode_datagram(address, reg, &data,
+                        g_batch.buffer + (index * WRITE_DATAGRAM_LENGTH));
+        if (index >= g_batch.count) {
+            g_batch.count = index + 1;
+        }
+        err = sizeof(data);
+    }
+
+    return err;
+}
+
+// Return the entry in the batch for the given register,
+// NULL if there is none.
+static batch_entry_t *find_in_batch(int32_t address, int32_t reg)
+{
+    batch_entry_t *entry = NULL;
+
+    if (g_batch.active) {
+        for (size_t x = 0; (x < g_batch.count) && (entry == NULL); x++) {
+            if ((g_batch.entry[x].address == address) &&
+                (g_batch.entry[x].reg == reg)) {
+                entry = &(g_batch.entry[x]);
+            }
+        }
+    }
+
+    return entry;
+}
+
+// Write to a TMC2209.  data may be NULL, in which case
+// a read request is sent.  If a batch is active, writes
+// are added to it rather than being sent.
 static esp_err_t write(int32_t address, int32_t reg, uint32_t *data)
 {
-    // Return the number of datagram bytes sent or negative error code from esp_err_t
+    // Return the number of data bytes sent or negative error code from esp_err_t
     esp_err_t err = -ESP_ERR_INVALID_ARG;
-    uint64_t datagram = 0;
 
     ESP_LOGD(TAG, "Sending %d byte(s) of data %sto address %d, register 0x%02x.",
              (data != NULL ? sizeof(*data) : 0),
              (data == NULL ? "(read access request) " : ""), address, reg);
+    lock();
     if ((g_uart >= 0) && (address < 4) && (reg < 128)) {
-        uint8_t *p = (uint8_t *) &datagram;
-        size_t index = 0;
-        *(p + index) = DATAGRAM_SYNC_AND_RESERVED;
-        index++;
-        *(p + index) = address;
-        index++;
-        *(p + index) = reg;
-        if (data != NULL) {
-            *(p + index) = reg | 0x80; // Set top bit if there is data to write
-        }
-        index++;
-        if (data != NULL) {
-            uint32_t buffer = endian_convert(*data);
-            memcpy ((p + index), &buffer, sizeof(buffer));
-            index += sizeof(buffer);
-        }
-        *(p + index) = calculate_crc(p, index);
-        index++;
-        print_datagram("Send datagram will be ", p, index);
-        // This function return the number of bytes sent or -1
-        err = uart_write_bytes((uart_port_t) g_uart, p, index);
-        if (err == index) {
-            // Return the number of _data_ bytes sent
-            err = (data != NULL) ? sizeof(*data) : 0;
-            // Since the Tx and Rx pins are tied together, we will get
-            // back what we sent: read it out now to get it out of
-            // the way
-            uint64_t read = 0;
-            p = (uint8_t *) &read;
-            int32_t read_count = uart_read_bytes((uart_port_t) g_uart, p,
-                                                  index,
-                                                  pdMS_TO_TICKS(100));
-            if (read_count > 0) {
-                if (memcmp(&read, &datagram, index != 0)) {
-                    print_datagram("Expected to read back what we sent but"
-                                   " instead read ", p, read_count);
-                }
-            } else {
-                ESP_LOGW(TAG, "Expected to read back what we sent but"
-                         " read returned %d.", err);
-            }
+        if (g_batch.active && (data != NULL)) {
+            err = add_to_batch(address, reg, *data);
         } else {
+            uint8_t datagram[WRITE_DATAGRAM_LENGTH];
+            size_t length = encode_datagram(address, reg, data, datagram);
+            err = send_datagrams(datagram, length);
             if (err >= 0) {
-                ESP_LOGE(TAG, "%d byte(s) (of %d) sent.", err, index);
-            } else {
-                ESP_LOGE(TAG, "UART write returned %d.", err);
+                // Return the number of _data_ bytes sent
+                err = (data != NULL) ? sizeof(*data) : 0;
             }
-       }
+        }
     } else {
         ESP_LOGE(TAG, "Not initialised or address or register or buffer"
                  " length out of range.");
     }
+    unlock();
 
     return err;
 }
@@ -235,73 +553,118 @@ static esp_err_t write(int32_t address, int32_t reg, uint32_t *data)
 static esp_err_t read(int32_t address, int32_t reg, uint32_t *data)
 {
     uint64_t datagram = 0;
-
-    // Send a read request, which is a write with no data
-    esp_err_t err = write(address, reg, NULL);
-    if (err == 0) {
-        uint8_t *p = (uint8_t *) &datagram;
-        err = uart_read_bytes((uart_port_t) g_uart, p, sizeof(datagram),
-                              pdMS_TO_TICKS(1000));
-        if (err == sizeof(datagram)) {
-            print_datagram("Read datagram was ", p, err);
-            // Check CRC
-            uint8_t crc = calculate_crc(p, sizeof(datagram) - 1);
-            if (crc == *(p + sizeof(datagram) - 1)) {
-                // Return the number of data bytes received
-                err = sizeof(uint32_t);
-                if (data) {
-                    uint32_t output = 0;
-                    // Data starts in the fourth byte
-                    memcpy(&output, (p + 3), sizeof(output));
-                    *data = endian_convert(output);
+    esp_err_t err;
+
+    lock();
+    // If the register is waiting to be written in a batch,
+    // what's in the batch is what will be there
+    batch_entry_t *entry = find_in_batch(address, reg);
+    if (entry != NULL) {
+        // Return the number of data bytes "received"
+        err = sizeof(uint32_t);
+        if (data) {
+            *data = entry->data;
+        }
+    } else {
+        // Send a read request, which is a write with no data
+        err = write(address, reg, NULL);
+        if (err == 0) {
+            uint8_t *p = (uint8_t *) &datagram;
+            err = uart_read_bytes((uart_port_t) g_uart, p, sizeof(datagram),
+                                  pdMS_TO_TICKS(1000));
+            if (err == sizeof(datagram)) {
+                print_datagram("Read datagram was ", p, err);
+                // Check CRC
+                uint8_t crc = calculate_crc(p, sizeof(datagram) - 1);
+                if (crc == *(p + sizeof(datagram) - 1)) {
+                    // Return the number of data bytes received
+                    err = sizeof(uint32_t);
+                    if (data) {
+                        uint32_t output = 0;
+                        // Data starts in the fourth byte
+                        memcpy(&output, (p + 3), sizeof(output));
+                        *data = endian_convert(output);
+                    }
+                } else {
+                    err = -ESP_ERR_INVALID_CRC;
+                    ESP_LOGE(TAG, "CRC failure: expected 0x%02x, got 0x%02x.",
+                             crc, *(p + sizeof(datagram) - 1));
+                    // If the line is that bad, who knows what
+                    // the TMC2209 has received of late
+                    shadow_invalidate(address);
                 }
             } else {
-                err = -ESP_ERR_INVALID_CRC;
-                ESP_LOGE(TAG, "CRC failure: expected 0x%02x, got 0x%02x.",
-                         crc, *(p + sizeof(datagram) - 1));
-            }
-        } else {
-            if (err > 0) {
-                print_datagram("Expected 8 bytes, got ", p, err);
-            } else {
-                ESP_LOGE(TAG, "UART read returned %d.", err);
+                if (err > 0) {
+                    print_datagram("Expected 8 bytes, got ", p, err);
+                } else {
+                    ESP_LOGE(TAG, "UART read returned %d.", err);
+                }
             }
         }
     }
+    unlock();
 
     return err;
 }
 
-// Do a generic register write.
+// Do a generic register write, skipping it if the shadow
+// of the register says that it would change nothing.
 static esp_err_t write_reg(int32_t address, int32_t reg,
                            uint32_t data)
 {
-    esp_err_t err = write(address, reg, &data);
+    esp_err_t err = ESP_OK;
+    shadow_t *shadow = shadow_find(address, reg, NULL);
 
-    if (err == sizeof(data)) {
-        err = ESP_OK;
-    } else {
-        if (err >= 0) {
-            err = -ESP_ERR_INVALID_RESPONSE;
+    lock();
+    if ((shadow == NULL) || !shadow->valid || (shadow->data != data)) {
+        err = write(address, reg, &data);
+        if (err == sizeof(data)) {
+            err = ESP_OK;
+            if (shadow) {
+                shadow->data = data;
+                shadow->valid = true;
+            }
+        } else {
+            if (shadow) {
+                shadow->valid = false;
+            }
+            if (err >= 0) {
+                err = -ESP_ERR_INVALID_RESPONSE;
+            }
         }
     }
+    unlock();
 
     return err;
 }
 
-// Do a generic register read.
+// Do a generic register read, from the shadow of the
+// register if there is one.
 static esp_err_t read_reg(int32_t address, int32_t reg)
 {
     uint32_t data = 0;
+    bool write_only = false;
+    shadow_t *shadow = shadow_find(address, reg, &write_only);
+    esp_err_t err;
 
-    esp_err_t err = read(address, reg, &data);
-    if (err == sizeof(data)) {
-        err = (esp_err_t) data;
+    lock();
+    if ((shadow != NULL) && shadow->valid) {
+        err = (esp_err_t) shadow->data;
     } else {
-        if (err >= 0) {
-            err = -ESP_ERR_INVALID_RESPONSE;
+        err = read(address, reg, &data);
+        if (err == sizeof(data)) {
+            err = (esp_err_t) data;
+            if ((shadow != NULL) && !write_only) {
+                shadow->data = data;
+                shadow->valid = true;
+            }
+        } else {
+            if (err >= 0) {
+                err = -ESP_ERR_INVALID_RESPONSE;
+            }
         }
     }
+    unlock();
 
     return err;
 }
@@ -405,7 +768,13 @@ esp_err_t tmc2209_init(int32_t uart, int32_t pin_txd, int32_t pin_rxd,
 {
     esp_err_t err = ESP_OK;
 
-    if (g_uart < 0) {
+    if (!crc_self_test()) {
+        ESP_LOGE(TAG, "CRC self-test failed.");
+        err = ESP_ERR_INVALID_CRC;
+    } else if (g_uart < 0) {
+        if (g_mutex == NULL) {
+            g_mutex = xSemaphoreCreateRecursiveMutex();
+        }
         // UART configuration
         uart_config_t uart_config = {
             // baud_rate is populated below
@@ -478,6 +847,8 @@ esp_err_t tmc2209_start(int32_t address, int32_t pin_motor_enable)
             }
         }
         ESP_LOGI(TAG, "Starting TMC2209 %d, %s.", address, buffer);
+        // Whatever we knew of the registers may no longer be true
+        shadow_invalidate(address);
         if (err == ESP_OK) {
             err = write_reg(address, 0, TMC2209_REG_GCONF_DEFAULTS);
             if (err != ESP_OK) {
@@ -515,7 +886,17 @@ void tmc2209_deinit()
 // the given address.
 esp_err_t tmc2209_write(int32_t address, int32_t reg, uint32_t data)
 {
-    return write(address, reg, &data);
+    shadow_t *shadow = shadow_find(address, reg, NULL);
+
+    lock();
+    esp_err_t err = write(address, reg, &data);
+    if (shadow) {
+        shadow->data = data;
+        shadow->valid = (err == sizeof(data));
+    }
+    unlock();
+
+    return err;
 }
 
 // Read a buffer of data from the given register of the TMC2209
@@ -525,6 +906,55 @@ esp_err_t tmc2209_read(int32_t address, int32_t reg, uint32_t *data)
     return read(address, reg, data);
 }
 
+// Forget what is known of the registers of a TMC2209.
+void tmc2209_invalidate_shadow(int32_t address)
+{
+    lock();
+    shadow_invalidate(address);
+    unlock();
+}
+
+// Begin a batch of register writes.
+esp_err_t tmc2209_batch_begin()
+{
+    esp_err_t err = -ESP_ERR_INVALID_STATE;
+
+    lock();
+    if ((g_uart >= 0) && !g_batch.active) {
+        g_batch.count = 0;
+        g_batch.active = true;
+        err = ESP_OK;
+    } else {
+        // Only a batch that has begun keeps hold of the mutex
+        unlock();
+    }
+
+    return err;
+}
+
+// End a batch of register writes, sending or discarding them.
+esp_err_t tmc2209_batch_end(bool send)
+{
+    esp_err_t err = -ESP_ERR_INVALID_STATE;
+
+    lock();
+    if (g_batch.active) {
+        err = ESP_OK;
+        if (send) {
+            err = flush_batch();
+        } else {
+            batch_invalidate_shadow();
+        }
+        g_batch.count = 0;
+        g_batch.active = false;
+        // Give back the hold that tmc2209_batch_begin() took
+        unlock();
+    }
+    unlock();
+
+    return err;
+}
+
 // Read the state of all of a TMC2209's lines.
 esp_err_t tmc2209_read_lines(int32_t address)
 {
@@ -685,13 +1115,7 @@ esp_err_t tmc2209_set_velocity(int32_t address,
     milliHertz /= VACTUAL_TO_MILLIHERTZ;
 
     // Write to the VACTUAL register (0x22)
-    esp_err_t err = write_reg(address, 0x22, milliHertz);
-
-    if (err == ESP_OK) {
-        g_vactual = milliHertz;
-    }
-
-    return err;
+    return write_reg(address, 0x22, milliHertz);
 }
 
 // Get the velocity of the stepper motor attached to a
@@ -701,11 +1125,20 @@ esp_err_t tmc2209_get_velocity(int32_t address,
 {
     esp_err_t err = ESP_ERR_INVALID_ARG;
 
-    // The VACTUAL register is write-only so return the shadow
-    if (milliHertz) {
-        *milliHertz = g_vactual;
+    // The VACTUAL register is write-only so return the shadow,
+    // which is zero if we've never written to it; the shadow may be
+    // invalidated by another task at any time, hence the lock
+    lock();
+    shadow_t *shadow = shadow_find(address, 0x22, NULL);
+    if (milliHertz && shadow) {
+        *milliHertz = 0;
+        if (shadow->valid) {
+            // VACTUAL is a signed value
+            *milliHertz = ((int32_t) shadow->data) * VACTUAL_TO_MILLIHERTZ;
+        }
         err = ESP_OK;
     }
+    unlock();
 
     return err;
 }
@@ -751,6 +1184,31 @@ esp_err_t tmc2209_get_sg_result(int32_t address)
     return read_reg(address, 0x41);
 }
 
+// Get the current a TMC2209 is actually delivering.
+esp_err_t tmc2209_get_current(int32_t address, uint32_t r_sense_mohm)
+{
+    // The VSENSE bit of the chopper configuration register (0x6c),
+    // which will usually come from the shadow
+    esp_err_t err = read_reg(address, 0x6c);
+    if (err >= 0) {
+        uint32_t v_sense = ((uint32_t) err >> 17) & 0x01;
+        // CS_ACTUAL, the current scale that CoolStep has arrived
+        // at, is bits 16 to 20 of DRV_STATUS (0x6f); read() rather
+        // than read_reg() since bit 31 of DRV_STATUS, standstill,
+        // would make the value look like an error
+        uint32_t data = 0;
+        err = read(address, 0x6f, &data);
+        if (err == sizeof(data)) {
+            err = (int32_t) rms_current_milliamps((data >> 16) & 0x1f,
+                                                  v_sense, r_sense_mohm);
+        } else if (err >= 0) {
+            err = -ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+
+    return err;
+}
+
 // Set the operation of stall-guard in a TMC2209.
 esp_err_t tmc2209_init_stallguard(int32_t address,
                                   int32_t tcoolthrs,
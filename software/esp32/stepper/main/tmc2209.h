@@ -19,7 +19,9 @@
 
 /** @file
  * @brief The TMC2209 stepper motor driver API for the stepper motor
- * application.
+ * application.  This API is thread-safe: the TMC2209s share one
+ * UART, so only one task at a time may talk to them, the others
+ * waiting until it is done.
  */
 
 #ifdef __cplusplus
@@ -30,6 +32,11 @@ extern "C" {
  * COMPILE-TIME MACROS
  * -------------------------------------------------------------- */
 
+/** The maximum number of register writes that can be held in a
+ * batch, see tmc2209_batch_begin().
+ */
+#define TMC2209_BATCH_MAX_WRITES 16
+
 /** The value that will be written to the TMC2209 GCONF register
  * (register 0, 10 bits wide) by tmc2209_start().  The important
  * bits are:
@@ -142,6 +149,62 @@ esp_err_t tmc2209_write(int32_t address, int32_t reg, uint32_t data);
  */
 esp_err_t tmc2209_read(int32_t address, int32_t reg, uint32_t *data);
 
+/** Begin a batch of register writes: until tmc2209_batch_end()
+ * is called, writes to any TMC2209, including those done inside
+ * the set functions of this API, are held back and then sent
+ * back-to-back in a single UART transmission, with the echo of
+ * the whole lot checked in one go, which is a lot quicker than
+ * sending each one and waiting for its echo.  Reads are still
+ * performed immediately, except that reading a register which is
+ * already waiting to be written in the batch returns the batched
+ * value, so read-modify-writes of the same register (e.g. CHOPCONF
+ * by tmc2209_set_current() and tmc2209_stop_that_bloody_racket())
+ * still work.  A later write to a register replaces an earlier one
+ * in the same batch; should more than TMC2209_BATCH_MAX_WRITES
+ * different registers be written, the batch is sent when full and
+ * a new one started.
+ *
+ * Note that, since a write in a batch has not yet happened, the
+ * return value of a write function only indicates that the write
+ * has been accepted into the batch: the return value of
+ * tmc2209_batch_end() is what indicates success.
+ *
+ * The task that begins a batch has the TMC2209s to itself until
+ * it calls tmc2209_batch_end(): any other task that calls this API
+ * in the meantime will wait.
+ *
+ * @return zero on success else negative error code from esp_err_t;
+ *         it is an error to begin a batch when one is already
+ *         in progress.
+ */
+esp_err_t tmc2209_batch_begin();
+
+/** End a batch of register writes, see tmc2209_batch_begin().
+ *
+ * @param send true to send the batched writes, false to throw
+ *             them away, e.g. if something went wrong while the
+ *             batch was being assembled.
+ * @return     zero on success else negative error code from
+ *             esp_err_t.
+ */
+esp_err_t tmc2209_batch_end(bool send);
+
+/** This API keeps a shadow of the configuration registers of
+ * each TMC2209 (GCONF, IHOLD_IRUN, TPWMTHRS, TCOOLTHRS, VACTUAL,
+ * SGTHRS, COOLCONF, CHOPCONF and PWMCONF) so that a write which
+ * would change nothing is not sent and a read of one of them, e.g.
+ * by tmc2209_get_microstep_resolution(), is served from RAM.  The
+ * shadow is forgotten by tmc2209_start() and when a CRC failure
+ * or a corrupted echo is seen on the UART; call this if you know
+ * that a TMC2209 has been reset by some other means, e.g. its motor
+ * supply has been switched off, so that its registers are read
+ * and written afresh.
+ *
+ * @param address the address of the device, range 0 to 3, or
+ *                negative to forget the shadow of all devices.
+ */
+void tmc2209_invalidate_shadow(int32_t address);
+
 /** Read the state of all of a TMC2209's lines.  The return
  * value, if non-negative, may be masked with one or more
  * TMC2209_LINE_MASK_* values (see above) to get the state
@@ -330,6 +393,19 @@ esp_err_t tmc2209_get_tstep(int32_t address);
  */
 esp_err_t tmc2209_get_sg_result(int32_t address);
 
+/** Get the RMS current that a TMC2209 device is actually
+ * delivering, which CoolStep may have reduced below that set
+ * by tmc2209_set_current(); meaningful only while
+ * tmc2209_set_current() is in force.
+ *
+ * @param address      the address of the device, range 0 to 3.
+ * @param r_sense_mohm the value of the sense resistors connected
+ *                     to the BRA and BRB pins in milliOhms.
+ * @return             the current in milliamps, else negative
+ *                     error code from esp_err_t.
+ */
+esp_err_t tmc2209_get_current(int32_t address, uint32_t r_sense_mohm);
+
 /** Set the operation of StallGuard in a TMC2209.
  * This allows the detection of a stall condition which
  * will pulse the DIAG pin of the TMC2209 that may be
@@ -0,0 +1,338 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+'''
+Benchmark the protocol between esp32_server.py and the ESP32s, using
+the host build of the stepper application (see
+../esp32/stepper/host/README.md) to stand in for the devices: one
+process per device, each connecting from a loopback address that
+ends in the same number as the address of the real device, so
+10.10.3.20 (the lift) becomes 127.0.3.20.  Reports query round-trip
+time percentiles, the number of commands per second that can be
+pushed through and the time from the end of a target to the arrival
+of its indication, plus the per-stage latency from the devices
+themselves and how many of their datagrams went missing.
+'''
+
+import argparse
+import queue
+import subprocess
+import threading
+import time
+from pathlib import Path
+from typing import Dict, List, Optional
+from esp32_server import Esp32Server
+from latency import LatencyHistogram
+
+# Add the protocol directory to Python path
+# Get the directory where THIS script is located
+import sys
+script_dir = Path(__file__).resolve().parent
+
+# Navigate up to the common directory where protocol.h and protocol.py live
+protocol_dir = script_dir.parent / 'protocol'
+sys.path.insert(0, str(protocol_dir))
+
+import protocol
+
+# The default port to run the ESP32 server on: not the usual one so
+# that this can be run alongside the real thing
+ESP32_PORT_DEFAULT = 5100
+
+# The datagrams of the UDP channel go to the ESP32 port plus this,
+# as 5002 is to 5000 for the real thing
+UDP_PORT_OFFSET = 2
+
+# The default location of the host build of the stepper application
+DEVICE_BINARY_DEFAULT = script_dir.parent / 'esp32' / 'stepper' / 'host' / 'build' / 'stepper_host'
+
+# The simulated devices connect from this network plus the last
+# number of the address of the real device
+DEVICE_NETWORK = '127.0.3.'
+
+# How long to wait for the simulated devices to connect and initialise, in seconds
+DEVICE_WAIT_SECONDS = 20
+
+# How long to wait for any one response or indication, in seconds
+RESPONSE_TIMEOUT_SECONDS = 2.0
+
+# The default number of queries each device is sent, one at a time,
+# to measure round-trip time
+QUERY_COUNT_DEFAULT = 200
+
+# The default number of commands each device is sent to measure throughput
+COMMAND_COUNT_DEFAULT = 1000
+
+# The number of commands that may be outstanding on any one device
+# during the throughput test: must be well short of the 256 a
+# reference can take, since responses are matched on reference
+COMMAND_WINDOW = 32
+
+# The default number of targets each device is sent to measure
+# indication latency
+TARGET_COUNT_DEFAULT = 10
+
+# The timeout of each of those targets, in milliseconds: no sensor
+# ever triggers in the simulation so all targets end this way
+TARGET_TIMEOUT_MS = 200
+
+# A target that moves for each type of device, as (device name
+# prefix, state, velocity in milliHertz, current in mA)
+TARGETS = [
+    ('stand', protocol.State.STATE_STAND_ROTATING_CLOCKWISE, 100000, 500),
+    ('lift', protocol.State.STATE_LIFT_RISING, 100000, 500),
+    ('plinky-plonky', protocol.State.STATE_PLINKY_PLONKY_PLAYING, 100000, 500),
+    ('door', protocol.State.STATE_DOOR_CLOSING, 100000, 250)
+]
+
+class Collector:
+    '''
+    Pulls everything out of the incoming queue of an Esp32Server in
+    its own thread, queueing indications per device; responses don't
+    come this way, they arrive through the futures of request()
+    '''
+    def __init__(self, server: Esp32Server):
+        self._server = server
+        self.indications = {ip: queue.Queue() for ip in server.devices}
+        self._running = True
+        self._thread = threading.Thread(target=self._loop, daemon=True)
+        self._thread.start()
+
+    def _loop(self):
+        while self._running:
+            try:
+                ip, msg = self._server.incoming_queue.get(timeout=0.1)
+            except queue.Empty:
+                continue
+            if isinstance(msg, protocol.IndMsg) and ip in self.indications:
+                self.indications[ip].put(msg)
+
+    def stop(self):
+        self._running = False
+        self._thread.join()
+
+def wait_for(future) -> Optional[protocol.RspMsg]:
+    '''Return the response a future of request() is given, None if there isn't one'''
+    if future is None:
+        return None
+    try:
+        return future.result(RESPONSE_TIMEOUT_SECONDS)
+    except Exception:
+        return None
+
+def take_reference(server: Esp32Server, ip) -> int:
+    '''Return the next reference to use with a device'''
+    reference = server.devices[ip]["reference"]
+    server.devices[ip]["reference"] = server.next_reference(reference)
+    return reference
+
+def run_per_device(ips: List[str], function) -> Dict[str, object]:
+    '''Run function(ip) for each device at the same time, returning the results'''
+    results = {}
+    def run(ip):
+        results[ip] = function(ip)
+    threads = [threading.Thread(target=run, args=(ip,)) for ip in ips]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return results
+
+def query_rtt(server: Esp32Server, ip, count) -> LatencyHistogram:
+    '''Send count queries, one at a time, returning a histogram of the round trip in microseconds'''
+    histogram = LatencyHistogram()
+    for _ in range(count):
+        reference = take_reference(server, ip)
+        send_time_ns = time.monotonic_ns()
+        msg = wait_for(server.request(ip, protocol.QryMsg(protocol.Qry.QRY_SYSTEM_STEPPER_STATE, reference),
+                                      RESPONSE_TIMEOUT_SECONDS))
+        if msg is not None:
+            histogram.add((msg.receive_time_ns - send_time_ns) // 1000)
+        else:
+            print(f"No response to query from {server.devices[ip]['name']}")
+    return histogram
+
+def command_throughput(server: Esp32Server, ip, count) -> Optional[float]:
+    '''
+    Send count CMD_STEPPER_TELEMETRY commands (switching telemetry off,
+    which costs the device nothing but the handling of the command),
+    keeping COMMAND_WINDOW of them outstanding, returning the number
+    of responses per second or None if any went missing
+    '''
+    outstanding = []
+    start_time = time.monotonic()
+    for sent in range(count + COMMAND_WINDOW):
+        if len(outstanding) >= COMMAND_WINDOW or (sent >= count and outstanding):
+            if wait_for(outstanding.pop(0)) is None:
+                print(f"No response to command from {server.devices[ip]['name']}")
+                return None
+        if sent < count:
+            reference = take_reference(server, ip)
+            future = server.request(ip, protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TELEMETRY, reference, 0),
+                                    RESPONSE_TIMEOUT_SECONDS)
+            if future is None:
+                return None
+            outstanding.append(future)
+    return count / (time.monotonic() - start_time)
+
+def indication_latency(server: Esp32Server, collector: Collector, ip, count) -> LatencyHistogram:
+    '''
+    Start count targets, one at a time, each of which ends on its
+    timeout, returning a histogram, in microseconds, of how much later
+    than the response plus the timeout the indication of the end of
+    the target arrived
+    '''
+    histogram = LatencyHistogram()
+    name = server.devices[ip]['name']
+    target = next((target for target in TARGETS if name.startswith(target[0])), None)
+    if target is None:
+        return histogram
+    indications = collector.indications[ip]
+    for _ in range(count):
+        reference = take_reference(server, ip)
+        command = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TARGET_START, reference,
+                                  target[1], target[2], target[3], TARGET_TIMEOUT_MS)
+        rsp = wait_for(server.request(ip, command, RESPONSE_TIMEOUT_SECONDS))
+        if rsp is None:
+            print(f"No response to CMD_STEPPER_TARGET_START from {name}")
+            continue
+        if rsp.status != protocol.Status.STATUS_OK:
+            print(f"CMD_STEPPER_TARGET_START refused by {name} (status"
+                  f" {protocol.Status(rsp.status).name})")
+            break
+        deadline = time.monotonic() + (TARGET_TIMEOUT_MS / 1000) + RESPONSE_TIMEOUT_SECONDS
+        while True:
+            try:
+                msg = indications.get(timeout=max(deadline - time.monotonic(), 0))
+            except queue.Empty:
+                print(f"No IND_SYSTEM_STEPPER_TARGET_END from {name}")
+                break
+            if msg.ind == protocol.Ind.IND_SYSTEM_STEPPER_TARGET_END:
+                histogram.add(max((msg.receive_time_ns - rsp.receive_time_ns) // 1000 - (TARGET_TIMEOUT_MS * 1000), 0))
+                break
+    return histogram
+
+def print_histograms(title, histograms: Dict[str, LatencyHistogram], devices):
+    '''Print the percentiles of a histogram per device'''
+    print(f"\n{title}:")
+    print(f"  {'device':<16}{'count':>8}{'mean':>10}{'p50':>10}{'p95':>10}{'max':>10}  (ms)")
+    for ip, histogram in histograms.items():
+        info = histogram.to_dict()
+        if info['count']:
+            print(f"  {devices[ip]['name']:<16}{info['count']:>8}{info['mean_us'] / 1000:>10.2f}"
+                  f"{info['p50_us'] / 1000:>10.2f}{info['p95_us'] / 1000:>10.2f}{info['max_us'] / 1000:>10.2f}")
+
+def print_datagrams(datagrams: dict):
+    '''Print how the datagrams of the UDP channel fared, see UdpMsg'''
+    print("\nDatagrams:")
+    print(f"  {'device':<16}{'received':>10}{'lost':>8}{'early':>8}{'dropped':>8}")
+    for name, info in datagrams.items():
+        print(f"  {name:<16}{info['received']:>10}{info['lost']:>8}{info['early']:>8}{info['dropped']:>8}")
+
+def print_latency(latency: dict):
+    '''Print the per-stage latency reported by the devices, see LatMsg'''
+    print("\nPer-stage latency reported by the devices (p50/p95, ms):")
+    for node, histograms in latency['nodes'].items():
+        print(f"  {node}:")
+        for interval in latency['intervals']:
+            info = histograms.get(interval)
+            if info and info['count']:
+                print(f"    {interval:<24}{info['p50_us'] / 1000:>8.2f}{info['p95_us'] / 1000:>8.2f}")
+
+def main(port, binary, device_names, query_count, command_count, target_count, uart_speed):
+    '''Main as a function'''
+    processes = []
+    server = Esp32Server()
+
+    # Move the chosen devices onto loopback addresses and forget the rest
+    devices = {}
+    for ip, info in server.devices.items():
+        if (device_names and any(info['name'].startswith(name) for name in device_names)) or \
+           (not device_names and info['required']):
+            info['required'] = True
+            devices[DEVICE_NETWORK + ip.split('.')[-1]] = info
+    if not devices:
+        print("No devices chosen.")
+        return 1
+    server.devices = devices
+
+    server.start(port, port + UDP_PORT_OFFSET)
+    collector = Collector(server)
+    try:
+        for ip in server.devices:
+            processes.append(subprocess.Popen([str(binary), '-s', '127.0.0.1', '-p', str(port),
+                                               '-d', str(port + UDP_PORT_OFFSET),
+                                               '-b', ip, '-u', str(uart_speed), '-l', 'w']))
+        if not server.wait_for_all_devices(DEVICE_WAIT_SECONDS):
+            return 1
+        ips = server.get_device_ip_list(connected=True, initialised=True)
+        server.sync_clocks()
+        server.latency.clear()
+
+        print(f"\nQuery round trip, {query_count} per device...")
+        histograms = run_per_device(ips, lambda ip: query_rtt(server, ip, query_count))
+        print_histograms("Query round trip", histograms, server.devices)
+
+        print(f"\nCommand throughput, {command_count} per device, {COMMAND_WINDOW} outstanding...")
+        rates = run_per_device(ips, lambda ip: command_throughput(server, ip, command_count))
+        total = 0
+        for ip, rate in rates.items():
+            if rate is not None:
+                total += rate
+                print(f"  {server.devices[ip]['name']:<16}{rate:>10.0f} commands/s")
+            else:
+                print(f"  {server.devices[ip]['name']:<16}{'failed':>10}")
+        print(f"  {'total':<16}{total:>10.0f} commands/s")
+
+        print(f"\nIndication latency, {target_count} targets of {TARGET_TIMEOUT_MS} ms per device...")
+        histograms = run_per_device(ips, lambda ip: indication_latency(server, collector, ip, target_count))
+        print_histograms("Indication latency beyond the target timeout", histograms, server.devices)
+
+        # Let the last LatMsg's arrive
+        time.sleep(0.5)
+        print_latency(server.get_latency())
+        print_datagrams(server.get_datagram_stats())
+    finally:
+        for process in processes:
+            process.terminate()
+        for process in processes:
+            process.wait()
+        collector.stop()
+        server.stop()
+
+    return 0
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=("Benchmark the protocol between esp32_server.py and simulated ESP32s."),
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('-p', type=int, default=ESP32_PORT_DEFAULT, help=("the ESP32 control port to use, default "
+                                                                         f"{ESP32_PORT_DEFAULT}."))
+    parser.add_argument('-b', default=DEVICE_BINARY_DEFAULT, help=("the host build of the stepper application, default"
+                                                                  f"\n{DEVICE_BINARY_DEFAULT}."))
+    parser.add_argument('-d', action='append', help=("the name of a device to simulate, may be the start of"
+                                                    " the name\n(e.g. door), may be given more than once;"
+                                                    " default all of the\nrequired devices."))
+    parser.add_argument('-q', type=int, default=QUERY_COUNT_DEFAULT, help=("the number of queries per device, default "
+                                                                          f"{QUERY_COUNT_DEFAULT}."))
+    parser.add_argument('-c', type=int, default=COMMAND_COUNT_DEFAULT, help=("the number of commands per device, default "
+                                                                            f"{COMMAND_COUNT_DEFAULT}."))
+    parser.add_argument('-t', type=int, default=TARGET_COUNT_DEFAULT, help=("the number of targets per device, default "
+                                                                           f"{TARGET_COUNT_DEFAULT}."))
+    parser.add_argument('-u', type=float, default=1.0, help=("the speed of the simulated TMC2209 UART relative to"
+                                                            " real time,\n0 for instantaneous, default 1.0."))
+    args = parser.parse_args()
+
+    sys.exit(main(args.p, args.b, args.d, args.q, args.c, args.t, args.u))
@@ -14,8 +14,9 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import asyncio
+import concurrent.futures
 import socket
-import select
 import queue
 import threading
 import time
@@ -35,253 +36,616 @@ protocol_dir = script_dir.parent / 'protocol'
 sys.path.insert(0, str(protocol_dir))
 
 import protocol
+from latency import LatencyStats
+
+# The number of QRY_SYSTEM_TIME exchanges to make when synchronising
+# with the clock of a device: the one with the shortest round trip wins
+CLOCK_SYNC_COUNT = 8
+
+# How long to wait for the response to a QRY_SYSTEM_TIME, in seconds
+CLOCK_SYNC_TIMEOUT_SECONDS = 1.0
+
+# How long request() waits for a response by default, in seconds
+RESPONSE_TIMEOUT_SECONDS = 5.0
+
+# How often the futures of request() are checked for having timed out, in seconds
+RESPONSE_TIMEOUT_CHECK_SECONDS = 0.5
+
+# The size of the receive buffer of each device, in bytes
+RX_BUFFER_SIZE = 4096
+
+# The port that devices send datagrams to, see udp_msg_t in protocol.h
+UDP_PORT_DEFAULT = 5002
+
+# How many datagrams beyond a missing one are held, waiting for the
+# missing one to turn up, before it is given up as lost
+UDP_REORDER_WINDOW = 16
+
+# How long a datagram is held waiting for one that is missing before
+# it, in seconds, before the missing one is given up as lost
+UDP_REORDER_TIMEOUT_SECONDS = 0.05
+
+# The messages that may arrive from a device, by magic byte: anything
+# else (e.g. a log message) is skipped a byte at a time
+RX_MESSAGE_CLASSES = {
+    protocol.PROTOCOL_MAGIC_RSP: protocol.RspMsg,
+    protocol.PROTOCOL_MAGIC_RSP_MANY: protocol.RspManyMsg,
+    protocol.PROTOCOL_MAGIC_IND: protocol.IndMsg,
+    protocol.PROTOCOL_MAGIC_TLM: protocol.TlmMsg,
+    protocol.PROTOCOL_MAGIC_LAT: protocol.LatMsg,
+    protocol.PROTOCOL_MAGIC_STATS: protocol.StatsMsg
+}
+
+# The receive buffer of a device always offers at least this much
+# space, so that any one message can be received into it in one go
+RX_BUFFER_MIN_FREE = max(message_class.SIZE for message_class in RX_MESSAGE_CLASSES.values())
+
+# The messages that may be carried in a datagram, after the UdpMsg header
+UDP_MESSAGE_CLASSES = {
+    protocol.PROTOCOL_MAGIC_IND: protocol.IndMsg,
+    protocol.PROTOCOL_MAGIC_TLM: protocol.TlmMsg
+}
+
+# Pseudo-stages for the latency intervals below: the time we sent the
+# command and the time we received the LatMsg, which the ESP32 sends
+# straight after the response or indication it goes with; intervals
+# involving these are only measured once sync_clock() has succeeded
+LAT_STAGE_SENT = 'sent'
+LAT_STAGE_RECEIVED = 'received'
+
+# The latency intervals measured from the LatMsg that follows the
+# response to a command, as (name, from stage, to stage)
+LATENCY_INTERVALS_RSP = [
+    ('network to ESP32', LAT_STAGE_SENT, protocol.LatStage.LAT_STAGE_RX),
+    ('lock', protocol.LatStage.LAT_STAGE_RX, protocol.LatStage.LAT_STAGE_LOCKED),
+    ('parse', protocol.LatStage.LAT_STAGE_LOCKED, protocol.LatStage.LAT_STAGE_PARSED),
+    ('UART', protocol.LatStage.LAT_STAGE_PARSED, protocol.LatStage.LAT_STAGE_UART_DONE),
+    ('motor enable', protocol.LatStage.LAT_STAGE_UART_DONE, protocol.LatStage.LAT_STAGE_MOTOR_ENABLED),
+    ('command handling', protocol.LatStage.LAT_STAGE_PARSED, protocol.LatStage.LAT_STAGE_RSP_QUEUED),
+    ('network from ESP32', protocol.LatStage.LAT_STAGE_RSP_QUEUED, LAT_STAGE_RECEIVED),
+    ('command to motion', LAT_STAGE_SENT, protocol.LatStage.LAT_STAGE_MOTOR_ENABLED)
+]
+
+# The latency intervals measured from the LatMsg that follows the
+# IND_SYSTEM_STEPPER_TARGET_END at the end of a target
+LATENCY_INTERVALS_IND = [
+    ('stop to indication', protocol.LatStage.LAT_STAGE_STOP_DETECTED, protocol.LatStage.LAT_STAGE_IND_QUEUED),
+    ('indication network', protocol.LatStage.LAT_STAGE_IND_QUEUED, LAT_STAGE_RECEIVED)
+]
+
+class DeviceConnection(asyncio.BufferedProtocol):
+    """
+    The connection to one device: the event loop receives straight into
+    a buffer that belongs to the connection and messages are decoded
+    from where they sit in that buffer with struct.unpack_from(); the
+    only copying is of a partial message at the end of the buffer back
+    to its start, when the buffer runs short of space
+    """
+    def __init__(self, server: "Esp32Server"):
+        self.server = server
+        self.transport = None
+        self.ip = None
+        self._buffer = bytearray(RX_BUFFER_SIZE)
+        self._view = memoryview(self._buffer)
+        self._start = 0  # The first byte not yet decoded
+        self._end = 0    # One beyond the last byte received
+
+    def connection_made(self, transport):
+        self.transport = transport
+        self.ip = transport.get_extra_info('peername')[0]
+        sock = transport.get_extra_info('socket')
+        if sock is not None:
+            # Messages are small and latency matters
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.server._handle_connect(self)
+
+    def get_buffer(self, sizehint):
+        if len(self._buffer) - self._end < RX_BUFFER_MIN_FREE:
+            length = self._end - self._start
+            self._buffer[:length] = self._view[self._start:self._end]
+            self._start = 0
+            self._end = length
+        return self._view[self._end:]
+
+    def buffer_updated(self, nbytes):
+        receive_time_ns = time.monotonic_ns()
+        self._end += nbytes
+        while self._start < self._end:
+            message_class = RX_MESSAGE_CLASSES.get(self._buffer[self._start])
+            if message_class is None:
+                # Unknown magic - discard a byte and continue
+                # (silently ignores log messages and invalid data)
+                self._start += 1
+                continue
+            if self._end - self._start < message_class.SIZE:
+                # Wait for more data
+                break
+            msg = message_class.unpack_from(self._buffer, self._start)
+            self._start += message_class.SIZE
+            msg.receive_time_ns = receive_time_ns
+            self.server._handle_message(self, msg)
+        if self._start == self._end:
+            self._start = 0
+            self._end = 0
+
+    def connection_lost(self, exc):
+        self.server._handle_disconnect(self)
+
+    def write(self, data: bytes):
+        """Send data to the device; must be called from the event loop"""
+        if not self.transport.is_closing():
+            self.transport.write(data)
+
+class DatagramSequence:
+    """
+    Puts the datagrams from one device back in the order of their
+    sequence numbers: a datagram that arrives ahead of one that is
+    missing is held until the missing one arrives, or until
+    UDP_REORDER_WINDOW datagrams are held or the oldest has been held
+    for UDP_REORDER_TIMEOUT_SECONDS, at which point whatever is missing
+    is given up as lost; a datagram from before the one most recently
+    handed on is a duplicate or has arrived too late and is dropped.
+    Also keeps the latest value of each indication, so that a value
+    that is only being repeated is not handed on again.  Only used in
+    the receiver thread.
+    """
+    def __init__(self):
+        self.expected = None  # The sequence number of the next datagram to hand on
+        self.held = {}        # Map sequence number -> (data, receive time ns, hold time)
+        self.values = {}      # Map (ind, motor) -> the latest value of that indication
+        self.received = 0
+        self.lost = 0
+        self.early = 0
+        self.dropped = 0
+
+    def add(self, sequence: int, data: bytes, receive_time_ns: int) -> List[Tuple[bytes, int]]:
+        """Add a datagram, returning those that may now be handed on,
+        in order, as (data, receive time ns)"""
+        self.received += 1
+        if self.expected is None:
+            self.expected = sequence
+        ahead = (sequence - self.expected) & 0xFFFFFFFF
+        if ahead >= 0x80000000 or sequence in self.held:
+            self.dropped += 1
+            return []
+        if ahead > 0:
+            self.early += 1
+        self.held[sequence] = (data, receive_time_ns, time.monotonic())
+        if len(self.held) > UDP_REORDER_WINDOW:
+            return self._release(True)
+        return self._release(False)
+
+    def expire(self) -> List[Tuple[bytes, int]]:
+        """Give up on whatever is missing if anything held has been
+        waiting too long, returning those that may now be handed on"""
+        released = []
+        deadline = time.monotonic() - UDP_REORDER_TIMEOUT_SECONDS
+        while any(hold_time <= deadline for _, _, hold_time in self.held.values()):
+            released += self._release(True)
+        return released
+
+    def _release(self, skip: bool) -> List[Tuple[bytes, int]]:
+        """Hand on datagrams from expected onwards, skipping the gap
+        before the next one held if skip is True"""
+        released = []
+        while self.held:
+            if skip and self.expected not in self.held:
+                lowest = min(self.held, key=lambda sequence: (sequence - self.expected) & 0xFFFFFFFF)
+                self.lost += (lowest - self.expected) & 0xFFFFFFFF
+                self.expected = lowest
+            if self.expected not in self.held:
+                break
+            data, receive_time_ns, _ = self.held.pop(self.expected)
+            released.append((data, receive_time_ns))
+            self.expected = (self.expected + 1) & 0xFFFFFFFF
+            # Only skip the one gap, anything beyond can still wait
+            skip = skip and len(self.held) > UDP_REORDER_WINDOW
+        return released
+
+    def is_new_value(self, msg: protocol.IndMsg) -> bool:
+        """Return True if an indication carries a value that is not
+        the one already known, remembering it"""
+        key = (msg.ind, msg.motor)
+        if self.values.get(key) == msg.value:
+            return False
+        self.values[key] = msg.value
+        return True
+
+    def to_dict(self) -> dict:
+        return {'received': self.received, 'lost': self.lost,
+                'early': self.early, 'dropped': self.dropped}
+
+class DeviceDatagramProtocol(asyncio.DatagramProtocol):
+    """The datagrams from all of the devices, which are told apart by IP address"""
+    def __init__(self, server: "Esp32Server"):
+        self.server = server
+
+    def datagram_received(self, data, address):
+        self.server._handle_datagram(address[0], data, time.monotonic_ns())
 
 class Esp32Server:
     def __init__(self):
         # Your known devices (fixed IPs)
         self.devices = {
-            "10.10.3.10": {"name": "stand", "required": True, "init": protocol.Cmd.CMD_STAND_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0},
-            "10.10.3.20": {"name": "lift", "required": True, "init": protocol.Cmd.CMD_LIFT_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0},
-            "10.10.3.30": {"name": "plinky-plonky", "required": True, "init": protocol.Cmd.CMD_PLINKY_PLONKY_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0},
+            "10.10.3.10": {"name": "stand", "required": True, "init": protocol.Cmd.CMD_STAND_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0},
+            "10.10.3.20": {"name": "lift", "required": True, "init": protocol.Cmd.CMD_LIFT_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0},
+            "10.10.3.30": {"name": "plinky-plonky", "required": True, "init": protocol.Cmd.CMD_PLINKY_PLONKY_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0},
             # Doors have index values also
-            "10.10.3.40": {"name": "door 0", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 0},
-            "10.10.3.41": {"name": "door 1", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 1},
-            "10.10.3.42": {"name": "door 2", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 2},
-            "10.10.3.43": {"name": "door 3", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 3},
-            "10.10.3.44": {"name": "door 4", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 4},
-            "10.10.3.45": {"name": "door 5", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0, "index": 5},
-            "10.10.3.100": {"name": "test", "required": False, "init": protocol.Cmd.CMD_STAND_INIT, "connected": False, "sock": None, "initialised": False, "reference": 0},
+            "10.10.3.40": {"name": "door 0", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 0},
+            "10.10.3.41": {"name": "door 1", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 1},
+            "10.10.3.42": {"name": "door 2", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 2},
+            "10.10.3.43": {"name": "door 3", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 3},
+            "10.10.3.44": {"name": "door 4", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 4},
+            "10.10.3.45": {"name": "door 5", "required": True, "init": protocol.Cmd.CMD_DOOR_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0, "index": 5},
+            "10.10.3.100": {"name": "test", "required": False, "init": protocol.Cmd.CMD_STAND_INIT, "connected": False, "connection": None, "initialised": False, "reference": 0},
         }
 
-        # Single unified queue for incoming messages (RspMsg and IndMsg only)
+        # Single unified queue for incoming messages (IndMsg, TlmMsg and
+        # any RspMsg/RspManyMsg that no-one is waiting for through request())
         # Each message is (ip, msg_obj)
         self.incoming_queue = queue.Queue()
 
-        # Socket management
-        self.server_socket = None
+        # The event loop that looks after the sockets, run by _thread
         self.running = False
+        self._loop = None
+        self._server = None
+        self._datagram_transport = None
+        self._thread = None
 
-        # For select() polling
-        self.socket_list = []
-        self.device_sockets = {}  # Map socket -> ip
+        # The order of the datagrams from each device, reset whenever it connects
+        self._datagram_sequence = {}  # Map ip -> DatagramSequence
 
-        # Partial message buffer for each socket (in case we get fragmented reads)
-        self.socket_buffers = {}  # Map socket -> bytes
+        # The futures of request() waiting for a response, protected by _pending_lock
+        self._pending = {}  # Map (ip, reference) -> (future, deadline)
+        self._pending_lock = threading.Lock()
 
-        # Track pending init responses
-        self.pending_inits = {}  # Map socket -> (ip, reference, timestamp)
+        # The time each command was sent, for the latency histograms
+        self.command_send_times = {}  # Map (ip, reference) -> send time ns
 
-    def start(self, port=5000):
-        """Start the server and wait for connections"""
-        self.running = True
+        # Per-node latency histograms, filled from LatMsg's
+        self.latency = LatencyStats([name for name, _, _ in LATENCY_INTERVALS_RSP + LATENCY_INTERVALS_IND])
 
-        # Create server socket
-        self.server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        self.server_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-        self.server_socket.bind(('0.0.0.0', port))
-        self.server_socket.listen(len(self.devices))
+        # Called with the IP address of a device whenever what is known
+        # about it changes, see add_change_listener()
+        self._change_listeners = []
 
-        # Add server socket to list for select
-        self.socket_list = [self.server_socket]
+    def start(self, port=5000, udp_port=UDP_PORT_DEFAULT):
+        """Start the server and wait for connections, and for datagrams
+        on udp_port unless it is None"""
+        self.running = True
 
-        print(f"Listening for ESP32s on port {port}")
+        # Create the server sockets now, so that any error in doing so
+        # is raised here, then hand the event loop over to a thread
+        self._loop = asyncio.new_event_loop()
+        self._server = self._loop.run_until_complete(
+            self._loop.create_server(lambda: DeviceConnection(self), '0.0.0.0', port,
+                                     reuse_address=True, backlog=len(self.devices)))
+        if udp_port is not None:
+            self._datagram_transport, _ = self._loop.run_until_complete(
+                self._loop.create_datagram_endpoint(lambda: DeviceDatagramProtocol(self),
+                                                    local_addr=('0.0.0.0', udp_port)))
+
+        print(f"Listening for ESP32s on port {port}" +
+              (f", datagrams on port {udp_port}" if udp_port is not None else ""))
         print("Known devices:")
         for ip, info in self.devices.items():
             print(f"  - {info['name']} ({ip})")
         print()
 
         # Start receiver thread
-        receiver_thread = threading.Thread(target=self._receiver_loop)
-        receiver_thread.daemon = True
-        receiver_thread.start()
-
-        return receiver_thread
-
-    def _parse_message(self, data: bytes) -> Optional[Union[protocol.RspMsg, protocol.IndMsg]]:
+        self._thread = threading.Thread(target=self._run_loop)
+        self._thread.daemon = True
+        self._thread.start()
+
+        return self._thread
+
+    def _run_loop(self):
+        """The receiver thread: runs the event loop until stop()"""
+        asyncio.set_event_loop(self._loop)
+        expire_task = self._loop.create_task(self._expire_requests())
+        self._loop.run_forever()
+        expire_task.cancel()
+        self._loop.run_until_complete(asyncio.gather(expire_task, return_exceptions=True))
+        self._loop.close()
+
+    def add_change_listener(self, listener):
+        """Call listener(ip) whenever a device connects, is initialised or
+        disconnects or, in MusicalBoxManager, whenever the state or sensors
+        recorded for it change; listener is called from whichever thread
+        made the change and so must be thread-safe"""
+        self._change_listeners.append(listener)
+
+    def remove_change_listener(self, listener):
+        """Stop calling a listener given to add_change_listener()"""
+        if listener in self._change_listeners:
+            self._change_listeners.remove(listener)
+
+    def _notify_change(self, ip):
+        """Tell the change listeners that something about a device has changed"""
+        for listener in list(self._change_listeners):
+            listener(ip)
+
+    def _in_loop(self) -> bool:
+        """Return True if called from the receiver thread"""
+        return threading.current_thread() is self._thread
+
+    def _handle_connect(self, connection: DeviceConnection):
+        """Handle a new connection, in the receiver thread"""
+        ip = connection.ip
+        if ip not in self.devices:
+            # Unknown device - reject
+            print(f"Rejected unknown device from {ip}")
+            connection.transport.close()
+            return
+
+        previous = self.devices[ip]["connection"]
+        if previous is not None:
+            # The device must have restarted without us noticing
+            # the old connection go
+            print(f"{self.devices[ip]['name']} reconnected, dropping old connection")
+            self._handle_disconnect(previous)
+            previous.transport.abort()
+
+        # Known device - accept
+        self.devices[ip]["connected"] = True
+        self.devices[ip]["connection"] = connection
+        self.devices[ip]["initialised"] = False  # Reset init flag
+        # The device picks up its datagram sequence from wherever it is
+        self._datagram_sequence[ip] = DatagramSequence()
+        print(f"{self.devices[ip]['name']} connected from {ip}")
+        self._notify_change(ip)
+
+        # Send init command, which marks the device as initialised when answered
+        reference = self.devices[ip]["reference"]
+        init = self.devices[ip]["init"]
+        future = self.request(ip, protocol.CmdMsg(init, reference, 0, 0, 0, 0))
+        if future is not None:
+            self.devices[ip]["reference"] = self.next_reference(reference)
+            future.add_done_callback(lambda future: self._handle_init_response(connection, future))
+            print(f"  Sent init command (ref={reference}) to {self.devices[ip]['name']}")
+
+    def _handle_init_response(self, connection: DeviceConnection, future: concurrent.futures.Future):
+        """Handle the response to init command"""
+        ip = connection.ip
+        if self.devices[ip]["connection"] is not connection:
+            # Gone, or replaced, since the init command was sent
+            return
+        if future.cancelled() or future.exception() is not None:
+            print(f"Warning: Init response timeout for {ip}")
+            return
+        msg = future.result()
+        if msg.status == protocol.Status.STATUS_OK:
+            print(f"✓ {self.devices[ip]['name']} initialised successfully")
+            self.devices[ip]["initialised"] = True
+            self._notify_change(ip)
+        else:
+            print(f"✗ {self.devices[ip]['name']} initialization failed with status {protocol.Status(msg.status).name}")
+
+    def _handle_message(self, connection: DeviceConnection, msg):
+        """Handle a message from a device, in the receiver thread"""
+        ip = connection.ip
+        if self.devices[ip]["connection"] is not connection:
+            return
+
+        # Latency messages only feed the histograms
+        if self._handle_latency(ip, msg, msg.receive_time_ns):
+            return
+
+        # Hand a response to whoever is waiting for it
+        if isinstance(msg, (protocol.RspMsg, protocol.RspManyMsg)):
+            with self._pending_lock:
+                pending = self._pending.pop((ip, msg.reference), None)
+            if pending is not None:
+                if not pending[0].done():
+                    pending[0].set_result(msg)
+                return
+
+        # Otherwise, add to queue
+        self.incoming_queue.put((ip, msg))
+
+    def _handle_datagram(self, ip, data, receive_time_ns):
+        """Handle a datagram from a device, in the receiver thread: only
+        a device that is connected may send datagrams"""
+        sequence = self._datagram_sequence.get(ip)
+        if (ip not in self.devices or self.devices[ip]["connection"] is None or sequence is None or
+            len(data) < protocol.UdpMsg.SIZE or data[0] != protocol.PROTOCOL_MAGIC_UDP):
+            return
+        header = protocol.UdpMsg.unpack_from(data, 0)
+        released = sequence.add(header.sequence, data, receive_time_ns)
+        if header.sequence in sequence.held:
+            self._loop.call_later(UDP_REORDER_TIMEOUT_SECONDS, self._expire_datagrams, ip, sequence)
+        self._handle_datagrams(ip, sequence, released)
+
+    def _expire_datagrams(self, ip, sequence: DatagramSequence):
+        """Hand on datagrams that have been held too long waiting for one that is missing"""
+        if self._datagram_sequence.get(ip) is sequence:
+            self._handle_datagrams(ip, sequence, sequence.expire())
+            if sequence.held:
+                # Something held arrived after whatever it is waiting for
+                self._loop.call_later(UDP_REORDER_TIMEOUT_SECONDS, self._expire_datagrams, ip, sequence)
+
+    def _handle_datagrams(self, ip, sequence: DatagramSequence, datagrams: List[Tuple[bytes, int]]):
+        """Hand on the messages carried by datagrams that are in order:
+        an indication is only handed on if its value is not already known"""
+        connection = self.devices[ip]["connection"]
+        for data, receive_time_ns in datagrams:
+            offset = protocol.UdpMsg.SIZE
+            while offset < len(data):
+                message_class = UDP_MESSAGE_CLASSES.get(data[offset])
+                if message_class is None or len(data) - offset < message_class.SIZE:
+                    # Not something we understand, give up on the rest
+                    break
+                msg = message_class.unpack_from(data, offset)
+                offset += message_class.SIZE
+                msg.receive_time_ns = receive_time_ns
+                if not isinstance(msg, protocol.IndMsg) or sequence.is_new_value(msg):
+                    self._handle_message(connection, msg)
+
+    def get_datagram_stats(self) -> dict:
+        """Return, by device name, how many datagrams have been received
+        from each device since it connected, how many went missing, how
+        many arrived ahead of one that was missing and how many were
+        dropped as duplicates or too late, in a form that can be turned
+        into JSON"""
+        return {self.devices[ip]["name"]: sequence.to_dict()
+                for ip, sequence in self._datagram_sequence.items() if ip in self.devices}
+
+    def _handle_disconnect(self, connection: DeviceConnection):
+        """Clean up disconnected device, in the receiver thread"""
+        ip = connection.ip
+        if ip in self.devices and self.devices[ip]["connection"] is connection:
+            self.devices[ip]["connected"] = False
+            self.devices[ip]["connection"] = None
+            self.devices[ip]["initialised"] = False
+            print(f"{self.devices[ip]['name']} disconnected")
+            self._notify_change(ip)
+
+            # No response is coming for anything outstanding
+            with self._pending_lock:
+                keys = [key for key in self._pending if key[0] == ip]
+                pendings = [self._pending.pop(key) for key in keys]
+            for future, _ in pendings:
+                if not future.done():
+                    future.set_exception(ConnectionError(f"{self.devices[ip]['name']} disconnected"))
+
+    async def _expire_requests(self):
+        """Give up on responses that have not arrived in time"""
+        while True:
+            await asyncio.sleep(RESPONSE_TIMEOUT_CHECK_SECONDS)
+            now = time.monotonic()
+            with self._pending_lock:
+                keys = [key for key, (_, deadline) in self._pending.items() if deadline < now]
+                pendings = [self._pending.pop(key) for key in keys]
+            for future, _ in pendings:
+                if not future.done():
+                    future.set_exception(TimeoutError("no response"))
+
+    def _send(self, ip: str, msg) -> bool:
+        """Send a message to a device, from any thread"""
+        connection = self.devices[ip]["connection"]
+        if connection is None:
+            return False
+        data = msg.pack()
+        if self._in_loop():
+            connection.write(data)
+        else:
+            self._loop.call_soon_threadsafe(connection.write, data)
+        return True
+
+    def request(self, ip: str, msg: Union[protocol.CmdMsg, protocol.QryMsg, protocol.QryManyMsg],
+                timeout: float = RESPONSE_TIMEOUT_SECONDS) -> Optional[concurrent.futures.Future]:
         """
-        Parse incoming data based on magic byte
-        Returns the appropriate message object or None if invalid
+        Send a command or query to a device and return a future that
+        will be given the response with the same reference (an RspMsg,
+        or an RspManyMsg for a QryManyMsg), which will not then appear
+        on incoming_queue, or None if the message could not be sent; the
+        future is given TimeoutError if no response arrives within
+        timeout seconds and ConnectionError if the device disconnects.
+        Use asyncio.wrap_future() to await it from another event loop.
         """
-        if len(data) < 1:
-            return None
-
-        magic = data[0]
-
-        try:
-            if magic == protocol.PROTOCOL_MAGIC_RSP:
-                return protocol.RspMsg.unpack(data)
-            elif magic == protocol.PROTOCOL_MAGIC_IND:
-                return protocol.IndMsg.unpack(data)
-            else:
-                # Log messages and unknown magics are ignored
-                return None
-        except Exception as e:
-            print(f"Error parsing message: {e}")
+        future = concurrent.futures.Future()
+        key = (ip, msg.reference)
+        with self._pending_lock:
+            previous = self._pending.get(key)
+            self._pending[key] = (future, time.monotonic() + timeout)
+        if previous is not None and not previous[0].done():
+            # The reference has come round again without an answer
+            previous[0].set_exception(TimeoutError("reference reused"))
+        if isinstance(msg, protocol.CmdMsg):
+            sent = self.send_command(ip, msg)
+        else:
+            sent = self.send_query(ip, msg)
+        if not sent:
+            with self._pending_lock:
+                if self._pending.get(key, (None,))[0] is future:
+                    del self._pending[key]
             return None
+        return future
 
-    def _handle_init_response(self, sock, ip, msg):
-        """Handle response to init command"""
-        if sock not in self.pending_inits:
-            return False
-
-        expected_ref, expected_cmd, timestamp = self.pending_inits[sock]  # Store expected command too
-
-        # Check if this response matches our pending init
-        if msg.reference == expected_ref and msg.cmd_or_qry == expected_cmd:
-            if msg.status == protocol.Status.STATUS_OK:
-                print(f"✓ {self.devices[ip]['name']} initialised successfully")
-                self.devices[ip]["initialised"] = True
-            else:
-                print(f"✗ {self.devices[ip]['name']} initialization failed with status {protocol.Status(msg.status).name}")
-
-            # Remove from pending
-            del self.pending_inits[sock]
-            return True
-
-        return False
-
-    def _receiver_loop(self):
-        """Main loop using select() to handle all sockets"""
-        while self.running:
+    def sync_clock(self, ip, count=CLOCK_SYNC_COUNT) -> bool:
+        """
+        Learn the offset between our clock and that of a device, NTP-style:
+        the device is asked for its time, in microseconds, count times and
+        the answer with the shortest round trip is assumed to have been
+        read half way through that round trip.  Blocks until done; returns
+        True if at least one answer was received.
+        """
+        best_rtt_us = None
+        for _ in range(count):
+            ref = self.devices[ip]["reference"]
+            send_time_ns = time.monotonic_ns()
+            future = self.request(ip, protocol.QryMsg(protocol.Qry.QRY_SYSTEM_TIME, ref),
+                                  CLOCK_SYNC_TIMEOUT_SECONDS)
+            if future is None:
+                continue
+            self.devices[ip]["reference"] = self.next_reference(ref)
             try:
-                # Check which sockets have data
-                readable, _, exceptional = select.select(self.socket_list, [], [], 1.0)
-
-                for sock in readable:
-                    if sock is self.server_socket:
-                        # New connection
-                        client_sock, addr = self.server_socket.accept()
-                        client_ip = addr[0]
-
-                        if client_ip in self.devices:
-                            # Known device - accept
-                            self.devices[client_ip]["connected"] = True
-                            self.devices[client_ip]["sock"] = client_sock
-                            self.devices[client_ip]["initialised"] = False  # Reset init flag
-                            self.socket_list.append(client_sock)
-                            self.device_sockets[client_sock] = client_ip
-                            self.socket_buffers[client_sock] = b""  # Initialize buffer
-                            print(f"{self.devices[client_ip]['name']} connected from {client_ip}")
-
-                            # Send init command
-                            cmd = protocol.CmdMsg(self.devices[client_ip]["init"], self.devices[client_ip]["reference"], 0, 0, 0, 0)
-
-                            # Track this pending init with both reference and command
-                            self.pending_inits[client_sock] = (self.devices[client_ip]["reference"], self.devices[client_ip]["init"], time.time())
-
-                            # Send the command
-                            protocol.send_message(client_sock, cmd)
-                            self.devices[client_ip]["reference"] = self.next_reference(self.devices[client_ip]["reference"])
-                            print(f"  Sent init command (ref={self.devices[client_ip]["reference"]}) to {self.devices[client_ip]['name']}")
-                        else:
-                            # Unknown device - reject
-                            print(f"Rejected unknown device from {client_ip}")
-                            client_sock.close()
-
-                    elif sock in self.device_sockets:
-                        # Data from known device
-                        ip = self.device_sockets[sock]
-                        try:
-                            data = sock.recv(1024)
-                            if data:
-                                #print(f"{ip}: received {len(data)} byte(s): ", end='')
-                                #for item in data:
-                                #    print(f"{item:02x}", end='')
-                                #print("")
-                                # Add to buffer and try to parse complete messages
-                                self.socket_buffers[sock] += data
-
-                                # Try to parse messages from buffer
-                                while True:
-                                    if len(self.socket_buffers[sock]) < 1:
-                                        break
-
-                                    # Determine expected message size from magic byte
-                                    magic = self.socket_buffers[sock][0]
-                                    msg_size = None
-
-                                    if magic == protocol.PROTOCOL_MAGIC_RSP:
-                                        msg_size = protocol.RspMsg.SIZE
-                                    elif magic == protocol.PROTOCOL_MAGIC_IND:
-                                        msg_size = protocol.IndMsg.SIZE
-                                    else:
-                                        # Unknown magic - discard first byte and continue
-                                        # (silently ignores log messages and invalid data)
-                                        self.socket_buffers[sock] = self.socket_buffers[sock][1:]
-                                        continue
-
-                                    # Check if we have a complete message
-                                    if len(self.socket_buffers[sock]) >= msg_size:
-                                        # Extract and parse message
-                                        msg_data = self.socket_buffers[sock][:msg_size]
-                                        self.socket_buffers[sock] = self.socket_buffers[sock][msg_size:]
-
-                                        msg = self._parse_message(msg_data)
-                                        if msg:
-                                            # Check if this is a response to a pending init
-                                            if sock in self.pending_inits and isinstance(msg, protocol.RspMsg):
-                                                if self._handle_init_response(sock, ip, msg):
-                                                    # This response was consumed by init handling
-                                                    continue
-
-                                            # Not an init response, add to queue
-                                            self.incoming_queue.put((ip, msg))
-                                    else:
-                                        # Wait for more data
-                                        break
-                            else:
-                                # Connection closed
-                                self._handle_disconnect(sock, ip)
-                        except Exception as e:
-                            print(f"Error reading from {ip}: {e}")
-                            self._handle_disconnect(sock, ip)
-
-                # Handle exceptional conditions
-                for sock in exceptional:
-                    if sock in self.device_sockets:
-                        ip = self.device_sockets[sock]
-                        self._handle_disconnect(sock, ip)
-
-                # Clean up stale pending inits (timeout after 5 seconds)
-                current_time = time.time()
-                stale_socks = []
-                for sock, (ref, cmd, timestamp) in self.pending_inits.items():  # Unpack all 3 values
-                    if current_time - timestamp > 5.0:
-                        ip = self.device_sockets.get(sock, "unknown")
-                        print(f"Warning: Init response timeout for {ip}")
-                        stale_socks.append(sock)
-
-                for sock in stale_socks:
-                    if sock in self.pending_inits:
-                        del self.pending_inits[sock]
-
-            except Exception as e:
-                print(f"Error in receiver loop: {e}")
-                time.sleep(1)
+                msg = future.result()
+            except Exception:
+                continue
+            if msg.status == protocol.Status.STATUS_OK:
+                rtt_us = (msg.receive_time_ns - send_time_ns) // 1000
+                if best_rtt_us is None or rtt_us < best_rtt_us:
+                    best_rtt_us = rtt_us
+                    local_us = (send_time_ns + msg.receive_time_ns) // 2000
+                    self.devices[ip]["clock_offset_us"] = ((msg.value & 0xFFFFFFFF) - local_us) & 0xFFFFFFFF
+                    self.devices[ip]["clock_rtt_us"] = rtt_us
+
+        if best_rtt_us is None:
+            print(f"Unable to synchronise with the clock of {self.devices[ip]['name']}")
+            return False
+        print(f"Synchronised with the clock of {self.devices[ip]['name']}"
+              f" (best round trip {best_rtt_us / 1000:.1f} ms)")
+        return True
 
-    def _handle_disconnect(self, sock, ip):
-        """Clean up disconnected device"""
-        if ip in self.devices:
-            self.devices[ip]["connected"] = False
-            self.devices[ip]["sock"] = None
-            self.devices[ip]["initialised"] = False
-            print(f"{self.devices[ip]['name']} disconnected")
+    def sync_clocks(self) -> Dict[str, bool]:
+        """Synchronise with the clocks of all connected devices"""
+        results = {}
+        for ip in self.get_device_ip_list(connected=True, initialised=True):
+            results[ip] = self.sync_clock(ip)
+        return results
 
-        # Clean up pending init
-        if sock in self.pending_inits:
-            del self.pending_inits[sock]
+    def device_time(self, ip, local_time) -> Optional[int]:
+        """
+        Return the time of a device, in microseconds wrapping at 32 bits as
+        used by CMD_STEPPER_START_AT, that corresponds to local_time, a value
+        of time.monotonic(), or None if sync_clock() has not succeeded
+        """
+        offset_us = self.devices[ip].get("clock_offset_us")
+        if offset_us is None:
+            return None
+        return (int(local_time * 1000000) + offset_us) & 0xFFFFFFFF
 
-        if sock in self.socket_list:
-            self.socket_list.remove(sock)
-        if sock in self.device_sockets:
-            del self.device_sockets[sock]
-        if sock in self.socket_buffers:
-            del self.socket_buffers[sock]
+    def _handle_latency(self, ip, msg, receive_time_ns):
+        """Add the intervals of a latency message to the histograms of its node"""
+        if not isinstance(msg, protocol.LatMsg):
+            return False
 
-        try:
-            sock.close()
-        except:
-            pass
+        times = {stage: msg.time_us[stage] for stage in protocol.LatStage
+                 if stage < protocol.LatStage.LAT_STAGE_NUM and msg.time_us[stage] != 0}
+        if msg.cmd_or_ind == protocol.Ind.IND_SYSTEM_STEPPER_TARGET_END:
+            intervals = LATENCY_INTERVALS_IND
+        else:
+            intervals = LATENCY_INTERVALS_RSP
+            send_time_ns = self.command_send_times.pop((ip, msg.reference), None)
+            if send_time_ns is not None:
+                times[LAT_STAGE_SENT] = self.device_time(ip, send_time_ns / 1000000000)
+        times[LAT_STAGE_RECEIVED] = self.device_time(ip, receive_time_ns / 1000000000)
+
+        for name, stage_from, stage_to in intervals:
+            time_from = times.get(stage_from)
+            time_to = times.get(stage_to)
+            if time_from is not None and time_to is not None:
+                # The times wrap at 32 bits; anything "negative" is
+                # clock synchronisation error and is ignored
+                interval_us = (time_to - time_from) & 0xFFFFFFFF
+                if interval_us < 0x80000000:
+                    self.latency.add(self.devices[ip]["name"], name, interval_us)
+        return True
+
+    def get_latency(self) -> dict:
+        """Return the per-node latency histograms in a form that can be turned into JSON"""
+        return self.latency.to_dict()
 
     def _print_waiting_status(self, final=False, elapsed=0):
         """Print the current waiting status on a single line"""
@@ -323,8 +687,8 @@ class Esp32Server:
                     return False
 
             try:
-                sock = self.devices[ip]["sock"]
-                return protocol.send_message(sock, command)
+                self.command_send_times[(ip, command.reference)] = time.monotonic_ns()
+                return self._send(ip, command)
             except Exception as e:
                 print(f"Failed to send to {self.devices[ip]['name']}: {e}")
                 return False
@@ -336,7 +700,7 @@ class Esp32Server:
             reference = 0
         return reference
 
-    def send_query(self, ip: str, query: protocol.QryMsg) -> bool:
+    def send_query(self, ip: str, query: Union[protocol.QryMsg, protocol.QryManyMsg]) -> bool:
         """
         Send a query message to a specific device
         """
@@ -347,8 +711,7 @@ class Esp32Server:
                 return False
 
             try:
-                sock = self.devices[ip]["sock"]
-                return protocol.send_message(sock, query)
+                return self._send(ip, query)
             except Exception as e:
                 print(f"Failed to send to {self.devices[ip]['name']}: {e}")
                 return False
@@ -425,10 +788,17 @@ class Esp32Server:
         self.running = False
 
         # Close all sockets
-        for sock in self.socket_list:
-            try:
-                sock.close()
-            except:
-                pass
+        def shutdown():
+            self._server.close()
+            if self._datagram_transport is not None:
+                self._datagram_transport.close()
+            for info in self.devices.values():
+                if info["connection"] is not None:
+                    info["connection"].transport.close()
+            self._loop.stop()
+
+        if self._loop is not None and self._thread is not None and self._thread.is_alive():
+            self._loop.call_soon_threadsafe(shutdown)
+            self._thread.join(2.0)
 
         print("ESP32 server stopped")
@@ -17,6 +17,7 @@
 '''HTTPS server on a Raspberry Pi Wi-Fi access point to which clients can connect to download binary files for OTA updates.'''
 
 import asyncio
+import hashlib
 import ssl
 import logging
 import os
@@ -28,6 +29,7 @@ from aiohttp.client_exceptions import ClientConnectorError
 # These are the correct exceptions for server-side:
 from aiohttp.web_exceptions import HTTPClientError
 from aiohttp.web_ws import WebSocketError
+import ota_pack
 
 # The default directory to serve files from
 BASE_DIR_DEFAULT = '.'
@@ -35,6 +37,10 @@ BASE_DIR_DEFAULT = '.'
 # The default listening port
 LISTENING_PORT_DEFAULT = 8070
 
+# The number of hex digits of the SHA-256 of a file that go into its
+# ETag; the ESP32 keeps the ETag in a buffer of OTA_ETAG_MAX_LENGTH
+ETAG_LENGTH = 32
+
 # The certificate and key for HTTPS
 CERTIFICATE_FILE = "ca_cert.pem"
 CERTIFICATE_KEY_FILE = "ca_key.pem"
@@ -65,53 +71,106 @@ IP_TO_FILE_MAP = {
 logging.basicConfig(level=logging.INFO)
 logger = logging.getLogger(__name__)
 
+class RangeNotSatisfiable(Exception):
+    """The Range header of a request asks for bytes that the file does not have"""
+
+def parse_range(range_header, file_size):
+    """
+    Return the (start, end) of the bytes asked for by an HTTP Range
+    header, end being exclusive, or None if the header is absent or
+    not something we understand, in which case the whole file is
+    served; only a single range is supported, which is all an ESP32
+    resuming an OTA download asks for
+    """
+    if not range_header or not range_header.startswith('bytes='):
+        return None
+    ranges = range_header[len('bytes='):].split(',')
+    if len(ranges) != 1:
+        return None
+    first, _, last = ranges[0].strip().partition('-')
+    try:
+        if first:
+            start = int(first)
+            end = int(last) + 1 if last else file_size
+        else:
+            # A suffix: the last so many bytes
+            start = file_size - int(last)
+            end = file_size
+    except ValueError:
+        return None
+    start = max(start, 0)
+    end = min(end, file_size)
+    if start >= end:
+        raise RangeNotSatisfiable()
+    return start, end
+
+class FileCache:
+    """
+    Holds the files being served in memory, so that all of the
+    ESP32s can be served at once, at whatever offset each has
+    reached, without any of them waiting on the SD card; a file
+    is read again if it changes
+    """
+    def __init__(self):
+        self._files = {}  # Map path -> (modification time, size, contents, ETag)
+
+    def get(self, filepath):
+        """
+        Return the contents of a file as a memoryview and its ETag,
+        which is taken from the contents, so that a device resuming
+        a download can tell, with If-Range, whether it is still
+        getting the same file
+        """
+        stat = os.stat(filepath)
+        cached = self._files.get(filepath)
+        if not cached or cached[0] != stat.st_mtime_ns or cached[1] != stat.st_size:
+            with open(filepath, 'rb') as f:
+                contents = f.read()
+            etag = f'"{hashlib.sha256(contents).hexdigest()[:ETAG_LENGTH]}"'
+            cached = (stat.st_mtime_ns, stat.st_size, memoryview(contents), etag)
+            self._files[filepath] = cached
+            logger.info(f"Loaded {filepath} ({stat.st_size} bytes) into memory")
+        return cached[2], cached[3]
+
 class RobustFileSender:
     """Helper class to handle file sending with error recovery"""
     
-    def __init__(self, request, response, filepath, file_size):
+    def __init__(self, request, response, contents, start, end):
         self.request = request
         self.response = response
-        self.filepath = filepath
-        self.file_size = file_size
+        self.contents = contents
+        self.start = start
+        self.end = end
         self.bytes_sent = 0
         self.start_time = time.time()
         
     async def send_file(self):
         try:
-            with open(self.filepath, 'rb') as f:
-                # Send first chunk (64KB)
-                first_chunk = f.read(65536)
-                if first_chunk and not await self.safe_write(first_chunk):
+            offset = self.start
+            # Send first chunk (64KB)
+            chunk_size = 65536
+            while offset < self.end:
+                chunk = self.contents[offset:min(offset + chunk_size, self.end)]
+                if not await self.safe_write(chunk):
                     return False
-                
+                offset += len(chunk)
                 # Send remaining chunks
-                while True:
-                    chunk = f.read(16384)
-                    if not chunk:
-                        break
-                    
-                    if not await self.safe_write(chunk):
-                        return False
-                    
-                    # Check transfer speed occasionally
-                    if self.bytes_sent % (1024 * 1024) < 16384:  # Every ~1MB
-                        elapsed = time.time() - self.start_time
-                        if elapsed > 0:
-                            speed = self.bytes_sent / elapsed / 1024  # KB/s
-                            logger.debug(f"Transfer to {self.request.remote}: "
-                                       f"{self.bytes_sent}/{self.file_size} bytes "
-                                       f"({speed:.1f} KB/s)")
-                
-                logger.info(f"Complete transfer to {self.request.remote}: "
-                          f"{self.bytes_sent} bytes in {time.time()-self.start_time:.1f}s")
-                return True
+                chunk_size = 16384
+
+                # Check transfer speed occasionally
+                if self.bytes_sent % (1024 * 1024) < chunk_size:  # Every ~1MB
+                    elapsed = time.time() - self.start_time
+                    if elapsed > 0:
+                        speed = self.bytes_sent / elapsed / 1024  # KB/s
+                        logger.debug(f"Transfer to {self.request.remote}: "
+                                   f"{offset}/{len(self.contents)} bytes "
+                                   f"({speed:.1f} KB/s)")
+            
+            logger.info(f"Complete transfer to {self.request.remote}: "
+                      f"{self.bytes_sent} bytes from offset {self.start}"
+                      f" in {time.time()-self.start_time:.1f}s")
+            return True
                 
-        except FileNotFoundError:
-            logger.error(f"File disappeared: {self.filepath}")
-            return False
-        except PermissionError:
-            logger.error(f"Permission denied: {self.filepath}")
-            return False
         except Exception as e:
             logger.error(f"Unexpected error in file send: {e}")
             return False
@@ -142,6 +201,7 @@ class HandleFirmware:
     def __init__(self, base_path, differentiated_mode):
         self.base_path = base_path
         self.differentiated_mode = differentiated_mode
+        self.file_cache = FileCache()
     
     def map_filename(self, requested_file, client_ip):
         file = requested_file
@@ -157,6 +217,34 @@ class HandleFirmware:
                 file = actual_file
         return file
 
+    def choose_pack(self, filepath, running_sha256):
+        """
+        Return the path of a pack of a file (see ota_pack.py) to serve to
+        a device that is running the image with the given SHA-256, sent
+        in hex by devices able to unpack, or the path of the file itself
+        if there is no suitable pack
+        """
+        if not running_sha256:
+            return filepath
+        try:
+            running_sha256 = bytes.fromhex(running_sha256)
+            image_size = os.path.getsize(filepath)
+            with open(filepath, 'rb') as f:
+                f.seek(-ota_pack.SHA256_LENGTH, os.SEEK_END)
+                image_sha256 = f.read(ota_pack.SHA256_LENGTH)
+            for candidate in [ota_pack.pack_name(filepath, running_sha256), ota_pack.pack_name(filepath)]:
+                if os.path.isfile(candidate):
+                    with open(candidate, 'rb') as f:
+                        header = ota_pack.parse_header(f.read(ota_pack.PACK_HEADER_SIZE))
+                    # A pack left over from a previous build must not be served
+                    if header and header['sha256'] == image_sha256 and \
+                       header['base_sha256'] in (None, running_sha256) and \
+                       os.path.getsize(candidate) < image_size:
+                        return candidate
+        except (ValueError, OSError) as e:
+            logger.warning(f"Unable to choose a pack of {filepath}: {e}")
+        return filepath
+
     def get_available_files(self):
         try:
             files = []
@@ -199,14 +287,50 @@ class HandleFirmware:
                 error_msg += f". Available files: {', '.join(available_files)}"
             return web.Response(status=404, text=error_msg)
         
-        file_size = os.path.getsize(filepath)
-        logger.info(f"Serving {filepath} ({file_size} bytes) to {request.remote} (requested: {filename})")
-        
+        # A device that can unpack says what it is running
+        filepath = self.choose_pack(filepath, request.headers.get('X-Running-SHA256'))
+
+        try:
+            contents, etag = self.file_cache.get(filepath)
+        except OSError as e:
+            logger.error(f"Unable to read {filepath}: {e}")
+            return web.Response(status=500, text="Unable to read file")
+        file_size = len(contents)
+
+        # An ESP32 that lost its connection part way through asks
+        # for the rest of the file with a Range header, and with an
+        # If-Range header carrying the ETag it was given: if the file
+        # has changed since then it is sent all of the new one
+        range_header = request.headers.get('Range')
+        if_range = request.headers.get('If-Range')
+        if range_header and if_range is not None and if_range != etag:
+            logger.info(f"{filepath} has changed since {request.remote} began downloading it"
+                        f" (If-Range {if_range}, ETag {etag}), sending all of it")
+            range_header = None
+        try:
+            byte_range = parse_range(range_header, file_size)
+        except RangeNotSatisfiable:
+            logger.info(f"Unsatisfiable range '{range_header}' of {filepath}"
+                        f" ({file_size} bytes) from {request.remote}")
+            return web.Response(status=416, headers={'Content-Range': f"bytes */{file_size}",
+                                                     'ETag': etag})
+
         # Create streaming response
         response = web.StreamResponse()
         response.headers['Content-Type'] = 'application/octet-stream'
-        response.headers['Content-Length'] = str(file_size)
+        response.headers['Accept-Ranges'] = 'bytes'
         response.headers['Cache-Control'] = 'no-cache'
+        response.headers['ETag'] = etag
+        if byte_range:
+            start, end = byte_range
+            response.set_status(206)
+            response.headers['Content-Range'] = f"bytes {start}-{end - 1}/{file_size}"
+            logger.info(f"Serving {filepath} bytes {start} to {end - 1} of {file_size} to {request.remote}"
+                        f" (requested: {filename})")
+        else:
+            start, end = 0, file_size
+            logger.info(f"Serving {filepath} ({file_size} bytes) to {request.remote} (requested: {filename})")
+        response.headers['Content-Length'] = str(end - start)
         
         try:
             await response.prepare(request)
@@ -218,7 +342,7 @@ class HandleFirmware:
             return web.Response(status=500)
         
         # Use robust sender
-        sender = RobustFileSender(request, response, filepath, file_size)
+        sender = RobustFileSender(request, response, contents, start, end)
         success = await sender.send_file()
         
         if not success and sender.bytes_sent == 0:
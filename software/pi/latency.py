@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Histograms of the latencies reported by the ESP32s in LatMsg's."""
+
+import bisect
+import threading
+from typing import Dict, List, Optional
+
+class LatencyHistogram:
+    """A histogram of latencies, in microseconds"""
+    # The upper limit of each bucket, roughly logarithmic; the
+    # last bucket takes everything above the last limit
+    BUCKET_LIMITS_US = [100, 200, 500, 1000, 2000, 5000, 10000, 20000,
+                        50000, 100000, 200000, 500000, 1000000]
+
+    def __init__(self):
+        self.counts = [0] * (len(self.BUCKET_LIMITS_US) + 1)
+        self.count = 0
+        self.total_us = 0
+        self.min_us = None
+        self.max_us = None
+
+    def add(self, value_us: int):
+        """Add a latency to the histogram"""
+        self.counts[bisect.bisect_left(self.BUCKET_LIMITS_US, value_us)] += 1
+        self.count += 1
+        self.total_us += value_us
+        if self.min_us is None or value_us < self.min_us:
+            self.min_us = value_us
+        if self.max_us is None or value_us > self.max_us:
+            self.max_us = value_us
+
+    def percentile(self, fraction: float) -> Optional[int]:
+        """
+        Return an upper bound on the given fraction (e.g. 0.95) of the
+        latencies, to the resolution of the buckets, or None if empty
+        """
+        if self.count == 0:
+            return None
+        wanted = fraction * self.count
+        total = 0
+        for index, count in enumerate(self.counts):
+            total += count
+            if total >= wanted:
+                if index < len(self.BUCKET_LIMITS_US):
+                    return min(self.BUCKET_LIMITS_US[index], self.max_us)
+                break
+        return self.max_us
+
+    def to_dict(self) -> dict:
+        """Return the histogram in a form that can be turned into JSON"""
+        return {
+            'counts': list(self.counts),
+            'count': self.count,
+            'mean_us': self.total_us // self.count if self.count else None,
+            'min_us': self.min_us,
+            'max_us': self.max_us,
+            'p50_us': self.percentile(0.5),
+            'p95_us': self.percentile(0.95)
+        }
+
+class LatencyStats:
+    """
+    The latency histograms of each node, one per named interval;
+    added to by the receive thread of Esp32Server and read by whoever
+    wants to show them, hence the lock
+    """
+    def __init__(self, intervals: List[str]):
+        self._intervals = list(intervals)
+        self._nodes: Dict[str, Dict[str, LatencyHistogram]] = {}
+        self._lock = threading.Lock()
+
+    def add(self, node: str, interval: str, value_us: int):
+        """Add a latency for an interval to the histograms of a node"""
+        with self._lock:
+            histograms = self._nodes.setdefault(node, {})
+            histograms.setdefault(interval, LatencyHistogram()).add(value_us)
+
+    def clear(self):
+        """Throw away all of the histograms"""
+        with self._lock:
+            self._nodes.clear()
+
+    def to_dict(self) -> dict:
+        """Return all of the histograms in a form that can be turned into JSON"""
+        with self._lock:
+            nodes = {}
+            for node, histograms in self._nodes.items():
+                nodes[node] = {interval: histogram.to_dict()
+                               for interval, histogram in histograms.items()}
+            return {
+                'bucket_limits_us': list(LatencyHistogram.BUCKET_LIMITS_US),
+                'intervals': list(self._intervals),
+                'nodes': nodes
+            }
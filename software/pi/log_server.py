@@ -25,7 +25,8 @@ import struct
 import threading
 import select
 import time
-from systemd import journal
+import re
+import argparse
 from pathlib import Path
 
 # Add the protocol directory to Python path
@@ -36,21 +37,63 @@ script_dir = Path(__file__).resolve().parent
 protocol_dir = script_dir.parent / 'protocol'
 sys.path.insert(0, str(protocol_dir))
 
-from protocol import LogMsg, LogLevel
+from protocol import LogMsg, LogDeferredMsg, LogLevel
+from log_strings import LOG_STRINGS
+from log_store import LogStore
+
+# The first letter of an ESP-IDF log line, by log level
+LOG_LEVEL_LETTER = {
+    LogLevel.LOG_DEBUG: 'D',
+    LogLevel.LOG_INFO: 'I',
+    LogLevel.LOG_WARN: 'W',
+    LogLevel.LOG_ERROR: 'E',
+}
+
+# The C conversions that can appear in a deferred log format string
+C_CONVERSION = re.compile(r'%(?:%|[-+ #0]*\d*(?:\.\d+)?[diuxXoc])')
+
+def format_c(fmt, args):
+    """Format int32 arguments with a C printf() format string"""
+    args = iter(args)
+    def convert(match):
+        spec = match.group(0)
+        if spec == '%%':
+            return '%'
+        value = next(args, 0)
+        if spec[-1] in 'uxXo':
+            # The ESP32 would have treated these as unsigned
+            value &= 0xFFFFFFFF
+            if spec[-1] == 'u':
+                spec = spec[:-1] + 'd'
+        return spec % value
+    return C_CONVERSION.sub(convert, fmt)
 
 class ESP32LogServer:
-    def __init__(self, port=5001):
+    """
+    Receives log frames from the ESP32s; these go, in a batch per recv(),
+    to store, if given, and, if journal is True, one line at a time to
+    the systemd journal and the console: on a Pi with a read-only file
+    system the journal lives in RAM, and writing a line per log message
+    to it is what we want to avoid, so there journal should be False and
+    store should be flushing to a directory
+    """
+    def __init__(self, port=5001, store=None, journal=True):
         self.port = port
+        self.store = store
         self.server = None
         self.running = False
         self.clients = []  # Track active clients
         self.clients_lock = threading.Lock()
 
         # Set up logging to journal
-        self.logger = logging.getLogger('esp32_logger')
-        self.logger.propagate = False
-        self.logger.addHandler(journal.JournalHandler(SYSLOG_IDENTIFIER='esp32-device'))
-        self.logger.setLevel(logging.DEBUG)
+        self.logger = None
+        if journal:
+            # Imported here so that the server may be used where there is no journal
+            from systemd import journal as systemd_journal
+            self.logger = logging.getLogger('esp32_logger')
+            self.logger.propagate = False
+            self.logger.addHandler(systemd_journal.JournalHandler(SYSLOG_IDENTIFIER='esp32-device'))
+            self.logger.setLevel(logging.DEBUG)
 
     def start(self):
         """Start the log server"""
@@ -61,7 +104,8 @@ class ESP32LogServer:
         self.server.listen(10)  # Increased backlog
         
         print(f"ESP32 log server listening on port {self.port}")
-        print("[view messages with \"journalctl -t esp32-device\"]")
+        if self.logger:
+            print("[view messages with \"journalctl -t esp32-device\"]")
         self.running = True
         
         # Start a thread to clean up dead connections
@@ -100,7 +144,6 @@ class ESP32LogServer:
     def handle_client(self, client, addr):
         """Handle a connected ESP32 client in a separate thread"""
         buffer = b''
-        expected_size = LogMsg.SIZE
         client.settimeout(60.0)
         # Enable TCP keepalive on the client socket
         client.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)        
@@ -108,7 +151,7 @@ class ESP32LogServer:
         try:
             while self.running:
                 try:
-                    data = client.recv(1024)  # Read larger chunks
+                    data = client.recv(4096)  # The ESP32 sends log messages in batches
                     if not data:
                         print(f"Client {addr[0]} disconnected (normal)")
                         break
@@ -116,24 +159,45 @@ class ESP32LogServer:
                     # Add to buffer
                     buffer += data
                     
-                    # Process complete messages
-                    while len(buffer) >= expected_size:
-                        msg_data = buffer[:expected_size]
-                        buffer = buffer[expected_size:]
+                    # Process complete messages: each is a LogMsg header
+                    # followed by a variable amount of text or a
+                    # LogDeferredMsg header followed by its arguments;
+                    # walk through them with an offset, trimming the
+                    # buffer once at the end, and hand them on together
+                    log_msgs = []
+                    offset = 0
+                    while len(buffer) - offset >= LogMsg.SIZE:
+                        if buffer[offset] not in (LogMsg.MAGIC, LogDeferredMsg.MAGIC):
+                            # Out of step: skip to the next magic byte
+                            skip = 1
+                            while offset + skip < len(buffer) and buffer[offset + skip] not in (LogMsg.MAGIC, LogDeferredMsg.MAGIC):
+                                skip += 1
+                            print(f"WARNING: Invalid magic byte from {addr[0]}: {buffer[offset]:#x}, skipping {skip} byte(s)")
+                            offset += skip
+                            continue
+
+                        if buffer[offset] == LogDeferredMsg.MAGIC:
+                            size = LogDeferredMsg.frame_size(buffer, offset)
+                        else:
+                            size = LogMsg.frame_size(buffer, offset)
+                        if size == 0 or len(buffer) - offset < size:
+                            # Wait for the rest of the frame
+                            break
+                        msg_data = buffer[offset:offset + size]
+                        offset += size
                         
                         try:
-                            log_msg = LogMsg.unpack(msg_data)
-                            
-                            if log_msg.magic != LogMsg.MAGIC:
-                                print(f"WARNING: Invalid magic byte from {addr[0]}: {log_msg.magic:#x}")
-                                continue
-                            
-                            self.forward_to_journal(log_msg, addr)
+                            if msg_data[0] == LogDeferredMsg.MAGIC:
+                                log_msgs.append(self.format_deferred(msg_data))
+                            else:
+                                log_msgs.append(LogMsg.unpack(msg_data))
                             
                         except struct.error as e:
                             print(f"Struct unpacking error from {addr[0]}: {e}")
                         except Exception as e:
                             print(f"Error parsing log message from {addr[0]}: {e}")
+                    buffer = buffer[offset:]
+                    self.forward(log_msgs, addr)
                             
                 except socket.timeout:
                     continue
@@ -197,6 +261,34 @@ class ESP32LogServer:
         if self.server:
             self.server.close()
         print("Server stopped")
+
+    def format_deferred(self, data):
+        """Turn a deferred log message into a LogMsg, as ESP_LOGx() would have formatted it"""
+        deferred = LogDeferredMsg.unpack(data[:LogDeferredMsg.SIZE])
+        args = struct.unpack(f"<{deferred.num_args}i", data[LogDeferredMsg.SIZE:])
+        if deferred.id < len(LOG_STRINGS):
+            _, tag, fmt = LOG_STRINGS[deferred.id]
+            text = format_c(fmt, args)
+        else:
+            # The ESP32 firmware is newer than our copy of log_strings.py
+            tag = 'log'
+            text = f"unknown deferred log string {deferred.id}, arguments {args}"
+        letter = LOG_LEVEL_LETTER.get(deferred.level, '?')
+        return LogMsg(deferred.level, f"{letter} ({deferred.timestamp_ms}) {tag}: {text}")
+
+    def forward(self, log_msgs, addr):
+        """Forward a batch of ESP32 log messages to the store and/or the journal"""
+        if not log_msgs:
+            return
+        if self.store is not None:
+            self.store.add_many((addr[0], log_msg.level, clean_message, None)
+                                for log_msg in log_msgs
+                                for clean_message in [log_msg.message.rstrip('\x00').strip()]
+                                if clean_message)
+        if self.logger is not None:
+            for log_msg in log_msgs:
+                self.forward_to_journal(log_msg, addr)
+
     def forward_to_journal(self, log_msg, addr):
         """Forward ESP32 log message to systemd journal with IP prepended"""
 
@@ -243,13 +335,30 @@ class ESP32LogServer:
         print(f"LOG: {enhanced_message}")
         
 if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Receive log messages from the ESP32s')
+    parser.add_argument('-p', '--port', type=int, default=5001,
+                        help='the port to listen on (default 5001)')
+    parser.add_argument('-d', '--directory',
+                        help='instead of writing each message to the journal and the console,'
+                             ' keep them in RAM and write them, compressed and in batches, to'
+                             ' files in this directory, e.g. /var/log/musical_box, which is a'
+                             ' tmpfs on a Pi with a read-only file system')
+    args = parser.parse_args()
+
     # Configure logging to also show debug info
     logging.basicConfig(level=logging.DEBUG)
 
-    server = ESP32LogServer(port=5001)
+    store = None
+    if args.directory:
+        store = LogStore(directory=args.directory, name='esp32')
+        print(f"Writing log messages, compressed, to {args.directory}")
+    server = ESP32LogServer(port=args.port, store=store, journal=store is None)
     try:
         print("Starting ESP32 log server. Press Ctrl+C to stop.")
         server.start()
     except KeyboardInterrupt:
         print("\nShutting down...")
         server.stop()
+    finally:
+        if store:
+            store.close()
@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+A bounded, in-memory store of log entries for a Pi with a read-only file
+system: entries go into a ring of fixed size, indexed by node and by level
+so that a filtered read need not look at the whole history, and are
+optionally flushed, in gzip-compressed batches, to files in a directory on
+a tmpfs or writable partition, the number and size of which are also
+bounded.
+"""
+
+import collections
+import gzip
+import heapq
+import itertools
+import os
+import threading
+import time
+from datetime import datetime
+from pathlib import Path
+from typing import Callable, Deque, Dict, Iterable, Iterator, List, NamedTuple, Optional, Tuple
+
+import protocol
+
+# The default number of entries the ring holds
+LOG_STORE_CAPACITY_DEFAULT = 20000
+
+# How often entries are flushed to file, in seconds, unless
+# LOG_STORE_FLUSH_COUNT of them arrive first
+LOG_STORE_FLUSH_SECONDS = 5.0
+
+# The number of entries waiting that will cause an early flush
+LOG_STORE_FLUSH_COUNT = 1000
+
+# The size a file of flushed entries may grow to before a new one is
+# started, in bytes, and the number of such files that are kept
+LOG_STORE_FILE_MAX_BYTES = 1024 * 1024
+LOG_STORE_FILE_COUNT = 10
+
+# The letter used for each log level in the flushed files, as ESP-IDF does
+LOG_LEVEL_LETTER = {
+    protocol.LogLevel.LOG_DEBUG: 'D',
+    protocol.LogLevel.LOG_INFO: 'I',
+    protocol.LogLevel.LOG_WARN: 'W',
+    protocol.LogLevel.LOG_ERROR: 'E',
+}
+
+class LogEntry(NamedTuple):
+    sequence: int  # Goes up by one with each entry added to the store
+    time: float    # As time.time()
+    node: str      # e.g. the IP address of an ESP32
+    level: int     # protocol.LogLevel
+    text: str
+
+class LogStore:
+    """
+    The most recent capacity log entries, oldest first, added to by any
+    number of threads; each LogEntry carries a sequence number so that a
+    reader can ask for only what has arrived since it last looked
+    """
+    def __init__(self, capacity: int = LOG_STORE_CAPACITY_DEFAULT,
+                 directory: Optional[str] = None, name: str = 'log'):
+        self._capacity = capacity
+        self._ring: List[Optional[LogEntry]] = [None] * capacity
+        self._first = 0  # The sequence number of the oldest entry
+        self._next = 0   # The sequence number the next entry will have
+        # The sequence numbers of the entries in the ring, oldest
+        # first, by node and by level
+        self._node_index: Dict[str, Deque[int]] = {}
+        self._level_index: Dict[int, Deque[int]] = {}
+        self._lock = threading.Lock()
+        self._listeners = []
+
+        # Flushing to file, done by _flush_thread
+        self._directory = Path(directory) if directory else None
+        self._name = name
+        self._flushed = 0  # The sequence number of the next entry to flush
+        self._pending_flush: List[LogEntry] = []  # Taken by clear() before they were flushed
+        self.lost_count = 0  # Entries that left the ring before they could be flushed
+        self._file = None
+        self._flush_wanted = threading.Event()
+        self._flush_lock = threading.Lock()
+        self._running = self._directory is not None
+        self._flush_thread = None
+        if self._running:
+            self._directory.mkdir(parents=True, exist_ok=True)
+            self._flush_thread = threading.Thread(target=self._flush_loop, daemon=True)
+            self._flush_thread.start()
+
+    def add(self, node: str, level: int, text: str, entry_time: Optional[float] = None) -> LogEntry:
+        """Add an entry, returning it"""
+        return self.add_many([(node, level, text, entry_time)])[0]
+
+    def add_many(self, entries: Iterable[Tuple[str, int, str, Optional[float]]]) -> List[LogEntry]:
+        """
+        Add a batch of entries, each (node, level, text, time), time being
+        None for now, taking the lock once for all of them; returns them
+        as LogEntry's
+        """
+        added = []
+        now = time.time()
+        with self._lock:
+            for node, level, text, entry_time in entries:
+                entry = LogEntry(self._next, entry_time if entry_time is not None else now,
+                                 node, level, text)
+                position = self._next % self._capacity
+                evicted = self._ring[position]
+                if evicted is not None and evicted.sequence >= self._first:
+                    self._unindex(evicted)
+                    self._first = evicted.sequence + 1
+                self._ring[position] = entry
+                self._node_index.setdefault(node, collections.deque()).append(entry.sequence)
+                self._level_index.setdefault(level, collections.deque()).append(entry.sequence)
+                self._next += 1
+                added.append(entry)
+            waiting = self._next - self._flushed
+        if self._running and waiting >= LOG_STORE_FLUSH_COUNT:
+            self._flush_wanted.set()
+        for listener in list(self._listeners):
+            listener(added)
+        return added
+
+    def _unindex(self, entry: LogEntry):
+        """Remove the oldest entry from the indexes, with the lock held"""
+        for index, key in ((self._node_index, entry.node), (self._level_index, entry.level)):
+            sequences = index[key]
+            sequences.popleft()
+            if not sequences:
+                del index[key]
+
+    def add_listener(self, listener: Callable[[List[LogEntry]], None]):
+        """Call listener(entries) with each batch of entries added; it is
+        called from whichever thread added them and so must be thread-safe"""
+        self._listeners.append(listener)
+
+    def remove_listener(self, listener):
+        """Stop calling a listener given to add_listener()"""
+        if listener in self._listeners:
+            self._listeners.remove(listener)
+
+    def entries(self, node: Optional[str] = None, level: Optional[int] = None,
+                since: Optional[int] = None, limit: Optional[int] = None) -> List[LogEntry]:
+        """
+        Return, oldest first, the most recent limit entries (all of them if
+        limit is None) from node (any node if None) at level or above (any
+        level if None) with a sequence number greater than since (any if
+        None); the search goes back from the newest entry through the
+        index of the node, or those of the levels, and stops as soon as it
+        has enough, so does not copy the whole history
+        """
+        with self._lock:
+            sequences = self._sequences_newest_first(node, level)
+            if since is not None:
+                sequences = itertools.takewhile(lambda sequence: sequence > since, sequences)
+            if limit is not None:
+                sequences = itertools.islice(sequences, max(limit, 0))
+            found = [self._ring[sequence % self._capacity] for sequence in sequences]
+        found.reverse()
+        return found
+
+    def _sequences_newest_first(self, node, level) -> Iterator[int]:
+        """Return an iterator over the sequence numbers of the entries that
+        match node and level, newest first, with the lock held"""
+        if node is not None:
+            sequences = reversed(self._node_index.get(node, ()))
+            if level is not None:
+                sequences = (sequence for sequence in sequences
+                             if self._ring[sequence % self._capacity].level >= level)
+            return sequences
+        if level is not None:
+            # Merge the indexes of the levels asked for
+            return heapq.merge(*[reversed(sequences) for key, sequences in self._level_index.items()
+                                 if key >= level], reverse=True)
+        return iter(range(self._next - 1, self._first - 1, -1))
+
+    def nodes(self) -> List[str]:
+        """Return the nodes that have entries in the store"""
+        with self._lock:
+            return list(self._node_index)
+
+    def last_sequence(self) -> int:
+        """Return the sequence number of the most recent entry, -1 if there has never been one"""
+        with self._lock:
+            return self._next - 1
+
+    def clear(self):
+        """Throw away all of the entries; any not yet flushed are still flushed"""
+        with self._lock:
+            self._flush_snapshot_locked()
+            self._first = self._next
+            self._node_index.clear()
+            self._level_index.clear()
+
+    # ===== Flushing to file =====
+
+    def _flush_snapshot_locked(self) -> List[LogEntry]:
+        """Take the entries not yet flushed, with the lock held"""
+        start = self._flushed
+        if start < self._first:
+            self.lost_count += self._first - start
+            start = self._first
+        self._flushed = self._next
+        pending = [self._ring[sequence % self._capacity] for sequence in range(start, self._next)]
+        if self._directory is not None:
+            self._pending_flush.extend(pending)
+        return pending
+
+    def flush(self):
+        """Write whatever has not yet been written to file, as one gzip member"""
+        if self._directory is None:
+            return
+        with self._flush_lock:
+            with self._lock:
+                self._flush_snapshot_locked()
+                pending = self._pending_flush
+                self._pending_flush = []
+            if pending:
+                lines = ''.join(self._format(entry) for entry in pending)
+                self._write(gzip.compress(lines.encode('utf-8', 'replace')), len(pending))
+
+    @staticmethod
+    def _format(entry: LogEntry) -> str:
+        """Return an entry as a line of a flushed file"""
+        timestamp = datetime.fromtimestamp(entry.time).strftime('%Y-%m-%d %H:%M:%S.%f')[:-3]
+        letter = LOG_LEVEL_LETTER.get(entry.level, '?')
+        text = entry.text.replace('\n', ' ')
+        return f"{timestamp} [{entry.node}] {letter} {text}\n"
+
+    def _write(self, data: bytes, count: int):
+        """Append the compressed data of count entries to the current file, starting a new one,
+        and deleting the oldest, as required; the files are concatenated
+        gzip members, which zcat and gzip.open() read as one"""
+        try:
+            if self._file is None or self._file.tell() + len(data) > LOG_STORE_FILE_MAX_BYTES:
+                if self._file is not None:
+                    self._file.close()
+                name = f"{self._name}-{datetime.now().strftime('%Y%m%d-%H%M%S-%f')}.log.gz"
+                self._file = open(self._directory / name, 'ab')
+                files = sorted(self._directory.glob(f"{self._name}-*.log.gz"))
+                for old in files[:-LOG_STORE_FILE_COUNT]:
+                    os.remove(old)
+            self._file.write(data)
+            self._file.flush()
+        except OSError as e:
+            # Nowhere to write is no reason to stop logging to memory
+            self._file = None
+            self.lost_count += count
+            print(f"Unable to write log file in {self._directory}: {e}")
+
+    def _flush_loop(self):
+        """The flush thread: flushes every LOG_STORE_FLUSH_SECONDS, or
+        sooner if LOG_STORE_FLUSH_COUNT entries are waiting"""
+        while self._running:
+            self._flush_wanted.wait(LOG_STORE_FLUSH_SECONDS)
+            self._flush_wanted.clear()
+            self.flush()
+
+    def close(self):
+        """Flush anything that is waiting and stop flushing"""
+        if self._flush_thread is not None:
+            self._running = False
+            self._flush_wanted.set()
+            self._flush_thread.join(2.0)
+            self._flush_thread = None
+            self.flush()
+            if self._file is not None:
+                self._file.close()
+                self._file = None
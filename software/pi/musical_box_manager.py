@@ -16,6 +16,7 @@
 
 import socket
 import select
+import struct
 import queue
 import threading
 import time
@@ -25,7 +26,7 @@ from time import sleep
 from datetime import datetime
 from pathlib import Path
 from typing import Optional, Union, Dict, List, Tuple
-from esp32_server import Esp32Server
+from esp32_server import Esp32Server, RESPONSE_TIMEOUT_SECONDS
 
 # Add the protocol directory to Python path
 # Get the directory where THIS script is located
@@ -38,10 +39,64 @@ protocol_dir = script_dir.parent / 'protocol'
 sys.path.insert(0, str(protocol_dir))
 
 import protocol
+from state_rules import STATE_RULES, ROLE_CURRENT_MAX_MA
+from stats import NodeStats
 
 # The default listening port
 ESP32_PORT_DEFAULT = 5000
 
+# How far ahead to set a synchronised start, in seconds: must be
+# long enough for the commands to reach all of the devices
+START_AT_LEAD_SECONDS = 0.25
+
+# How often to ask each device for its statistics, see QRY_SYSTEM_STATS,
+# in seconds, and how many of the answers to keep for each device
+STATS_POLL_SECONDS = 5
+STATS_HISTORY_LENGTH = 120
+
+# The bit position of each query that can be part of a QryManyMsg; built
+# by name one way round since, where a query has the same value as a
+# QRY_*_BEGIN marker, it is the marker that Python calls it by
+QUERY_MANY_BITS = {protocol.Qry[bit.name.replace("QRY_MANY_", "QRY_", 1)]: bit
+                   for bit in protocol.QryMany if bit != protocol.QryMany.QRY_MANY_NUM}
+
+def query_many_bit(query_type):
+    '''Return the bit position of a query in the bitmask of a QryManyMsg'''
+    return QUERY_MANY_BITS[query_type]
+
+def state_role(value):
+    '''Return the role of a state, command or query, see STATE_RULE_ROLE()
+    in state_rules.h'''
+    return int(value) >> 12
+
+# The rules of state_rules.h, as applied by filter_and_conclude() in
+# stepper.c: (velocity rule, stop rule) by target state and the most
+# current, in milliAmps, by role
+TARGET_RULES = {protocol.State[state]: rule for state, rule in STATE_RULES.items()}
+ROLE_CURRENT_MAX_MA_BY_ROLE = {state_role(protocol.State[begin]): current_max_ma
+                               for begin, current_max_ma in ROLE_CURRENT_MAX_MA.items()}
+
+def check_target(init, target_state, velocity_mhz, current_ma):
+    '''Check a target for a device that was sent init (a CMD_*_INIT) in the
+    same way as the device will; returns (velocity_mhz, problem), where
+    velocity_mhz is that which the device will use, e.g. with its sign
+    corrected, or None if the device will refuse the target, and problem
+    describes anything wrong, None if there was nothing'''
+    role = state_role(init)
+    rule = TARGET_RULES.get(int(target_state))
+    if current_ma > ROLE_CURRENT_MAX_MA_BY_ROLE.get(role, 0):
+        return None, f"current {current_ma} mA is more than the {ROLE_CURRENT_MAX_MA_BY_ROLE.get(role, 0)} mA allowed"
+    if rule is None or state_role(target_state) != role:
+        return None, f"target state 0x{int(target_state):04x} is not applicable"
+    velocity_rule = rule[0]
+    if velocity_rule == 'STATE_RULE_VELOCITY_ZERO':
+        if velocity_mhz != 0:
+            return 0, f"velocity {velocity_mhz} mHz zeroed for a \"stopped\" target state"
+    elif ((velocity_rule == 'STATE_RULE_VELOCITY_POSITIVE' and velocity_mhz < 0) or
+          (velocity_rule == 'STATE_RULE_VELOCITY_NEGATIVE' and velocity_mhz > 0)):
+        return -velocity_mhz, f"sign of velocity {velocity_mhz} mHz doesn't match the target state, negated"
+    return velocity_mhz, None
+
 class MusicalBoxManager(Esp32Server):
     """Specialised manager for the Musical Box stuff"""
     def __init__(self):
@@ -70,9 +125,19 @@ class MusicalBoxManager(Esp32Server):
         self._lift_sensors = {}  # ip -> {'down': bool, 'limit': bool}
         self._door_sensors = {}  # ip -> {'open': bool}
         self._plinky_plonky_sensor = {}  # ip -> {'reference': bool}
-        
-        # Track pending queries (for correlating responses)
-        self.pending_queries = {}  # (ip, reference) -> query_type
+
+        # Track step positions, for devices that support moving to a position
+        self._position = {}  # ip -> position in steps
+
+        # Track the most recent telemetry, see CMD_STEPPER_TELEMETRY
+        self._telemetry = {}  # ip -> list of (timestamp_ms, sg_result, tstep, current_ma)
+
+        # The recent statistics of each device, by name, see poll_stats()
+        self.stats = NodeStats(STATS_HISTORY_LENGTH)
+        self._stats_poll_time = None
+
+        # Called with (ip, IndMsg) for every indication, see add_indication_listener()
+        self._indication_listeners = []
         
         # Track current reference for each device (already in self.devices)
         # We'll use self.devices[ip]["reference"] for commands/queries
@@ -84,6 +149,16 @@ class MusicalBoxManager(Esp32Server):
         """Set a callback function for logging"""
         self.log_callback = callback
     
+    def add_indication_listener(self, listener):
+        """Call listener(ip, msg) for every indication, once the state it
+        carries has been recorded, from the thread calling _process_message()"""
+        self._indication_listeners.append(listener)
+
+    def remove_indication_listener(self, listener):
+        """Stop calling a listener given to add_indication_listener()"""
+        if listener in self._indication_listeners:
+            self._indication_listeners.remove(listener)
+
     def _log(self, message):
         """Log a message using callback if available, otherwise print"""
         if self.log_callback:
@@ -149,26 +224,43 @@ class MusicalBoxManager(Esp32Server):
         
         if isinstance(msg, protocol.RspMsg):
             return self._process_response(ip, device_name, msg)
+        elif isinstance(msg, protocol.RspManyMsg):
+            return self._process_response_many(ip, device_name, msg)
         elif isinstance(msg, protocol.IndMsg):
             return self._process_indication(ip, device_name, msg)
+        elif isinstance(msg, protocol.TlmMsg):
+            return self._process_telemetry(ip, device_name, msg)
+        elif isinstance(msg, protocol.StatsMsg):
+            return self._process_stats(ip, device_name, msg)
     
     def _process_response(self, ip, device_name, msg):
-        """Process a response message"""
-        cmd_or_qry = msg.cmd_or_qry
-        ref = msg.reference
-        status = msg.status
-        value = msg.value
-        
-        print(f"{device_name}: response to {self.formatter.cmd_or_qry(cmd_or_qry)}, "
-              f"ref={ref}: status={self.formatter.status(status)} (value=0x{value:04x})")
-        
-        # Check if this is a response to a query we sent
-        query_key = (ip, ref)
-        if query_key in self.pending_queries:
-            query_type = self.pending_queries.pop(query_key)
-            self._handle_query_response(ip, device_name, query_type, value, status)
-        
+        """Process a response message that nobody was waiting for, which is
+        that of a command sent with send_command(): the responses to queries
+        go to the futures of request_query() and request_query_many()"""
+        print(f"{device_name}: response to {self.formatter.cmd_or_qry(msg.cmd_or_qry)}, "
+              f"ref={msg.reference}: status={self.formatter.status(msg.status)} (value=0x{msg.value:04x})")
+        return True
+
+    def _process_response_many(self, ip, device_name, msg):
+        """Process the response to a query many that nobody was waiting for,
+        e.g. one that arrived after its future timed out"""
+        print(f"{device_name}: response to query many 0x{msg.queries:04x}, ref={msg.reference}:"
+              f" status={self.formatter.status(msg.status)} (answered=0x{msg.answered:04x}), ignored")
         return True
+
+    def _handle_query_many_response(self, ip, device_name, query_types, msg):
+        """Handle the response to a query many, handling each answer as if
+        it had arrived in its own response"""
+        print(f"{device_name}: response to query many 0x{msg.queries:04x}, ref={msg.reference}:"
+              f" status={self.formatter.status(msg.status)} (answered=0x{msg.answered:04x})")
+        for query_type in query_types:
+            bit = query_many_bit(query_type)
+            status = protocol.Status.STATUS_OK
+            if not msg.answered & (1 << bit):
+                status = msg.status
+                if status == protocol.Status.STATUS_OK:
+                    status = protocol.Status.STATUS_ERROR_UNHANDLED_QUERY
+            self._handle_query_response(ip, device_name, query_type, msg.value[bit], status)
     
     def _handle_query_response(self, ip, device_name, query_type, value, status):
         """Handle response to a specific query"""
@@ -192,6 +284,10 @@ class MusicalBoxManager(Esp32Server):
             elif self.is_door(ip):
                 self._door_state[ip] = value
                 print(f"  Door {self.which_door(ip)} state: {self.formatter.state(value)}")
+
+        elif query_type == protocol.Qry.QRY_SYSTEM_STEPPER_POSITION:
+            self._position[ip] = value
+            print(f"  {device_name} position: {value} step(s)")
         
         elif query_type == protocol.Qry.QRY_LIFT_SENSOR_DOWN:
             self._lift_sensors.setdefault(ip, {})['down'] = bool(value)
@@ -208,20 +304,65 @@ class MusicalBoxManager(Esp32Server):
         elif query_type == protocol.Qry.QRY_DOOR_SENSOR_OPEN:
             self._door_sensors.setdefault(ip, {})['open'] = bool(value)
             print(f"  Door open sensor: {'TRIGGERED' if value else 'clear'}")
+
+        self._notify_change(ip)
     
+    def _process_telemetry(self, ip, device_name, msg):
+        """Process a telemetry message; only that of motor 0 is kept"""
+        if msg.motor != 0:
+            self._log(f"{device_name}: telemetry for motor {msg.motor}, ignored")
+            return True
+        samples = []
+        for x in range(min(msg.num_samples, protocol.TLM_MAX_SAMPLES)):
+            samples.append((msg.timestamp_ms + x * msg.period_ms,
+                            msg.sg_result[x], msg.tstep[x], msg.current_ma[x]))
+        self._telemetry[ip] = samples
+        if samples:
+            sg_result = [sample[1] for sample in samples]
+            self._log(f"{device_name}: telemetry, {len(samples)} sample(s) from {msg.timestamp_ms} ms"
+                      f" every {msg.period_ms} ms, SG_RESULT {min(sg_result)} to {max(sg_result)},"
+                      f" TSTEP {samples[-1][2]}, {samples[-1][3]} mA")
+        return True
+
+    def get_telemetry(self, ip):
+        '''Return the most recent telemetry samples from a device as a list of
+        (timestamp_ms, sg_result, tstep, current_ma)'''
+        return self._telemetry.get(ip, [])
+
+    def _process_stats(self, ip, device_name, msg):
+        """Process a statistics message, which follows the response to a QRY_SYSTEM_STATS"""
+        self.stats.add(device_name, msg)
+        return True
+
+    def get_stats(self):
+        '''Return the recent statistics of all of the devices in a form that
+        can be turned into JSON'''
+        return self.stats.to_dict()
+
     def _process_indication(self, ip, device_name, msg):
         """Process an indication message"""
         ind = msg.ind
         value = msg.value
         
-        self._log(f"{device_name}: indication {self.formatter.ind(ind)} (value={value})")
+        self._log(f"{device_name}: indication {self.formatter.ind(ind)} (value={value}, motor {msg.motor})")
         
-        if ind == protocol.Ind.IND_SYSTEM_STEPPER_TARGET_END:
+        if msg.motor != 0:
+            # The state kept here is that of motor 0 of each device,
+            # the listeners can deal with any others
+            pass
+        elif ind == protocol.Ind.IND_SYSTEM_STEPPER_TARGET_END:
             self._log(f"  Stepper movement completed with status {self.formatter.status(value)}")
             # If this is a door, query its state
             if self.is_door(ip):
                 self._log(f"  Door {self.which_door(ip)} movement completed, querying door state...")
                 self.query_door_state(ip)
+
+        elif ind == protocol.Ind.IND_SYSTEM_STATE:
+            # From the heartbeat of the UDP channel, which only gets
+            # this far when the state has changed
+            for states in (self._stand_state, self._lift_state, self._plinky_plonky_state, self._door_state):
+                if ip in states:
+                    states[ip] = value
         
         elif ind == protocol.Ind.IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN:
             self._door_sensors.setdefault(ip, {})['open'] = bool(value)
@@ -243,6 +384,11 @@ class MusicalBoxManager(Esp32Server):
             self._plinky_plonky_sensor.setdefault(ip, {})['reference'] = bool(value)
             if value:
                 self._plinky_plonky_state[ip] = protocol.State.STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE
+
+        self._notify_change(ip)
+
+        for listener in list(self._indication_listeners):
+            listener(ip, msg)
     
     # ===== Status APIs with Sensor Fallback =====
     
@@ -373,75 +519,239 @@ class MusicalBoxManager(Esp32Server):
             ip = self.get_ip_plinky_plonky()
         return self._plinky_plonky_state.get(ip) == protocol.State.STATE_PLINKY_PLONKY_PLAYING
     
+    def sensors(self, ip):
+        """Get the last known state of the sensors of a device, a dict of
+        sensor name (e.g. 'open') -> True if triggered"""
+        sensors = {}
+        for table in (self._lift_sensors, self._door_sensors, self._plinky_plonky_sensor):
+            sensors.update(table.get(ip, {}))
+        return sensors
+
+    def position(self, ip):
+        """Get the last known step position of a device, None if not known"""
+        return self._position.get(ip)
+
     # ===== Enhanced Command Methods with Automatic State Tracking =====
     
-    def send_query_with_tracking(self, ip, query, query_type):
-        """Send a query and track it for response handling"""
-        ref = self.devices[ip]["reference"]
-        self.pending_queries[(ip, ref)] = query_type
-        qry_msg = protocol.QryMsg(query, ref)
-        success = self.send_query(ip, qry_msg)
-        if success:
+    def _request_tracked(self, ip, msg, handle_response, timeout):
+        """Send a query or query many through request(), calling handle_response(msg)
+        with the response, from the thread of the server, before whoever is waiting
+        on the future that is returned gets it; None if it could not be sent"""
+        ref = msg.reference
+        future = self.request(ip, msg, timeout)
+        if future is not None:
             self.devices[ip]["reference"] = self.next_reference(ref)
-        else:
-            # Remove tracking if send failed
-            self.pending_queries.pop((ip, ref), None)
-        return success
-    
+
+            def done(future):
+                if future.cancelled():
+                    return
+                if future.exception() is not None:
+                    self._log(f"{self.devices[ip]['name']}: no response to ref={ref}"
+                              f" ({future.exception()})")
+                    return
+                handle_response(future.result())
+
+            # Callbacks are called in the order they are added, so this
+            # gets in before whoever is waiting on the future
+            future.add_done_callback(done)
+        return future
+
+    def request_query(self, ip, query_type, timeout=RESPONSE_TIMEOUT_SECONDS):
+        """Send a query: returns a future that is given the RspMsg, once the state
+        tracked here has been updated from it, or None if the query could not be sent"""
+        msg = protocol.QryMsg(query_type, self.devices[ip]["reference"])
+        return self._request_tracked(ip, msg,
+                                     lambda rsp: self._handle_query_response(ip, self.devices[ip]["name"],
+                                                                             query_type, rsp.value, rsp.status),
+                                     timeout)
+
+    def request_query_many(self, ip, query_types, timeout=RESPONSE_TIMEOUT_SECONDS):
+        """Send several queries in a single message: returns a future that is given
+        the single RspManyMsg with all of the answers, once the state tracked here
+        has been updated from each of them, or None if the queries could not be sent"""
+        query_types = list(query_types)
+        queries = 0
+        for query_type in query_types:
+            queries |= 1 << query_many_bit(query_type)
+        msg = protocol.QryManyMsg(self.devices[ip]["reference"], queries)
+        return self._request_tracked(ip, msg,
+                                     lambda rsp: self._handle_query_many_response(ip, self.devices[ip]["name"],
+                                                                                  query_types, rsp),
+                                     timeout)
+
+    def poll_stats(self):
+        """Ask every device that is ready for its statistics if it is
+        STATS_POLL_SECONDS since they were last asked for; call this at
+        least once a second.  The responses go to request(), so as not to
+        fill the log, and the StatsMsg's that follow them to _process_stats()"""
+        now = time.monotonic()
+        if self._stats_poll_time is not None and now - self._stats_poll_time < STATS_POLL_SECONDS:
+            return
+        self._stats_poll_time = now
+        for ip in self.get_device_ip_list(connected=True, initialised=True):
+            ref = self.devices[ip]["reference"]
+            if self.request(ip, protocol.QryMsg(protocol.Qry.QRY_SYSTEM_STATS, ref)) is not None:
+                self.devices[ip]["reference"] = self.next_reference(ref)
+
+    def query_status(self, ip):
+        """Query the state of a device and all of its sensors in one go"""
+        query_types = [protocol.Qry.QRY_SYSTEM_STEPPER_STATE]
+        if self.is_lift(ip):
+            query_types += [protocol.Qry.QRY_LIFT_SENSOR_DOWN, protocol.Qry.QRY_LIFT_SENSOR_LIMIT]
+        elif self.is_plinky_plonky(ip):
+            query_types.append(protocol.Qry.QRY_PLINKY_PLONKY_SENSOR_REFERENCE)
+        elif self.is_door(ip):
+            query_types.append(protocol.Qry.QRY_DOOR_SENSOR_OPEN)
+        return self.request_query_many(ip, query_types)
+
     def query_stand_state(self, ip=None):
         """Query stand state"""
         if ip is None:
             ip = self.get_ip_stand();
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+        return self.request_query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
     
     def query_lift_state(self, ip=None):
         """Query the current lift state"""
         if ip is None:
             ip = self.get_ip_lift();
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+        return self.request_query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
     
     def query_lift_sensors(self, ip=None):
         """Query both lift sensors"""
         if ip is None:
             ip = self.get_ip_lift();
-        self.send_query_with_tracking(ip, protocol.Qry.QRY_LIFT_SENSOR_DOWN, protocol.Qry.QRY_LIFT_SENSOR_DOWN)
-        self.send_query_with_tracking(ip, protocol.Qry.QRY_LIFT_SENSOR_LIMIT, protocol.Qry.QRY_LIFT_SENSOR_LIMIT)
+        return self.request_query_many(ip, [protocol.Qry.QRY_LIFT_SENSOR_DOWN,
+                                            protocol.Qry.QRY_LIFT_SENSOR_LIMIT])
     
     def query_plinky_plonky_state(self, ip=None):
         """Query plinky-plonky state"""
         if ip is None:
             ip = self.get_ip_plinky_plonky();
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+        return self.request_query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
     
     def query_plinky_plonky_sensor(self, ip=None):
         """Query plinky-plonky reference sensor"""
         if ip is None:
             ip = self.get_ip_plinky_plonky()
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_PLINKY_PLONKY_SENSOR_REFERENCE, 
-                                     protocol.Qry.QRY_PLINKY_PLONKY_SENSOR_REFERENCE)
+        return self.request_query(ip, protocol.Qry.QRY_PLINKY_PLONKY_SENSOR_REFERENCE)
 
     def query_door_state(self, ip=None, index=None):
         """Query door state"""
         if ip is None and index is not None:
             ip = self.get_ip_door(index)
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+        return self.request_query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
     
     def query_door_sensor(self, ip=None, index=None):
         """Query door open sensor"""
         if ip is None and index is not None:
             ip = self.get_ip_door(index)
-        return self.send_query_with_tracking(ip, protocol.Qry.QRY_DOOR_SENSOR_OPEN, protocol.Qry.QRY_DOOR_SENSOR_OPEN)
+        return self.request_query(ip, protocol.Qry.QRY_DOOR_SENSOR_OPEN)
     
+    def query_position(self, ip):
+        """Query the step position of a device"""
+        return self.request_query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_POSITION)
+
     def send_cmd_stepper_target_start(self, name_operation, ip, name_device, reference, target_state, velocity_mhz, current_ma, timeout_ms):
         '''Helper function to send CMD_STEPPER_TARGET_START'''
+        velocity_mhz = self._check_target(name_operation, ip, name_device, target_state, velocity_mhz, current_ma)
+        if velocity_mhz is None:
+            return False
         print(f"{name_operation}: CMD_STEPPER_TARGET_START (ref {reference}) to {name_device} ({ip})"
               f", target state {target_state.name}, velocity {velocity_mhz} mHz,"
               f" {current_ma} mA, timeout {timeout_ms} ms.")
         cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TARGET_START, reference, target_state, velocity_mhz, current_ma, timeout_ms)
+        return self.send_command(ip, cmd)
+
+    def send_cmd_stepper_target_position_start(self, name_operation, ip, name_device, reference, target_state, velocity_mhz, current_ma, position):
+        '''Helper function to send CMD_STEPPER_TARGET_POSITION_START'''
+        velocity_mhz = self._check_target(name_operation, ip, name_device, target_state, velocity_mhz, current_ma)
+        if velocity_mhz is None:
+            return False
+        print(f"{name_operation}: CMD_STEPPER_TARGET_POSITION_START (ref {reference}) to {name_device} ({ip})"
+              f", target state {target_state.name}, velocity {velocity_mhz} mHz,"
+              f" {current_ma} mA, position {position}.")
+        cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TARGET_POSITION_START, reference, target_state, velocity_mhz, current_ma, position)
+        return self.send_command(ip, cmd)
+
+    def send_cmd_stepper_target_append(self, name_operation, ip, name_device, reference, target_state, velocity_mhz, current_ma, timeout_ms):
+        '''Helper function to send CMD_STEPPER_TARGET_APPEND: like CMD_STEPPER_TARGET_START
+        but queued on the device behind whatever target is running'''
+        velocity_mhz = self._check_target(name_operation, ip, name_device, target_state, velocity_mhz, current_ma)
+        if velocity_mhz is None:
+            return False
+        print(f"{name_operation}: CMD_STEPPER_TARGET_APPEND (ref {reference}) to {name_device} ({ip})"
+              f", target state {target_state.name}, velocity {velocity_mhz} mHz,"
+              f" {current_ma} mA, timeout {timeout_ms} ms.")
+        cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TARGET_APPEND, reference, target_state, velocity_mhz, current_ma, timeout_ms)
+        return self.send_command(ip, cmd)
+
+    def send_cmd_stepper_target_position_append(self, name_operation, ip, name_device, reference, target_state, velocity_mhz, current_ma, position):
+        '''Helper function to send CMD_STEPPER_TARGET_POSITION_APPEND: like
+        CMD_STEPPER_TARGET_POSITION_START but queued on the device behind whatever
+        target is running'''
+        velocity_mhz = self._check_target(name_operation, ip, name_device, target_state, velocity_mhz, current_ma)
+        if velocity_mhz is None:
+            return False
+        print(f"{name_operation}: CMD_STEPPER_TARGET_POSITION_APPEND (ref {reference}) to {name_device} ({ip})"
+              f", target state {target_state.name}, velocity {velocity_mhz} mHz,"
+              f" {current_ma} mA, position {position}.")
+        cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TARGET_POSITION_APPEND, reference, target_state, velocity_mhz, current_ma, position)
+        return self.send_command(ip, cmd)
+
+    def _check_target(self, name_operation, ip, name_device, target_state, velocity_mhz, current_ma):
+        '''Check a target with check_target(), logging any problem, returning
+        the velocity to send or None if the target should not be sent'''
+        velocity_mhz, problem = check_target(self.devices[ip]["init"], target_state, velocity_mhz, current_ma)
+        if problem is not None:
+            self._log(f"{name_operation}: {'ERROR' if velocity_mhz is None else 'WARNING'}: target"
+                      f" {protocol.State(target_state).name} for {name_device} ({ip}), {problem}.")
+        return velocity_mhz
+
+    def send_cmd_stepper_start_at(self, name_operation, ip, name_device, reference, start_time):
+        '''Helper function to send CMD_STEPPER_START_AT: start_time is a value of
+        time.monotonic(), converted to the time of the device using the offset found
+        by sync_clock(); returns False if the clock of the device is not known'''
+        device_time_us = self.device_time(ip, start_time)
+        if device_time_us is None:
+            return False
+        print(f"{name_operation}: CMD_STEPPER_START_AT (ref {reference}) to {name_device} ({ip})"
+              f", in {(start_time - time.monotonic()) * 1000:.0f} ms.")
+        # param_1 is signed on the wire
+        if device_time_us >= 0x80000000:
+            device_time_us -= 0x100000000
+        cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_START_AT, reference, device_time_us)
+        return self.send_command(ip, cmd)
+
+    def start_time(self, delay=START_AT_LEAD_SECONDS):
+        '''Return a start time, for the start_time parameter of the helper
+        functions below, delay seconds from now'''
+        return time.monotonic() + delay
+
+    def _send_target(self, name_operation, ip, info, target_state, velocity_mhz, current_ma, timeout_ms, start_time=None):
+        '''Helper function to send a target to a device, either straight away or, if
+        start_time is given and the clock of the device is known, at start_time'''
+        # Check first, rather than leave a start time with nothing to start
+        velocity_mhz = self._check_target(name_operation, ip, info["name"], target_state, velocity_mhz, current_ma)
+        if velocity_mhz is None:
+            return
+        if start_time is not None and self.send_cmd_stepper_start_at(name_operation, ip, info["name"], info["reference"], start_time):
+            info["reference"] = self.next_reference(info["reference"])
+            self.send_cmd_stepper_target_append(name_operation, ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
+        else:
+            self.send_cmd_stepper_target_start(name_operation, ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
+        info["reference"] = self.next_reference(info["reference"])
+
+    def send_cmd_stepper_telemetry(self, name_operation, ip, name_device, reference, period_ms):
+        '''Helper function to send CMD_STEPPER_TELEMETRY: period_ms is the interval
+        between samples while a target is running, zero to switch telemetry off'''
+        print(f"{name_operation}: CMD_STEPPER_TELEMETRY (ref {reference}) to {name_device} ({ip})"
+              f", interval {period_ms} ms.")
+        cmd = protocol.CmdMsg(protocol.Cmd.CMD_STEPPER_TELEMETRY, reference, period_ms)
         self.send_command(ip, cmd)
 
-    def stand_rotate_clockwise(self, opposites_day=False):
-        '''Helper function to rotate the stand'''
+    def stand_rotate_clockwise(self, opposites_day=False, start_time=None):
+        '''Helper function to rotate the stand: start_time, from start_time(),
+        makes the start synchronised with that of any other device given the same start_time'''
         # Clockwise is negative velocity
         velocity_mhz = int(-(1000 * 64 * 1.152))
         current_ma = 1000
@@ -454,8 +764,7 @@ class MusicalBoxManager(Esp32Server):
             velocity_mhz = -velocity_mhz
         for ip, info in self.devices.items():
             if info["init"] == protocol.Cmd.CMD_STAND_INIT:
-                self.send_cmd_stepper_target_start(f"rotate {name_operation}", ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
-                info["reference"] = self.next_reference(info["reference"])
+                self._send_target(f"rotate {name_operation}", ip, info, target_state, velocity_mhz, current_ma, timeout_ms, start_time)
 
     def stand_stop(self):
         '''Helper function to stop the stand'''
@@ -465,8 +774,9 @@ class MusicalBoxManager(Esp32Server):
                 self.send_cmd_stepper_target_start(f"stop stand", ip, info["name"], info["reference"], target_state, 0, 0, 0)
                 info["reference"] = self.next_reference(info["reference"])
 
-    def lift_up(self, opposites_day=False):
-        '''Helper function to raise and lower the lift'''
+    def lift_up(self, opposites_day=False, start_time=None):
+        '''Helper function to raise and lower the lift: start_time, from start_time(),
+        makes the start synchronised with that of any other device given the same start_time'''
         # Up is positive velocity
         velocity_mhz = (1000 * 64 * 17)
         current_ma = 1200
@@ -479,8 +789,7 @@ class MusicalBoxManager(Esp32Server):
             velocity_mhz = -velocity_mhz
         for ip, info in self.devices.items():
             if info["init"] == protocol.Cmd.CMD_LIFT_INIT:
-                self.send_cmd_stepper_target_start(f"{name_operation} lift", ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
-                info["reference"] = self.next_reference(info["reference"])
+                self._send_target(f"{name_operation} lift", ip, info, target_state, velocity_mhz, current_ma, timeout_ms, start_time)
 
     def lift_stop(self):
         '''Helper function to stop the lift'''
@@ -491,8 +800,9 @@ class MusicalBoxManager(Esp32Server):
                 self.send_cmd_stepper_target_start(f"{name_operation} lift", ip, info["name"], info["reference"], target_state, 0, 0, 0)
                 info["reference"] = self.next_reference(info["reference"])
 
-    def plinky_plonky_play(self, opposites_day=False):
-        '''Helper function to play or stop the plinky-plonky'''
+    def plinky_plonky_play(self, opposites_day=False, start_time=None):
+        '''Helper function to play or stop the plinky-plonky: start_time, from start_time(),
+        makes the start synchronised with that of any other device given the same start_time'''
         velocity_mhz = (1000 * 64 * 11)
         current_ma = 1000
         target_state = protocol.State.STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE
@@ -504,11 +814,80 @@ class MusicalBoxManager(Esp32Server):
             velocity_mhz = 0
         for ip, info in self.devices.items():
             if info["init"] == protocol.Cmd.CMD_PLINKY_PLONKY_INIT:
-                self.send_cmd_stepper_target_start(f"{name_operation}", ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
-                info["reference"] = self.next_reference(info["reference"])
+                self._send_target(f"{name_operation}", ip, info, target_state, velocity_mhz, current_ma, timeout_ms, start_time)
+
+    def plinky_plonky_upload_profile(self, profile):
+        '''Helper function to upload a velocity profile, the bytes of a file
+        written by plinky_plonky_strip_maker.py, to the plinky-plonky, which keeps
+        it and plays it with every target that moves at a velocity from then on;
+        an empty profile deletes it.  Each message waits for its response, so call
+        this from a thread other than that of the server.  Returns True if the
+        plinky-plonky kept the profile, False if it is not valid, could not be sent
+        or the plinky-plonky refused any part of it'''
+        segment_size = struct.calcsize('<HH')
+        if len(profile) % segment_size != 0:
+            self._log(f"upload profile: ERROR: profile of {len(profile)} byte(s) is not"
+                      f" a whole number of {segment_size} byte segments.")
+            return False
+        segments = list(struct.iter_unpack('<HH', profile))
+        if len(segments) > protocol.PROTOCOL_PROFILE_SEGMENTS_MAX:
+            self._log(f"upload profile: ERROR: profile has {len(segments)} segments,"
+                      f" the most there may be is {protocol.PROTOCOL_PROFILE_SEGMENTS_MAX}.")
+            return False
+        for duration_ms, velocity_per_mille in segments:
+            if duration_ms == 0 or not 0 < velocity_per_mille <= protocol.PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX:
+                self._log(f"upload profile: ERROR: segment of {duration_ms} ms at"
+                          f" {velocity_per_mille} per mille is not valid.")
+                return False
+        # Three segments go in each CMD_PLINKY_PLONKY_PROFILE_SEGMENTS, one per
+        # parameter, duration_ms in the low 16 bits; the parameters are signed
+        params = [struct.unpack('<i', struct.pack('<HH', *segment))[0] for segment in segments]
+        success = False
+        for ip, info in self.devices.items():
+            if info["init"] == protocol.Cmd.CMD_PLINKY_PLONKY_INIT:
+                print(f"upload profile: CMD_PLINKY_PLONKY_PROFILE_BEGIN (ref {info['reference']})"
+                      f" to {info['name']} ({ip}), {len(segments)} segment(s).")
+                # The command and parameters of each message, in order
+                messages = [(protocol.Cmd.CMD_PLINKY_PLONKY_PROFILE_BEGIN, [len(segments)])]
+                for index in range(0, len(params), 3):
+                    chunk = (params[index:index + 3] + [0, 0])[:3]
+                    messages.append((protocol.Cmd.CMD_PLINKY_PLONKY_PROFILE_SEGMENTS, [index] + chunk))
+                for command, message_params in messages:
+                    cmd = protocol.CmdMsg(command, info["reference"], *message_params)
+                    success = self._request_ok("upload profile", ip, cmd)
+                    if not success:
+                        break
+                if success:
+                    print(f"upload profile: {info['name']} ({ip}) has kept the profile.")
+        return success
+
+    def _request_ok(self, name_operation, ip, cmd, timeout=RESPONSE_TIMEOUT_SECONDS):
+        '''Send a command through request() and wait for its response, from a
+        thread other than that of the server; returns True if the status of the
+        response is STATUS_OK, otherwise logs why not and returns False'''
+        name_device = self.devices[ip]["name"]
+        future = self.request(ip, cmd, timeout)
+        if future is None:
+            self._log(f"{name_operation}: ERROR: unable to send {self.formatter.cmd_or_qry(cmd.command)}"
+                      f" (ref {cmd.reference}) to {name_device} ({ip}).")
+            return False
+        self.devices[ip]["reference"] = self.next_reference(cmd.reference)
+        try:
+            rsp = future.result()
+        except (TimeoutError, ConnectionError) as e:
+            self._log(f"{name_operation}: ERROR: no response from {name_device} ({ip}) to"
+                      f" {self.formatter.cmd_or_qry(cmd.command)} (ref {cmd.reference}): {e}.")
+            return False
+        if rsp.status != protocol.Status.STATUS_OK:
+            self._log(f"{name_operation}: ERROR: {name_device} ({ip}) answered"
+                      f" {self.formatter.cmd_or_qry(cmd.command)} (ref {cmd.reference})"
+                      f" with status {self.formatter.status(rsp.status)}.")
+            return False
+        return True
 
-    def door_open(self, index=-1, opposites_day=False):
-        '''Helper function to open and close a door or all doors'''
+    def door_open(self, index=-1, opposites_day=False, start_time=None):
+        '''Helper function to open and close a door or all doors: start_time, from start_time(),
+        makes the start synchronised with that of any other device given the same start_time'''
         # Open is negative velocity
         velocity_mhz = -(1000 * 64 * 2)
         current_ma = 150
@@ -523,8 +902,7 @@ class MusicalBoxManager(Esp32Server):
         for ip, info in self.devices.items():
             if info["init"] == protocol.Cmd.CMD_DOOR_INIT:
                 if index < 0 or index == info["index"]:
-                    self.send_cmd_stepper_target_start(f"{name_operation} doors", ip, info["name"], info["reference"], target_state, velocity_mhz, current_ma, timeout_ms)
-                    info["reference"] = self.next_reference(info["reference"])
+                    self._send_target(f"{name_operation} doors", ip, info, target_state, velocity_mhz, current_ma, timeout_ms, start_time)
 
     def reboot_all(self):
         '''Helper function to reboot all connected devices'''
@@ -773,10 +1151,11 @@ def main(port):
             # Process incoming messages
             while True:
                 try:
-                    ip, msg = manager.incoming_queue.get_nowait()
+                    ip, msg = manager.incoming_queue.get(timeout=1.0)
                     manager._process_message(ip, msg)
                 except queue.Empty:
-                    time.sleep(0.1)
+                    pass
+                manager.poll_stats()
         else:
             print("Failed to connect and initialize all devices")
 
@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+'''
+Pack an ESP32 firmware image for OTA: zlib compressed and, if given the
+image a device is running now, as just the differences from it.  The
+ESP32 unpacks the result as it downloads it (see CONFIG_STEPPER_OTA_PACKED
+and OTA_PACK_MAGIC in ota.c) and https_server.py serves it in place of the
+image to devices that say they are running the base image.
+
+A pack for image.bin is written alongside it as image.bin.pack (compressed
+only) or image.bin.<first 16 hex digits of the SHA-256 of the base>.pack,
+so, after a new build:
+
+    python3 ota_pack.py stepper.bin -b previous/stepper.bin
+'''
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import zlib
+from binary_file_version import extract_version_aggressive, \
+                                ESP32_DESCRIPTION_OFFSET, ESP32_DESCRIPTION_LENGTH
+
+# The header of a pack, see OTA_PACK_MAGIC in ota.c
+PACK_MAGIC = b'MBPK'
+PACK_VERSION = 1
+PACK_FLAG_DELTA = 0x01
+PACK_HEADER_FORMAT = '<4sBBxxI32s32s'
+PACK_HEADER_SIZE = struct.calcsize(PACK_HEADER_FORMAT)
+
+# The operations in a pack
+PACK_OP_END = 0x00
+PACK_OP_COPY = 0x01
+PACK_OP_LITERAL = 0x02
+
+# The SHA-256 appended to an ESP32 image, which is what
+# esp_partition_get_sha256() returns for the running image
+SHA256_LENGTH = 32
+
+# The offset of the hash_appended field of esp_image_header_t
+IMAGE_HASH_APPENDED_OFFSET = 23
+
+# An ESP32 image starts with this byte
+IMAGE_MAGIC = 0xE9
+
+# The length of the blocks of the base image that are looked for in
+# the new image: shorter finds more matches but a copy operation is
+# nine bytes so there is no point in going much below this
+MATCH_LENGTH = 32
+
+# Matches are looked for starting at offsets in the base image that
+# are a multiple of this, keeping the index to a sensible size
+MATCH_STRIDE = 4
+
+def image_sha256(image: bytes) -> bytes:
+    '''Return the SHA-256 appended to an ESP32 image, checking that it is one'''
+    if len(image) <= IMAGE_HASH_APPENDED_OFFSET or image[0] != IMAGE_MAGIC:
+        raise ValueError("not an ESP32 image")
+    if not image[IMAGE_HASH_APPENDED_OFFSET]:
+        raise ValueError("image has no SHA-256 appended")
+    digest = image[-SHA256_LENGTH:]
+    if hashlib.sha256(image[:-SHA256_LENGTH]).digest() != digest:
+        raise ValueError("SHA-256 appended to image is wrong")
+    return digest
+
+def pack_header(image: bytes, base_sha256: bytes = None) -> bytes:
+    '''Return the header of a pack of image, relative to a base if it has a SHA-256'''
+    return struct.pack(PACK_HEADER_FORMAT, PACK_MAGIC, PACK_VERSION,
+                       PACK_FLAG_DELTA if base_sha256 else 0, len(image),
+                       image_sha256(image), base_sha256 or bytes(SHA256_LENGTH))
+
+def parse_header(header: bytes) -> dict:
+    '''Return the fields of the header of a pack, None if it is not one'''
+    if len(header) < PACK_HEADER_SIZE:
+        return None
+    magic, version, flags, length, sha256, base_sha256 = struct.unpack(PACK_HEADER_FORMAT,
+                                                                       header[:PACK_HEADER_SIZE])
+    if magic != PACK_MAGIC:
+        return None
+    return {'version': version, 'flags': flags, 'length': length, 'sha256': sha256,
+            'base_sha256': base_sha256 if flags & PACK_FLAG_DELTA else None}
+
+def pack_name(image_path, base_sha256: bytes = None) -> str:
+    '''Return the file name of a pack of an image, relative to a base if it has a SHA-256'''
+    if base_sha256:
+        return f"{image_path}.{base_sha256.hex()[:16]}.pack"
+    return f"{image_path}.pack"
+
+def literal(data) -> bytes:
+    '''Return a literal operation'''
+    return struct.pack('<BI', PACK_OP_LITERAL, len(data)) + bytes(data)
+
+def copy(offset, length) -> bytes:
+    '''Return a copy operation'''
+    return struct.pack('<BII', PACK_OP_COPY, offset, length)
+
+def diff(base: bytes, image: bytes) -> bytes:
+    '''
+    Return the operations that turn base into image: blocks of the new
+    image found in the base are copied, greedily extended in both
+    directions, everything else is a literal
+    '''
+    index = {}
+    for offset in range(0, len(base) - MATCH_LENGTH + 1, MATCH_STRIDE):
+        index.setdefault(base[offset:offset + MATCH_LENGTH], offset)
+
+    ops = []
+    literal_start = 0
+    position = 0
+    while position + MATCH_LENGTH <= len(image):
+        base_offset = index.get(image[position:position + MATCH_LENGTH])
+        if base_offset is None:
+            position += 1
+            continue
+        # Extend forwards...
+        length = MATCH_LENGTH
+        while position + length < len(image) and base_offset + length < len(base) and \
+              image[position + length] == base[base_offset + length]:
+            length += 1
+        # ...and backwards, into what would have been a literal
+        while position > literal_start and base_offset > 0 and \
+              image[position - 1] == base[base_offset - 1]:
+            position -= 1
+            base_offset -= 1
+            length += 1
+        if position > literal_start:
+            ops.append(literal(image[literal_start:position]))
+        ops.append(copy(base_offset, length))
+        position += length
+        literal_start = position
+    if literal_start < len(image):
+        ops.append(literal(image[literal_start:]))
+    ops.append(bytes([PACK_OP_END]))
+    return b''.join(ops)
+
+def pack(image: bytes, base: bytes = None) -> bytes:
+    '''Return a pack of image, relative to base if given'''
+    if base is not None:
+        base_sha256 = image_sha256(base)
+        ops = diff(base, image)
+    else:
+        base_sha256 = None
+        ops = literal(image) + bytes([PACK_OP_END])
+    return pack_header(image, base_sha256) + zlib.compress(ops, 9)
+
+def unpack(packed: bytes, base: bytes = None) -> bytes:
+    '''Return the image in a pack, the inverse of pack(), for checking'''
+    header = parse_header(packed)
+    if not header or header['version'] != PACK_VERSION:
+        raise ValueError("not a pack")
+    ops = zlib.decompress(packed[PACK_HEADER_SIZE:])
+    image = bytearray()
+    position = 0
+    while ops[position] != PACK_OP_END:
+        if ops[position] == PACK_OP_COPY:
+            offset, length = struct.unpack_from('<II', ops, position + 1)
+            image += base[offset:offset + length]
+            position += 9
+        elif ops[position] == PACK_OP_LITERAL:
+            length, = struct.unpack_from('<I', ops, position + 1)
+            image += ops[position + 5:position + 5 + length]
+            position += 5 + length
+        else:
+            raise ValueError(f"unknown operation 0x{ops[position]:02x}")
+    if len(image) != header['length']:
+        raise ValueError("wrong length")
+    return bytes(image)
+
+def version(path) -> str:
+    '''Return the version of an image, as binary_file_version.py would'''
+    return extract_version_aggressive(path, ESP32_DESCRIPTION_OFFSET, ESP32_DESCRIPTION_LENGTH)
+
+def main(image_path, base_paths):
+    '''Main as a function'''
+    with open(image_path, 'rb') as f:
+        image = f.read()
+    print(f"{image_path}: {len(image)} bytes, version {version(image_path)}")
+
+    for base_path in [None] + (base_paths or []):
+        base = None
+        if base_path:
+            with open(base_path, 'rb') as f:
+                base = f.read()
+        try:
+            packed = pack(image, base)
+            # Never write something that the ESP32 would turn into
+            # anything other than the image
+            if unpack(packed, base) != image:
+                raise ValueError("pack does not unpack to image")
+        except ValueError as e:
+            print(f"Unable to pack {image_path}{' relative to ' + base_path if base_path else ''}: {e}")
+            return 1
+        path = pack_name(image_path, image_sha256(base) if base else None)
+        with open(path, 'wb') as f:
+            f.write(packed)
+        relative = f" relative to {base_path} (version {version(base_path)})" if base_path else ""
+        print(f"{path}: {len(packed)} bytes ({len(packed) * 100 / len(image):.1f}%){relative}")
+
+    return 0
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=("Pack an ESP32 firmware image for OTA, see ota.c."),
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('image', help="the firmware image, e.g. stepper.bin.")
+    parser.add_argument('-b', action='append', help=("a firmware image that devices may be running now:"
+                                                    " a delta is\nwritten relative to it, as well as"
+                                                    " the compressed image;\nmay be given more than once."))
+    args = parser.parse_args()
+
+    sys.exit(main(args.image, args.b))
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+A small engine for running the steps of a sequence (e.g. opening the
+musical box) on an asyncio event loop: each step waits for the
+indications that say it has finished, or for the answers to its
+queries, rather than for a fixed time, and independent steps can be
+run at the same time with asyncio.gather().
+"""
+
+import asyncio
+from typing import Callable, Iterable, List, Optional
+
+from musical_box_manager import MusicalBoxManager
+import protocol
+
+# How long to wait for the answer to a query, in seconds
+QUERY_TIMEOUT_SECONDS = 2.0
+
+# A predicate that is given (ip, IndMsg) and returns True if that is
+# the indication being waited for
+IndicationPredicate = Callable[[str, protocol.IndMsg], bool]
+
+def target_end(ip: str, motor: int = 0) -> IndicationPredicate:
+    """Match the IND_SYSTEM_STEPPER_TARGET_END of a motor of a device"""
+    return lambda _ip, msg: ((_ip == ip) and (msg.motor == motor) and
+                             (msg.ind == protocol.Ind.IND_SYSTEM_STEPPER_TARGET_END))
+
+def indication(ip: str, ind: protocol.Ind, value: Optional[int] = None,
+               motor: int = 0) -> IndicationPredicate:
+    """Match a given indication from a motor of a device, optionally with a given value"""
+    return lambda _ip, msg: ((_ip == ip) and (msg.motor == motor) and (msg.ind == ind) and
+                             (value is None or msg.value == value))
+
+def any_of(*predicates: IndicationPredicate) -> IndicationPredicate:
+    """Match any one of several indications"""
+    return lambda ip, msg: any(predicate(ip, msg) for predicate in predicates)
+
+class Sequencer:
+    """
+    Waits, on the event loop it is used from, for the indications that
+    MusicalBoxManager._process_indication() sees in another thread
+    """
+    def __init__(self, manager: MusicalBoxManager, log: Callable[[str], None]):
+        self._manager = manager
+        self._log = log
+        self._loop = None
+        self._waiters = []  # List of (predicate, future)
+        manager.add_indication_listener(self._on_indication)
+
+    def _on_indication(self, ip, msg):
+        """Called by the manager, in its thread, for every indication"""
+        loop = self._loop
+        if loop is not None and not loop.is_closed():
+            loop.call_soon_threadsafe(self._dispatch, ip, msg)
+
+    def _dispatch(self, ip, msg):
+        """Hand an indication to the first of those waiting that wants it"""
+        for predicate, future in self._waiters:
+            if not future.done() and predicate(ip, msg):
+                future.set_result(msg)
+                break
+
+    def expect(self, predicate: IndicationPredicate) -> asyncio.Future:
+        """
+        Return a future that will be given the next indication that
+        matches predicate; call this BEFORE doing whatever causes the
+        indication, so that it can't be missed, and pass the future to
+        wait(), or forget(), to tidy up afterwards
+        """
+        self._loop = asyncio.get_running_loop()
+        future = self._loop.create_future()
+        self._waiters.append((predicate, future))
+        return future
+
+    def forget(self, futures: Iterable[asyncio.Future]):
+        """Stop waiting on futures from expect()"""
+        futures = set(futures)
+        self._waiters = [(predicate, future) for predicate, future in self._waiters
+                         if future not in futures]
+        for future in futures:
+            if not future.done():
+                future.cancel()
+
+    async def wait(self, name: str, futures: List[asyncio.Future], timeout: float) -> bool:
+        """
+        Wait for all of the futures from expect() to be given their
+        indication, for up to timeout seconds; returns True if they all
+        were
+        """
+        if not futures:
+            return True
+        try:
+            _, pending = await asyncio.wait(futures, timeout=timeout)
+            if pending:
+                self._log(f"{name}: {len(pending)} of {len(futures)} did not finish"
+                          f" within {timeout:.1f} second(s)")
+            return not pending
+        finally:
+            self.forget(futures)
+
+    async def step(self, name: str, action: Callable[[], object],
+                   expected: List[IndicationPredicate], timeout: float) -> bool:
+        """
+        Run one step of a sequence: call action(), which should set
+        things going, and wait for all of the expected indications, for
+        up to timeout seconds; returns True if they all arrived
+        """
+        futures = [self.expect(predicate) for predicate in expected]
+        try:
+            action()
+        except Exception:
+            self.forget(futures)
+            raise
+        return await self.wait(name, futures, timeout)
+
+    async def query(self, ip: str, query_type: protocol.Qry,
+                    timeout: float = QUERY_TIMEOUT_SECONDS) -> Optional[int]:
+        """
+        Query a device, updating the state the manager keeps, and return
+        the answer, or None if there wasn't one
+        """
+        future = self._manager.request_query(ip, query_type, timeout)
+        if future is None:
+            return None
+        try:
+            msg = await asyncio.wrap_future(future)
+        except Exception:
+            return None
+        if msg.status != protocol.Status.STATUS_OK:
+            return None
+        return msg.value
+
+    async def query_all(self, ips: List[str], query_type: protocol.Qry,
+                        timeout: float = QUERY_TIMEOUT_SECONDS) -> List[Optional[int]]:
+        """Make the same query of several devices at once, returning the answers in order"""
+        return await asyncio.gather(*[self.query(ip, query_type, timeout) for ip in ips])
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""The recent history of the statistics reported by the ESP32s in StatsMsg's."""
+
+import collections
+import threading
+import time
+from typing import Deque, Dict, Optional
+
+import protocol
+
+# The tasks of a StatsMsg, by index, named as they are shown
+STATS_TASK_NAMES = {int(task): task.name.replace('STATS_TASK_', '', 1).lower()
+                    for task in protocol.StatsTask if task != protocol.StatsTask.STATS_TASK_NUM}
+
+def stats_sample(msg: protocol.StatsMsg, receive_time: Optional[float] = None) -> dict:
+    """
+    Return the contents of a StatsMsg in a form that can be turned
+    into JSON, the CPU load and free stack of each task by name, None
+    where the device doesn't know them
+    """
+    return {
+        'time': receive_time if receive_time is not None else time.time(),
+        'period_ms': msg.period_ms,
+        'heap_free': msg.heap_free,
+        'heap_min_free': msg.heap_min_free,
+        'log_dropped_count': msg.log_dropped_count,
+        'tx_dropped_count': msg.tx_dropped_count,
+        'tx_retry_count': msg.tx_retry_count,
+        'cpu_percent': {name: (None if msg.cpu_percent[index] == protocol.STATS_UNKNOWN_CPU
+                               else msg.cpu_percent[index])
+                        for index, name in STATS_TASK_NAMES.items()},
+        'stack_free': {name: (None if msg.stack_free[index] == protocol.STATS_UNKNOWN_STACK
+                              else msg.stack_free[index])
+                       for index, name in STATS_TASK_NAMES.items()}
+    }
+
+class NodeStats:
+    """
+    The most recent samples of the statistics of each node, oldest
+    first; added to by whoever processes the StatsMsg's and read by
+    whoever wants to show them, hence the lock
+    """
+    def __init__(self, history_length: int):
+        self._history_length = history_length
+        self._nodes: Dict[str, Deque[dict]] = {}
+        self._lock = threading.Lock()
+
+    def add(self, node: str, msg: protocol.StatsMsg):
+        """Add the contents of a StatsMsg to the history of a node"""
+        sample = stats_sample(msg)
+        with self._lock:
+            history = self._nodes.setdefault(node, collections.deque(maxlen=self._history_length))
+            history.append(sample)
+
+    def latest(self, node: str) -> Optional[dict]:
+        """Return the most recent sample of a node, None if there isn't one"""
+        with self._lock:
+            history = self._nodes.get(node)
+            return history[-1] if history else None
+
+    def clear(self):
+        """Throw away all of the history"""
+        with self._lock:
+            self._nodes.clear()
+
+    def to_dict(self) -> dict:
+        """Return all of the history in a form that can be turned into JSON"""
+        with self._lock:
+            return {
+                'tasks': list(STATS_TASK_NAMES.values()),
+                'nodes': {node: list(history) for node, history in self._nodes.items()}
+            }
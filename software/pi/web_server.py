@@ -24,7 +24,6 @@ import time
 import argparse
 from datetime import datetime
 from typing import Optional
-from collections import deque
 
 from aiohttp import web
 import aiohttp_jinja2
@@ -32,6 +31,9 @@ import jinja2
 
 # Import MusicalBoxManager
 from musical_box_manager import MusicalBoxManager, Formatter
+from sequence import Sequencer
+import sequence
+from log_store import LogStore, LogEntry
 import protocol
 
 # The default HTTP port
@@ -40,14 +42,74 @@ HTTP_PORT_DEFAULT = 8080
 # The ESP32 control port
 ESP32_PORT_DEFAULT = 5000
 
-# Max log entries to keep
+# The most log entries sent to a client in one go, unless it asks for
+# a different number
 MAX_LOG_ENTRIES = 500
 
+# The node the log entries of the Pi itself are stored against
+LOG_NODE_PI = 'pi'
+
+# How long after the music starts the doors open, in the open
+# sequence, and the lift lowers, in the close sequence, in seconds
+DOOR_OPEN_DELAY_SECONDS = 7
+LIFT_LOWER_DELAY_SECONDS = 7
+
+# How long to wait for the doors to finish opening or closing, in
+# seconds: a little longer than the timeout of their targets
+DOOR_MOVE_TIMEOUT_SECONDS = 5
+
+# How long to wait for the lift to get down, in seconds
+LIFT_DOWN_TIMEOUT_SECONDS = 15
+
+# How long to wait for the music to stop, in seconds
+MUSIC_END_TIMEOUT_SECONDS = 60
+
+# The most events that may wait to be sent to an SSE client; one that
+# falls further behind than this is sent a fresh snapshot instead
+SSE_MAX_QUEUED_EVENTS = 256
+
+# How often to send something to an otherwise idle SSE client, so that
+# one which has gone away is noticed, in seconds
+SSE_KEEPALIVE_SECONDS = 15
+
+
+class EventBus:
+    """
+    Hands each event published to it to every subscriber, in order, for
+    the SSE streams; must only be used from the event loop
+    """
+    def __init__(self):
+        self._queues = set()
+
+    def subscribe(self) -> asyncio.Queue:
+        """Return a queue that will be given (event, data) for every event
+        published from now on, or (None, None) if the subscriber falls so
+        far behind that it has been dropped and must subscribe again"""
+        events = asyncio.Queue(maxsize=SSE_MAX_QUEUED_EVENTS)
+        self._queues.add(events)
+        return events
+
+    def unsubscribe(self, events: asyncio.Queue):
+        """Stop giving events to a queue from subscribe()"""
+        self._queues.discard(events)
+
+    def publish(self, event: str, data):
+        """Give an event to all of the subscribers"""
+        for events in list(self._queues):
+            try:
+                events.put_nowait((event, data))
+            except asyncio.QueueFull:
+                while not events.empty():
+                    events.get_nowait()
+                events.put_nowait((None, None))
+                self._queues.discard(events)
+
 
 class WebControlInterface:
     """Web-based control interface for the Musical Box"""
 
-    def __init__(self, manager: MusicalBoxManager, host='0.0.0.0', port=HTTP_PORT_DEFAULT):
+    def __init__(self, manager: MusicalBoxManager, host='0.0.0.0', port=HTTP_PORT_DEFAULT,
+                 log_store: Optional[LogStore] = None):
         self.manager = manager
         self.manager.set_log_callback(self._log_message)
         self.host = host
@@ -70,21 +132,29 @@ class WebControlInterface:
         # Formatter for pretty status
         self.formatter = Formatter()
 
-        # Log storage (deque for automatic max size)
-        self.log_entries = deque(maxlen=MAX_LOG_ENTRIES)
+        # Runs the steps of the open and close sequences
+        self.sequencer = Sequencer(manager, self._log_message)
 
-        # SSE clients
-        self.sse_clients = set()
+        # Log storage, which may be shared with an ESP32LogServer
+        self.log_store = log_store if log_store is not None else LogStore()
+        self.log_store.add_listener(self._log_entries_added)
+
+        # The SSE streams: status is sent as a snapshot followed by
+        # deltas to it, logs as a snapshot followed by new entries
+        self._loop = None
+        self.status_bus = EventBus()
+        self.log_bus = EventBus()
+        self._status_snapshot = None  # The status the last delta took us to
+        self._status_publish_pending = False
+        self._log_pending = []  # Log entries not yet published
+        self.manager.add_change_listener(self._status_changed)
 
         # Store the HTML template as a string
         self.html_template = self._get_html_template()
 
-        # Track if we're already notifying
-        self._status_version = 0
-        self._log_version = 0
-
     async def start(self):
         """Start the web server"""
+        self._loop = asyncio.get_running_loop()
         self.app = web.Application()
 
         # Routes
@@ -96,6 +166,8 @@ class WebControlInterface:
         self.app.router.add_post('/api/settings', self.handle_api_settings)
         self.app.router.add_get('/api/logs', self.handle_api_logs)
         self.app.router.add_post('/api/logs/clear', self.handle_api_logs_clear)
+        self.app.router.add_get('/api/latency', self.handle_api_latency)
+        self.app.router.add_get('/api/stats', self.handle_api_stats)
 
         # Set up a queue to receive logs from the manager
         self.log_queue = queue.Queue()
@@ -112,10 +184,6 @@ class WebControlInterface:
         self.running = True
         print(f"\nWeb interface running at http://{self.host}:{self.port}")
 
-        # Start background tasks for SSE
-        asyncio.create_task(self._broadcast_status())
-        asyncio.create_task(self._broadcast_logs())
-
     def _redirect_logs(self):
         """Redirect print statements to our log storage"""
         # Monkey-patch print to capture logs
@@ -123,10 +191,7 @@ class WebControlInterface:
 
         def captured_print(*args, **kwargs):
             message = ' '.join(str(arg) for arg in args)
-            timestamp = datetime.now().strftime('%H:%M:%S')
-            log_entry = f"[{timestamp}] {message}"
-            self.log_entries.append(log_entry)
-            self._log_version += 1
+            self._add_log_entry(message)
             self.original_print(*args, **kwargs)
 
         import builtins
@@ -153,48 +218,22 @@ class WebControlInterface:
             return web.json_response({'error': str(e)}, status=500)
 
     async def handle_status_stream(self, request):
-        """Server-Sent Events stream for status updates"""
-        response = web.StreamResponse(
-            status=200,
-            headers={
-                'Content-Type': 'text/event-stream',
-                'Cache-Control': 'no-cache',
-                'Connection': 'keep-alive',
-            }
-        )
-        await response.prepare(request)
-
-        client_id = id(response)
-        self.sse_clients.add(client_id)
-
-        try:
-            last_version = 0
-            while self.running:
-                try:
-                    if self._status_version > last_version:
-                        last_version = self._status_version
-                        status = self._get_system_status()
-                        await response.write(f"data: {json.dumps(status)}\n\n".encode())
-                    await asyncio.sleep(0.5)
-                except ConnectionResetError:
-                    # Client disconnected
-                    print(f"DEBUG: Status client {client_id} disconnected")
-                    break
-                except RuntimeError as e:
-                    if "Cannot write to closing transport" in str(e):
-                        print(f"DEBUG: Status client {client_id} closed connection")
-                        break
-                    raise
-        except Exception as e:
-            print(f"DEBUG: Status stream error: {e}")
-        finally:
-            self.sse_clients.discard(client_id)
-            print("DEBUG: Status stream ended")
-
-        return response
+        """Server-Sent Events stream for status updates: a snapshot of the
+        status then, as things change, deltas to it"""
+        if self._status_snapshot is None:
+            self._publish_status()
+        return await self._stream(request, self.status_bus, lambda: self._status_snapshot)
 
     async def handle_logs_stream(self, request):
-        """Server-Sent Events stream for log updates (incremental)"""
+        """Server-Sent Events stream for log updates: the log so far then
+        each new entry as it is added"""
+        return await self._stream(request, self.log_bus,
+                                  lambda: [self._log_text(entry) for entry in
+                                           self.log_store.entries(limit=MAX_LOG_ENTRIES)])
+
+    async def _stream(self, request, bus, snapshot):
+        """Send the events of a bus to an SSE client, starting with a
+        "snapshot" event carrying whatever snapshot() returns"""
         response = web.StreamResponse(
             status=200,
             headers={
@@ -204,60 +243,112 @@ class WebControlInterface:
             }
         )
         await response.prepare(request)
-        
-        client_id = id(response)
-        self.sse_clients.add(client_id)
-        
-        # Track the last count for this client
-        last_count = 0
-        
+
+        # Subscribe and take the snapshot together, so that the events
+        # which follow are exactly those that come after it
+        events = bus.subscribe()
         try:
+            await response.write(self._sse_event('snapshot', snapshot()))
             while self.running:
                 try:
-                    current_count = len(self.log_entries)
-                    
-                    if last_count == 0 or current_count != last_count:
-                        if current_count == 0:
-                            await response.write(f"data: {json.dumps([])}\n\n".encode())
-                        else:
-                            new_logs = list(self.log_entries)[last_count:]
-                            await response.write(f"data: {json.dumps(new_logs)}\n\n".encode())
-                        last_count = current_count
-                    
-                    await asyncio.sleep(0.5)
-                except ConnectionResetError:
-                    # Client disconnected
-                    print(f"DEBUG: Client {client_id} disconnected")
-                    break
-                except RuntimeError as e:
-                    if "Cannot write to closing transport" in str(e):
-                        print(f"DEBUG: Client {client_id} closed connection")
-                        break
-                    raise
-        except Exception as e:
-            print(f"DEBUG: Logs stream error: {e}")
+                    event, data = await asyncio.wait_for(events.get(), SSE_KEEPALIVE_SECONDS)
+                except asyncio.TimeoutError:
+                    await response.write(b": keep-alive\n\n")
+                    continue
+                if event is None:
+                    # Fell too far behind, start again
+                    events = bus.subscribe()
+                    event, data = 'snapshot', snapshot()
+                await response.write(self._sse_event(event, data))
+        except ConnectionResetError:
+            print(f"DEBUG: Client {id(response)} disconnected")
+        except RuntimeError as e:
+            if "Cannot write to closing transport" not in str(e):
+                print(f"DEBUG: Stream error: {e}")
         finally:
-            self.sse_clients.discard(client_id)
-        
+            bus.unsubscribe(events)
+
         return response
 
-    async def _broadcast_status(self):
-        """Broadcast status updates to all SSE clients"""
-        while self.running:
-            try:
-                self._status_version += 1
-            except Exception:
-                pass
-            await asyncio.sleep(2)  # Update every 2 seconds
-
-    async def _broadcast_logs(self):
-        """Broadcast log updates to all SSE clients"""
-        while self.running:
-            try:
-                self._log_version += 1
-            except Exception:
-                pass
-            await asyncio.sleep(1)  # Update every 1 second
+    @staticmethod
+    def _sse_event(event, data) -> bytes:
+        """Encode an SSE event with a JSON payload"""
+        return f"event: {event}\ndata: {json.dumps(data)}\n\n".encode()
+
+    def _status_changed(self, ip=None):
+        """Arrange for any change in the status to be pushed to the SSE
+        clients; may be called from any thread and many calls in quick
+        succession result in a single delta"""
+        if self._loop is not None and not self._loop.is_closed():
+            self._loop.call_soon_threadsafe(self._schedule_status_publish)
+
+    def _schedule_status_publish(self):
+        """Publish the status once the events already waiting have been handled"""
+        if not self._status_publish_pending:
+            self._status_publish_pending = True
+            self._loop.call_soon(self._publish_status)
+
+    def _publish_status(self):
+        """Publish whatever has changed in the status since last time"""
+        self._status_publish_pending = False
+        status = self._get_system_status()
+        delta = self._status_delta(self._status_snapshot, status)
+        self._status_snapshot = status
+        if delta:
+            self.status_bus.publish('delta', delta)
+
+    @staticmethod
+    def _status_delta(old, new):
+        """Return the members of status new that differ from those of status
+        old; where both are a dict (e.g. of IP address -> state), just the
+        entries of it that differ are included, None marking one removed"""
+        if old is None:
+            return new
+        delta = {}
+        for key, value in new.items():
+            previous = old.get(key)
+            if isinstance(value, dict) and isinstance(previous, dict):
+                changes = {k: v for k, v in value.items() if previous.get(k) != v}
+                changes.update({k: None for k in previous if k not in value})
+                if changes:
+                    delta[key] = changes
+            elif value != previous:
+                delta[key] = value
+        return delta
+
+    def _add_log_entry(self, message, level=protocol.LogLevel.LOG_INFO):
+        """Add an entry of the Pi's own to the log; may be called from any thread"""
+        self.log_store.add(LOG_NODE_PI, level, message)
+
+    @staticmethod
+    def _log_text(entry: LogEntry) -> str:
+        """Return a log entry as a line in the debug window"""
+        timestamp = datetime.fromtimestamp(entry.time).strftime('%H:%M:%S')
+        if entry.node == LOG_NODE_PI:
+            return f"[{timestamp}] {entry.text}"
+        return f"[{timestamp}] [{entry.node}] {entry.text}"
+
+    def _log_entries_added(self, entries):
+        """Called by the log store, in whichever thread added them, with a
+        batch of new entries, which are pushed to the SSE clients"""
+        loop = self._loop
+        if loop is not None and not loop.is_closed():
+            loop.call_soon_threadsafe(self._queue_log_entries,
+                                      [self._log_text(entry) for entry in entries])
+
+    def _queue_log_entries(self, texts):
+        """Queue entries to be published along with any others that
+        arrive at the same time"""
+        if not self._log_pending:
+            self._loop.call_soon(self._publish_log_entries)
+        self._log_pending.extend(texts)
+
+    def _publish_log_entries(self):
+        """Publish the queued entries"""
+        entries = self._log_pending
+        self._log_pending = []
+        if entries:
+            self.log_bus.publish('append', entries)
 
     async def handle_api_command(self, request):
         """Handle command requests"""
@@ -269,12 +360,13 @@ class WebControlInterface:
 
         # Also log the result to the debug window
         if result['status'] == 'error':
-            self._log_message(f"ERROR: Command '{command}' failed - {result['message']}")
+            self._log_message(f"ERROR: Command '{command}' failed - {result['message']}",
+                              protocol.LogLevel.LOG_ERROR)
         else:
             self._log_message(f"Command '{command}': {result['message']}")
 
-        # Trigger immediate status update
-        self._status_version += 1
+        # Push the change to the status
+        self._status_changed()
 
         return web.json_response(result)
 
@@ -297,8 +389,8 @@ class WebControlInterface:
         if 'auto_run_sequence' in data:
             self.auto_run_sequence = data['auto_run_sequence']
 
-        # Trigger immediate status update
-        self._status_version += 1
+        # Push the change to the status
+        self._status_changed()
 
         return web.json_response({'status': 'ok', 'settings': {
             'auto_run_enabled': self.auto_run_enabled,
@@ -307,16 +399,47 @@ class WebControlInterface:
         }})
 
     async def handle_api_logs(self, request):
-        """Return recent logs"""
-        logs = list(self.log_entries)
-        return web.json_response({'logs': logs})
+        """
+        Return recent logs, optionally filtered with ?node= (e.g. "pi" or
+        the IP address of an ESP32), ?level= (the least severe level
+        wanted, e.g. "warn" or 2), ?since= (a sequence number, as returned
+        in "last", to get only what has been added since) and ?limit=
+        (the most entries wanted, default MAX_LOG_ENTRIES)
+        """
+        try:
+            level = request.query.get('level')
+            if level is not None:
+                if level.lstrip('-').isdigit():
+                    level = int(level)
+                else:
+                    level = protocol.LogLevel[f"LOG_{level.upper().removeprefix('LOG_')}"]
+            since = request.query.get('since')
+            since = int(since) if since is not None else None
+            limit = int(request.query.get('limit', MAX_LOG_ENTRIES))
+        except (KeyError, ValueError) as e:
+            return web.json_response({'status': 'error', 'message': f"Invalid query: {e}"}, status=400)
+        last = self.log_store.last_sequence()
+        entries = self.log_store.entries(node=request.query.get('node'), level=level,
+                                         since=since, limit=limit)
+        return web.json_response({'logs': [self._log_text(entry) for entry in entries],
+                                  'last': entries[-1].sequence if entries else last,
+                                  'nodes': self.log_store.nodes()})
 
     async def handle_api_logs_clear(self, request):
         """Clear the log buffer"""
-        self.log_entries.clear()
-        self._log_version += 1
+        self.log_store.clear()
+        self._log_pending = []
+        self.log_bus.publish('clear', None)
         return web.json_response({'status': 'ok'})
 
+    async def handle_api_latency(self, request):
+        """Return the per-node command latency histograms"""
+        return web.json_response(self.manager.get_latency())
+
+    async def handle_api_stats(self, request):
+        """Return the recent task, CPU and heap statistics of each node"""
+        return web.json_response(self.manager.get_stats())
+
     async def _execute_command(self, command, params):
         """Execute a command and return result"""
         result = {'status': 'ok', 'message': ''}
@@ -407,20 +530,21 @@ class WebControlInterface:
 
         return result
 
-    def _log_message(self, message):
+    def _log_message(self, message, level=protocol.LogLevel.LOG_INFO):
         """Add a message to the log buffer"""
-        timestamp = datetime.now().strftime('%H:%M:%S')
-        self.log_entries.append(f"[{timestamp}] {message}")
-        self._log_version += 1
+        self._add_log_entry(message, level)
+
+    def _ips(self, is_thing):
+        """Return the IP addresses of the connected and initialised devices of a type"""
+        return [ip for ip in self.manager.get_device_ip_list(connected=True, initialised=True)
+                if is_thing(ip)]
 
-    def _query_door_sensors(self):
-        door_count = 0
+    async def _query_door_sensors(self):
+        """Query the open sensor of all doors at once, returning how many there are"""
+        door_ips = self._ips(self.manager.is_door)
         self._log_message("Querying door sensors...")
-        for ip, info in self.manager.devices.items():
-            if self.manager.is_door(ip):
-                door_count += 1
-                self.manager.query_door_sensor(ip)
-        return door_count
+        await self.sequencer.query_all(door_ips, protocol.Qry.QRY_DOOR_SENSOR_OPEN)
+        return len(door_ips)
 
     def _count_and_print_door_states(self):
         open_count = 0
@@ -434,44 +558,87 @@ class WebControlInterface:
                     open_count += 1
         return open_count
 
+    async def _wait_until(self, start_time, offset_seconds):
+        """
+        Wait until just short of offset_seconds after start_time, a value of
+        manager.start_time(), so that a command with START_AT can be sent to
+        happen exactly then
+        """
+        await asyncio.sleep(max(start_time + offset_seconds - self.manager.start_time(), 0))
+
+    def _expect_music_end(self):
+        """Return the futures for the plinky-plonky getting back to its reference"""
+        return [self.sequencer.expect(sequence.any_of(sequence.target_end(ip),
+                                                      sequence.indication(ip, protocol.Ind.IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE, 1)))
+                for ip in self._ips(self.manager.is_plinky_plonky)]
+
+    async def _wait_for_music_end(self, music_end):
+        """Wait for the futures from _expect_music_end(), or for the reference if there are none"""
+        self._log_message("Waiting for music to stop...")
+        plinky_plonky_ips = self._ips(self.manager.is_plinky_plonky)
+        if not music_end:
+            # Didn't start the music, it may be stopped already
+            music_end = self._expect_music_end()
+            for ip in plinky_plonky_ips:
+                await self.sequencer.query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+            if all(self.manager.is_plinky_plonky_at_reference(ip) for ip in plinky_plonky_ips):
+                self.sequencer.forget(music_end)
+                return
+        if not await self.sequencer.wait("music", music_end, MUSIC_END_TIMEOUT_SECONDS):
+            self._log_message("Plinky-plonky did not signal reference position"
+                              f" within {MUSIC_END_TIMEOUT_SECONDS} second(s), considering"
+                              f" the sequence completed anyway.")
+
+    def _start_music_and_rotation(self):
+        """Start the music and the stand together, returning the start time"""
+        self._log_message("Starting music and rotation...")
+        start_time = self.manager.start_time()
+        self.manager.plinky_plonky_play(start_time=start_time)
+        self.manager.stand_rotate_clockwise(start_time=start_time)
+        return start_time
+
     async def _run_open_sequence(self):
         """Run the complete open sequence"""
         self.operation_status = "running"
         self.current_operation = "open_sequence"
         self.operation_start_time = datetime.now()
-        self._status_version += 1
-        
+        self._status_changed()
+        music_end = []
+
         try:
-            # Query door sensors (to make sure none are already open)
-            door_count = self._query_door_sensors()
-            
-            # Wait for responses
-            await asyncio.sleep(2)
+            # Query door sensors (to make sure none are already open),
+            # and synchronise clocks so that the music, rotation and
+            # doors start exactly together, all at the same time
+            door_count, _ = await asyncio.gather(self._query_door_sensors(),
+                                                 asyncio.to_thread(self.manager.sync_clocks))
 
             # Check and log the current door states
             open_count = self._count_and_print_door_states()
 
-            if open_count == 0:        
-                self._log_message("Starting music and rotation...")
-                self.manager.plinky_plonky_play()
-                self.manager.stand_rotate_clockwise()
+            if open_count == 0:
+                music_end = self._expect_music_end()
+                start_time = self._start_music_and_rotation()
 
-                self._log_message("Waiting for 7 seconds...")
-                await asyncio.sleep(7)
+                self._log_message(f"Waiting for {DOOR_OPEN_DELAY_SECONDS} seconds...")
+                # Wake up a little early so that the doors can be
+                # told to open exactly on time after the music started
+                await self._wait_until(start_time, DOOR_OPEN_DELAY_SECONDS)
 
+                # Open all of the doors at once and wait for them all to stop
                 self._log_message("Opening doors...")
-                self.manager.door_open()
-
-                self._log_message("Waiting 5 seconds...")
-                await asyncio.sleep(5)
+                await self.sequencer.step("open doors",
+                                          lambda: self.manager.door_open(start_time=start_time + DOOR_OPEN_DELAY_SECONDS),
+                                          [sequence.target_end(ip) for ip in self._ips(self.manager.is_door)],
+                                          DOOR_MOVE_TIMEOUT_SECONDS)
 
                 # Log the current door states
+                await self._query_door_sensors()
                 open_count = self._count_and_print_door_states()
                 if open_count < door_count:
                     self._log_message(f"Only {open_count} out of {door_count} door sensors"
                                       " indicate open but sensors can be affected by"
                                       " ambient light so raising lift anyway")
-                    
+
                 # Raise lift
                 self._log_message("Raising lift...")
                 self.manager.lift_up()
@@ -479,85 +646,66 @@ class WebControlInterface:
                 self._log_message("Not starting the open sequence as there are"
                                   f" {open_count} door(s) already open")
 
-            self._log_message("Waiting for music to stop...")
-            wait_guard_seconds = 0
-            self.manager.query_plinky_plonky_state()
-            # Wait for response
-            await asyncio.sleep(1)
-            while (not self.manager.is_plinky_plonky_at_reference()) and wait_guard_seconds < 60:
-                self.manager.query_plinky_plonky_state()
-                await asyncio.sleep(1)
-                wait_guard_seconds += 1
-
-            if wait_guard_seconds >= 60:
-                 self._log_message("Plinky-plonky did not signal reference position"
-                                   f" within {wait_guard_seconds} second(s), considering"
-                                   f" the sequence completed anyway.")
+            await self._wait_for_music_end(music_end)
+
             self.operation_status = "completed"
             self._log_message("Open sequence completed")
-            
+
         except Exception as e:
             self.operation_status = "error"
             self._log_message(f"Open sequence error: {e}")
         finally:
-            self._status_version += 1
+            self.sequencer.forget(music_end)
+            self._status_changed()
 
     async def _run_close_sequence(self):
         """Run the complete close sequence"""
         self.operation_status = "running"
         self.current_operation = "close_sequence"
         self.operation_start_time = datetime.now()
-        self._status_version += 1
+        self._status_changed()
+        music_end = []
 
         try:
-            self._log_message("Starting music and rotation...")
-            self.manager.plinky_plonky_play()
-            self.manager.stand_rotate_clockwise()
+            await asyncio.to_thread(self.manager.sync_clocks)
+            music_end = self._expect_music_end()
+            start_time = self._start_music_and_rotation()
 
-            self._log_message("Waiting for 7 seconds...")
-            await asyncio.sleep(7)
+            self._log_message(f"Waiting for {LIFT_LOWER_DELAY_SECONDS} seconds...")
+            await self._wait_until(start_time, LIFT_LOWER_DELAY_SECONDS)
 
-            # Lower lift
+            # Lower lift, waiting for it to get down
             self._log_message("Lowering lift...")
-            self.manager.lift_up(opposites_day=True)
-            lift_down_wait_seconds = 15
-            self.manager.query_lift_state()
-            # Wait for response
-            await asyncio.sleep(1)
-            while not self.manager.is_lift_down() and lift_down_wait_seconds > 0:
-                self.manager.query_lift_state()
-                await asyncio.sleep(1)
-                lift_down_wait_seconds -= 1
-
-            if lift_down_wait_seconds > 0:
+            lift_ips = self._ips(self.manager.is_lift)
+            await self.sequencer.step("lower lift",
+                                      lambda: self.manager.lift_up(opposites_day=True,
+                                                                   start_time=start_time + LIFT_LOWER_DELAY_SECONDS),
+                                      [sequence.any_of(sequence.target_end(ip),
+                                                       sequence.indication(ip, protocol.Ind.IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN, 1))
+                                       for ip in lift_ips],
+                                      LIFT_DOWN_TIMEOUT_SECONDS)
+            for ip in lift_ips:
+                await self.sequencer.query(ip, protocol.Qry.QRY_SYSTEM_STEPPER_STATE)
+
+            if lift_ips and all(self.manager.is_lift_down(ip) for ip in lift_ips):
                 # Log the current door states
                 open_count = self._count_and_print_door_states()
 
+                # Close all of the doors at once and wait for them all to stop
                 self._log_message("Closing doors...")
-                self.manager.door_open(opposites_day=True)
-
-                self._log_message("Waiting 5 seconds...")
-                await asyncio.sleep(5)
+                await self.sequencer.step("close doors",
+                                          lambda: self.manager.door_open(opposites_day=True),
+                                          [sequence.target_end(ip) for ip in self._ips(self.manager.is_door)],
+                                          DOOR_MOVE_TIMEOUT_SECONDS)
 
                 # Log the current door states
+                await self._query_door_sensors()
                 open_count = self._count_and_print_door_states()
 
             else:
                 self._log_message("Not closing the doors as the lift did not get down")
 
-            wait_guard_seconds = 0
-            self.manager.query_plinky_plonky_state()
-            # Wait for response
-            await asyncio.sleep(1)
-            while (not self.manager.is_plinky_plonky_at_reference()) and wait_guard_seconds < 60:
-                self.manager.query_plinky_plonky_state()
-                await asyncio.sleep(1)
-                wait_guard_seconds += 1
-
-            if wait_guard_seconds >= 60:
-                 self._log_message("Plinky-plonky did not signal reference position"
-                                   f" within {wait_guard_seconds} second(s), considering"
-                                   f" the sequence completed anyway.")
+            await self._wait_for_music_end(music_end)
 
             self.operation_status = "completed"
             self._log_message("Close sequence completed")
@@ -566,7 +714,8 @@ class WebControlInterface:
             self.operation_status = "error"
             self._log_message(f"Close sequence error: {e}")
         finally:
-            self._status_version += 1
+            self.sequencer.forget(music_end)
+            self._status_changed()
 
     async def _check_doors_open(self):
         """
@@ -613,7 +762,14 @@ class WebControlInterface:
             
             # Doors still have multiple devices, so we need a dictionary
             door_state_dict = self.manager.door_state()  # This returns a dict of all doors
-            
+
+            # The sensors of each device, where known
+            sensor_dict = {}
+            for ip in device_connected_ip_list:
+                sensors = self.manager.sensors(ip)
+                if sensors:
+                    sensor_dict[ip] = sensors
+
             return {
                 'device_connected_ip_list': device_connected_ip_list,
                 'device_initialised_ip_list': device_connected_ip_list,
@@ -631,7 +787,8 @@ class WebControlInterface:
                 'lift_state': self._format_state_dict(lift_state),
                 'door_state_dict': self._format_state_dict(door_state_dict),
                 'stand_state': self._format_state_dict(stand_state),
-                'plinky_plonky_state': self._format_state_dict(plinky_plonky_state)
+                'plinky_plonky_state': self._format_state_dict(plinky_plonky_state),
+                'sensor_dict': sensor_dict
             }
         except Exception as e:
             print(f"ERROR in _get_system_status: {e}")
@@ -910,6 +1067,20 @@ class WebControlInterface:
             margin-top: 10px;
         }
         .debug-window .log-info { color: #4ec9b0; }
+        .latency-table {
+            border-collapse: collapse;
+            font-size: 12px;
+            margin: 5px 0 15px 0;
+        }
+        .latency-table th, .latency-table td {
+            padding: 2px 10px;
+            text-align: right;
+        }
+        .latency-table th:first-child, .latency-table td:first-child { text-align: left; }
+        .latency-table .bars { font-family: 'Courier New', monospace; text-align: left; }
+        .stats-chart { vertical-align: middle; }
+        .stats-chart polyline { fill: none; stroke: #007bff; stroke-width: 1.5; }
+        .stats-chart .stats-limit { stroke: #dc3545; stroke-dasharray: 2 2; }
         .debug-window .log-warning { color: #dcdcaa; }
         .debug-window .log-error { color: #f48771; }
         .debug-window .log-debug { color: #9cdcfe; }
@@ -1039,6 +1210,16 @@ class WebControlInterface:
         <div id="systemStatusCompact">Loading devices...</div>
     </div>
 
+    <div class="panel">
+        <h2>⏱️ Command Latency</h2>
+        <div id="latency">No latency measurements (the ESP32s must be built with CONFIG_STEPPER_LATENCY).</div>
+    </div>
+
+    <div class="panel">
+        <h2>🧮 Node Load</h2>
+        <div id="stats">No statistics yet.</div>
+    </div>
+
     <div class="panel">
         <h2>🐛 Debug Output
             <div style="float: right; display: flex; gap: 8px;">
@@ -1269,6 +1450,14 @@ class WebControlInterface:
             }
         }
 
+        // The sensors of a device, filled-in if triggered
+        function sensorsHtml(sensors) {
+            if (!sensors || Object.keys(sensors).length === 0) return '';
+            const text = Object.entries(sensors).map(([name, triggered]) =>
+                `${name} ${triggered ? '●' : '○'}`).join(' ');
+            return `<div class="state">Sensors: ${text}</div>`;
+        }
+
         function updateUI(status) {
             // Update auto-run UI
             const auto = status.auto_run;
@@ -1373,6 +1562,7 @@ class WebControlInterface:
                     if (stateValue) {
                         html += `<div class="state">State: ${stateValue}</div>`;
                     }
+                    html += sensorsHtml(status.sensor_dict[ip]);
                     html += `</div>`;
                 }
             }
@@ -1389,6 +1579,7 @@ class WebControlInterface:
                     if (doorState) {
                         html += `<div class="state">State: ${doorState}</div>`;
                     }
+                    html += sensorsHtml(status.sensor_dict[ip]);
                     html += `</div>`;
                 }
             }
@@ -1482,20 +1673,53 @@ class WebControlInterface:
             }
         }
 
+        // Apply a delta from the status stream: where a member is an
+        // object (e.g. of IP address -> state) only the entries that
+        // changed are sent, null marking one that has gone
+        function applyStatusDelta(status, delta) {
+            for (const [key, value] of Object.entries(delta)) {
+                const current = status[key];
+                if (value !== null && typeof value === 'object' && !Array.isArray(value) &&
+                    current !== null && typeof current === 'object' && !Array.isArray(current)) {
+                    for (const [k, v] of Object.entries(value)) {
+                        if (v === null) {
+                            delete current[k];
+                        } else {
+                            current[k] = v;
+                        }
+                    }
+                } else {
+                    status[key] = value;
+                }
+            }
+        }
+
         // Initialize SSE connections
+        let currentStatus = null;
+
         function setupStatusStream() {
             if (!window.EventSource) return;
             
             const source = new EventSource('/api/status/stream');
             
-            source.onmessage = function(event) {
+            source.addEventListener('snapshot', function(event) {
                 try {
-                    const status = JSON.parse(event.data);
-                    updateUI(status);
+                    currentStatus = JSON.parse(event.data);
+                    updateUI(currentStatus);
                 } catch (e) {
                     console.error("Error parsing status:", e);
                 }
-            };
+            });
+
+            source.addEventListener('delta', function(event) {
+                if (currentStatus === null) return;
+                try {
+                    applyStatusDelta(currentStatus, JSON.parse(event.data));
+                    updateUI(currentStatus);
+                } catch (e) {
+                    console.error("Error parsing status delta:", e);
+                }
+            });
             
             source.onerror = function() {
                 console.log('Status stream error, reconnecting in 5 seconds...');
@@ -1511,16 +1735,32 @@ class WebControlInterface:
             
             const source = new EventSource('/api/logs/stream');
             
-            source.onmessage = function(event) {
+            source.addEventListener('snapshot', function(event) {
                 try {
-                    const newLogs = JSON.parse(event.data);
-                    if (newLogs.length > 0) {
-                        appendLogs(newLogs);
+                    const logs = JSON.parse(event.data);
+                    if (logs.length > 0) {
+                        // Replace whatever we had, e.g. from before a reconnect
+                        logBuffer = [];
+                        appendLogs(logs);
+                    } else if (logBuffer.length > 0) {
+                        appendLogs([]);
                     }
                 } catch (e) {
                     console.error("Error parsing logs:", e);
                 }
-            };
+            });
+
+            source.addEventListener('append', function(event) {
+                try {
+                    appendLogs(JSON.parse(event.data));
+                } catch (e) {
+                    console.error("Error parsing logs:", e);
+                }
+            });
+
+            source.addEventListener('clear', function() {
+                appendLogs([]);
+            });
             
             source.onerror = function() {
                 console.log('Logs stream error, reconnecting in 5 seconds...');
@@ -1531,12 +1771,110 @@ class WebControlInterface:
             logsSource = source;
         }
 
+        // Show the latency histograms of each node: the bars are
+        // the buckets, from the left, up to each of bucket_limits_us
+        function formatLatencyUs(us) {
+            if (us === null || us === undefined) return '-';
+            return us >= 1000 ? `${(us / 1000).toFixed(1)} ms` : `${us} µs`;
+        }
+
+        async function updateLatency() {
+            try {
+                const response = await fetch('/api/latency');
+                const latency = await response.json();
+                const nodes = Object.keys(latency.nodes).sort();
+                if (nodes.length === 0) return;
+                const levels = '▁▂▃▄▅▆▇█';
+                let html = '';
+                for (const node of nodes) {
+                    html += `<b>${escapeHtml(node)}</b><table class="latency-table">`;
+                    html += '<tr><th>Interval</th><th>Count</th><th>Median</th><th>95%</th><th>Max</th>' +
+                            `<th class="bars">0 … ${formatLatencyUs(latency.bucket_limits_us.at(-1))}+</th></tr>`;
+                    for (const interval of latency.intervals) {
+                        const h = latency.nodes[node][interval];
+                        if (!h) continue;
+                        const most = Math.max(...h.counts);
+                        const bars = h.counts.map(c => c === 0 ? '·' :
+                            levels[Math.min(levels.length - 1, Math.floor(c * levels.length / (most + 1)))]).join('');
+                        html += `<tr><td>${escapeHtml(interval)}</td><td>${h.count}</td>` +
+                                `<td>≤ ${formatLatencyUs(h.p50_us)}</td><td>≤ ${formatLatencyUs(h.p95_us)}</td>` +
+                                `<td>${formatLatencyUs(h.max_us)}</td><td class="bars">${bars}</td></tr>`;
+                    }
+                    html += '</table>';
+                }
+                document.getElementById('latency').innerHTML = html;
+            } catch (e) {
+                console.error("Error fetching latency:", e);
+            }
+        }
+
+        // Draw the history of a value as a line, scaled to 0 … max,
+        // with a dashed line at limit if there is one
+        function statsChart(values, max, limit) {
+            const width = 240, height = 30;
+            const known = values.filter(v => v !== null && v !== undefined);
+            if (known.length === 0) return '-';
+            max = Math.max(max, ...known, 1);
+            const y = v => (height - 1 - (v * (height - 2) / max)).toFixed(1);
+            const step = width / Math.max(values.length - 1, 1);
+            const points = values.map((v, i) => (v === null || v === undefined) ? null :
+                                      `${(i * step).toFixed(1)},${y(v)}`).filter(p => p !== null);
+            let svg = `<svg class="stats-chart" width="${width}" height="${height}">`;
+            if (limit !== undefined) {
+                svg += `<line class="stats-limit" x1="0" x2="${width}" y1="${y(limit)}" y2="${y(limit)}"/>`;
+            }
+            return svg + `<polyline points="${points.join(' ')}"/></svg>`;
+        }
+
+        function formatStat(value, units) {
+            return (value === null || value === undefined) ? '-' : `${value}${units}`;
+        }
+
+        // Show the recent load of each node: the CPU of each task over
+        // the history kept, its least free stack and the heap
+        async function updateStats() {
+            try {
+                const response = await fetch('/api/stats');
+                const stats = await response.json();
+                const nodes = Object.keys(stats.nodes).sort();
+                if (nodes.length === 0) return;
+                let html = '';
+                for (const node of nodes) {
+                    const history = stats.nodes[node];
+                    const latest = history.at(-1);
+                    html += `<b>${escapeHtml(node)}</b>: CPU over the last ${(latest.period_ms / 1000).toFixed(1)} s;` +
+                            ` since boot ${latest.log_dropped_count} log message(s) dropped,` +
+                            ` ${latest.tx_dropped_count} message(s) to the server dropped and` +
+                            ` ${latest.tx_retry_count} send(s) retried<table class="latency-table">`;
+                    html += '<tr><th>Task</th><th>CPU</th><th>Stack free</th><th>CPU history</th></tr>';
+                    for (const task of stats.tasks) {
+                        if (latest.cpu_percent[task] === null && latest.stack_free[task] === null) continue;
+                        html += `<tr><td>${escapeHtml(task)}</td>` +
+                                `<td>${formatStat(latest.cpu_percent[task], '%')}</td>` +
+                                `<td>${formatStat(latest.stack_free[task], ' bytes')}</td>` +
+                                `<td>${statsChart(history.map(h => h.cpu_percent[task]), 100)}</td></tr>`;
+                    }
+                    html += `<tr><td>heap</td><td></td>` +
+                            `<td>${latest.heap_free} bytes (least ${latest.heap_min_free})</td>` +
+                            `<td>${statsChart(history.map(h => h.heap_free), 0, latest.heap_min_free)}</td></tr>`;
+                    html += '</table>';
+                }
+                document.getElementById('stats').innerHTML = html;
+            } catch (e) {
+                console.error("Error fetching stats:", e);
+            }
+        }
+
         // Start the streams
         // Add a small delay before starting SSE to ensure page is fully loaded
         setTimeout(() => {
             setupSettingsPanel();
             setupStatusStream();
             setupLogsStream();
+            updateLatency();
+            setInterval(updateLatency, 5000);
+            updateStats();
+            setInterval(updateStats, 5000);
         }, 1000);
         setupDebugWindow();
     </script>
@@ -1557,12 +1895,23 @@ def get_ip_address():
     return ip
 
 
-def main(http_port, esp32_port):
+def main(http_port, esp32_port, log_port=None, log_directory=None, profile_path=None):
     # Create manager
     manager = MusicalBoxManager()
 
+    # The log, kept in RAM and, if there is a directory, flushed there
+    log_store = LogStore(directory=log_directory, name='musical_box')
+
     # Create web interface
-    web_interface = WebControlInterface(manager, host='0.0.0.0', port=http_port)
+    web_interface = WebControlInterface(manager, host='0.0.0.0', port=http_port,
+                                        log_store=log_store)
+
+    if log_port:
+        # Receive the logs of the ESP32s into the same store, rather
+        # than the journal
+        from log_server import ESP32LogServer
+        log_server = ESP32LogServer(port=log_port, store=log_store, journal=False)
+        threading.Thread(target=log_server.start, daemon=True).start()
 
     # Start the server (non-blocking)
     receiver_thread = manager.start(esp32_port)
@@ -1582,22 +1931,35 @@ def main(http_port, esp32_port):
         # Wait for all devices to connect and initialise
         if manager.wait_for_all_devices():
             print("Querying the state of all devices...")
-            manager.query_stand_state()
-            manager.query_lift_state()
-            manager.query_plinky_plonky_state()
-            for index in range(6): # 0 to 5
-                manager.query_door_state(ip=None, index=index)
- 
-            print("=== Ready to play ===")
-            print(f"Web interface available at http://{get_ip_address()}:{http_port}")
-
-            # Process incoming messages
-            while True:
+            # One round trip per device for its state and sensors
+            for ip in manager.get_device_ip_list(connected=True, initialised=True):
+                manager.query_status(ip)
+
+            profile_ok = True
+            if profile_path:
+                # The plinky-plonky keeps this, so it need only be sent
+                # when it changes, but sending it again does no harm
                 try:
-                    ip, msg = manager.incoming_queue.get_nowait()
-                    manager._process_message(ip, msg)
-                except queue.Empty:
-                    time.sleep(0.1)
+                    with open(profile_path, 'rb') as profile_file:
+                        profile_ok = manager.plinky_plonky_upload_profile(profile_file.read())
+                except OSError as e:
+                    print(f"Unable to read velocity profile {profile_path}: {e}")
+                    profile_ok = False
+
+            if profile_ok:
+                print("=== Ready to play ===")
+                print(f"Web interface available at http://{get_ip_address()}:{http_port}")
+
+                # Process incoming messages
+                while True:
+                    try:
+                        ip, msg = manager.incoming_queue.get(timeout=1.0)
+                        manager._process_message(ip, msg)
+                    except queue.Empty:
+                        pass
+                    manager.poll_stats()
+            else:
+                print(f"Failed to upload velocity profile {profile_path}")
         else:
             print("Failed to connect and initialise all devices")
 
@@ -1606,6 +1968,7 @@ def main(http_port, esp32_port):
     finally:
         manager.stop()
         loop.call_soon_threadsafe(loop.stop)
+        log_store.close()
 
 
 if __name__ == "__main__":
@@ -1615,6 +1978,16 @@ if __name__ == "__main__":
                                                                          f"{HTTP_PORT_DEFAULT}."))
     parser.add_argument('-e', type=int, default=ESP32_PORT_DEFAULT, help=("the ESP32 control port, default "
                                                                          f"{ESP32_PORT_DEFAULT}."))
+    parser.add_argument('-l', type=int, help=("receive the logs of the ESP32s on this port, usually 5001,\n"
+                                              "into the log of the web interface, instead of running\n"
+                                              "log_server.py."))
+    parser.add_argument('-g', help=("write the log, compressed and in batches, to files in this\n"
+                                    "directory, e.g. /var/log/musical_box, which is a tmpfs on a\n"
+                                    "Pi with a read-only file system."))
+    parser.add_argument('-v', help=("upload this velocity profile, as written by\n"
+                                    "plinky_plonky_strip_maker.py, to the plinky-plonky;\n"
+                                    "it is kept there, so this need only be given when\n"
+                                    "the profile changes."))
     args = parser.parse_args()
 
-    main(args.p, args.e)
+    main(args.p, args.e, args.l, args.g, args.v)
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Deferred Log String Table Generator
+
+This script parses the LOG_STRING() entries of the C header file
+log_strings.h and writes a Python module containing the same table,
+so that a receiver of deferred log messages (see log_deferred_msg_t
+in protocol.h) can format them.
+
+Usage:
+    python3 generate_python_log_strings_module.py <log_strings.h> [output.py]
+"""
+
+import re
+import sys
+from pathlib import Path
+
+# Matches LOG_STRING(ID, "tag", "format"), allowing for escaped
+# characters in the strings
+ENTRY_PATTERN = re.compile(r'LOG_STRING\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)')
+
+# The conversions a deferred log format string may contain
+CONVERSION_PATTERN = re.compile(r'%(?:%|[-+ #0]*\d*(?:\.\d+)?([a-zA-Z]))')
+CONVERSIONS_ALLOWED = 'diuxXoc'
+
+def parse(content: str):
+    """Return a list of (id, tag, format) tuples, in ID order"""
+    # Only look inside the LOG_STRINGS macro, not at the
+    # LOG_STRING() #define used to expand it
+    start = content.find('#define LOG_STRINGS')
+    if start < 0:
+        raise ValueError("no LOG_STRINGS macro found")
+    entries = []
+    for match in ENTRY_PATTERN.finditer(content, start):
+        name, tag, fmt = match.groups()
+        # Undo C escapes; the strings are plain ASCII
+        tag = tag.encode().decode('unicode_escape')
+        fmt = fmt.encode().decode('unicode_escape')
+        for conversion in CONVERSION_PATTERN.finditer(fmt):
+            letter = conversion.group(1)
+            if letter is not None and letter not in CONVERSIONS_ALLOWED:
+                raise ValueError(f"{name}: conversion \"{conversion.group(0)}\" is not supported")
+        entries.append((name, tag, fmt))
+    return entries
+
+def generate(entries) -> str:
+    """Return the Python module as a string"""
+    output = [
+        '#!/usr/bin/env python3',
+        '"""',
+        'Auto-generated table of deferred log format strings.',
+        '',
+        'This module is generated from the C header file log_strings.h.',
+        'Do not edit this file directly - edit the .h file and regenerate.',
+        '"""',
+        '',
+        '# Indexed by log_string_id_t: (ID name, tag, format)',
+        'LOG_STRINGS = ['
+    ]
+    for name, tag, fmt in entries:
+        output.append(f'    ({name!r}, {tag!r}, {fmt!r}),')
+    output.extend([
+        ']',
+        ''
+    ])
+    return '\n'.join(output)
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+
+    header_path = sys.argv[1]
+    output_path = sys.argv[2] if len(sys.argv) > 2 else 'log_strings.py'
+
+    entries = parse(Path(header_path).read_text())
+    python_code = generate(entries)
+    # Don't touch the output if nothing has changed, to avoid
+    # upsetting anything that watches file times
+    if not Path(output_path).exists() or Path(output_path).read_text() != python_code:
+        Path(output_path).write_text(python_code)
+    print(f"{len(entries)} log string(s) written to {output_path}")
+
+if __name__ == "__main__":
+    main()
@@ -43,10 +43,16 @@ class ProtocolDef:
     states: Dict[str, int] = field(default_factory=dict)
     commands: Dict[str, int] = field(default_factory=dict)
     queries: Dict[str, int] = field(default_factory=dict)
+    query_bits: Dict[str, int] = field(default_factory=dict)
+    latency_stages: Dict[str, int] = field(default_factory=dict)
+    stats_tasks: Dict[str, int] = field(default_factory=dict)
     indications: Dict[str, int] = field(default_factory=dict)
     log_levels: Dict[str, int] = field(default_factory=dict)
     status_codes: Dict[str, int] = field(default_factory=dict)
     structs: Dict[str, Dict[str, Tuple[str, int, str]]] = field(default_factory=dict)
+    # Integer #defines, used for array sizes
+    defines: Dict[str, int] = field(default_factory=dict)
+    array_size_names: List[str] = field(default_factory=list)
 
 
 class CHeaderParser:
@@ -83,6 +89,10 @@ class CHeaderParser:
         log_len_match = re.search(r'#define\s+LOG_MESSAGE_MAX_LEN\s+(\d+)', self.content)
         if log_len_match:
             self.protocol.log_max_len = int(log_len_match.group(1))
+
+        # Any other simple integer #defines, which may be array sizes
+        for match in re.finditer(r'#define\s+(\w+)\s+(0x[0-9A-Fa-f]+|\d+)\s*$', self.content, re.MULTILINE):
+            self.protocol.defines[match.group(1)] = self._parse_int(match.group(2))
     
     def _parse_int(self, value_str: str) -> int:
         """Parse integer value that might be hex, decimal, or binary"""
@@ -216,6 +226,12 @@ class CHeaderParser:
                 self.protocol.commands = values
             elif enum_name == 'qry':
                 self.protocol.queries = values
+            elif enum_name == 'qry_many':
+                self.protocol.query_bits = values
+            elif enum_name == 'lat_stage':
+                self.protocol.latency_stages = values
+            elif enum_name == 'stats_task':
+                self.protocol.stats_tasks = values
             elif enum_name == 'ind':
                 self.protocol.indications = values
             elif enum_name == 'log_level':
@@ -298,11 +314,17 @@ class CHeaderParser:
                 type_name = parts[0]
                 field_name_part = parts[1].rstrip(';')
                 
-                # Handle arrays
-                array_match = re.search(r'(\w+)\[(\d+)\]', field_name_part)
+                # Handle arrays, the size of which may be a #define
+                array_match = re.search(r'(\w+)\[(\w+)\]', field_name_part)
                 if array_match:
                     field_name = array_match.group(1)
-                    array_size = int(array_match.group(2))
+                    array_size_str = array_match.group(2)
+                    if array_size_str in self.protocol.defines:
+                        array_size = self.protocol.defines[array_size_str]
+                        if array_size_str not in self.protocol.array_size_names:
+                            self.protocol.array_size_names.append(array_size_str)
+                    else:
+                        array_size = self._parse_int(array_size_str)
                     element_size = type_sizes.get(type_name, 1)
                     size = element_size * array_size
                     type_info = f"{type_name}[{array_size}]"
@@ -369,6 +391,20 @@ class PythonGenerator:
         
         if self.p.log_max_len is not None:
             self.output.append(f'\nLOG_MESSAGE_MAX_LEN = {self.p.log_max_len}')
+
+        # Array sizes
+        for name in self.p.array_size_names:
+            self.output.append(f'{name} = {self.p.defines[name]}')
+
+        # Values that stand for "not known"
+        for name in sorted(self.p.defines):
+            if '_UNKNOWN_' in name:
+                self.output.append(f'{name} = {self.p.defines[name]}')
+
+        # Limits, e.g. the number of motors, that aren't array sizes
+        for name in sorted(self.p.defines):
+            if name.startswith('PROTOCOL_') and (name.endswith('_MAX') or name.endswith('_MAX_LEN')):
+                self.output.append(f'{name} = {self.p.defines[name]}')
         
         self.output.append('')
     
@@ -378,6 +414,9 @@ class PythonGenerator:
             ('State', self.p.states, 'States'),
             ('Cmd', self.p.commands, 'Command codes'),
             ('Qry', self.p.queries, 'Query codes'),
+            ('QryMany', self.p.query_bits, 'Bit positions of the queries in a QryManyMsg'),
+            ('LatStage', self.p.latency_stages, 'Indices of the timestamps in a LatMsg'),
+            ('StatsTask', self.p.stats_tasks, 'Indices of the tasks in a StatsMsg'),
             ('Ind', self.p.indications, 'Indication/Event codes'),
             ('LogLevel', self.p.log_levels, 'Log levels'),
             ('Status', self.p.status_codes, 'Status codes')
@@ -423,6 +462,10 @@ class PythonGenerator:
                 format_chars.append(f'{array_size}s')
             elif type_name == 'char':
                 format_chars.append('s')
+            elif '[' in type_name:
+                # Array of integers
+                base_type, array_size = type_name.rstrip(']').split('[')
+                format_chars.append(f"{array_size}{type_format.get(base_type, 'B')}")
             else:
                 # Look up the format character, default to 'B' for unknown types
                 format_char = type_format.get(type_name, 'B')
@@ -437,11 +480,20 @@ class PythonGenerator:
         """Add message class definitions"""
         # Map struct names (without _t suffix) to message class names and magic constants
         message_types = [
-            ('cmd_msg', 'CmdMsg', 'CMD', ['command', 'reference', 'param_1', 'param_2', 'param_3', 'param_4']),
-            ('qry_msg', 'QryMsg', 'QRY', ['query', 'reference',]),
+            ('cmd_msg', 'CmdMsg', 'CMD', ['command', 'reference', 'param_1', 'param_2', 'param_3', 'param_4', 'motor']),
+            ('qry_msg', 'QryMsg', 'QRY', ['query', 'reference', 'motor']),
+            ('qry_many_msg', 'QryManyMsg', 'QRY_MANY', ['reference', 'queries', 'motor']),
             ('rsp_msg', 'RspMsg', 'RSP', ['cmd_or_qry', 'reference', 'status', 'value']),
-            ('ind_msg', 'IndMsg', 'IND', ['ind', 'value']),
-            ('log_msg', 'LogMsg', 'LOG', ['level', 'message'])
+            ('rsp_many_msg', 'RspManyMsg', 'RSP_MANY', ['reference', 'queries', 'answered', 'status', 'value']),
+            ('ind_msg', 'IndMsg', 'IND', ['ind', 'value', 'motor']),
+            ('log_msg', 'LogMsg', 'LOG', ['level', 'message']),
+            ('log_deferred_msg', 'LogDeferredMsg', 'LOG_DEFERRED', ['level', 'num_args', 'id', 'timestamp_ms']),
+            ('tlm_msg', 'TlmMsg', 'TLM', ['num_samples', 'period_ms', 'timestamp_ms', 'sg_result', 'tstep', 'current_ma', 'motor']),
+            ('lat_msg', 'LatMsg', 'LAT', ['cmd_or_ind', 'reference', 'time_us']),
+            ('stats_msg', 'StatsMsg', 'STATS', ['reference', 'period_ms', 'heap_free', 'heap_min_free',
+                                                'log_dropped_count', 'tx_dropped_count', 'tx_retry_count',
+                                                'cpu_percent', 'stack_free']),
+            ('udp_msg', 'UdpMsg', 'UDP', ['sequence'])
         ]
         
         for struct_name, class_name, magic_name, fields in message_types:
@@ -457,6 +509,12 @@ class PythonGenerator:
         
         # Handle special case for log message which has a string
         is_log_msg = (class_name == 'LogMsg')
+
+        # Note the sizes of any integer array fields
+        array_sizes = {}
+        for field, (type_name, _, _) in self.p.structs[struct_name].items():
+            if '[' in type_name and not type_name.startswith('char['):
+                array_sizes[field] = int(type_name.split('[')[1].rstrip(']'))
         
         # Class definition
         self.output.extend([
@@ -467,8 +525,9 @@ class PythonGenerator:
         # FORMAT and SIZE
         if is_log_msg:
             self.output.extend([
-                f'    FORMAT = f"<BB {{LOG_MESSAGE_MAX_LEN}}s"',
-                f'    SIZE = 2 + LOG_MESSAGE_MAX_LEN',
+                f'    # Header only: the header is followed by "length" bytes of text',
+                f'    FORMAT = "<BBB"',
+                f'    SIZE = 3',
                 f'    MAGIC = PROTOCOL_MAGIC_{magic_name}',
                 ''
             ])
@@ -490,11 +549,14 @@ class PythonGenerator:
                 ''
             ])
         else:
-            # For non-log messages, generate params with defaults
+            # For non-log messages, generate params with defaults;
+            # array fields are lists, defaulting to all zeroes
             params = []
             for i, field in enumerate(fields):
                 if i == 0:
                     params.append(f"{field}")
+                elif field in array_sizes:
+                    params.append(f"{field}=None")
                 else:
                     params.append(f"{field}=0")
             
@@ -504,7 +566,10 @@ class PythonGenerator:
             ])
             
             for field in fields:
-                self.output.append(f'        self.{field} = {field}')
+                if field in array_sizes:
+                    self.output.append(f'        self.{field} = list({field}) if {field} is not None else [0] * {array_sizes[field]}')
+                else:
+                    self.output.append(f'        self.{field} = {field}')
             
             self.output.append('')
         
@@ -513,18 +578,23 @@ class PythonGenerator:
             self.output.extend([
                 '    def pack(self) -> bytes:',
                 '        """Pack message into bytes for transmission"""',
-                '        # Truncate message if too long',
+                '        # Truncate message if too long; the text is not null-terminated',
                 '        msg_bytes = self.message.encode("utf-8")[:LOG_MESSAGE_MAX_LEN-1]',
-                '        # Pad with null bytes to reach full size',
-                '        padded = msg_bytes + b"\\0" * (LOG_MESSAGE_MAX_LEN - len(msg_bytes))',
                 '        return struct.pack(self.FORMAT,',
                 '                          self.magic,',
                 '                          self.level,',
-                '                          padded)',
+                '                          len(msg_bytes)) + msg_bytes',
+                '',
+                '    @classmethod',
+                '    def frame_size(cls, data: bytes, offset: int = 0) -> int:',
+                '        """Return the size of the frame at offset in data, 0 if the header is incomplete"""',
+                '        if len(data) - offset < cls.SIZE:',
+                '            return 0',
+                '        return cls.SIZE + data[offset + 2]',
                 ''
             ])
         else:
-            pack_args = ['self.magic'] + [f'self.{field}' for field in fields]
+            pack_args = ['self.magic'] + [f'*self.{field}' if field in array_sizes else f'self.{field}' for field in fields]
             self.output.extend([
                 '    def pack(self) -> bytes:',
                 '        """Pack message into bytes for transmission"""',
@@ -532,6 +602,17 @@ class PythonGenerator:
                 f'                          {", ".join(pack_args)})',
                 ''
             ])
+            if class_name == 'LogDeferredMsg':
+                # The header is followed by num_args int32 arguments
+                self.output.extend([
+                    '    @classmethod',
+                    '    def frame_size(cls, data: bytes, offset: int = 0) -> int:',
+                    '        """Return the size of the frame, header plus int32 arguments, at offset in data, 0 if the header is incomplete"""',
+                    '        if len(data) - offset < cls.SIZE:',
+                    '            return 0',
+                    '        return cls.SIZE + data[offset + 2] * 4',
+                    ''
+                ])
         
         # unpack method
         if is_log_msg:
@@ -539,13 +620,15 @@ class PythonGenerator:
                 '    @classmethod',
                 f'    def unpack(cls, data: bytes) -> "{class_name}":',
                 '        """Unpack bytes into a message instance"""',
-                '        if len(data) != cls.SIZE:',
-                '            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")',
-                '        magic, level, msg_bytes = struct.unpack(cls.FORMAT, data)',
+                '        if len(data) < cls.SIZE:',
+                '            raise ValueError(f"Invalid message size: got {len(data)}, expected at least {cls.SIZE}")',
+                '        magic, level, length = struct.unpack(cls.FORMAT, data[:cls.SIZE])',
                 '        if magic != cls.MAGIC:',
                 '            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")',
-                '        # Decode null-terminated string',
-                '        message = msg_bytes.split(b"\\0", 1)[0].decode("utf-8")',
+                '        if len(data) != cls.SIZE + length:',
+                '            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE + length}")',
+                '        # The text may have been truncated mid-character by the sender',
+                '        message = data[cls.SIZE:].decode("utf-8", errors="replace")',
                 f'        return cls(level, message)',
                 ''
             ])
@@ -556,13 +639,35 @@ class PythonGenerator:
                 '        """Unpack bytes into a message instance"""',
                 '        if len(data) != cls.SIZE:',
                 '            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")',
-                '        values = struct.unpack(cls.FORMAT, data)',
+                '        return cls.unpack_from(data)',
+                '',
+                '    @classmethod',
+                f'    def unpack_from(cls, buffer, offset: int = 0) -> "{class_name}":',
+                '        """',
+                '        Unpack a message instance from buffer (e.g. a bytearray or',
+                '        memoryview) at offset, without copying it; there must be at',
+                '        least SIZE bytes from offset',
+                '        """',
+                '        values = struct.unpack_from(cls.FORMAT, buffer, offset)',
                 '        magic = values[0]',
                 '        if magic != cls.MAGIC:',
                 '            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")',
-                f'        return cls(*values[1:])',
-                ''
             ])
+            if array_sizes:
+                # Gather the flattened values of arrays back into lists
+                args = []
+                index = 1
+                for field in fields:
+                    if field in array_sizes:
+                        args.append(f'list(values[{index}:{index + array_sizes[field]}])')
+                        index += array_sizes[field]
+                    else:
+                        args.append(f'values[{index}]')
+                        index += 1
+                self.output.append(f'        return cls({", ".join(args)})')
+            else:
+                self.output.append(f'        return cls(*values[1:])')
+            self.output.append('')
         
         # __repr__ method - FIXED with self. references and proper formatting
         if is_log_msg:
@@ -717,10 +822,13 @@ The Python protocol module has been generated. Here's how to use it:
 ��
     • All multi-byte fields are little-endian (matches ESP32 and Raspberry Pi)
     • TCP provides reliable delivery - no checksums needed
-    • Message sizes are fixed - receive exactly SIZE bytes
+    • Message sizes are fixed - receive exactly SIZE bytes, except LogMsg
     • CmdMsg has 4 parameters for the CMD_STEPPER_TARGET_START command
     • Other commands may use only the first parameter
-    • Log messages are automatically null-padded to LOG_MESSAGE_MAX_LEN
+    • LogMsg is a SIZE byte header followed by "length" bytes of text:
+      use LogMsg.frame_size() on the received bytes to find the frame length
+    • LogDeferredMsg is a SIZE byte header followed by "num_args" int32
+      arguments: LogDeferredMsg.frame_size() gives its frame length
 
 For more details, see the protocol definition in the original C header file.
 """
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Copyright 2026 Rob Meades
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Target State Rule Table Generator
+
+This script parses the STATE_RULE() and ROLE_RULE() entries of the C
+header file state_rules.h and writes a Python module containing the
+same tables, so that the Raspberry Pi can check a target in the same
+way as filter_and_conclude() on the ESP32.
+
+Usage:
+    python3 generate_python_state_rules_module.py <state_rules.h> [output.py]
+"""
+
+import re
+import sys
+from pathlib import Path
+
+# Matches STATE_RULE(state, velocity, stop)
+STATE_RULE_PATTERN = re.compile(r'STATE_RULE\(\s*(STATE_\w+)\s*,\s*(STATE_RULE_VELOCITY_\w+)\s*,'
+                                r'\s*(STATE_RULE_STOP_\w+)\s*\)')
+
+# Matches ROLE_RULE(begin, current_max_ma)
+ROLE_RULE_PATTERN = re.compile(r'ROLE_RULE\(\s*(STATE_\w+_BEGIN)\s*,\s*(\d+)\s*\)')
+
+def parse(content: str):
+    """Return a list of (state, velocity, stop) tuples and a list
+    of (begin, current_max_ma) tuples, in the order of the header"""
+    tables = []
+    for name, pattern in (('STATE_RULES', STATE_RULE_PATTERN), ('ROLE_RULES', ROLE_RULE_PATTERN)):
+        # Only look inside the macro, not at the #define used to expand it
+        start = content.find(f'#define {name}')
+        if start < 0:
+            raise ValueError(f"no {name} macro found")
+        end = content.find('#define', start + 1)
+        entries = [match.groups() for match in pattern.finditer(content, start, end if end >= 0 else len(content))]
+        if not entries:
+            raise ValueError(f"{name} has no entries")
+        tables.append(entries)
+    states = [state for state, _, _ in tables[0]]
+    if len(states) != len(set(states)):
+        raise ValueError("a state has more than one STATE_RULE()")
+    return tables[0], [(begin, int(current_max_ma)) for begin, current_max_ma in tables[1]]
+
+def generate(state_rules, role_rules) -> str:
+    """Return the Python module as a string"""
+    output = [
+        '#!/usr/bin/env python3',
+        '"""',
+        'Auto-generated tables of the rules for target states.',
+        '',
+        'This module is generated from the C header file state_rules.h.',
+        'Do not edit this file directly - edit the .h file and regenerate.',
+        '"""',
+        '',
+        '# Indexed by target state name: (velocity rule, stop rule)',
+        'STATE_RULES = {'
+    ]
+    for state, velocity, stop in state_rules:
+        output.append(f'    {state!r}: ({velocity!r}, {stop!r}),')
+    output.extend([
+        '}',
+        '',
+        '# Indexed by the name of the STATE_*_BEGIN of a role: the most',
+        '# current that may be asked for in that role, in milliAmps',
+        'ROLE_CURRENT_MAX_MA = {'
+    ])
+    for begin, current_max_ma in role_rules:
+        output.append(f'    {begin!r}: {current_max_ma},')
+    output.extend([
+        '}',
+        ''
+    ])
+    return '\n'.join(output)
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        sys.exit(1)
+
+    header_path = sys.argv[1]
+    output_path = sys.argv[2] if len(sys.argv) > 2 else 'state_rules.py'
+
+    state_rules, role_rules = parse(Path(header_path).read_text())
+    python_code = generate(state_rules, role_rules)
+    # Don't touch the output if nothing has changed, to avoid
+    # upsetting anything that watches file times
+    if not Path(output_path).exists() or Path(output_path).read_text() != python_code:
+        Path(output_path).write_text(python_code)
+    print(f"{len(state_rules)} state rule(s) and {len(role_rules)} role rule(s) written to {output_path}")
+
+if __name__ == "__main__":
+    main()
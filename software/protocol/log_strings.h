@@ -0,0 +1,98 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOG_STRINGS_H_
+#define _LOG_STRINGS_H_
+
+/** @file
+ * @brief The table of format strings for deferred log messages
+ * (see log_deferred_msg_t in protocol.h): the ESP32 sends just the
+ * ID of one of these, plus its arguments, and the receiver does the
+ * formatting.
+ *
+ * The ID of a string is its position in the table, so add new entries
+ * at the end, never remove or re-order entries and, having changed
+ * anything, regenerate log_strings.py with:
+ *
+ * python3 generate_python_log_strings_module.py log_strings.h log_strings.py
+ *
+ * ...which the ESP32 build also does.
+ *
+ * Arguments are always sent as int32_t and a format string may
+ * contain only the integer conversions d, i, u, x, X, o and c, with
+ * no length modifiers, at most LOG_DEFERRED_MAX_ARGS of them; each
+ * entry is LOG_STRING(ID, tag, format) and both tag and format must
+ * be a single string literal.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+#define LOG_STRINGS \
+    LOG_STRING(LOG_STRING_RX_UNKNOWN_MAGIC, "stepper", "Received unknown magic byte from host (0x%02x)!") \
+    LOG_STRING(LOG_STRING_RX_CMD, "stepper", "Received command 0x%04x, reference %d, motor %d, parameters 0x%x, 0x%x, 0x%x, 0x%x.") \
+    LOG_STRING(LOG_STRING_RX_QRY, "stepper", "Received query 0x%04x, reference %d, motor %d.") \
+    LOG_STRING(LOG_STRING_CMD_TARGET_START, "stepper", "Received CMD_STEPPER_TARGET_START (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, timeout %d ms.") \
+    LOG_STRING(LOG_STRING_CMD_TARGET_APPEND, "stepper", "Received CMD_STEPPER_TARGET_APPEND (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, timeout %d ms.") \
+    LOG_STRING(LOG_STRING_CMD_TARGET_POSITION_START, "stepper", "Received CMD_STEPPER_TARGET_POSITION_START (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, position %d.") \
+    LOG_STRING(LOG_STRING_CMD_TARGET_POSITION_APPEND, "stepper", "Received CMD_STEPPER_TARGET_POSITION_APPEND (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, position %d.") \
+    LOG_STRING(LOG_STRING_TARGET_QUEUED, "stepper", "Target 0x%04x queued, %d in the queue.") \
+    LOG_STRING(LOG_STRING_TARGET_QUEUE_FULL, "stepper", "Target queue is full (%d), ignoring command.") \
+    LOG_STRING(LOG_STRING_TARGET_ABORT, "stepper", "Aborting previous target (0x%04x) after %d ms to accommodate new one (0x%04x).") \
+    LOG_STRING(LOG_STRING_TARGET_CURRENT, "stepper", "Current will be %d mA.") \
+    LOG_STRING(LOG_STRING_TARGET_MOVE_TIME, "stepper", "Move should take %d ms.") \
+    LOG_STRING(LOG_STRING_TARGET_DISCARD, "stepper", "Discarding %d queued target(s).") \
+    LOG_STRING(LOG_STRING_TARGET_START_QUEUED, "stepper", "Starting queued target 0x%04x, %d more queued.") \
+    LOG_STRING(LOG_STRING_TARGET_START_QUEUED_FAILED, "stepper", "Unable to start queued target 0x%04x (status %d).") \
+    LOG_STRING(LOG_STRING_CMD_INIT, "stepper", "Received CMD_*_INIT (0x%04x).") \
+    LOG_STRING(LOG_STRING_CMD_UNKNOWN, "stepper", "Unknown command received 0x%04x") \
+    LOG_STRING(LOG_STRING_QRY_UNKNOWN, "stepper", "Unknown query received 0x%04x") \
+    LOG_STRING(LOG_STRING_IND_LIFT_DOWN, "stepper", "Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN.") \
+    LOG_STRING(LOG_STRING_IND_LIFT_LIMIT, "stepper", "Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT.") \
+    LOG_STRING(LOG_STRING_IND_PLINKY_PLONKY_REFERENCE, "stepper", "Sent IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE.") \
+    LOG_STRING(LOG_STRING_IND_DOOR_OPEN, "stepper", "Sent IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN.") \
+    LOG_STRING(LOG_STRING_STATE_CHANGE, "stepper", "Motor %d state change 0x%04x -> 0x%04x.") \
+    LOG_STRING(LOG_STRING_STOP_CALLBACK, "stepper", "Stop callback returned true.") \
+    LOG_STRING(LOG_STRING_AT_POSITION, "stepper", "At position %d.") \
+    LOG_STRING(LOG_STRING_TIMEOUT, "stepper", "Timeout.") \
+    LOG_STRING(LOG_STRING_IND_TARGET_END, "stepper", "Sent IND_SYSTEM_STEPPER_TARGET_END for motor %d (status %d).") \
+    LOG_STRING(LOG_STRING_RX_QRY_MANY, "stepper", "Received query many 0x%04x, reference %d, motor %d.") \
+    LOG_STRING(LOG_STRING_CMD_START_AT, "stepper", "Received CMD_STEPPER_START_AT (0x%04x): start in %d us.")
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// The IDs of the deferred log format strings.
+typedef enum {
+#define LOG_STRING(id, tag, format) id,
+    LOG_STRINGS
+#undef LOG_STRING
+    LOG_STRING_NUM
+} log_string_id_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LOG_STRINGS_H_
+
+// End of file
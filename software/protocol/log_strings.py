@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+"""
+Auto-generated table of deferred log format strings.
+
+This module is generated from the C header file log_strings.h.
+Do not edit this file directly - edit the .h file and regenerate.
+"""
+
+# Indexed by log_string_id_t: (ID name, tag, format)
+LOG_STRINGS = [
+    ('LOG_STRING_RX_UNKNOWN_MAGIC', 'stepper', 'Received unknown magic byte from host (0x%02x)!'),
+    ('LOG_STRING_RX_CMD', 'stepper', 'Received command 0x%04x, reference %d, motor %d, parameters 0x%x, 0x%x, 0x%x, 0x%x.'),
+    ('LOG_STRING_RX_QRY', 'stepper', 'Received query 0x%04x, reference %d, motor %d.'),
+    ('LOG_STRING_CMD_TARGET_START', 'stepper', 'Received CMD_STEPPER_TARGET_START (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, timeout %d ms.'),
+    ('LOG_STRING_CMD_TARGET_APPEND', 'stepper', 'Received CMD_STEPPER_TARGET_APPEND (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, timeout %d ms.'),
+    ('LOG_STRING_CMD_TARGET_POSITION_START', 'stepper', 'Received CMD_STEPPER_TARGET_POSITION_START (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, position %d.'),
+    ('LOG_STRING_CMD_TARGET_POSITION_APPEND', 'stepper', 'Received CMD_STEPPER_TARGET_POSITION_APPEND (0x%04x): target state 0x%04x, velocity %d milliHertz, %d mA, position %d.'),
+    ('LOG_STRING_TARGET_QUEUED', 'stepper', 'Target 0x%04x queued, %d in the queue.'),
+    ('LOG_STRING_TARGET_QUEUE_FULL', 'stepper', 'Target queue is full (%d), ignoring command.'),
+    ('LOG_STRING_TARGET_ABORT', 'stepper', 'Aborting previous target (0x%04x) after %d ms to accommodate new one (0x%04x).'),
+    ('LOG_STRING_TARGET_CURRENT', 'stepper', 'Current will be %d mA.'),
+    ('LOG_STRING_TARGET_MOVE_TIME', 'stepper', 'Move should take %d ms.'),
+    ('LOG_STRING_TARGET_DISCARD', 'stepper', 'Discarding %d queued target(s).'),
+    ('LOG_STRING_TARGET_START_QUEUED', 'stepper', 'Starting queued target 0x%04x, %d more queued.'),
+    ('LOG_STRING_TARGET_START_QUEUED_FAILED', 'stepper', 'Unable to start queued target 0x%04x (status %d).'),
+    ('LOG_STRING_CMD_INIT', 'stepper', 'Received CMD_*_INIT (0x%04x).'),
+    ('LOG_STRING_CMD_UNKNOWN', 'stepper', 'Unknown command received 0x%04x'),
+    ('LOG_STRING_QRY_UNKNOWN', 'stepper', 'Unknown query received 0x%04x'),
+    ('LOG_STRING_IND_LIFT_DOWN', 'stepper', 'Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_DOWN.'),
+    ('LOG_STRING_IND_LIFT_LIMIT', 'stepper', 'Sent IND_LIFT_SENSOR_TRIGGERED_LIFT_LIMIT.'),
+    ('LOG_STRING_IND_PLINKY_PLONKY_REFERENCE', 'stepper', 'Sent IND_PLINKY_PLONKY_SENSOR_TRIGGERED_REFERENCE.'),
+    ('LOG_STRING_IND_DOOR_OPEN', 'stepper', 'Sent IND_DOOR_SENSOR_TRIGGERED_DOOR_OPEN.'),
+    ('LOG_STRING_STATE_CHANGE', 'stepper', 'Motor %d state change 0x%04x -> 0x%04x.'),
+    ('LOG_STRING_STOP_CALLBACK', 'stepper', 'Stop callback returned true.'),
+    ('LOG_STRING_AT_POSITION', 'stepper', 'At position %d.'),
+    ('LOG_STRING_TIMEOUT', 'stepper', 'Timeout.'),
+    ('LOG_STRING_IND_TARGET_END', 'stepper', 'Sent IND_SYSTEM_STEPPER_TARGET_END for motor %d (status %d).'),
+    ('LOG_STRING_RX_QRY_MANY', 'stepper', 'Received query many 0x%04x, reference %d, motor %d.'),
+    ('LOG_STRING_CMD_START_AT', 'stepper', 'Received CMD_STEPPER_START_AT (0x%04x): start in %d us.'),
+]
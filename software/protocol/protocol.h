@@ -36,22 +36,67 @@ extern "C" {
  * -------------------------------------------------------------- */
 
 // The version of this protocol.
-#define PROTOCOL_VERSION      0x01
+#define PROTOCOL_VERSION      0x02
 
 // Magic bytes for different message types.
 #define PROTOCOL_MAGIC_CMD    0xAA
 #define PROTOCOL_MAGIC_QRY    0xBB
+#define PROTOCOL_MAGIC_QRY_MANY 0xBC
 #define PROTOCOL_MAGIC_RSP    0xCC
+#define PROTOCOL_MAGIC_RSP_MANY 0xCD
 #define PROTOCOL_MAGIC_IND    0xDD
+#define PROTOCOL_MAGIC_TLM    0xDF
+#define PROTOCOL_MAGIC_LAT    0xDE
+#define PROTOCOL_MAGIC_STATS  0xDC
 #define PROTOCOL_MAGIC_LOG    0xEE
+#define PROTOCOL_MAGIC_LOG_DEFERRED 0xEF
+#define PROTOCOL_MAGIC_UDP    0xDB
 
 // The maximum length of a message that can be sent to the ESP32
-// "module", i.e. the length of a cmd_t.
-#define PROTOCOL_ESP32_MAX_RX_LEN (sizeof(cmd_t))
+// "module", i.e. the length of a cmd_msg_t.
+#define PROTOCOL_ESP32_MAX_RX_LEN (sizeof(cmd_msg_t))
 
-// The maximum length of a log message (including the null terminator).
+// The maximum length of the text of a log message plus one: the text
+// of a log_msg_t is not null-terminated so at most
+// LOG_MESSAGE_MAX_LEN - 1 bytes of it are sent.
 #define LOG_MESSAGE_MAX_LEN   256
 
+// The maximum number of arguments a deferred log message may carry.
+#define LOG_DEFERRED_MAX_ARGS 8
+
+// The number of telemetry samples carried by a tlm_msg_t.
+#define TLM_MAX_SAMPLES 8
+
+// The number of bits in the bitmask of a qry_many_msg_t and hence
+// the number of values in a rsp_many_msg_t.
+#define QRY_MANY_MAX 16
+
+// The number of timestamps carried by a lat_msg_t.
+#define LAT_MAX_STAGES 8
+
+// The number of tasks a stats_msg_t has room for.
+#define STATS_MAX_TASKS 10
+
+// The values in a stats_msg_t of a task that is not running, or
+// for which the figure is not available.
+#define STATS_UNKNOWN_CPU   0xff
+#define STATS_UNKNOWN_STACK 0xffff
+
+// The most motors that a receiver may drive, each with a TMC2209 of
+// its own on a shared UART, see the motor field of cmd_msg_t.
+#define PROTOCOL_MOTOR_MAX 4
+
+// The longest datagram that a receiver sends on the UDP channel, see
+// udp_msg_t, kept below the Ethernet MTU so that it is never
+// fragmented.
+#define PROTOCOL_UDP_MAX_LEN 1400
+
+// The most segments a velocity profile of the plinky-plonky may have,
+// see CMD_PLINKY_PLONKY_PROFILE_BEGIN, and the most that a segment may
+// scale the velocity of a target by, in thousandths.
+#define PROTOCOL_PROFILE_SEGMENTS_MAX 128
+#define PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX 4000
+
 /* ----------------------------------------------------------------
  * TYPES
  * -------------------------------------------------------------- */
@@ -109,6 +154,56 @@ typedef enum {
     // 3: the current to supply to the stepper motor in milliamps
     // 4: the timeout for the operation in milliseconds
     CMD_STEPPER_TARGET_START       = CMD_SYSTEM_BEGIN + 3,
+    // CMD_STEPPER_TARGET_POSITION_START is the same as
+    // CMD_STEPPER_TARGET_START except that the stepper is driven
+    // through its STEP pin with an acceleration profile and stops
+    // at the given position or when the target state is reached,
+    // whichever comes first; it has four parameters:
+    // 1: the target state, taken from state_t,
+    // 2: the maximum velocity to travel at in milliHertz, the
+    //    direction being set by the position,
+    // 3: the current to supply to the stepper motor in milliamps
+    // 4: the position to move to, in steps
+    CMD_STEPPER_TARGET_POSITION_START = CMD_SYSTEM_BEGIN + 4,
+    // CMD_STEPPER_TARGET_APPEND has the same parameters as
+    // CMD_STEPPER_TARGET_START but, rather than replacing any
+    // target that is running, it is queued behind it, and behind
+    // anything else already queued, starting the moment the one in
+    // front of it ends; each target ends with its own
+    // IND_SYSTEM_STEPPER_TARGET_END.  A CMD_STEPPER_TARGET_START
+    // or CMD_STEPPER_TARGET_POSITION_START throws away anything
+    // queued, sending an IND_SYSTEM_STEPPER_TARGET_END with
+    // STATUS_ERROR_ABORT for each.  If the queue is full the
+    // response is STATUS_ERROR_BUSY.
+    CMD_STEPPER_TARGET_APPEND      = CMD_SYSTEM_BEGIN + 5,
+    // CMD_STEPPER_TARGET_POSITION_APPEND is to
+    // CMD_STEPPER_TARGET_POSITION_START what
+    // CMD_STEPPER_TARGET_APPEND is to CMD_STEPPER_TARGET_START.
+    CMD_STEPPER_TARGET_POSITION_APPEND = CMD_SYSTEM_BEGIN + 6,
+    // CMD_STEPPER_TELEMETRY switches telemetry on or off for a
+    // motor; while telemetry is on, and a target is running,
+    // SG_RESULT, TSTEP and the current actually being delivered are
+    // sampled and sent in tlm_msg_t's of up to TLM_MAX_SAMPLES, any
+    // that remain being sent when the target ends.  It has one
+    // parameter:
+    // 1: the interval between samples in milliseconds, from 10 to
+    //    65535, or 0 to switch telemetry off.
+    CMD_STEPPER_TELEMETRY          = CMD_SYSTEM_BEGIN + 7,
+    // CMD_STEPPER_START_AT aborts any running or queued target
+    // and then holds the targets that are sent after it, with
+    // CMD_STEPPER_TARGET_APPEND or CMD_STEPPER_TARGET_POSITION_APPEND,
+    // until a given time, at which point they are started as if
+    // they had been queued; this allows several receivers to start
+    // moving together.  It applies to one motor: the targets of
+    // all of the motors of a receiver that are due to start at the
+    // same time are started together, the register writes for all
+    // of them going to the TMC2209s in one go.  A
+    // CMD_STEPPER_TARGET_START or CMD_STEPPER_TARGET_POSITION_START
+    // cancels it.  It has one parameter:
+    // 1: the time to start, in the time base of the receiver
+    //    returned by QRY_SYSTEM_TIME, which must be in the future
+    //    by no more than 60 seconds.
+    CMD_STEPPER_START_AT           = CMD_SYSTEM_BEGIN + 8,
     CMD_SYSTEM_END                 = 0x00ff,
 
     // System-level queries start at 0x0100
@@ -134,11 +229,32 @@ typedef enum {
     // Queries to the lift start at 0x2100
     // Indications from the lift start at 0x2200
 
-    // Commands to the plinky-plonky (there is only init)
+    // Commands to the plinky-plonky
     CMD_PLINKY_PLONKY_BEGIN         = 0x3000,
     // CMD_PLINKY_PLONKY_INIT has no parameters, it just
     // means "you are a plinky-plonky"
     CMD_PLINKY_PLONKY_INIT          = CMD_PLINKY_PLONKY_BEGIN,
+    // CMD_PLINKY_PLONKY_PROFILE_BEGIN starts the upload of a
+    // velocity profile, see profile_segment_t, throwing away any
+    // upload that was under way; the segments follow in
+    // CMD_PLINKY_PLONKY_PROFILE_SEGMENTS.  Once they have all
+    // arrived the profile is kept in NVS and every target of the
+    // plinky-plonky that moves at a velocity (i.e. not one of the
+    // POSITION variants) plays it, with no further traffic from the
+    // server.  It has one parameter:
+    // 1: the number of segments, up to PROTOCOL_PROFILE_SEGMENTS_MAX,
+    //    or zero to delete the profile, which takes effect at once.
+    CMD_PLINKY_PLONKY_PROFILE_BEGIN = CMD_PLINKY_PLONKY_BEGIN + 1,
+    // CMD_PLINKY_PLONKY_PROFILE_SEGMENTS carries up to three
+    // segments of the profile being uploaded, which must be sent in
+    // order; the response to the one that carries the last segment
+    // says whether the profile was kept.  It has four parameters:
+    // 1: the index of the first of the segments, counting from zero,
+    // 2, 3 and 4: the segments, each a profile_segment_t in the
+    //    low and high 16 bits, duration_ms being the low 16 bits;
+    //    those past the number of segments given to
+    //    CMD_PLINKY_PLONKY_PROFILE_BEGIN are ignored.
+    CMD_PLINKY_PLONKY_PROFILE_SEGMENTS = CMD_PLINKY_PLONKY_BEGIN + 2,
     CMD_PLINKY_PLONKY_END           = 0x30ff,
 
     // Queries to the plinky-plonky start at 0x3100
@@ -158,12 +274,28 @@ typedef enum {
 
 // Queries.
 typedef enum {
-    // System-level queries (there are none)
+    // System-level queries
     QRY_SYSTEM_BEGIN                   = 0x0100,
     // QRY_STEPPER_STATE should cause the receiver to
     // return a rsp_msg_t with the value field containing
     // its current state, from state_t.
     QRY_SYSTEM_STEPPER_STATE           = QRY_SYSTEM_BEGIN,
+    // QRY_SYSTEM_STEPPER_POSITION should cause the receiver
+    // to return a rsp_msg_t with the value field containing
+    // its current position in steps, as counted for
+    // CMD_STEPPER_TARGET_POSITION_START
+    QRY_SYSTEM_STEPPER_POSITION        = QRY_SYSTEM_BEGIN + 1,
+    // QRY_SYSTEM_TIME should cause the receiver to return
+    // a rsp_msg_t with the value field containing its time
+    // in microseconds, which wraps at 32 bits; the sender may
+    // use this, NTP-style, to learn the offset between its
+    // time and that of the receiver, e.g. for CMD_STEPPER_START_AT.
+    QRY_SYSTEM_TIME                    = QRY_SYSTEM_BEGIN + 2,
+    // QRY_SYSTEM_STATS should cause the receiver to return
+    // a rsp_msg_t with the value field containing its free
+    // heap in bytes, followed by a stats_msg_t with the same
+    // reference saying how loaded it is.
+    QRY_SYSTEM_STATS                   = QRY_SYSTEM_BEGIN + 3,
     QRY_SYSTEM_END                     = 0x01ff,
 
     // Queries to the stand (there are none)
@@ -201,15 +333,68 @@ typedef enum {
     QRY_DOOR_END                       = 0x41ff
 } qry_t;
 
+// The bit positions of the queries that may be asked together in
+// a qry_many_msg_t, each named as its qry_t with QRY_ replaced by
+// QRY_MANY_; there may be at most QRY_MANY_MAX of these.  Add new
+// entries at the end.
+typedef enum {
+    QRY_MANY_SYSTEM_STEPPER_STATE           = 0,
+    QRY_MANY_SYSTEM_STEPPER_POSITION        = 1,
+    QRY_MANY_LIFT_SENSOR_DOWN               = 2,
+    QRY_MANY_LIFT_SENSOR_LIMIT              = 3,
+    QRY_MANY_PLINKY_PLONKY_SENSOR_REFERENCE = 4,
+    QRY_MANY_DOOR_SENSOR_OPEN               = 5,
+    QRY_MANY_NUM                            = 6
+} qry_many_t;
+
+// The stages in the handling of a command at which a timestamp
+// is captured in a lat_msg_t, in the order they are reached;
+// there may be at most LAT_MAX_STAGES of these.
+typedef enum {
+    LAT_STAGE_RX            = 0, // Data noticed waiting on the socket
+    LAT_STAGE_LOCKED        = 1, // Production lock acquired
+    LAT_STAGE_PARSED        = 2, // Command parsed out of the received data
+    LAT_STAGE_UART_DONE     = 3, // Register writes to the TMC2209 complete
+    LAT_STAGE_MOTOR_ENABLED = 4, // Motor enabled, motion begins
+    LAT_STAGE_RSP_QUEUED    = 5, // Response queued for transmission
+    LAT_STAGE_STOP_DETECTED = 6, // End of the target noticed
+    LAT_STAGE_IND_QUEUED    = 7, // IND_SYSTEM_STEPPER_TARGET_END queued for transmission
+    LAT_STAGE_NUM           = 8
+} lat_stage_t;
+
+// The tasks whose load is reported in a stats_msg_t, the index
+// of each in the arrays there; there may be at most
+// STATS_MAX_TASKS of these.
+typedef enum {
+    STATS_TASK_PRODUCTION    = 0, // The task that connects to the server
+    STATS_TASK_MONITOR       = 1, // Sensors and the running target
+    STATS_TASK_COMMS_RX      = 2, // Receives commands and queries
+    STATS_TASK_COMMS_TX      = 3, // Sends responses and indications
+    STATS_TASK_STALL         = 4, // Handles a stall of the motor
+    STATS_TASK_LOG_RECONNECT = 5, // Reconnects to the log server
+    STATS_TASK_LOG_FLUSH     = 6, // Sends what is logged
+    STATS_TASK_ESP_TIMER     = 7, // Runs the esp_timer callbacks, e.g. debouncing
+    STATS_TASK_IDLE          = 8, // What is left over
+    STATS_TASK_TELEMETRY     = 9, // Takes the samples for CMD_STEPPER_TELEMETRY
+    STATS_TASK_NUM           = 10
+} stats_task_t;
+
 // Indications.
 typedef enum {
     // System-level indications
     IND_SYSTEM_BEGIN                             = 0x0200,
     // This is sent by a stepper when it has completed a
-    // CMD_STEPPER_TARGET_START, either successfully or not,
-    // the value field of the ind_msg_t indicating containing
+    // CMD_STEPPER_TARGET_START (or one of its variants), either
+    // successfully or not, the value field of the ind_msg_t
+    // indicating containing
     // status_t (i.e. zero for success)
     IND_SYSTEM_STEPPER_TARGET_END                = IND_SYSTEM_BEGIN,
+    // Sent periodically by a receiver that uses the UDP channel, for
+    // each of its motors, with the value field of the ind_msg_t
+    // containing the current state_t; it is accompanied by the
+    // current value of each sensor indication of the role, so that
+    // a datagram that is lost is made good by the next one
+    IND_SYSTEM_STATE                             = IND_SYSTEM_BEGIN + 1,
     IND_SYSTEM_END                               = 0x02ff,
 
     // Indications from the stand (there are none)
@@ -256,7 +441,14 @@ typedef enum {
     STATUS_ERROR_HARDWARE          = 10
 } status_t;
 
-// Message structures
+// Message structures.  A receiver may drive several motors, see
+// PROTOCOL_MOTOR_MAX, motor n being the TMC2209 at UART address n;
+// a command, query or indication that concerns a motor says which
+// one in its motor field, zero for a receiver with a single motor.
+// A command or query for a motor the receiver does not have is
+// answered with STATUS_ERROR_INVALID_PARAM.  Everything else (e.g.
+// CMD_*_INIT, CMD_REBOOT, QRY_SYSTEM_TIME) is the same whichever
+// motor is given.
 typedef struct __attribute__((packed)) {
     uint8_t magic;      // PROTOCOL_MAGIC_CMD
     uint16_t command;   // cmd_t
@@ -265,12 +457,14 @@ typedef struct __attribute__((packed)) {
     int32_t param_2;   // Parameter 2
     int32_t param_3;   // Parameter 3
     int32_t param_4;   // Parameter 4
+    uint8_t motor;      // The motor, from 0 to PROTOCOL_MOTOR_MAX - 1
 } cmd_msg_t;
 
 typedef struct __attribute__((packed)) {
     uint8_t magic;      // PROTOCOL_MAGIC_QRY
     uint16_t query;     // qry_t
     uint8_t reference;  // Reference to be copied into the response, increment after each query
+    uint8_t motor;      // The motor, from 0 to PROTOCOL_MOTOR_MAX - 1
 } qry_msg_t;
 
 typedef struct __attribute__((packed)) {
@@ -281,18 +475,135 @@ typedef struct __attribute__((packed)) {
     int32_t value;      // Response value (if any)
 } rsp_msg_t;
 
+// Ask several queries at once: the receiver returns a single
+// rsp_many_msg_t carrying all of the answers.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;      // PROTOCOL_MAGIC_QRY_MANY
+    uint8_t reference;  // Reference to be copied into the response, increment after each query
+    uint16_t queries;   // Bitmask of the queries to answer, bit positions from qry_many_t
+    uint8_t motor;      // The motor, from 0 to PROTOCOL_MOTOR_MAX - 1
+} qry_many_msg_t;
+
+// The response to a qry_many_msg_t: value[n] is the answer to the
+// query at bit position n, valid if bit n of answered is set; status
+// is STATUS_OK if all of the queries were answered, otherwise the
+// status of the first one that was not.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;                   // PROTOCOL_MAGIC_RSP_MANY
+    uint8_t reference;               // Reference from the qry_many_msg_t
+    uint16_t queries;                // Bitmask of the queries that were asked
+    uint16_t answered;               // Bitmask of the queries that were answered
+    uint16_t status;                 // non-zero means at least one query failed
+    int32_t value[QRY_MANY_MAX];     // The answers, indexed by bit position
+} rsp_many_msg_t;
+
 typedef struct __attribute__((packed)) {
     uint8_t magic;      // PROTOCOL_MAGIC_IND
     uint16_t ind;       // ind_t
     int32_t value;     // Associated value (if any)
+    uint8_t motor;      // The motor, from 0 to PROTOCOL_MOTOR_MAX - 1
 } ind_msg_t;
 
+// A log message is this header followed immediately by length bytes
+// of text, the text NOT being null-terminated; on the wire log
+// messages are variable length, a receiver reading the header to
+// find out how many more bytes make up the frame.
 typedef struct __attribute__((packed)) {
     uint8_t magic;      // PROTOCOL_MAGIC_LOG
     uint8_t level;      // log_level_t
-    char message[LOG_MESSAGE_MAX_LEN];  // Null-terminated string
+    uint8_t length;     // Bytes of text that follow, max LOG_MESSAGE_MAX_LEN - 1
 } log_msg_t;
 
+// A deferred log message: rather than text, the ESP32 sends the ID
+// of a format string from log_strings.h plus the arguments, and the
+// receiver does the formatting.  This header is followed immediately
+// by num_args int32_t arguments; as for log_msg_t, the third byte
+// is what tells a receiver how long the frame is.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;         // PROTOCOL_MAGIC_LOG_DEFERRED
+    uint8_t level;         // log_level_t
+    uint8_t num_args;      // int32_t arguments that follow, max LOG_DEFERRED_MAX_ARGS
+    uint16_t id;           // log_string_id_t
+    uint32_t timestamp_ms; // Milliseconds since boot when logged
+} log_deferred_msg_t;
+
+// A telemetry message: the first num_samples entries of each array
+// are valid, the first sample taken at timestamp_ms and the rest
+// nominally period_ms apart; see CMD_STEPPER_TELEMETRY.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;                          // PROTOCOL_MAGIC_TLM
+    uint8_t num_samples;                    // Valid entries in each array
+    uint16_t period_ms;                     // Interval between samples
+    uint32_t timestamp_ms;                  // Milliseconds since boot of the first sample
+    uint16_t sg_result[TLM_MAX_SAMPLES];    // SG_RESULT, lower means more load
+    uint32_t tstep[TLM_MAX_SAMPLES];        // TSTEP, 0xfffff when (nearly) stationary
+    uint16_t current_ma[TLM_MAX_SAMPLES];   // RMS current being delivered, in mA
+    uint8_t motor;                          // The motor, from 0 to PROTOCOL_MOTOR_MAX - 1
+} tlm_msg_t;
+
+// A latency message, sent only if the receiver has been built with
+// latency measurement switched on: it follows the response to a
+// command, with cmd_or_ind set to the command, and, for a command
+// that starts a target, also follows the IND_SYSTEM_STEPPER_TARGET_END
+// that ends it, with cmd_or_ind set to IND_SYSTEM_STEPPER_TARGET_END
+// and all of the stages that target went through.  Times are in
+// the same microsecond time base as QRY_SYSTEM_TIME, zero meaning
+// that the stage was not reached.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;                    // PROTOCOL_MAGIC_LAT
+    uint16_t cmd_or_ind;              // The command, or IND_SYSTEM_STEPPER_TARGET_END
+    uint8_t reference;                // Reference from the command
+    uint32_t time_us[LAT_MAX_STAGES]; // Indexed by lat_stage_t
+} lat_msg_t;
+
+// A statistics message: it follows the response to a
+// QRY_SYSTEM_STATS.  The CPU load of each task is a percentage
+// of the period_ms since the previous QRY_SYSTEM_STATS (or since
+// boot), and is only available if the receiver has been built
+// with FreeRTOS run-time statistics switched on; the free stack
+// of each task is the least there has ever been.  The counts are
+// of everything since boot.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;                         // PROTOCOL_MAGIC_STATS
+    uint8_t reference;                     // Reference from the query
+    uint32_t period_ms;                    // Time the CPU loads are over
+    uint32_t heap_free;                    // Bytes of heap free now
+    uint32_t heap_min_free;                // Least bytes of heap there have been free
+    uint32_t log_dropped_count;            // Log messages dropped
+    uint32_t tx_dropped_count;             // Messages to the server dropped
+    uint32_t tx_retry_count;               // Sends to the server retried
+    uint8_t cpu_percent[STATS_MAX_TASKS];  // Indexed by stats_task_t, or STATS_UNKNOWN_CPU
+    uint16_t stack_free[STATS_MAX_TASKS];  // Indexed by stats_task_t, bytes, or STATS_UNKNOWN_STACK
+} stats_msg_t;
+
+// The header of a datagram on the UDP channel, which a receiver may
+// be built to use for traffic where only the latest value matters:
+// sensor indications, IND_SYSTEM_STATE and tlm_msg_t's.  Everything
+// else, including IND_SYSTEM_STEPPER_TARGET_END, remains on the TCP
+// connection.  The header is followed immediately by one or more of
+// those messages, as they would be on the TCP connection, up to a
+// total of PROTOCOL_UDP_MAX_LEN bytes.  sequence goes up by one with
+// each datagram a receiver sends, from wherever it happens to be when
+// the TCP connection is made, so that the server can put datagrams
+// back in order and notice any that have gone missing.
+typedef struct __attribute__((packed)) {
+    uint8_t magic;      // PROTOCOL_MAGIC_UDP
+    uint32_t sequence;  // Wraps at 32 bits
+} udp_msg_t;
+
+// A segment of a velocity profile of the plinky-plonky, see
+// CMD_PLINKY_PLONKY_PROFILE_BEGIN: for duration_ms the velocity of
+// the target is that given to CMD_STEPPER_TARGET_START scaled by
+// velocity_per_mille, the segments following one after another from
+// the moment the target starts; after the last segment the velocity
+// stays where it is until the target ends.  A profile, as written to
+// file by plinky_plonky_strip_maker.py, is simply its segments, one
+// after the other.
+typedef struct __attribute__((packed)) {
+    uint16_t duration_ms;
+    uint16_t velocity_per_mille;  // From 1 to PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX
+} profile_segment_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,16 +11,33 @@ from enum import IntEnum
 from typing import Optional, Union, Tuple, Any
 import socket
 
-PROTOCOL_VERSION = 1
+PROTOCOL_VERSION = 2
 
 # Magic bytes
 PROTOCOL_MAGIC_CMD = 170
 PROTOCOL_MAGIC_IND = 221
+PROTOCOL_MAGIC_LAT = 222
 PROTOCOL_MAGIC_LOG = 238
+PROTOCOL_MAGIC_LOG_DEFERRED = 239
 PROTOCOL_MAGIC_QRY = 187
+PROTOCOL_MAGIC_QRY_MANY = 188
 PROTOCOL_MAGIC_RSP = 204
+PROTOCOL_MAGIC_RSP_MANY = 205
+PROTOCOL_MAGIC_STATS = 220
+PROTOCOL_MAGIC_TLM = 223
+PROTOCOL_MAGIC_UDP = 219
 
 LOG_MESSAGE_MAX_LEN = 256
+QRY_MANY_MAX = 16
+TLM_MAX_SAMPLES = 8
+LAT_MAX_STAGES = 8
+STATS_MAX_TASKS = 10
+STATS_UNKNOWN_CPU = 255
+STATS_UNKNOWN_STACK = 65535
+PROTOCOL_MOTOR_MAX = 4
+PROTOCOL_PROFILE_SEGMENTS_MAX = 128
+PROTOCOL_PROFILE_VELOCITY_PER_MILLE_MAX = 4000
+PROTOCOL_UDP_MAX_LEN = 1400
 
 class State(IntEnum):
     """States"""
@@ -57,6 +74,11 @@ class Cmd(IntEnum):
     CMD_LOG_START = 1
     CMD_LOG_STOP = 2
     CMD_STEPPER_TARGET_START = 3
+    CMD_STEPPER_TARGET_POSITION_START = 4
+    CMD_STEPPER_TARGET_APPEND = 5
+    CMD_STEPPER_TARGET_POSITION_APPEND = 6
+    CMD_STEPPER_TELEMETRY = 7
+    CMD_STEPPER_START_AT = 8
     CMD_SYSTEM_END = 255
     CMD_STAND_BEGIN = 4096
     CMD_STAND_INIT = 4096
@@ -66,6 +88,8 @@ class Cmd(IntEnum):
     CMD_LIFT_END = 8447
     CMD_PLINKY_PLONKY_BEGIN = 12288
     CMD_PLINKY_PLONKY_INIT = 12288
+    CMD_PLINKY_PLONKY_PROFILE_BEGIN = 12289
+    CMD_PLINKY_PLONKY_PROFILE_SEGMENTS = 12290
     CMD_PLINKY_PLONKY_END = 12543
     CMD_DOOR_BEGIN = 16384
     CMD_DOOR_INIT = 16384
@@ -75,6 +99,9 @@ class Qry(IntEnum):
     """Query codes"""
     QRY_SYSTEM_BEGIN = 256
     QRY_SYSTEM_STEPPER_STATE = 256
+    QRY_SYSTEM_STEPPER_POSITION = 257
+    QRY_SYSTEM_TIME = 258
+    QRY_SYSTEM_STATS = 259
     QRY_SYSTEM_END = 511
     QRY_STAND_BEGIN = 4352
     QRY_STAND_END = 4607
@@ -89,10 +116,47 @@ class Qry(IntEnum):
     QRY_DOOR_SENSOR_OPEN = 16640
     QRY_DOOR_END = 16895
 
+class QryMany(IntEnum):
+    """Bit positions of the queries in a QryManyMsg"""
+    QRY_MANY_SYSTEM_STEPPER_STATE = 0
+    QRY_MANY_SYSTEM_STEPPER_POSITION = 1
+    QRY_MANY_LIFT_SENSOR_DOWN = 2
+    QRY_MANY_LIFT_SENSOR_LIMIT = 3
+    QRY_MANY_PLINKY_PLONKY_SENSOR_REFERENCE = 4
+    QRY_MANY_DOOR_SENSOR_OPEN = 5
+    QRY_MANY_NUM = 6
+
+class LatStage(IntEnum):
+    """Indices of the timestamps in a LatMsg"""
+    LAT_STAGE_RX = 0
+    LAT_STAGE_LOCKED = 1
+    LAT_STAGE_PARSED = 2
+    LAT_STAGE_UART_DONE = 3
+    LAT_STAGE_MOTOR_ENABLED = 4
+    LAT_STAGE_RSP_QUEUED = 5
+    LAT_STAGE_STOP_DETECTED = 6
+    LAT_STAGE_IND_QUEUED = 7
+    LAT_STAGE_NUM = 8
+
+class StatsTask(IntEnum):
+    """Indices of the tasks in a StatsMsg"""
+    STATS_TASK_PRODUCTION = 0
+    STATS_TASK_MONITOR = 1
+    STATS_TASK_COMMS_RX = 2
+    STATS_TASK_COMMS_TX = 3
+    STATS_TASK_STALL = 4
+    STATS_TASK_LOG_RECONNECT = 5
+    STATS_TASK_LOG_FLUSH = 6
+    STATS_TASK_ESP_TIMER = 7
+    STATS_TASK_IDLE = 8
+    STATS_TASK_TELEMETRY = 9
+    STATS_TASK_NUM = 10
+
 class Ind(IntEnum):
     """Indication/Event codes"""
     IND_SYSTEM_BEGIN = 512
     IND_SYSTEM_STEPPER_TARGET_END = 512
+    IND_SYSTEM_STATE = 513
     IND_SYSTEM_END = 767
     IND_STAND_BEGIN = 4608
     IND_STAND_END = 4863
@@ -130,11 +194,11 @@ class Status(IntEnum):
 
 class CmdMsg:
     """CmdMsg - packed binary message"""
-    FORMAT = "<BHBiiii"
-    SIZE = 20
+    FORMAT = "<BHBiiiiB"
+    SIZE = 21
     MAGIC = PROTOCOL_MAGIC_CMD
 
-    def __init__(self, command, reference=0, param_1=0, param_2=0, param_3=0, param_4=0):
+    def __init__(self, command, reference=0, param_1=0, param_2=0, param_3=0, param_4=0, motor=0):
         self.magic = self.MAGIC
         self.command = command
         self.reference = reference
@@ -142,55 +206,115 @@ class CmdMsg:
         self.param_2 = param_2
         self.param_3 = param_3
         self.param_4 = param_4
+        self.motor = motor
 
     def pack(self) -> bytes:
         """Pack message into bytes for transmission"""
         return struct.pack(self.FORMAT,
-                          self.magic, self.command, self.reference, self.param_1, self.param_2, self.param_3, self.param_4)
+                          self.magic, self.command, self.reference, self.param_1, self.param_2, self.param_3, self.param_4, self.motor)
 
     @classmethod
     def unpack(cls, data: bytes) -> "CmdMsg":
         """Unpack bytes into a message instance"""
         if len(data) != cls.SIZE:
             raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
-        values = struct.unpack(cls.FORMAT, data)
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "CmdMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
         magic = values[0]
         if magic != cls.MAGIC:
             raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
         return cls(*values[1:])
 
     def __repr__(self):
-        return f"<CmdMsg command={self.command} reference={self.reference} param_1={self.param_1} param_2={self.param_2} param_3={self.param_3} param_4={self.param_4}>"
+        return f"<CmdMsg command={self.command} reference={self.reference} param_1={self.param_1} param_2={self.param_2} param_3={self.param_3} param_4={self.param_4} motor={self.motor}>"
 
 class QryMsg:
     """QryMsg - packed binary message"""
-    FORMAT = "<BHB"
-    SIZE = 4
+    FORMAT = "<BHBB"
+    SIZE = 5
     MAGIC = PROTOCOL_MAGIC_QRY
 
-    def __init__(self, query, reference=0):
+    def __init__(self, query, reference=0, motor=0):
         self.magic = self.MAGIC
         self.query = query
         self.reference = reference
+        self.motor = motor
 
     def pack(self) -> bytes:
         """Pack message into bytes for transmission"""
         return struct.pack(self.FORMAT,
-                          self.magic, self.query, self.reference)
+                          self.magic, self.query, self.reference, self.motor)
 
     @classmethod
     def unpack(cls, data: bytes) -> "QryMsg":
         """Unpack bytes into a message instance"""
         if len(data) != cls.SIZE:
             raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
-        values = struct.unpack(cls.FORMAT, data)
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "QryMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(*values[1:])
+
+    def __repr__(self):
+        return f"<QryMsg query={self.query} reference={self.reference} motor={self.motor}>"
+
+class QryManyMsg:
+    """QryManyMsg - packed binary message"""
+    FORMAT = "<BBHB"
+    SIZE = 5
+    MAGIC = PROTOCOL_MAGIC_QRY_MANY
+
+    def __init__(self, reference, queries=0, motor=0):
+        self.magic = self.MAGIC
+        self.reference = reference
+        self.queries = queries
+        self.motor = motor
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.reference, self.queries, self.motor)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "QryManyMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "QryManyMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
         magic = values[0]
         if magic != cls.MAGIC:
             raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
         return cls(*values[1:])
 
     def __repr__(self):
-        return f"<QryMsg query={self.query} reference={self.reference}>"
+        return f"<QryManyMsg reference={self.reference} queries={self.queries} motor={self.motor}>"
 
 class RspMsg:
     """RspMsg - packed binary message"""
@@ -215,7 +339,16 @@ class RspMsg:
         """Unpack bytes into a message instance"""
         if len(data) != cls.SIZE:
             raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
-        values = struct.unpack(cls.FORMAT, data)
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "RspMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
         magic = values[0]
         if magic != cls.MAGIC:
             raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
@@ -224,40 +357,93 @@ class RspMsg:
     def __repr__(self):
         return f"<RspMsg cmd_or_qry={self.cmd_or_qry} reference={self.reference} status={self.status} value={self.value}>"
 
+class RspManyMsg:
+    """RspManyMsg - packed binary message"""
+    FORMAT = "<BBHHH16i"
+    SIZE = 72
+    MAGIC = PROTOCOL_MAGIC_RSP_MANY
+
+    def __init__(self, reference, queries=0, answered=0, status=0, value=None):
+        self.magic = self.MAGIC
+        self.reference = reference
+        self.queries = queries
+        self.answered = answered
+        self.status = status
+        self.value = list(value) if value is not None else [0] * 16
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.reference, self.queries, self.answered, self.status, *self.value)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "RspManyMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "RspManyMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(values[1], values[2], values[3], values[4], list(values[5:21]))
+
+    def __repr__(self):
+        return f"<RspManyMsg reference={self.reference} queries={self.queries} answered={self.answered} status={self.status} value={self.value}>"
+
 class IndMsg:
     """IndMsg - packed binary message"""
-    FORMAT = "<BHi"
-    SIZE = 7
+    FORMAT = "<BHiB"
+    SIZE = 8
     MAGIC = PROTOCOL_MAGIC_IND
 
-    def __init__(self, ind, value=0):
+    def __init__(self, ind, value=0, motor=0):
         self.magic = self.MAGIC
         self.ind = ind
         self.value = value
+        self.motor = motor
 
     def pack(self) -> bytes:
         """Pack message into bytes for transmission"""
         return struct.pack(self.FORMAT,
-                          self.magic, self.ind, self.value)
+                          self.magic, self.ind, self.value, self.motor)
 
     @classmethod
     def unpack(cls, data: bytes) -> "IndMsg":
         """Unpack bytes into a message instance"""
         if len(data) != cls.SIZE:
             raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
-        values = struct.unpack(cls.FORMAT, data)
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "IndMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
         magic = values[0]
         if magic != cls.MAGIC:
             raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
         return cls(*values[1:])
 
     def __repr__(self):
-        return f"<IndMsg ind={self.ind} value={self.value}>"
+        return f"<IndMsg ind={self.ind} value={self.value} motor={self.motor}>"
 
 class LogMsg:
     """LogMsg - packed binary message"""
-    FORMAT = f"<BB {LOG_MESSAGE_MAX_LEN}s"
-    SIZE = 2 + LOG_MESSAGE_MAX_LEN
+    # Header only: the header is followed by "length" bytes of text
+    FORMAT = "<BBB"
+    SIZE = 3
     MAGIC = PROTOCOL_MAGIC_LOG
 
     def __init__(self, level, message=""):
@@ -267,30 +453,253 @@ class LogMsg:
 
     def pack(self) -> bytes:
         """Pack message into bytes for transmission"""
-        # Truncate message if too long
+        # Truncate message if too long; the text is not null-terminated
         msg_bytes = self.message.encode("utf-8")[:LOG_MESSAGE_MAX_LEN-1]
-        # Pad with null bytes to reach full size
-        padded = msg_bytes + b"\0" * (LOG_MESSAGE_MAX_LEN - len(msg_bytes))
         return struct.pack(self.FORMAT,
                           self.magic,
                           self.level,
-                          padded)
+                          len(msg_bytes)) + msg_bytes
+
+    @classmethod
+    def frame_size(cls, data: bytes, offset: int = 0) -> int:
+        """Return the size of the frame at offset in data, 0 if the header is incomplete"""
+        if len(data) - offset < cls.SIZE:
+            return 0
+        return cls.SIZE + data[offset + 2]
 
     @classmethod
     def unpack(cls, data: bytes) -> "LogMsg":
         """Unpack bytes into a message instance"""
-        if len(data) != cls.SIZE:
-            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
-        magic, level, msg_bytes = struct.unpack(cls.FORMAT, data)
+        if len(data) < cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected at least {cls.SIZE}")
+        magic, level, length = struct.unpack(cls.FORMAT, data[:cls.SIZE])
         if magic != cls.MAGIC:
             raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
-        # Decode null-terminated string
-        message = msg_bytes.split(b"\0", 1)[0].decode("utf-8")
+        if len(data) != cls.SIZE + length:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE + length}")
+        # The text may have been truncated mid-character by the sender
+        message = data[cls.SIZE:].decode("utf-8", errors="replace")
         return cls(level, message)
 
     def __repr__(self):
         return f"<LogMsg level={self.level}, message=\"{self.message}\">"
 
+class LogDeferredMsg:
+    """LogDeferredMsg - packed binary message"""
+    FORMAT = "<BBBHI"
+    SIZE = 9
+    MAGIC = PROTOCOL_MAGIC_LOG_DEFERRED
+
+    def __init__(self, level, num_args=0, id=0, timestamp_ms=0):
+        self.magic = self.MAGIC
+        self.level = level
+        self.num_args = num_args
+        self.id = id
+        self.timestamp_ms = timestamp_ms
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.level, self.num_args, self.id, self.timestamp_ms)
+
+    @classmethod
+    def frame_size(cls, data: bytes, offset: int = 0) -> int:
+        """Return the size of the frame, header plus int32 arguments, at offset in data, 0 if the header is incomplete"""
+        if len(data) - offset < cls.SIZE:
+            return 0
+        return cls.SIZE + data[offset + 2] * 4
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "LogDeferredMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "LogDeferredMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(*values[1:])
+
+    def __repr__(self):
+        return f"<LogDeferredMsg level={self.level} num_args={self.num_args} id={self.id} timestamp_ms={self.timestamp_ms}>"
+
+class TlmMsg:
+    """TlmMsg - packed binary message"""
+    FORMAT = "<BBHI8H8I8HB"
+    SIZE = 73
+    MAGIC = PROTOCOL_MAGIC_TLM
+
+    def __init__(self, num_samples, period_ms=0, timestamp_ms=0, sg_result=None, tstep=None, current_ma=None, motor=0):
+        self.magic = self.MAGIC
+        self.num_samples = num_samples
+        self.period_ms = period_ms
+        self.timestamp_ms = timestamp_ms
+        self.sg_result = list(sg_result) if sg_result is not None else [0] * 8
+        self.tstep = list(tstep) if tstep is not None else [0] * 8
+        self.current_ma = list(current_ma) if current_ma is not None else [0] * 8
+        self.motor = motor
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.num_samples, self.period_ms, self.timestamp_ms, *self.sg_result, *self.tstep, *self.current_ma, self.motor)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "TlmMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "TlmMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(values[1], values[2], values[3], list(values[4:12]), list(values[12:20]), list(values[20:28]), values[28])
+
+    def __repr__(self):
+        return f"<TlmMsg num_samples={self.num_samples} period_ms={self.period_ms} timestamp_ms={self.timestamp_ms} sg_result={self.sg_result} tstep={self.tstep} current_ma={self.current_ma} motor={self.motor}>"
+
+class LatMsg:
+    """LatMsg - packed binary message"""
+    FORMAT = "<BHB8I"
+    SIZE = 36
+    MAGIC = PROTOCOL_MAGIC_LAT
+
+    def __init__(self, cmd_or_ind, reference=0, time_us=None):
+        self.magic = self.MAGIC
+        self.cmd_or_ind = cmd_or_ind
+        self.reference = reference
+        self.time_us = list(time_us) if time_us is not None else [0] * 8
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.cmd_or_ind, self.reference, *self.time_us)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "LatMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "LatMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(values[1], values[2], list(values[3:11]))
+
+    def __repr__(self):
+        return f"<LatMsg cmd_or_ind={self.cmd_or_ind} reference={self.reference} time_us={self.time_us}>"
+
+class StatsMsg:
+    """StatsMsg - packed binary message"""
+    FORMAT = "<BBIIIIII10B10H"
+    SIZE = 56
+    MAGIC = PROTOCOL_MAGIC_STATS
+
+    def __init__(self, reference, period_ms=0, heap_free=0, heap_min_free=0, log_dropped_count=0, tx_dropped_count=0, tx_retry_count=0, cpu_percent=None, stack_free=None):
+        self.magic = self.MAGIC
+        self.reference = reference
+        self.period_ms = period_ms
+        self.heap_free = heap_free
+        self.heap_min_free = heap_min_free
+        self.log_dropped_count = log_dropped_count
+        self.tx_dropped_count = tx_dropped_count
+        self.tx_retry_count = tx_retry_count
+        self.cpu_percent = list(cpu_percent) if cpu_percent is not None else [0] * 10
+        self.stack_free = list(stack_free) if stack_free is not None else [0] * 10
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.reference, self.period_ms, self.heap_free, self.heap_min_free, self.log_dropped_count, self.tx_dropped_count, self.tx_retry_count, *self.cpu_percent, *self.stack_free)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "StatsMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "StatsMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(values[1], values[2], values[3], values[4], values[5], values[6], values[7], list(values[8:18]), list(values[18:28]))
+
+    def __repr__(self):
+        return f"<StatsMsg reference={self.reference} period_ms={self.period_ms} heap_free={self.heap_free} heap_min_free={self.heap_min_free} log_dropped_count={self.log_dropped_count} tx_dropped_count={self.tx_dropped_count} tx_retry_count={self.tx_retry_count} cpu_percent={self.cpu_percent} stack_free={self.stack_free}>"
+
+class UdpMsg:
+    """UdpMsg - packed binary message"""
+    FORMAT = "<BI"
+    SIZE = 5
+    MAGIC = PROTOCOL_MAGIC_UDP
+
+    def __init__(self, sequence):
+        self.magic = self.MAGIC
+        self.sequence = sequence
+
+    def pack(self) -> bytes:
+        """Pack message into bytes for transmission"""
+        return struct.pack(self.FORMAT,
+                          self.magic, self.sequence)
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "UdpMsg":
+        """Unpack bytes into a message instance"""
+        if len(data) != cls.SIZE:
+            raise ValueError(f"Invalid message size: got {len(data)}, expected {cls.SIZE}")
+        return cls.unpack_from(data)
+
+    @classmethod
+    def unpack_from(cls, buffer, offset: int = 0) -> "UdpMsg":
+        """
+        Unpack a message instance from buffer (e.g. a bytearray or
+        memoryview) at offset, without copying it; there must be at
+        least SIZE bytes from offset
+        """
+        values = struct.unpack_from(cls.FORMAT, buffer, offset)
+        magic = values[0]
+        if magic != cls.MAGIC:
+            raise ValueError(f"Invalid magic byte: got {magic:#x}, expected {cls.MAGIC:#x}")
+        return cls(*values[1:])
+
+    def __repr__(self):
+        return f"<UdpMsg sequence={self.sequence}>"
+
 def send_message(sock: socket.socket, msg) -> bool:
     """Send a protocol message over a socket"""
     try:
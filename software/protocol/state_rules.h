@@ -0,0 +1,127 @@
+/*
+ * Copyright 2026 Rob Meades
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STATE_RULES_H_
+#define _STATE_RULES_H_
+
+/** @file
+ * @brief The rules that the target state of a CMD_STEPPER_TARGET_*
+ * command (param_1) must obey: a device may only be given a target
+ * state of its own role (the one its CMD_*_INIT told it to be), the
+ * sign of the velocity must match the direction the target state
+ * implies, there is a limit on the current for each role and some
+ * target states are ended by a sensor.  The ESP32 applies these rules
+ * in filter_and_conclude() and the Raspberry Pi applies the same rules
+ * before sending a target; having changed anything, regenerate
+ * state_rules.py with:
+ *
+ * python3 generate_python_state_rules_module.py state_rules.h state_rules.py
+ *
+ * ...which the ESP32 build also does.
+ *
+ * Each entry of STATE_RULES is STATE_RULE(state, velocity, stop), where
+ * state is a state_t, velocity a state_rule_velocity_t and stop a
+ * state_rule_stop_t; a target state with no entry is refused.  Each
+ * entry of ROLE_RULES is ROLE_RULE(begin, current_max_ma), where begin
+ * is the STATE_*_BEGIN of a role and current_max_ma, a plain decimal
+ * number, the most current that may be asked for in that role, in
+ * milliAmps.
+ *
+ * The states, commands and queries of a role all lie in the same
+ * block of 0x1000 values (see protocol.h), so STATE_RULE_ROLE() of a
+ * CMD_*_INIT is the role of the target states that go with it.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The role of a state, command or query, a small number, zero for
+// STATE_NULL.
+#define STATE_RULE_ROLE(value) (((uint32_t) (value)) >> 12)
+
+// The number of values STATE_RULE_ROLE() may have for a role that
+// has rules.
+#define STATE_RULE_ROLE_NUM 5
+
+// The position of a state within its role.
+#define STATE_RULE_OFFSET(state) (((uint32_t) (state)) & 0x0fff)
+
+// The most states a role may have rules for: STATE_RULE_OFFSET() of
+// each must be less than this.
+#define STATE_RULE_OFFSET_NUM 8
+
+// The index of the rule for a state in a table of
+// STATE_RULE_ROLE_NUM * STATE_RULE_OFFSET_NUM entries.
+#define STATE_RULE_INDEX(state) ((STATE_RULE_ROLE(state) * STATE_RULE_OFFSET_NUM) + \
+                                 STATE_RULE_OFFSET(state))
+
+#define STATE_RULES \
+    STATE_RULE(STATE_STAND_STOPPED,                      STATE_RULE_VELOCITY_ZERO,     STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_STAND_ROTATING_CLOCKWISE,           STATE_RULE_VELOCITY_NEGATIVE, STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_STAND_ROTATING_ANTICLOCKWISE,       STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_LIFT_STOPPED_UNKNOWN,               STATE_RULE_VELOCITY_ZERO,     STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_LIFT_STOPPED_DOWN,                  STATE_RULE_VELOCITY_NEGATIVE, STATE_RULE_STOP_DOWN) \
+    STATE_RULE(STATE_LIFT_STOPPED_UP,                    STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_UP) \
+    STATE_RULE(STATE_LIFT_RISING,                        STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_UP) \
+    STATE_RULE(STATE_LIFT_LOWERING,                      STATE_RULE_VELOCITY_NEGATIVE, STATE_RULE_STOP_DOWN) \
+    STATE_RULE(STATE_PLINKY_PLONKY_STOPPED_UNKNOWN,      STATE_RULE_VELOCITY_ZERO,     STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE, STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_AT_REFERENCE) \
+    STATE_RULE(STATE_PLINKY_PLONKY_PLAYING,              STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_AT_REFERENCE) \
+    STATE_RULE(STATE_DOOR_STOPPED_UNKNOWN,               STATE_RULE_VELOCITY_ZERO,     STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_DOOR_STOPPED_CLOSED,                STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_NONE) \
+    STATE_RULE(STATE_DOOR_STOPPED_OPEN,                  STATE_RULE_VELOCITY_NEGATIVE, STATE_RULE_STOP_OPEN) \
+    STATE_RULE(STATE_DOOR_OPENING,                       STATE_RULE_VELOCITY_NEGATIVE, STATE_RULE_STOP_OPEN) \
+    STATE_RULE(STATE_DOOR_CLOSING,                       STATE_RULE_VELOCITY_POSITIVE, STATE_RULE_STOP_NONE)
+
+#define ROLE_RULES \
+    ROLE_RULE(STATE_STAND_BEGIN,         1200) \
+    ROLE_RULE(STATE_LIFT_BEGIN,          1200) \
+    ROLE_RULE(STATE_PLINKY_PLONKY_BEGIN, 1200) \
+    ROLE_RULE(STATE_DOOR_BEGIN,          250)
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// The velocity that a target state requires.
+typedef enum {
+    STATE_RULE_VELOCITY_ZERO,     // A "stopped" state, the velocity is zeroed
+    STATE_RULE_VELOCITY_POSITIVE, // The velocity is negated if it is negative
+    STATE_RULE_VELOCITY_NEGATIVE  // The velocity is negated if it is positive
+} state_rule_velocity_t;
+
+// The sensor that ends a move to a target state, if any.
+typedef enum {
+    STATE_RULE_STOP_NONE,
+    STATE_RULE_STOP_DOWN,
+    STATE_RULE_STOP_UP,
+    STATE_RULE_STOP_AT_REFERENCE,
+    STATE_RULE_STOP_OPEN,
+    STATE_RULE_STOP_NUM
+} state_rule_stop_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STATE_RULES_H_
+
+// End of file
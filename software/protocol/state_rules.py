@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+"""
+Auto-generated tables of the rules for target states.
+
+This module is generated from the C header file state_rules.h.
+Do not edit this file directly - edit the .h file and regenerate.
+"""
+
+# Indexed by target state name: (velocity rule, stop rule)
+STATE_RULES = {
+    'STATE_STAND_STOPPED': ('STATE_RULE_VELOCITY_ZERO', 'STATE_RULE_STOP_NONE'),
+    'STATE_STAND_ROTATING_CLOCKWISE': ('STATE_RULE_VELOCITY_NEGATIVE', 'STATE_RULE_STOP_NONE'),
+    'STATE_STAND_ROTATING_ANTICLOCKWISE': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_NONE'),
+    'STATE_LIFT_STOPPED_UNKNOWN': ('STATE_RULE_VELOCITY_ZERO', 'STATE_RULE_STOP_NONE'),
+    'STATE_LIFT_STOPPED_DOWN': ('STATE_RULE_VELOCITY_NEGATIVE', 'STATE_RULE_STOP_DOWN'),
+    'STATE_LIFT_STOPPED_UP': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_UP'),
+    'STATE_LIFT_RISING': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_UP'),
+    'STATE_LIFT_LOWERING': ('STATE_RULE_VELOCITY_NEGATIVE', 'STATE_RULE_STOP_DOWN'),
+    'STATE_PLINKY_PLONKY_STOPPED_UNKNOWN': ('STATE_RULE_VELOCITY_ZERO', 'STATE_RULE_STOP_NONE'),
+    'STATE_PLINKY_PLONKY_STOPPED_AT_REFERENCE': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_AT_REFERENCE'),
+    'STATE_PLINKY_PLONKY_PLAYING': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_AT_REFERENCE'),
+    'STATE_DOOR_STOPPED_UNKNOWN': ('STATE_RULE_VELOCITY_ZERO', 'STATE_RULE_STOP_NONE'),
+    'STATE_DOOR_STOPPED_CLOSED': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_NONE'),
+    'STATE_DOOR_STOPPED_OPEN': ('STATE_RULE_VELOCITY_NEGATIVE', 'STATE_RULE_STOP_OPEN'),
+    'STATE_DOOR_OPENING': ('STATE_RULE_VELOCITY_NEGATIVE', 'STATE_RULE_STOP_OPEN'),
+    'STATE_DOOR_CLOSING': ('STATE_RULE_VELOCITY_POSITIVE', 'STATE_RULE_STOP_NONE'),
+}
+
+# Indexed by the name of the STATE_*_BEGIN of a role: the most
+# current that may be asked for in that role, in milliAmps
+ROLE_CURRENT_MAX_MA = {
+    'STATE_STAND_BEGIN': 1200,
+    'STATE_LIFT_BEGIN': 1200,
+    'STATE_PLINKY_PLONKY_BEGIN': 1200,
+    'STATE_DOOR_BEGIN': 250,
+}